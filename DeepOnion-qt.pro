@@ -246,13 +246,18 @@ HEADERS += src/qt/bitcoingui.h \
 	src/qt/trafficgraphwidget.h \
     src/qt/intro.h \
     src/alert.h \
+    src/addrindex.h \
     src/addrman.h \
+    src/arith_uint256.h \
     src/base58.h \
     src/bignum.h \
     src/checkpoints.h \
     src/compat.h \
     src/coincontrol.h \
     src/smessage.h \
+    src/smsgstore.h \
+    src/smsgrecon.h \
+    src/smsgcompress.h \
     src/sync.h \
     src/util.h \
     src/uint256.h \
@@ -298,6 +303,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/transactionview.h \
     src/qt/walletmodel.h \
     src/bitcoinrpc.h \
+    src/jsonwriter.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -307,6 +313,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/qvaluecombobox.h \
     src/qt/askpassphrasedialog.h \
     src/protocol.h \
+    src/pushnotify.h \
     src/qt/notificator.h \
     src/qt/qtipcserver.h \
     src/allocators.h \
@@ -321,12 +328,15 @@ HEADERS += src/qt/bitcoingui.h \
 	src/qt/scicon.h \
     src/version.h \
     src/netbase.h \
+    src/netpoll.h \
     src/clientversion.h \
     src/bloom.h \
     src/checkqueue.h \
+    src/workqueue.h \
     src/hash.h \
     src/hashblock.h \
     src/limitedmap.h \
+    src/lrucache.h \
     src/sph_blake.h \
     src/sph_bmw.h \
     src/sph_cubehash.h \
@@ -370,6 +380,7 @@ SOURCES += src/qt/bitcoin.cpp \
     src/qt/plugins/mrichtexteditor/mrichtextedit.cpp \
     src/qt/intro.cpp \
     src/alert.cpp \
+    src/addrindex.cpp \
     src/version.cpp \
     src/sync.cpp \
     src/util.cpp \
@@ -378,9 +389,13 @@ SOURCES += src/qt/bitcoin.cpp \
     src/script.cpp \
     src/main.cpp \
     src/smessage.cpp \
+    src/smsgstore.cpp \
+    src/smsgrecon.cpp \
+    src/smsgcompress.cpp \
     src/miner.cpp \
     src/init.cpp \
     src/net.cpp \
+    src/netpoll.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
     src/db.cpp \
@@ -401,12 +416,15 @@ SOURCES += src/qt/bitcoin.cpp \
     src/qt/transactionview.cpp \
     src/qt/walletmodel.cpp \
     src/bitcoinrpc.cpp \
+    src/jsonwriter.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
     src/rpcmining.cpp \
     src/rpcwallet.cpp \
     src/rpcblockchain.cpp \
     src/rpcrawtransaction.cpp \
+    src/rest.cpp \
+    src/pushnotify.cpp \
     src/rpcsmessage.cpp \
     src/qt/overviewpage.cpp \
     src/qt/csvmodelwriter.cpp \
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+# Load test for the JSON-RPC server: runs a number of concurrent clients that
+# each send the same call over and over and reports throughput and latency.
+#
+# Usage:
+#   rpcbench.py --user=<rpcuser> --password=<rpcpassword> [options] [method [params...]]
+#
+# Examples:
+#   rpcbench.py --user=u --password=p --clients=64 --requests=200 getblockcount
+#   rpcbench.py --user=u --password=p --no-keepalive getblockhash 1000
+#   rpcbench.py --user=u --password=p --batch=100 getblockhash 1000
+#
+# Params that look like JSON (numbers, true/false, objects) are sent as such.
+
+import argparse
+import base64
+import http.client
+import json
+import threading
+import time
+
+
+def parse_param(s):
+    try:
+        return json.loads(s)
+    except ValueError:
+        return s
+
+
+class Client(threading.Thread):
+    def __init__(self, args, body, start_event):
+        threading.Thread.__init__(self)
+        self.args = args
+        self.body = body
+        self.start_event = start_event
+        self.latencies = []
+        self.status = {}
+        self.errors = 0
+        auth = base64.b64encode(("%s:%s" % (args.user, args.password)).encode()).decode()
+        self.headers = {"Authorization": "Basic " + auth, "Content-Type": "application/json"}
+        if not args.keepalive:
+            self.headers["Connection"] = "close"
+
+    def connect(self):
+        return http.client.HTTPConnection(self.args.host, self.args.port, timeout=self.args.timeout)
+
+    def run(self):
+        self.start_event.wait()
+        conn = None
+        for _ in range(self.args.requests):
+            t = time.time()
+            try:
+                if conn is None:
+                    conn = self.connect()
+                conn.request("POST", "/", self.body, self.headers)
+                resp = conn.getresponse()
+                resp.read()
+                self.status[resp.status] = self.status.get(resp.status, 0) + 1
+                if not self.args.keepalive or resp.getheader("Connection", "").lower() == "close":
+                    conn.close()
+                    conn = None
+            except (OSError, http.client.HTTPException):
+                self.errors += 1
+                if conn is not None:
+                    conn.close()
+                conn = None
+                continue
+            self.latencies.append(time.time() - t)
+        if conn is not None:
+            conn.close()
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test the JSON-RPC server")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=18580)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--clients", type=int, default=16, help="concurrent connections (default: 16)")
+    parser.add_argument("--requests", type=int, default=100, help="requests per client (default: 100)")
+    parser.add_argument("--batch", type=int, default=0, help="send batches of this many calls instead of single calls")
+    parser.add_argument("--no-keepalive", dest="keepalive", action="store_false", help="open a new connection per request")
+    parser.add_argument("--timeout", type=float, default=30.0)
+    parser.add_argument("method", nargs="?", default="getblockcount")
+    parser.add_argument("params", nargs="*")
+    args = parser.parse_args()
+
+    call = {"method": args.method, "params": [parse_param(p) for p in args.params], "id": 1}
+    if args.batch > 0:
+        body = json.dumps([dict(call, id=i) for i in range(args.batch)])
+    else:
+        body = json.dumps(call)
+
+    start_event = threading.Event()
+    clients = [Client(args, body, start_event) for _ in range(args.clients)]
+    for c in clients:
+        c.start()
+    t = time.time()
+    start_event.set()
+    for c in clients:
+        c.join()
+    elapsed = time.time() - t
+
+    latencies = sorted(l for c in clients for l in c.latencies)
+    status = {}
+    for c in clients:
+        for k, v in c.status.items():
+            status[k] = status.get(k, 0) + v
+    errors = sum(c.errors for c in clients)
+
+    print("%s: %d clients x %d requests%s, %s" % (args.method, args.clients, args.requests,
+          " (batch %d)" % args.batch if args.batch else "", "keep-alive" if args.keepalive else "connection per request"))
+    print("  completed %d in %.2f s, %.1f req/s, %d connection errors" % (len(latencies), elapsed, len(latencies) / elapsed, errors))
+    print("  status   %s" % ", ".join("%d: %d" % kv for kv in sorted(status.items())))
+    if latencies:
+        print("  latency  p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms" % (
+            percentile(latencies, 50) * 1000, percentile(latencies, 90) * 1000,
+            percentile(latencies, 99) * 1000, latencies[-1] * 1000))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,328 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrindex.h"
+#include "main.h"
+#include "txdb.h"
+
+#include <boost/foreach.hpp>
+#include <limits>
+
+using namespace std;
+
+bool fAddrIndex = false;
+bool fSpentIndex = false;
+
+// The builder gives cs_main back after this long
+static const int64_t ADDRINDEX_BUILD_SLICE_MS = 250;
+
+bool AddrIndexDestination(const CTxDestination& dest, unsigned char& nAddrTypeRet, uint160& hashRet)
+{
+    if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+    {
+        nAddrTypeRet = ADDRINDEX_PUBKEYHASH;
+        hashRet = *pkeyID;
+        return true;
+    }
+    if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+    {
+        nAddrTypeRet = ADDRINDEX_SCRIPTHASH;
+        hashRet = *pscriptID;
+        return true;
+    }
+    return false;
+}
+
+bool AddrIndexDestination(const CScript& scriptPubKey, unsigned char& nAddrTypeRet, uint160& hashRet)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    return AddrIndexDestination(dest, nAddrTypeRet, hashRet);
+}
+
+// Rows for one block, the caller has checked it is next in line
+static bool WriteAddrRows(CTxDB& txdb, const CBlock& block, int nHeight, const vector<CTxOut>& vPrevOut)
+{
+    unsigned char nAddrType;
+    uint160 hash;
+    unsigned int nPrev = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+
+        if (!tx.IsCoinBase())
+        {
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            {
+                if (nPrev >= vPrevOut.size())
+                    return error("AddrIndex : missing previous output for %s", hashTx.ToString().c_str());
+                const CTxOut& prevout = vPrevOut[nPrev++];
+                if (!AddrIndexDestination(prevout.scriptPubKey, nAddrType, hash))
+                    continue;
+                if (!txdb.WriteAddrIndex(CAddrIndexKey(nAddrType, hash, nHeight, hashTx, i, true), -prevout.nValue) ||
+                    !txdb.EraseAddrUnspent(CAddrUnspentKey(nAddrType, hash, tx.vin[i].prevout.hash, tx.vin[i].prevout.n)))
+                    return false;
+            }
+        }
+
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            const CTxOut& txout = tx.vout[i];
+            if (!AddrIndexDestination(txout.scriptPubKey, nAddrType, hash))
+                continue;
+            if (!txdb.WriteAddrIndex(CAddrIndexKey(nAddrType, hash, nHeight, hashTx, i, false), txout.nValue) ||
+                !txdb.WriteAddrUnspent(CAddrUnspentKey(nAddrType, hash, hashTx, i), CAddrUnspentValue(txout.nValue, txout.scriptPubKey, nHeight)))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool AddrIndexConnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, const vector<CTxOut>& vPrevOut)
+{
+    // Until the builder thread reaches the tip it indexes the blocks itself
+    int nIndexed;
+    if (!txdb.ReadAddrIndexHeight(nIndexed) || nIndexed != pindex->nHeight - 1)
+        return true;
+
+    if (!WriteAddrRows(txdb, block, pindex->nHeight, vPrevOut))
+        return error("AddrIndexConnectBlock() : writing block %d failed", pindex->nHeight);
+    return txdb.WriteAddrIndexHeight(pindex->nHeight);
+}
+
+static bool WriteSpentRows(CTxDB& txdb, const CBlock& block, int nHeight, const vector<CTxOut>& vPrevOut)
+{
+    unsigned int nPrev = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (tx.IsCoinBase())
+            continue;
+        uint256 hashTx = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            if (nPrev >= vPrevOut.size())
+                return error("SpentIndex : missing previous output for %s", hashTx.ToString().c_str());
+            const CTxOut& prevout = vPrevOut[nPrev++];
+            unsigned char nAddrType = 0;
+            uint160 hash = 0;
+            AddrIndexDestination(prevout.scriptPubKey, nAddrType, hash);
+            if (!txdb.WriteSpentIndex(tx.vin[i].prevout, CSpentIndexValue(hashTx, i, nHeight, prevout.nValue, nAddrType, hash)))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool SpentIndexConnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, const vector<CTxOut>& vPrevOut)
+{
+    int nIndexed;
+    if (!txdb.ReadSpentIndexHeight(nIndexed) || nIndexed != pindex->nHeight - 1)
+        return true;
+
+    if (!WriteSpentRows(txdb, block, pindex->nHeight, vPrevOut))
+        return error("SpentIndexConnectBlock() : writing block %d failed", pindex->nHeight);
+    return txdb.WriteSpentIndexHeight(pindex->nHeight);
+}
+
+bool SpentIndexDisconnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex)
+{
+    int nIndexed;
+    if (!txdb.ReadSpentIndexHeight(nIndexed) || nIndexed < pindex->nHeight)
+        return true;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (!txdb.EraseSpentIndex(txin.prevout))
+                return false;
+    }
+    return txdb.WriteSpentIndexHeight(pindex->nHeight - 1);
+}
+
+// Height of the block a transaction was found in
+static int GetTxPosHeight(const CDiskTxPos& pos, map<pair<unsigned int, unsigned int>, int>& mapCache)
+{
+    pair<unsigned int, unsigned int> key = make_pair(pos.nFile, pos.nBlockPos);
+    map<pair<unsigned int, unsigned int>, int>::iterator it = mapCache.find(key);
+    if (it != mapCache.end())
+        return it->second;
+
+    int nHeight = -1;
+    CBlock block;
+    if (block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+        if (mi != mapBlockIndex.end())
+            nHeight = mi->second->nHeight;
+    }
+    mapCache[key] = nHeight;
+    return nHeight;
+}
+
+bool AddrIndexDisconnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex)
+{
+    int nIndexed;
+    if (!txdb.ReadAddrIndexHeight(nIndexed) || nIndexed < pindex->nHeight)
+        return true;
+
+    unsigned char nAddrType;
+    uint160 hash;
+    map<pair<unsigned int, unsigned int>, int> mapHeights;
+
+    // In reverse, so outputs spent within the block are restored before they are removed
+    for (int i = block.vtx.size() - 1; i >= 0; i--)
+    {
+        const CTransaction& tx = block.vtx[i];
+        uint256 hashTx = tx.GetHash();
+
+        for (unsigned int n = 0; n < tx.vout.size(); n++)
+        {
+            if (!AddrIndexDestination(tx.vout[n].scriptPubKey, nAddrType, hash))
+                continue;
+            if (!txdb.EraseAddrIndex(CAddrIndexKey(nAddrType, hash, pindex->nHeight, hashTx, n, false)) ||
+                !txdb.EraseAddrUnspent(CAddrUnspentKey(nAddrType, hash, hashTx, n)))
+                return false;
+        }
+
+        if (tx.IsCoinBase())
+            continue;
+        for (unsigned int n = 0; n < tx.vin.size(); n++)
+        {
+            const COutPoint& prevout = tx.vin[n].prevout;
+            CTransaction txPrev;
+            CTxIndex txindexPrev;
+            if (!txdb.ReadDiskTx(prevout.hash, txPrev, txindexPrev) || prevout.n >= txPrev.vout.size())
+                return error("AddrIndexDisconnectBlock() : previous transaction %s not found", prevout.hash.ToString().c_str());
+            const CTxOut& txout = txPrev.vout[prevout.n];
+            if (!AddrIndexDestination(txout.scriptPubKey, nAddrType, hash))
+                continue;
+            int nPrevHeight = GetTxPosHeight(txindexPrev.pos, mapHeights);
+            if (nPrevHeight < 0)
+                return error("AddrIndexDisconnectBlock() : block of %s not found", prevout.hash.ToString().c_str());
+            if (!txdb.EraseAddrIndex(CAddrIndexKey(nAddrType, hash, pindex->nHeight, hashTx, n, true)) ||
+                !txdb.WriteAddrUnspent(CAddrUnspentKey(nAddrType, hash, prevout.hash, prevout.n),
+                                       CAddrUnspentValue(txout.nValue, txout.scriptPubKey, nPrevHeight)))
+                return false;
+        }
+    }
+    return txdb.WriteAddrIndexHeight(pindex->nHeight - 1);
+}
+
+// Where an enabled index stopped, starting one that was never built after genesis
+static int ReadIndexHeight(CTxDB& txdb, bool fEnabled, bool (CTxDB::*pfnRead)(int&), bool (CTxDB::*pfnWrite)(int))
+{
+    if (!fEnabled)
+        return std::numeric_limits<int>::max();
+    int nIndexed;
+    if (!(txdb.*pfnRead)(nIndexed))
+    {
+        // The genesis outputs can't be spent and are not in the transaction index either
+        nIndexed = 0;
+        if (!(txdb.*pfnWrite)(nIndexed))
+            throw runtime_error("BuildAddrIndex() : writing the index height failed");
+    }
+    return nIndexed;
+}
+
+// Index the main chain from where the indexes stopped, a slice at a time under
+// cs_main so blocks that arrive meanwhile are connected in between.  Once an
+// index is caught up ConnectBlock keeps it current.
+static void BuildAddrIndex()
+{
+    int64_t nStart = GetTimeMillis();
+    int nFirst = -1;
+    int nReported = 0;
+    while (!fShutdown)
+    {
+        LOCK(cs_main);
+        CTxDB txdb;
+        // The transaction index is read through a second instance that doesn't see the batch
+        CTxDB txdbRead("r");
+
+        int nAddrIndexed = ReadIndexHeight(txdb, fAddrIndex, &CTxDB::ReadAddrIndexHeight, &CTxDB::WriteAddrIndexHeight);
+        int nSpentIndexed = ReadIndexHeight(txdb, fSpentIndex, &CTxDB::ReadSpentIndexHeight, &CTxDB::WriteSpentIndexHeight);
+        int nIndexed = min(nAddrIndexed, nSpentIndexed);
+        if (nFirst < 0)
+        {
+            nFirst = nIndexed;
+            if (nIndexed < nBestHeight)
+                printf("Building address index from height %d to %d\n", nIndexed + 1, nBestHeight);
+        }
+        if (nIndexed >= nBestHeight)
+            break;
+
+        if (!txdb.TxnBegin())
+            throw runtime_error("BuildAddrIndex() : TxnBegin failed");
+        int64_t nSliceStart = GetTimeMillis();
+        CBlockIndex* pindex = FindBlockByHeight(nIndexed + 1);
+        for (; pindex && !fShutdown && GetTimeMillis() - nSliceStart < ADDRINDEX_BUILD_SLICE_MS; pindex = pindex->pnext)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+                throw runtime_error(strprintf("BuildAddrIndex() : ReadFromDisk failed at height %d", pindex->nHeight));
+
+            vector<CTxOut> vPrevOut;
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            {
+                if (tx.IsCoinBase())
+                    continue;
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    CTransaction txPrev;
+                    if (!txdbRead.ReadDiskTx(txin.prevout.hash, txPrev) || txin.prevout.n >= txPrev.vout.size())
+                        throw runtime_error(strprintf("BuildAddrIndex() : input %s not found", txin.prevout.ToString().c_str()));
+                    vPrevOut.push_back(txPrev.vout[txin.prevout.n]);
+                }
+            }
+
+            // The indexes may have stopped at different heights
+            if (nAddrIndexed == pindex->nHeight - 1)
+            {
+                if (!WriteAddrRows(txdb, block, pindex->nHeight, vPrevOut))
+                    throw runtime_error(strprintf("BuildAddrIndex() : writing block %d failed", pindex->nHeight));
+                nAddrIndexed = pindex->nHeight;
+            }
+            if (nSpentIndexed == pindex->nHeight - 1)
+            {
+                if (!WriteSpentRows(txdb, block, pindex->nHeight, vPrevOut))
+                    throw runtime_error(strprintf("BuildAddrIndex() : writing spent block %d failed", pindex->nHeight));
+                nSpentIndexed = pindex->nHeight;
+            }
+            nIndexed = pindex->nHeight;
+        }
+        if ((fAddrIndex && !txdb.WriteAddrIndexHeight(nAddrIndexed)) ||
+            (fSpentIndex && !txdb.WriteSpentIndexHeight(nSpentIndexed)) ||
+            !txdb.TxnCommit())
+            throw runtime_error("BuildAddrIndex() : TxnCommit failed");
+
+        if (nIndexed - nReported >= 10000 || nIndexed == nBestHeight)
+        {
+            printf("Address index at height %d of %d\n", nIndexed, nBestHeight);
+            nReported = nIndexed;
+        }
+    }
+
+    if (nFirst >= 0 && nFirst < nBestHeight && !fShutdown)
+        printf("Address index built in %" PRId64 "ms\n", GetTimeMillis() - nStart);
+}
+
+void ThreadAddrIndexBuild(void* parg)
+{
+    // Make this thread recognisable as the address index builder
+    RenameThread("DeepOnion-addrindex");
+    vnThreadsRunning[THREAD_ADDRINDEX]++;
+    try
+    {
+        BuildAddrIndex();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadAddrIndexBuild()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadAddrIndexBuild()");
+    }
+    vnThreadsRunning[THREAD_ADDRINDEX]--;
+}
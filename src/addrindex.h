@@ -0,0 +1,226 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ADDRINDEX_H
+#define BITCOIN_ADDRINDEX_H
+
+#include <vector>
+
+#include "uint256.h"
+#include "serialize.h"
+#include "script.h"
+
+class CBlock;
+class CBlockIndex;
+class CTxDB;
+class CTxOut;
+
+extern bool fAddrIndex;
+extern bool fSpentIndex;
+
+/** Kinds of destination in the address index, the hash is a CKeyID or a CScriptID */
+enum AddrIndexType
+{
+    ADDRINDEX_PUBKEYHASH = 1,
+    ADDRINDEX_SCRIPTHASH = 2,
+};
+
+/** One row of an address' history: an output paying to it or an input spending from it.
+ * The value stored with it is the amount, negative for spends.
+ *
+ * The height is serialized big endian, so the rows of one address are sorted by
+ * height in the database and a range of blocks can be read with a single seek.
+ */
+class CAddrIndexKey
+{
+public:
+    unsigned char nAddrType;
+    uint160 hashBytes;
+    int nHeight;
+    uint256 txhash;
+    unsigned int nIndex;    // output number, or input number for a spend
+    bool fSpending;
+
+    CAddrIndexKey()
+    {
+        nAddrType = 0;
+        hashBytes = 0;
+        nHeight = 0;
+        txhash = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    CAddrIndexKey(unsigned char nAddrTypeIn, const uint160& hashBytesIn, int nHeightIn,
+                  const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn)
+    {
+        nAddrType = nAddrTypeIn;
+        hashBytes = hashBytesIn;
+        nHeight = nHeightIn;
+        txhash = txhashIn;
+        nIndex = nIndexIn;
+        fSpending = fSpendingIn;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nAddrType, nType, nVersion);
+        ::Serialize(s, hashBytes, nType, nVersion);
+        unsigned char pchHeight[4] = { (unsigned char)(nHeight >> 24), (unsigned char)(nHeight >> 16),
+                                       (unsigned char)(nHeight >> 8), (unsigned char)nHeight };
+        s.write((char*)pchHeight, sizeof(pchHeight));
+        ::Serialize(s, txhash, nType, nVersion);
+        ::Serialize(s, nIndex, nType, nVersion);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, nAddrType, nType, nVersion);
+        ::Unserialize(s, hashBytes, nType, nVersion);
+        unsigned char pchHeight[4];
+        s.read((char*)pchHeight, sizeof(pchHeight));
+        nHeight = (pchHeight[0] << 24) | (pchHeight[1] << 16) | (pchHeight[2] << 8) | pchHeight[3];
+        ::Unserialize(s, txhash, nType, nVersion);
+        ::Unserialize(s, nIndex, nType, nVersion);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+};
+
+/** An unspent output of an address */
+class CAddrUnspentKey
+{
+public:
+    unsigned char nAddrType;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddrUnspentKey()
+    {
+        nAddrType = 0;
+        hashBytes = 0;
+        txhash = 0;
+        nIndex = 0;
+    }
+
+    CAddrUnspentKey(unsigned char nAddrTypeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int nIndexIn)
+    {
+        nAddrType = nAddrTypeIn;
+        hashBytes = hashBytesIn;
+        txhash = txhashIn;
+        nIndex = nIndexIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nAddrType);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+};
+
+class CAddrUnspentValue
+{
+public:
+    int64_t nValue;
+    CScript scriptPubKey;
+    int nHeight;
+
+    CAddrUnspentValue()
+    {
+        nValue = 0;
+        nHeight = 0;
+    }
+
+    CAddrUnspentValue(int64_t nValueIn, const CScript& scriptPubKeyIn, int nHeightIn)
+    {
+        nValue = nValueIn;
+        scriptPubKey = scriptPubKeyIn;
+        nHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(scriptPubKey);
+        READWRITE(nHeight);
+    )
+};
+
+/** The spender of an output, stored under the output in the spent index */
+class CSpentIndexValue
+{
+public:
+    uint256 txhash;
+    unsigned int nInput;
+    int nHeight;
+    int64_t nValue;             // of the spent output
+    unsigned char nAddrType;    // 0 if the spent output has no address
+    uint160 hashBytes;
+
+    CSpentIndexValue()
+    {
+        txhash = 0;
+        nInput = 0;
+        nHeight = 0;
+        nValue = 0;
+        nAddrType = 0;
+        hashBytes = 0;
+    }
+
+    CSpentIndexValue(const uint256& txhashIn, unsigned int nInputIn, int nHeightIn, int64_t nValueIn,
+                     unsigned char nAddrTypeIn, const uint160& hashBytesIn)
+    {
+        txhash = txhashIn;
+        nInput = nInputIn;
+        nHeight = nHeightIn;
+        nValue = nValueIn;
+        nAddrType = nAddrTypeIn;
+        hashBytes = hashBytesIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txhash);
+        READWRITE(nInput);
+        READWRITE(nHeight);
+        READWRITE(nValue);
+        READWRITE(nAddrType);
+        READWRITE(hashBytes);
+    )
+};
+
+/** Where an output script pays to, false for scripts without a single address.
+ * Pay-to-pubkey outputs are filed under the key's hash, the address they are shown as.
+ */
+bool AddrIndexDestination(const CScript& scriptPubKey, unsigned char& nAddrTypeRet, uint160& hashRet);
+bool AddrIndexDestination(const CTxDestination& dest, unsigned char& nAddrTypeRet, uint160& hashRet);
+
+/** Index a block that is being connected, if the index has caught up with its parent.
+ * vPrevOut holds the output spent by each input of the block, in block order.
+ */
+bool AddrIndexConnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, const std::vector<CTxOut>& vPrevOut);
+
+/** Remove a block that is being disconnected, if it had been indexed.
+ * Runs whether or not -addrindex is set, so an index that was switched off
+ * stays correct up to the height it had reached.
+ */
+bool AddrIndexDisconnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex);
+
+/** The same for the spent index, which has its own height marker */
+bool SpentIndexConnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, const std::vector<CTxOut>& vPrevOut);
+bool SpentIndexDisconnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex);
+
+/** Index the blocks of the main chain the enabled indexes are missing, in the background */
+void ThreadAddrIndexBuild(void* parg);
+
+#endif
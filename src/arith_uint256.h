@@ -0,0 +1,505 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Copyright (c) 2018 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ARITH_UINT256_H
+#define BITCOIN_ARITH_UINT256_H
+
+#include <stdexcept>
+#include <string>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "uint256.h"
+
+/** Errors thrown by the arith_uint classes (division by zero) */
+class uint_error : public std::runtime_error
+{
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** Fixed-width unsigned big integer with full arithmetic.
+ *
+ * Unlike CBigNum this lives entirely on the stack, so it is suitable for
+ * the consensus hot paths (target checks, kernel hashing, chain trust).
+ * Arithmetic wraps modulo 2^BITS; callers that need a wider intermediate
+ * (e.g. coin-day weight times target) use arith_uint512.
+ */
+template<unsigned int BITS>
+class arith_uint
+{
+public:
+    enum { WIDTH=BITS/32 };
+
+protected:
+    uint32_t pn[WIDTH];
+
+public:
+    arith_uint()
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    arith_uint(const arith_uint& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = b.pn[i];
+    }
+
+    arith_uint& operator=(const arith_uint& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = b.pn[i];
+        return *this;
+    }
+
+    arith_uint(uint64_t b)
+    {
+        pn[0] = (uint32_t)b;
+        pn[1] = (uint32_t)(b >> 32);
+        for (int i = 2; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    /** Zero-extend or truncate from another width */
+    template<unsigned int BITS2>
+    explicit arith_uint(const arith_uint<BITS2>& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = i < (int)arith_uint<BITS2>::WIDTH ? b.GetLimb(i) : 0;
+    }
+
+    explicit arith_uint(const std::string& str)
+    {
+        SetHex(str);
+    }
+
+    uint32_t GetLimb(int n) const
+    {
+        return pn[n];
+    }
+
+    bool operator!() const
+    {
+        for (int i = 0; i < WIDTH; i++)
+            if (pn[i] != 0)
+                return false;
+        return true;
+    }
+
+    const arith_uint operator~() const
+    {
+        arith_uint ret;
+        for (int i = 0; i < WIDTH; i++)
+            ret.pn[i] = ~pn[i];
+        return ret;
+    }
+
+    const arith_uint operator-() const
+    {
+        arith_uint ret;
+        for (int i = 0; i < WIDTH; i++)
+            ret.pn[i] = ~pn[i];
+        ++ret;
+        return ret;
+    }
+
+    double getdouble() const
+    {
+        double ret = 0.0;
+        double fact = 1.0;
+        for (int i = 0; i < WIDTH; i++) {
+            ret += fact * pn[i];
+            fact *= 4294967296.0;
+        }
+        return ret;
+    }
+
+    arith_uint& operator=(uint64_t b)
+    {
+        pn[0] = (uint32_t)b;
+        pn[1] = (uint32_t)(b >> 32);
+        for (int i = 2; i < WIDTH; i++)
+            pn[i] = 0;
+        return *this;
+    }
+
+    arith_uint& operator^=(const arith_uint& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] ^= b.pn[i];
+        return *this;
+    }
+
+    arith_uint& operator&=(const arith_uint& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] &= b.pn[i];
+        return *this;
+    }
+
+    arith_uint& operator|=(const arith_uint& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] |= b.pn[i];
+        return *this;
+    }
+
+    arith_uint& operator<<=(unsigned int shift)
+    {
+        arith_uint a(*this);
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int k = shift / 32;
+        shift = shift % 32;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            if (i+k+1 < WIDTH && shift != 0)
+                pn[i+k+1] |= (a.pn[i] >> (32-shift));
+            if (i+k < WIDTH)
+                pn[i+k] |= (a.pn[i] << shift);
+        }
+        return *this;
+    }
+
+    arith_uint& operator>>=(unsigned int shift)
+    {
+        arith_uint a(*this);
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int k = shift / 32;
+        shift = shift % 32;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            if (i-k-1 >= 0 && shift != 0)
+                pn[i-k-1] |= (a.pn[i] << (32-shift));
+            if (i-k >= 0)
+                pn[i-k] |= (a.pn[i] >> shift);
+        }
+        return *this;
+    }
+
+    arith_uint& operator+=(const arith_uint& b)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64_t n = carry + pn[i] + b.pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    arith_uint& operator-=(const arith_uint& b)
+    {
+        *this += -b;
+        return *this;
+    }
+
+    arith_uint& operator+=(uint64_t b64)
+    {
+        arith_uint b(b64);
+        *this += b;
+        return *this;
+    }
+
+    arith_uint& operator-=(uint64_t b64)
+    {
+        arith_uint b(b64);
+        *this += -b;
+        return *this;
+    }
+
+    arith_uint& operator*=(uint32_t b32)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64_t n = carry + (uint64_t)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    arith_uint& operator*=(const arith_uint& b)
+    {
+        arith_uint a;
+        for (int j = 0; j < WIDTH; j++)
+        {
+            uint64_t carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64_t n = carry + a.pn[i + j] + (uint64_t)pn[j] * b.pn[i];
+                a.pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        *this = a;
+        return *this;
+    }
+
+    arith_uint& operator/=(const arith_uint& b)
+    {
+        arith_uint div = b;     // make a copy, so we can shift.
+        arith_uint num = *this; // make a copy, so we can subtract.
+        *this = 0;              // the quotient.
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0)
+            throw uint_error("Division by zero");
+        if (div_bits > num_bits) // the result is certainly 0.
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift; // shift so that div and num align.
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1 << (shift & 31)); // set a bit of the result.
+            }
+            div >>= 1; // shift back.
+            shift--;
+        }
+        // num now contains the remainder of the division.
+        return *this;
+    }
+
+    arith_uint& operator++()
+    {
+        // prefix operator
+        int i = 0;
+        while (i < WIDTH && ++pn[i] == 0)
+            i++;
+        return *this;
+    }
+
+    const arith_uint operator++(int)
+    {
+        // postfix operator
+        const arith_uint ret = *this;
+        ++(*this);
+        return ret;
+    }
+
+    arith_uint& operator--()
+    {
+        // prefix operator
+        int i = 0;
+        while (i < WIDTH && --pn[i] == (uint32_t)-1)
+            i++;
+        return *this;
+    }
+
+    const arith_uint operator--(int)
+    {
+        // postfix operator
+        const arith_uint ret = *this;
+        --(*this);
+        return ret;
+    }
+
+    int CompareTo(const arith_uint& b) const
+    {
+        for (int i = WIDTH-1; i >= 0; i--)
+        {
+            if (pn[i] < b.pn[i])
+                return -1;
+            if (pn[i] > b.pn[i])
+                return 1;
+        }
+        return 0;
+    }
+
+    bool EqualTo(uint64_t b) const
+    {
+        for (int i = WIDTH-1; i >= 2; i--)
+        {
+            if (pn[i])
+                return false;
+        }
+        if (pn[1] != (b >> 32))
+            return false;
+        if (pn[0] != (b & 0xfffffffful))
+            return false;
+        return true;
+    }
+
+    friend inline const arith_uint operator+(const arith_uint& a, const arith_uint& b) { return arith_uint(a) += b; }
+    friend inline const arith_uint operator-(const arith_uint& a, const arith_uint& b) { return arith_uint(a) -= b; }
+    friend inline const arith_uint operator*(const arith_uint& a, const arith_uint& b) { return arith_uint(a) *= b; }
+    friend inline const arith_uint operator/(const arith_uint& a, const arith_uint& b) { return arith_uint(a) /= b; }
+    friend inline const arith_uint operator|(const arith_uint& a, const arith_uint& b) { return arith_uint(a) |= b; }
+    friend inline const arith_uint operator&(const arith_uint& a, const arith_uint& b) { return arith_uint(a) &= b; }
+    friend inline const arith_uint operator^(const arith_uint& a, const arith_uint& b) { return arith_uint(a) ^= b; }
+    friend inline const arith_uint operator>>(const arith_uint& a, int shift) { return arith_uint(a) >>= shift; }
+    friend inline const arith_uint operator<<(const arith_uint& a, int shift) { return arith_uint(a) <<= shift; }
+    friend inline const arith_uint operator*(const arith_uint& a, uint32_t b) { return arith_uint(a) *= b; }
+    friend inline bool operator==(const arith_uint& a, const arith_uint& b) { return memcmp(a.pn, b.pn, sizeof(a.pn)) == 0; }
+    friend inline bool operator!=(const arith_uint& a, const arith_uint& b) { return memcmp(a.pn, b.pn, sizeof(a.pn)) != 0; }
+    friend inline bool operator>(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) > 0; }
+    friend inline bool operator<(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) < 0; }
+    friend inline bool operator>=(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) >= 0; }
+    friend inline bool operator<=(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) <= 0; }
+    friend inline bool operator==(const arith_uint& a, uint64_t b) { return a.EqualTo(b); }
+    friend inline bool operator!=(const arith_uint& a, uint64_t b) { return !a.EqualTo(b); }
+
+    /** Position of the highest set bit plus one, or zero if the value is zero. */
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH-1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                {
+                    if (pn[pos] & 1U << nbits)
+                        return 32 * pos + nbits + 1;
+                }
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    uint64_t GetLow64() const
+    {
+        return pn[0] | (uint64_t)pn[1] << 32;
+    }
+
+    /**
+     * The "compact" format is a representation of a whole number N using an
+     * unsigned 32bit number similar to a floating point format.
+     * The most significant 8 bits are the unsigned exponent of base 256.
+     * This exponent can be thought of as "number of bytes of N".
+     * The lower 23 bits are the mantissa.
+     * Bit number 24 (0x800000) represents the sign of N.
+     * N = (-1^sign) * mantissa * 256^(exponent-3)
+     *
+     * This is the same encoding CBigNum::SetCompact/GetCompact produce via
+     * OpenSSL's MPI format; the sign and overflow conditions that a signed,
+     * unbounded bignum would represent are reported through the out flags.
+     */
+    arith_uint& SetCompact(uint32_t nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > (int)BITS/8 + 2) ||
+                                         (nWord > 0xff && nSize > (int)BITS/8 + 1) ||
+                                         (nWord > 0xffff && nSize > (int)BITS/8));
+        return *this;
+    }
+
+    uint32_t GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        uint32_t nCompact = 0;
+        if (nSize <= 3)
+        {
+            nCompact = GetLow64() << 8 * (3 - nSize);
+        }
+        else
+        {
+            arith_uint bn = *this >> 8 * (nSize - 3);
+            nCompact = bn.GetLow64();
+        }
+        // The 0x00800000 bit denotes the sign.
+        // Thus, if it is already set, divide the mantissa by 256 and increase the exponent.
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        nCompact |= (fNegative && (nCompact & 0x007fffff) ? 0x00800000 : 0);
+        return nCompact;
+    }
+
+    std::string GetHex() const
+    {
+        char psz[sizeof(pn)*2 + 1];
+        for (unsigned int i = 0; i < sizeof(pn); i++)
+            sprintf(psz + i*2, "%02x", ((unsigned char*)pn)[sizeof(pn) - i - 1]);
+        return std::string(psz, psz + sizeof(pn)*2);
+    }
+
+    void SetHex(const std::string& str)
+    {
+        base_uint<BITS> b;
+        b.SetHex(str);
+        memcpy(pn, b.begin(), sizeof(pn));
+    }
+
+    std::string ToString() const
+    {
+        return GetHex();
+    }
+
+    /** Decimal representation, matching CBigNum::ToString() for non-negative values */
+    std::string ToDecimalString() const
+    {
+        if (!*this)
+            return "0";
+        std::string str;
+        arith_uint n = *this;
+        while (!!n)
+        {
+            // divide by 10 one limb at a time, collecting the remainder
+            uint64_t rem = 0;
+            for (int i = WIDTH-1; i >= 0; i--)
+            {
+                uint64_t cur = (rem << 32) | n.pn[i];
+                n.pn[i] = (uint32_t)(cur / 10);
+                rem = cur % 10;
+            }
+            str += (char)('0' + rem);
+        }
+        return std::string(str.rbegin(), str.rend());
+    }
+
+    unsigned int size() const
+    {
+        return sizeof(pn);
+    }
+};
+
+typedef arith_uint<256> arith_uint256;
+typedef arith_uint<512> arith_uint512;
+
+inline uint256 ArithToUint256(const arith_uint256& a)
+{
+    uint256 b;
+    for (int i = 0; i < arith_uint256::WIDTH; i++)
+        ((uint32_t*)b.begin())[i] = a.GetLimb(i);
+    return b;
+}
+
+inline arith_uint256 UintToArith256(const uint256& a)
+{
+    arith_uint256 b;
+    for (int i = 0; i < arith_uint256::WIDTH; i++)
+        b |= arith_uint256(((const uint32_t*)a.begin())[i]) << (32 * i);
+    return b;
+}
+
+#endif
@@ -23,8 +23,12 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
 #include <list>
 
+#include "workqueue.h"
+
 
 #define printf OutputDebugStringF
 
@@ -40,6 +44,10 @@ static std::string strRPCUserColonPass;
 const Object emptyobj;
 
 void ThreadRPCServer3(void* parg);
+static void RPCStatsLogTimer(boost::shared_ptr<asio::deadline_timer> timer, int64_t nInterval, const boost::system::error_code& error);
+
+// Idle keep-alive connections are dropped after this many seconds
+static const int RPC_KEEPALIVE_TIMEOUT = 30;
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -243,6 +251,50 @@ Value stop(const Array& params, bool fHelp)
     return "DeepOnion server stopping";
 }
 
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getrpcstats [reset=false]\n"
+            "Returns the number of calls, errors, time taken and time spent waiting for locks of each RPC method,\n"
+            "with a histogram of the call times in microseconds. Starts counting afresh if [reset] is true.");
+
+    bool fReset = false;
+    if (params.size() > 0)
+        fReset = params[0].get_bool();
+
+    map<string, CRPCMethodStats> mapStats;
+    GetRPCStats(mapStats, fReset);
+
+    Object ret;
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapStats)
+    {
+        const CRPCMethodStats& stats = item.second;
+        Object obj;
+        obj.push_back(Pair("count", (boost::int64_t)stats.nCount));
+        obj.push_back(Pair("errors", (boost::int64_t)stats.nErrors));
+        obj.push_back(Pair("totalus", (boost::int64_t)stats.nTotalMicros));
+        obj.push_back(Pair("avgus", (boost::int64_t)(stats.nTotalMicros / (int64_t)stats.nCount)));
+        obj.push_back(Pair("maxus", (boost::int64_t)stats.nMaxMicros));
+        obj.push_back(Pair("lockwaitus", (boost::int64_t)stats.nLockWaitMicros));
+        obj.push_back(Pair("maxlockwaitus", (boost::int64_t)stats.nMaxLockWaitMicros));
+
+        // Only the buckets with calls in them, keyed by their upper bound
+        Object objHistogram;
+        int64_t nLimit = 128;
+        for (int i = 0; i < RPC_STATS_BUCKETS; i++, nLimit *= 2)
+        {
+            if (stats.vHistogram[i] == 0)
+                continue;
+            string strKey = (i < RPC_STATS_BUCKETS - 1) ? strprintf("<%" PRId64, nLimit) : strprintf(">=%" PRId64, nLimit / 2);
+            objHistogram.push_back(Pair(strKey, (boost::int64_t)stats.vHistogram[i]));
+        }
+        obj.push_back(Pair("histogram", objHistogram));
+        ret.push_back(Pair(item.first, obj));
+    }
+    return ret;
+}
+
 Value uptime(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 0){
@@ -261,117 +313,136 @@ Value uptime(const Array& params, bool fHelp)
 
 static const CRPCCommand vRPCCommands[] =
     {
-        //  category          name                     function                  safemd  unlocked
-        //  ----------------  -----------------------  ------------------------  ------  --------
+        //  category          name                     function                  safemd  unlocked  readonly
+        //  ----------------  -----------------------  ------------------------  ------  --------  --------
 
         /* Overall control/query calls */
-        {"control",           "help",                   &help,                   true,   true },
-        {"control",           "stop",                   &stop,                   true,   true },
-        {"control",           "getinfo",                &getinfo,                true,   false},
-        {"control",           "uptime",                 &uptime,                 true,   false},
+        {"control",           "help",                   &help,                   true,   true,    false},
+        {"control",           "stop",                   &stop,                   true,   true,    false},
+        {"control",           "getinfo",                &getinfo,                true,   false,   false},
+        {"control",           "uptime",                 &uptime,                 true,   false,   false},
+        {"control",           "getrpcstats",            &getrpcstats,            true,   true,    false},
 
         /* P2P networking */
-        {"network",           "getconnectioncount",     &getconnectioncount,     true,   false},
-        {"network",           "getnettotals",           &getnettotals,           true,   false},
-        {"network",           "getpeerinfo",            &getpeerinfo,            true,   false},
-        {"network",           "sendalert",              &sendalert,              false,  false},
+        {"network",           "getconnectioncount",     &getconnectioncount,     true,   false,   false},
+        {"network",           "getnettotals",           &getnettotals,           true,   false,   false},
+        {"network",           "getpeerinfo",            &getpeerinfo,            true,   false,   false},
+        {"network",           "getmessagestats",        &getmessagestats,        true,   true,    false},
+        {"network",           "sendalert",              &sendalert,              false,  false,   false},
 
         /* Block chain mining and UTXO */
-        {"blockchain",        "getbestblockhash",       &getbestblockhash,       true,   false},
-        {"blockchain",        "getblockcount",          &getblockcount,          true,   false},
-        {"blockchain",        "getblock",               &getblock,               false,  false},
-        {"blockchain",        "getblockhash",           &getblockhash,           false,  false},
-        {"blockchain",        "getblockbynumber",       &getblockbynumber,       false,  false},
-        {"blockchain",        "getcheckpoint",          &getcheckpoint,          true,   false},
-        {"blockchain",        "getblocktemplate",       &getblocktemplate,       true,   false},
-        {"blockchain",        "getdifficulty",          &getdifficulty,          true,   false},
-        {"blockchain",        "getmininginfo",          &getmininginfo,          true,   false},
-        {"blockchain",        "getnetworkhashps",       &getnetworkhashps,       true,   false},
-        {"blockchain",        "getrawmempool",          &getrawmempool,          true,   false},
-        {"blockchain",        "getstakinginfo",         &getstakinginfo,         true,   false},
-        {"blockchain",        "getsubsidy",             &getsubsidy,             true,   false},
-        {"blockchain",        "getwork",                &getwork,                true,   false},
-        {"blockchain",        "getworkex",              &getworkex,              true,   false},
-        {"blockchain",        "settxfee",               &settxfee,               false,  false},
-        {"blockchain",        "submitblock",            &submitblock,            false,  false},
-        {"blockchain",        "reservebalance",         &reservebalance,         false,  true },      
+        {"blockchain",        "getaddressbalance",      &getaddressbalance,      true,   false,   true },
+        {"blockchain",        "getaddresstxids",        &getaddresstxids,        true,   false,   true },
+        {"blockchain",        "getaddressutxos",        &getaddressutxos,        true,   false,   true },
+        {"blockchain",        "getbestblockhash",       &getbestblockhash,       true,   false,   true },
+        {"blockchain",        "getblockcount",          &getblockcount,          true,   false,   true },
+        {"blockchain",        "getblock",               &getblock,               false,  false,   true },
+        {"blockchain",        "getblockhash",           &getblockhash,           false,  false,   true },
+        {"blockchain",        "getblockbynumber",       &getblockbynumber,       false,  false,   true },
+        {"blockchain",        "getcheckpoint",          &getcheckpoint,          true,   false,   false},
+        {"blockchain",        "getblocktemplate",       &getblocktemplate,       true,   true,    false},
+        {"blockchain",        "getdifficulty",          &getdifficulty,          true,   false,   true },
+        {"blockchain",        "getmininginfo",          &getmininginfo,          true,   false,   false},
+        {"blockchain",        "getnetworkhashps",       &getnetworkhashps,       true,   false,   false},
+        {"blockchain",        "getrawmempool",          &getrawmempool,          true,   false,   true },
+        {"blockchain",        "getspentinfo",           &getspentinfo,           true,   false,   true },
+        {"blockchain",        "getstakinginfo",         &getstakinginfo,         true,   false,   false},
+        {"blockchain",        "getsubsidy",             &getsubsidy,             true,   false,   false},
+        {"blockchain",        "getwork",                &getwork,                true,   true,    false},
+        {"blockchain",        "getworkex",              &getworkex,              true,   false,   false},
+        {"blockchain",        "settxfee",               &settxfee,               false,  false,   false},
+        {"blockchain",        "submitblock",            &submitblock,            false,  false,   false},
+        {"blockchain",        "reservebalance",         &reservebalance,         false,  true,    false},
 
         /* Wallet */
-        {"wallet",            "addmultisigaddress",     &addmultisigaddress,     false,  false},
-        {"wallet",            "addredeemscript",        &addredeemscript,        false,  false},
-        {"wallet",            "backupwallet",           &backupwallet,           true,   false},
-        {"wallet",            "checkwallet",            &checkwallet,            false,  true },
-        {"wallet",            "dumpprivkey",            &dumpprivkey,            false,  false},
-        {"wallet",            "dumpwallet",             &dumpwallet,             true,   false},
-        {"wallet",            "encryptwallet",          &encryptwallet,          false,  false},
-        {"wallet",            "getaccountaddress",      &getaccountaddress,      true,   false},
-        {"wallet",            "getaccount",             &getaccount,             false,  false},
-        {"wallet",            "getaddressesbyaccount",  &getaddressesbyaccount,  true,   false},
-        {"wallet",            "getbalance",             &getbalance,             false,  false},
-        {"wallet",            "getnewaddress",          &getnewaddress,          true,   false},
-        {"wallet",            "getnewpubkey",           &getnewpubkey,           true,   false},
-        {"wallet",            "getreceivedbyaccount",   &getreceivedbyaccount,   false,  false},
-        {"wallet",            "getreceivedbyaddress",   &getreceivedbyaddress,   false,  false},
-        {"wallet",            "gettransaction",         &gettransaction,         false,  false},
-        {"wallet",            "importprivkey",          &importprivkey,          false,  false},
-        {"wallet",            "importwallet",           &importwallet,           false,  false},
-        {"wallet",            "keypoolrefill",          &keypoolrefill,          true,   false},
-        {"wallet",            "listaccounts",           &listaccounts,           false,  false},
-        {"wallet",            "listaddressgroupings",   &listaddressgroupings,   false,  false},
-        {"wallet",            "listreceivedbyaccount",  &listreceivedbyaccount,  false,  false},
-        {"wallet",            "listreceivedbyaddress",  &listreceivedbyaddress,  false,  false},
-        {"wallet",            "listsinceblock",         &listsinceblock,         false,  false},
-        {"wallet",            "listtransactions",       &listtransactions,       false,  false},
-        {"wallet",            "listunspent",            &listunspent,            false,  false},
-        {"wallet",            "move",                   &movecmd,                false,  false},
-        {"wallet",            "repairwallet",           &repairwallet,           false,  true },
-        {"wallet",            "sendfrom",               &sendfrom,               false,  false},
-        {"wallet",            "sendmany",               &sendmany,               false,  false},
-        {"wallet",            "sendtoaddress",          &sendtoaddress,          false,  false},
-        {"wallet",            "setaccount",             &setaccount,             true,   false},
-        {"wallet",            "resendtx",               &resendtx,               false,  true },
-        {"wallet",            "walletlock",             &walletlock,             true,   false},
-        {"wallet",            "walletpassphrasechange", &walletpassphrasechange, false,  false},
-        {"wallet",            "walletpassphrase",       &walletpassphrase,       true,   false},      
+        {"wallet",            "addmultisigaddress",     &addmultisigaddress,     false,  false,   false},
+        {"wallet",            "addredeemscript",        &addredeemscript,        false,  false,   false},
+        {"wallet",            "backupwallet",           &backupwallet,           true,   false,   false},
+        {"wallet",            "checkwallet",            &checkwallet,            false,  true,    false},
+        {"wallet",            "dumpprivkey",            &dumpprivkey,            false,  false,   false},
+        {"wallet",            "dumpwallet",             &dumpwallet,             true,   false,   false},
+        {"wallet",            "encryptwallet",          &encryptwallet,          false,  false,   false},
+        {"wallet",            "getaccountaddress",      &getaccountaddress,      true,   false,   false},
+        {"wallet",            "getaccount",             &getaccount,             false,  false,   false},
+        {"wallet",            "getaddressesbyaccount",  &getaddressesbyaccount,  true,   false,   false},
+        {"wallet",            "getbalance",             &getbalance,             false,  false,   false},
+        {"wallet",            "getnewaddress",          &getnewaddress,          true,   false,   false},
+        {"wallet",            "getnewpubkey",           &getnewpubkey,           true,   false,   false},
+        {"wallet",            "getreceivedbyaccount",   &getreceivedbyaccount,   false,  false,   false},
+        {"wallet",            "getreceivedbyaddress",   &getreceivedbyaddress,   false,  false,   false},
+        {"wallet",            "gettransaction",         &gettransaction,         false,  false,   false},
+        {"wallet",            "importprivkey",          &importprivkey,          false,  false,   false},
+        {"wallet",            "importwallet",           &importwallet,           false,  false,   false},
+        {"wallet",            "keypoolrefill",          &keypoolrefill,          true,   false,   false},
+        {"wallet",            "listaccounts",           &listaccounts,           false,  false,   false},
+        {"wallet",            "listaddressgroupings",   &listaddressgroupings,   false,  false,   false},
+        {"wallet",            "listreceivedbyaccount",  &listreceivedbyaccount,  false,  false,   false},
+        {"wallet",            "listreceivedbyaddress",  &listreceivedbyaddress,  false,  false,   false},
+        {"wallet",            "listsinceblock",         &listsinceblock,         false,  false,   false},
+        {"wallet",            "listtransactions",       &listtransactions,       false,  false,   false},
+        {"wallet",            "listunspent",            &listunspent,            false,  false,   false},
+        {"wallet",            "move",                   &movecmd,                false,  false,   false},
+        {"wallet",            "repairwallet",           &repairwallet,           false,  true,    false},
+        {"wallet",            "sendfrom",               &sendfrom,               false,  false,   false},
+        {"wallet",            "sendmany",               &sendmany,               false,  false,   false},
+        {"wallet",            "sendtoaddress",          &sendtoaddress,          false,  false,   false},
+        {"wallet",            "setaccount",             &setaccount,             true,   false,   false},
+        {"wallet",            "resendtx",               &resendtx,               false,  true,    false},
+        {"wallet",            "walletlock",             &walletlock,             true,   false,   false},
+        {"wallet",            "walletpassphrasechange", &walletpassphrasechange, false,  false,   false},
+        {"wallet",            "walletpassphrase",       &walletpassphrase,       true,   false,   false},
         
         /* Utility functions */
-        {"util",              "makekeypair",            &makekeypair,            false,  true },
-        {"util",              "signmessage",            &signmessage,            false,  false},
-        {"util",              "verifymessage",          &verifymessage,          false,  false},
-        {"util",              "validateaddress",        &validateaddress,        true,   false},
-        {"util",              "validatepubkey",         &validatepubkey,         true,   false},
+        {"util",              "makekeypair",            &makekeypair,            false,  true,    false},
+        {"util",              "signmessage",            &signmessage,            false,  false,   false},
+        {"util",              "verifymessage",          &verifymessage,          false,  false,   false},
+        {"util",              "validateaddress",        &validateaddress,        true,   false,   false},
+        {"util",              "validatepubkey",         &validatepubkey,         true,   false,   false},
 
         /* Raw transactions */
-        {"rawtransactions",   "createrawtransaction",   &createrawtransaction,   false,  false},
-        {"rawtransactions",   "decoderawtransaction",   &decoderawtransaction,   false,  false},
-        {"rawtransactions",   "decodescript",           &decodescript,           false,  false},
-        {"rawtransactions",   "getrawtransaction",      &getrawtransaction,      false,  false},
-        {"rawtransactions",   "listunspent",            &listunspent,            false,  false},
-        {"rawtransactions",   "sendrawtransaction",     &sendrawtransaction,     false,  false},
-        {"rawtransactions",   "signrawtransaction",     &signrawtransaction,     false,  false},    
+        {"rawtransactions",   "createrawtransaction",   &createrawtransaction,   false,  false,   false},
+        {"rawtransactions",   "decoderawtransaction",   &decoderawtransaction,   false,  false,   true },
+        {"rawtransactions",   "decodescript",           &decodescript,           false,  false,   true },
+        {"rawtransactions",   "getrawtransaction",      &getrawtransaction,      false,  false,   true },
+        {"rawtransactions",   "listunspent",            &listunspent,            false,  false,   false},
+        {"rawtransactions",   "sendrawtransaction",     &sendrawtransaction,     false,  false,   false},
+        {"rawtransactions",   "signrawtransaction",     &signrawtransaction,     false,  false,   false},
 
         /* Stealth Addresses */
-        {"stealth",           "getnewstealthaddress",   &getnewstealthaddress,   false,  false},
-        {"stealth",           "liststealthaddresses",   &liststealthaddresses,   false,  false},
-        {"stealth",           "importstealthaddress",   &importstealthaddress,   false,  false},
-        {"stealth",           "sendtostealthaddress",   &sendtostealthaddress,   false,  false},
-        {"stealth",           "scanforalltxns",         &scanforalltxns,         false,  false},
-        {"stealth",           "scanforstealthtxns",     &scanforstealthtxns,     false,  false},
+        {"stealth",           "getnewstealthaddress",   &getnewstealthaddress,   false,  false,   false},
+        {"stealth",           "liststealthaddresses",   &liststealthaddresses,   false,  false,   false},
+        {"stealth",           "importstealthaddress",   &importstealthaddress,   false,  false,   false},
+        {"stealth",           "sendtostealthaddress",   &sendtostealthaddress,   false,  false,   false},
+        {"stealth",           "scanforalltxns",         &scanforalltxns,         false,  false,   false},
+        {"stealth",           "scanforstealthtxns",     &scanforstealthtxns,     false,  false,   false},
         
         /* Messages */
-        {"messages",          "smsgenable",             &smsgenable,             false,  false},
-        {"messages",          "smsgdisable",            &smsgdisable,            false,  false},
-        {"messages",          "smsglocalkeys",          &smsglocalkeys,          false,  false},
-        {"messages",          "smsgoptions",            &smsgoptions,            false,  false},
-        {"messages",          "smsgscanchain",          &smsgscanchain,          false,  false},
-        {"messages",          "smsgscanbuckets",        &smsgscanbuckets,        false,  false},
-        {"messages",          "smsgaddkey",             &smsgaddkey,             false,  false},
-        {"messages",          "smsggetpubkey",          &smsggetpubkey,          false,  false},
-        {"messages",          "smsgsend",               &smsgsend,               false,  false},
-        {"messages",          "smsgsendanon",           &smsgsendanon,           false,  false},
-        {"messages",          "smsginbox",              &smsginbox,              false,  false},
-        {"messages",          "smsgoutbox",             &smsgoutbox,             false,  false},
-        {"messages",          "smsgbuckets",            &smsgbuckets,            false,  false},
+        {"messages",          "smsgenable",             &smsgenable,             false,  false,   false},
+        {"messages",          "smsgdisable",            &smsgdisable,            false,  false,   false},
+        {"messages",          "smsglocalkeys",          &smsglocalkeys,          false,  false,   false},
+        {"messages",          "smsgoptions",            &smsgoptions,            false,  false,   false},
+        {"messages",          "smsgscanchain",          &smsgscanchain,          false,  false,   false},
+        {"messages",          "smsgscanbuckets",        &smsgscanbuckets,        false,  false,   false},
+        {"messages",          "smsgaddkey",             &smsgaddkey,             false,  false,   false},
+        {"messages",          "smsggetpubkey",          &smsggetpubkey,          false,  false,   false},
+        {"messages",          "smsgsend",               &smsgsend,               false,  false,   false},
+        {"messages",          "smsgsendanon",           &smsgsendanon,           false,  false,   false},
+        {"messages",          "smsginbox",              &smsginbox,              false,  false,   false},
+        {"messages",          "smsgoutbox",             &smsgoutbox,             false,  false,   false},
+        {"messages",          "smsgbuckets",            &smsgbuckets,            false,  false,   false},
+};
+
+// Commands with large results that write them as JSON text, see CJSONWriter.
+// Locking and safe mode follow the entry of the same name above.
+static const CRPCStreamCommand vRPCStreamCommands[] =
+    {
+        //  name                       function
+        //  -------------------------  ------------------------
+        {"getblock",                   &getblock                },
+        {"getblockbynumber",           &getblockbynumber        },
+        {"getrawmempool",              &getrawmempool           },
+        {"listtransactions",           &listtransactions        },
+        {"listunspent",                &listunspent             },
 };
 
 CRPCTable::CRPCTable()
@@ -384,6 +455,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++)
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = &vRPCStreamCommands[vcidx];
 }
 
 const CRPCCommand *CRPCTable::operator[](string name) const
@@ -431,7 +504,36 @@ string rfc1123Time()
     return string(buffer);
 }
 
-static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+string HTTPReplyHeader(int nStatus, bool keepalive, int64_t nContentLength, const char* pszContentType)
+{
+    const char *cStatus;
+         if (nStatus == HTTP_OK) cStatus = "OK";
+    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
+    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
+    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
+    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
+    else cStatus = "";
+    string strLength = nContentLength < 0 ? string("Transfer-Encoding: chunked") :
+                                            strprintf("Content-Length: %" PRId64, nContentLength);
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "%s\r\n"
+            "Content-Type: %s\r\n"
+            "Server: DeepOnion-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        cStatus,
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        strLength.c_str(),
+        pszContentType,
+        FormatFullVersion().c_str());
+}
+
+string HTTPReply(int nStatus, const string& strMsg, bool keepalive, const char* pszContentType)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -450,29 +552,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
-    const char *cStatus;
-         if (nStatus == HTTP_OK) cStatus = "OK";
-    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
-    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
-    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
-    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
-    else cStatus = "";
-    return strprintf(
-            "HTTP/1.1 %d %s\r\n"
-            "Date: %s\r\n"
-            "Connection: %s\r\n"
-            "Content-Length: %" PRIszu "\r\n"
-            "Content-Type: application/json\r\n"
-            "Server: DeepOnion-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
-        nStatus,
-        cStatus,
-        rfc1123Time().c_str(),
-        keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+    return HTTPReplyHeader(nStatus, keepalive, strMsg.size(), pszContentType) + strMsg;
 }
 
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
@@ -490,6 +570,25 @@ int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
     return atoi(vWords[1].c_str());
 }
 
+// Method and path of a request line such as "POST / HTTP/1.1"
+static bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
+                                string& http_method, string& http_uri)
+{
+    string str;
+    getline(stream, str);
+    vector<string> vWords;
+    boost::split(vWords, str, boost::is_any_of(" "));
+    if (vWords.size() < 2)
+        return false;
+    http_method = vWords[0];
+    http_uri = vWords[1];
+    proto = 0;
+    const char *ver = strstr(str.c_str(), "HTTP/1.");
+    if (ver != NULL)
+        proto = atoi(ver+7);
+    return true;
+}
+
 int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet)
 {
     int nLen = 0;
@@ -515,6 +614,46 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
+// Fill in the connection header if the peer didn't, HTTP/1.1 defaults to keep-alive
+static void ReadHTTPConnection(map<string, string>& mapHeadersRet, int nProto)
+{
+    string sConHdr = mapHeadersRet["connection"];
+
+    if ((sConHdr != "close") && (sConHdr != "keep-alive"))
+    {
+        if (nProto >= 1)
+            mapHeadersRet["connection"] = "keep-alive";
+        else
+            mapHeadersRet["connection"] = "close";
+    }
+}
+
+// Reassemble a body sent with chunked transfer encoding
+static bool ReadHTTPChunked(std::basic_istream<char>& stream, string& strMessageRet)
+{
+    while (true)
+    {
+        string str;
+        if (!std::getline(stream, str))
+            return false;
+        unsigned long nChunk = strtoul(str.c_str(), NULL, 16);
+        if (nChunk == 0)
+            break;
+        if (nChunk > MAX_SIZE || strMessageRet.size() + nChunk > MAX_SIZE)
+            return false;
+        size_t nOld = strMessageRet.size();
+        strMessageRet.resize(nOld + nChunk);
+        if (!stream.read(&strMessageRet[nOld], nChunk))
+            return false;
+        std::getline(stream, str);
+    }
+    // Skip trailers up to the closing empty line
+    string str;
+    while (std::getline(stream, str) && !str.empty() && str != "\r")
+        ;
+    return true;
+}
+
 int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
 {
     mapHeadersRet.clear();
@@ -530,22 +669,19 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        if (!ReadHTTPChunked(stream, strMessageRet))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
         strMessageRet = string(vch.begin(), vch.end());
     }
 
-    string sConHdr = mapHeadersRet["connection"];
-
-    if ((sConHdr != "close") && (sConHdr != "keep-alive"))
-    {
-        if (nProto >= 1)
-            mapHeadersRet["connection"] = "keep-alive";
-        else
-            mapHeadersRet["connection"] = "close";
-    }
+    ReadHTTPConnection(mapHeadersRet, nProto);
 
     return nStatus;
 }
@@ -597,15 +733,15 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+string ErrorReply(const Object& objError, const Value& id)
 {
-    // Send error reply from json-rpc error object
+    // Build error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, false);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -684,14 +820,28 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
+class AcceptedConnection : public boost::enable_shared_from_this<AcceptedConnection>
 {
 public:
+    AcceptedConnection() : nProto(0) {}
     virtual ~AcceptedConnection() {}
 
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+
+    // Read the next request into mapHeaders and strRequest without blocking,
+    // fn is called on the io_service thread with whether that worked
+    virtual void async_read_request(const boost::function<void (bool)>& fn) = 0;
+    // Send a reply, from any thread, while no read is outstanding
+    virtual bool write(const std::string& strReply) = 0;
+    virtual asio::io_service& get_io_service() = 0;
+
+    string strMethod;
+    string strURI;
+    map<string, string> mapHeaders;
+    string strRequest;
+    int nProto;     // minor HTTP version of the request, 1 for HTTP/1.1
 };
 
 template <typename Protocol>
@@ -701,10 +851,16 @@ public:
     AcceptedConnectionImpl(
             asio::io_service& io_service,
             ssl::context &context,
-            bool fUseSSL) :
+            bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+        _d(sslStream, fUseSSLIn),
+        _stream(_d),
+        fUseSSL(fUseSSLIn),
+        fNeedHandshake(fUseSSLIn),
+        fReading(false),
+        nContentLength(0),
+        buf(MAX_SIZE),
+        timerIdle(io_service)
     {
     }
 
@@ -723,14 +879,170 @@ public:
         _stream.close();
     }
 
+    virtual void async_read_request(const boost::function<void (bool)>& fn)
+    {
+        fnRead = fn;
+        fReading = true;
+
+        // Nothing else notices a client that went away without closing
+        timerIdle.expires_from_now(posix_time::seconds(RPC_KEEPALIVE_TIMEOUT));
+        timerIdle.async_wait(boost::bind(&AcceptedConnectionImpl<Protocol>::handle_timeout, this,
+                shared_from_this(), asio::placeholders::error));
+
+        if (fNeedHandshake)
+        {
+            fNeedHandshake = false;
+            sslStream.async_handshake(ssl::stream_base::server,
+                    boost::bind(&AcceptedConnectionImpl<Protocol>::handle_handshake, this,
+                        shared_from_this(), asio::placeholders::error));
+        }
+        else
+            read_header();
+    }
+
+    virtual bool write(const std::string& strReply)
+    {
+        boost::system::error_code error;
+        if (fUseSSL)
+            asio::write(sslStream, asio::buffer(strReply), error);
+        else
+            asio::write(sslStream.next_layer(), asio::buffer(strReply), error);
+        return !error;
+    }
+
+    virtual asio::io_service& get_io_service()
+    {
+        return sslStream.get_io_service();
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
     SSLIOStreamDevice<Protocol> _d;
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+
+    bool fUseSSL;
+    bool fNeedHandshake;
+    bool fReading;
+    int nContentLength;
+    asio::streambuf buf;
+    asio::deadline_timer timerIdle;
+    boost::function<void (bool)> fnRead;
+
+    void finish(bool fOk)
+    {
+        fReading = false;
+        timerIdle.cancel();
+        boost::function<void (bool)> fn;
+        fn.swap(fnRead);
+        fn(fOk);
+    }
+
+    void handle_timeout(boost::shared_ptr<AcceptedConnection> self, const boost::system::error_code& error)
+    {
+        // A timer that was re-armed for the next request may still deliver the old expiry
+        if (error == asio::error::operation_aborted || !fReading ||
+            timerIdle.expires_at() > posix_time::microsec_clock::universal_time())
+            return;
+        boost::system::error_code ignored;
+        sslStream.lowest_layer().close(ignored);
+    }
+
+    void handle_handshake(boost::shared_ptr<AcceptedConnection> self, const boost::system::error_code& error)
+    {
+        if (error)
+            finish(false);
+        else
+            read_header();
+    }
+
+    void read_header()
+    {
+        // Pipelined requests may already be waiting in buf
+        if (fUseSSL)
+            asio::async_read_until(sslStream, buf, "\r\n\r\n",
+                    boost::bind(&AcceptedConnectionImpl<Protocol>::handle_header, this,
+                        shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_read_until(sslStream.next_layer(), buf, "\r\n\r\n",
+                    boost::bind(&AcceptedConnectionImpl<Protocol>::handle_header, this,
+                        shared_from_this(), asio::placeholders::error));
+    }
+
+    void handle_header(boost::shared_ptr<AcceptedConnection> self, const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            finish(false);
+            return;
+        }
+
+        std::istream is(&buf);
+        if (!ReadHTTPRequestLine(is, nProto, strMethod, strURI))
+        {
+            finish(false);
+            return;
+        }
+        mapHeaders.clear();
+        nContentLength = ReadHTTPHeader(is, mapHeaders);
+        if (nContentLength < 0 || nContentLength > (int)MAX_SIZE)
+        {
+            finish(false);
+            return;
+        }
+        ReadHTTPConnection(mapHeaders, nProto);
+
+        if ((int)buf.size() >= nContentLength)
+            handle_body(self, boost::system::error_code());
+        else if (fUseSSL)
+            asio::async_read(sslStream, buf, asio::transfer_at_least(nContentLength - buf.size()),
+                    boost::bind(&AcceptedConnectionImpl<Protocol>::handle_body, this,
+                        shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_read(sslStream.next_layer(), buf, asio::transfer_at_least(nContentLength - buf.size()),
+                    boost::bind(&AcceptedConnectionImpl<Protocol>::handle_body, this,
+                        shared_from_this(), asio::placeholders::error));
+    }
+
+    void handle_body(boost::shared_ptr<AcceptedConnection> self, const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            finish(false);
+            return;
+        }
+        asio::streambuf::const_buffers_type data = buf.data();
+        strRequest.assign(asio::buffers_begin(data), asio::buffers_begin(data) + nContentLength);
+        buf.consume(nContentLength);
+        finish(true);
+    }
 };
 
+// Requests that have been read completely and parts of batches, waiting for a worker
+static CWorkQueue<boost::function<void()> >* pRPCWorkQueue = NULL;
+
+static void RPCReadRequest(boost::shared_ptr<AcceptedConnection> conn);
+static void RPCServeRequest(boost::shared_ptr<AcceptedConnection> conn);
+
+static void RPCRequestRead(boost::shared_ptr<AcceptedConnection> conn, bool fOk)
+{
+    // Dropping the last reference closes the connection
+    if (!fOk || fShutdown)
+        return;
+    if (!pRPCWorkQueue->Push(boost::bind(&RPCServeRequest, conn)))
+    {
+        printf("ThreadRPCServer work queue full (%u requests), rejecting request from %s\n",
+               pRPCWorkQueue->GetMaxDepth(), conn->peer_address_to_string().c_str());
+        conn->write(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false));
+    }
+}
+
+static void RPCReadRequest(boost::shared_ptr<AcceptedConnection> conn)
+{
+    conn->async_read_request(boost::bind(&RPCRequestRead, conn, _1));
+}
+
 void ThreadRPCServer(void* parg)
 {
     // Make this thread recognisable as the RPC listener
@@ -757,7 +1069,7 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error);
 
 /**
@@ -769,7 +1081,7 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
                    const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
+    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -789,7 +1101,7 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error)
 {
     vnThreadsRunning[THREAD_RPCLISTENER]++;
@@ -799,31 +1111,27 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
      && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
+    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
 
     // TODO: Actually handle errors
     if (error)
     {
-        delete conn;
     }
 
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading any request, to filter out
     // certain DoS and misbehaving clients.
     else if (tcp_conn
           && !ClientAllowed(tcp_conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
+            conn->write(HTTPReply(HTTP_FORBIDDEN, "", false));
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
-    }
+    // Requests are read here and handed to the worker threads once complete
+    else
+        RPCReadRequest(conn);
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
@@ -952,6 +1260,23 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    // A fixed pool of workers executes the requests this thread reads
+    int nWorkQueue = max((int)GetArg("-rpcworkqueue", 16), 1);
+    int nThreads = max((int)GetArg("-rpcthreads", 4), 1);
+    pRPCWorkQueue = new CWorkQueue<boost::function<void()> >(nWorkQueue);
+    printf("ThreadRPCServer using %d worker threads, work queue depth %d\n", nThreads, nWorkQueue);
+    for (int i = 0; i < nThreads; i++)
+        if (!NewThread(ThreadRPCServer3, NULL))
+            printf("Failed to create RPC server worker thread\n");
+
+    int64_t nStatsLogInterval = GetArg("-rpcstatslog", 0);
+    if (nStatsLogInterval > 0)
+    {
+        boost::shared_ptr<asio::deadline_timer> timerStatsLog(new asio::deadline_timer(io_service));
+        timerStatsLog->expires_from_now(posix_time::seconds(nStatsLogInterval));
+        timerStatsLog->async_wait(boost::bind(&RPCStatsLogTimer, timerStatsLog, nStatsLogInterval, _1));
+    }
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
@@ -1024,114 +1349,381 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+static bool IsReadOnlyRequest(const Value& req)
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
-
-    return write_string(Value(ret), false) + "\n";
+    if (req.type() != obj_type)
+        return false;
+    Value valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->readonly;
 }
 
-static CCriticalSection cs_THREAD_RPCHANDLER;
-
-void ThreadRPCServer3(void* parg)
+/** Runs of read-only calls in a batch, shared between the worker that owns
+ * the batch and the helpers it queued.  Every thread claims the next call of
+ * the current run until none is left; results go to their own slot, so the
+ * reply keeps the order of the request.
+ */
+class CRPCBatch
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("DeepOnion-rpchand");
+private:
+    boost::mutex mutex;
+    boost::condition_variable condDone;
+    const Array* pvReq;
+    unsigned int nNext;
+    unsigned int nEnd;
+    unsigned int nDone;
+    int nHelpers;
+
+    bool Claim(unsigned int& nReq)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nNext >= nEnd)
+            return false;
+        nReq = nNext++;
+        return true;
+    }
+
+public:
+    std::vector<Object> vResult;
 
+    CRPCBatch(const Array& vReq) : pvReq(&vReq), nNext(0), nEnd(0), nDone(0), nHelpers(0), vResult(vReq.size()) {}
+
+    // Execute calls of the current run until all are claimed
+    void Work()
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        unsigned int nReq;
+        while (Claim(nReq))
+        {
+            try {
+                vResult[nReq] = JSONRPCExecOne((*pvReq)[nReq]);
+            } catch (...) {
+                vResult[nReq] = JSONRPCReplyObj(Value::null, JSONRPCError(RPC_MISC_ERROR, "unknown exception"), Value::null);
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (++nDone == nEnd)
+                condDone.notify_all();
+        }
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
 
-    bool fRun = true;
-    while (true)
+    static void Help(boost::shared_ptr<CRPCBatch> batch)
     {
-        if (fShutdown || !fRun)
+        batch->Work();
+        boost::unique_lock<boost::mutex> lock(batch->mutex);
+        batch->nHelpers--;
+    }
+
+    // Execute calls nBegin..nEndIn-1 with up to nThreads threads, the caller included
+    static void Run(boost::shared_ptr<CRPCBatch> batch, unsigned int nBegin, unsigned int nEndIn, int nThreads)
+    {
+        int nWanted;
+        {
+            boost::unique_lock<boost::mutex> lock(batch->mutex);
+            batch->nNext = batch->nDone = nBegin;
+            batch->nEnd = nEndIn;
+            // Helpers from an earlier run that are still queued join this one
+            nWanted = min(nThreads - 1, (int)(nEndIn - nBegin) - 1) - batch->nHelpers;
+        }
+        // Helpers don't wait for a free slot, when the queue is full the
+        // owner does the work itself
+        for (int i = 0; i < nWanted; i++)
         {
-            conn->close();
-            delete conn;
             {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
+                boost::unique_lock<boost::mutex> lock(batch->mutex);
+                batch->nHelpers++;
+            }
+            if (!pRPCWorkQueue->Push(boost::bind(&CRPCBatch::Help, batch)))
+            {
+                boost::unique_lock<boost::mutex> lock(batch->mutex);
+                batch->nHelpers--;
+                break;
             }
-            return;
         }
-        map<string, string> mapHeaders;
-        string strRequest;
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+        batch->Work();
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+        boost::unique_lock<boost::mutex> lock(batch->mutex);
+        while (batch->nDone < batch->nEnd)
+            batch->condDone.wait(lock);
+    }
+};
+
+static Array JSONRPCExecBatch(const Array& vReq)
+{
+    // Consecutive read-only calls are spread over the worker pool, anything
+    // else runs in order on this thread
+    int nThreads = max((int)GetArg("-rpcbatchthreads", 4), 1);
+    boost::shared_ptr<CRPCBatch> batch(new CRPCBatch(vReq));
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size())
+    {
+        unsigned int nEnd = reqIdx;
+        while (nEnd < vReq.size() && IsReadOnlyRequest(vReq[nEnd]))
+            nEnd++;
+        if (nThreads > 1 && nEnd - reqIdx > 1)
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            CRPCBatch::Run(batch, reqIdx, nEnd, nThreads);
+            reqIdx = nEnd;
         }
-        if (!HTTPAuthorized(mapHeaders))
+        else
         {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            batch->vResult[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            reqIdx++;
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+    }
 
-        JSONRequest jreq;
-        try
+    Array ret;
+    ret.reserve(vReq.size());
+    BOOST_FOREACH(const Object& result, batch->vResult)
+        ret.push_back(result);
+
+    return ret;
+}
+
+/** Sends a 200 reply with chunked transfer encoding, the header goes out
+ * with the first chunk.  Nothing is sent before the first Write(), so the
+ * caller can still fall back to an error reply until then.
+ */
+class CHTTPChunkedSink : public CJSONSink
+{
+private:
+    AcceptedConnection *conn;
+    bool fKeepAlive;
+    bool fHeaderSent;
+
+    string Header()
+    {
+        if (fHeaderSent)
+            return "";
+        fHeaderSent = true;
+        return HTTPReplyHeader(HTTP_OK, fKeepAlive, -1);
+    }
+
+public:
+    CHTTPChunkedSink(AcceptedConnection *connIn, bool fKeepAliveIn) : conn(connIn), fKeepAlive(fKeepAliveIn), fHeaderSent(false) {}
+
+    bool Write(const char* pch, size_t nSize)
+    {
+        string str = Header();
+        str.reserve(str.size() + nSize + 16);
+        str += strprintf("%x\r\n", (unsigned int)nSize);
+        str.append(pch, nSize);
+        str += "\r\n";
+        return conn->write(str);
+    }
+
+    // The last, empty chunk
+    bool Finish()
+    {
+        return conn->write(Header() + "0\r\n\r\n");
+    }
+};
+
+// Raw access to the client socket for the REST handlers
+class CHTTPConnectionSink : public CJSONSink
+{
+private:
+    AcceptedConnection *conn;
+
+public:
+    CHTTPConnectionSink(AcceptedConnection *connIn) : conn(connIn) {}
+
+    bool Write(const char* pch, size_t nSize)
+    {
+        return conn->write(string(pch, nSize));
+    }
+};
+
+// Body of a successful reply to a single request
+static void WriteJSONRPCReply(CJSONWriter& writer, const Value& result, const string* pstrResult, const Value& id)
+{
+    writer.BeginObject();
+    writer.Key("result");
+    if (pstrResult)
+        writer.Raw(*pstrResult);
+    else
+        writer.WriteValue(result);
+    writer.Key("error");
+    writer.Null();
+    writer.Key("id");
+    writer.WriteValue(id);
+    writer.EndObject();
+}
+
+static void WriteJSONRPCBatchReply(CJSONWriter& writer, const Array& ret)
+{
+    writer.BeginArray();
+    BOOST_FOREACH(const Value& reply, ret)
+        writer.WriteValue(reply);
+    writer.EndArray();
+}
+
+// Send a 200 reply whose JSON body is written by fnBody.  HTTP/1.1 clients get
+// it in chunks as it is written, older ones with a Content-Length.
+static bool HTTPReplyJSON(AcceptedConnection *conn, const boost::function<void (CJSONWriter&)>& fnBody, bool fKeepAlive)
+{
+    if (conn->nProto < 1)
+    {
+        CJSONStringSink sink;
         {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+            CJSONWriter writer(sink);
+            fnBody(writer);
+        }
+        sink.str += "\n";
+        return conn->write(HTTPReply(HTTP_OK, sink.str, fKeepAlive));
+    }
 
-            string strReply;
+    CHTTPChunkedSink sink(conn, fKeepAlive);
+    {
+        CJSONWriter writer(sink);
+        fnBody(writer);
+        // Replies have always ended with a newline
+        writer.Raw("\n");
+        if (!writer.Flush())
+            return false;
+    }
+    return sink.Finish();
+}
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+static CCriticalSection cs_THREAD_RPCHANDLER;
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+// Execute one request that was read by the listener, returns whether the
+// connection stays open for the next one
+static bool RPCHandleRequest(AcceptedConnection *conn)
+{
+    map<string, string>& mapHeaders = conn->mapHeaders;
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+    // The REST interface only serves public chain data and needs no password
+    if (boost::algorithm::starts_with(conn->strURI, "/rest/") && GetBoolArg("-rest"))
+    {
+        CHTTPConnectionSink sink(conn);
+        return HTTPReq_REST(sink, conn->strMethod, conn->strURI, mapHeaders["connection"] != "close");
+    }
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        conn->write(HTTPReply(HTTP_UNAUTHORIZED, "", false));
+        return false;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
+
+        conn->write(HTTPReply(HTTP_UNAUTHORIZED, "", false));
+        return false;
+    }
+    bool fRun = (mapHeaders["connection"] != "close");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!read_string(conn->strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            // Commands that can write JSON text do so into memory while
+            // they hold their locks, the socket is only written afterwards
+            Value result;
+            CJSONStringSink sinkResult;
+            bool fStreamed;
+            {
+                CJSONWriter writer(sinkResult);
+                fStreamed = tableRPC.execute(jreq.strMethod, jreq.params, writer);
+            }
+            if (!fStreamed)
+                result = tableRPC.execute(jreq.strMethod, jreq.params);
+
+            // Send reply
+            if (!HTTPReplyJSON(conn, boost::bind(&WriteJSONRPCReply, _1, boost::cref(result),
+                                                 fStreamed ? &sinkResult.str : NULL, boost::cref(jreq.id)), fRun))
+                return false;
+
+        // array of requests
+        } else if (valRequest.type() == array_type) {
+            Array ret = JSONRPCExecBatch(valRequest.get_array());
+            if (!HTTPReplyJSON(conn, boost::bind(&WriteJSONRPCBatchReply, _1, boost::cref(ret)), fRun))
+                return false;
         }
-        catch (Object& objError)
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    }
+    catch (Object& objError)
+    {
+        conn->write(ErrorReply(objError, jreq.id));
+        return false;
+    }
+    catch (std::exception& e)
+    {
+        conn->write(ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id));
+        return false;
+    }
+    return fRun;
+}
+
+static void RPCServeRequest(boost::shared_ptr<AcceptedConnection> conn)
+{
+    bool fKeepAlive = false;
+    try
+    {
+        fKeepAlive = RPCHandleRequest(conn.get());
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadRPCServer3()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadRPCServer3()");
+    }
+
+    // Keep-alive connections go back to the listener to wait for their next request
+    if (fKeepAlive && !fShutdown)
+        conn->get_io_service().post(boost::bind(&RPCReadRequest, conn));
+}
+
+void ThreadRPCServer3(void* parg)
+{
+    // Make this thread recognisable as the RPC handler
+    RenameThread("DeepOnion-rpchand");
+
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
+
+    while (!fShutdown)
+    {
+        boost::function<void()> work;
+        if (!pRPCWorkQueue->Pop(work, 100))
+            continue;
+
+        try
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            work();
         }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadRPCServer3()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadRPCServer3()");
         }
     }
 
-    delete conn;
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+static const CRPCCommand* FindCommand(const std::string &strMethod)
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -1143,20 +1735,112 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     if (strWarning != "" && !GetBoolArg("-disablesafemode") &&
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
+    return pcmd;
+}
+
+static map<string, CRPCMethodStats> mapRPCStats;
+static CCriticalSection cs_mapRPCStats;
+
+int RPCStatsBucket(int64_t nMicros)
+{
+    int nBucket = 0;
+    for (int64_t nLimit = 128; nMicros >= nLimit && nBucket < RPC_STATS_BUCKETS - 1; nLimit *= 2)
+        nBucket++;
+    return nBucket;
+}
+
+// Caller holds cs_mapRPCStats
+static void LogRPCStats()
+{
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapRPCStats)
+    {
+        const CRPCMethodStats& stats = item.second;
+        printf("rpcstats: %s count=%" PRIu64 " errors=%" PRIu64 " avgus=%" PRId64 " maxus=%" PRId64 " lockwaitus=%" PRId64 " maxlockwaitus=%" PRId64 "\n",
+               item.first.c_str(), stats.nCount, stats.nErrors, stats.nTotalMicros / (int64_t)stats.nCount,
+               stats.nMaxMicros, stats.nLockWaitMicros, stats.nMaxLockWaitMicros);
+    }
+}
+
+void RecordRPCCall(const string& strMethod, int64_t nLockWaitMicros, int64_t nMicros, bool fError)
+{
+    LOCK(cs_mapRPCStats);
+    // Only methods found in the table get here, the map stays small
+    CRPCMethodStats& stats = mapRPCStats[strMethod];
+    stats.nCount++;
+    if (fError)
+        stats.nErrors++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = max(stats.nMaxMicros, nMicros);
+    stats.nLockWaitMicros += nLockWaitMicros;
+    stats.nMaxLockWaitMicros = max(stats.nMaxLockWaitMicros, nLockWaitMicros);
+    stats.vHistogram[RPCStatsBucket(nMicros)]++;
+}
+
+// Runs on the RPC listener's io_service every -rpcstatslog seconds, calls or not
+static void RPCStatsLogTimer(boost::shared_ptr<asio::deadline_timer> timer, int64_t nInterval, const boost::system::error_code& error)
+{
+    if (error == asio::error::operation_aborted || fShutdown)
+        return;
+    {
+        LOCK(cs_mapRPCStats);
+        LogRPCStats();
+    }
+    timer->expires_from_now(posix_time::seconds(nInterval));
+    timer->async_wait(boost::bind(&RPCStatsLogTimer, timer, nInterval, _1));
+}
+
+void GetRPCStats(map<string, CRPCMethodStats>& mapStats, bool fReset)
+{
+    LOCK(cs_mapRPCStats);
+    mapStats = mapRPCStats;
+    if (fReset)
+        mapRPCStats.clear();
+}
+
+// Times one call and records it when the call returns or throws
+class CRPCCallTimer
+{
+private:
+    const string& strMethod;
+    int64_t nStart;
+    int64_t nLocked;
+    bool fDone;
+
+public:
+    CRPCCallTimer(const string& strMethodIn) : strMethod(strMethodIn)
+    {
+        nStart = nLocked = GetTimeMicros();
+        fDone = false;
+    }
+
+    void Locked() { nLocked = GetTimeMicros(); }
+    void Done() { fDone = true; }
+
+    ~CRPCCallTimer()
+    {
+        RecordRPCCall(strMethod, nLocked - nStart, GetTimeMicros() - nStart, !fDone);
+    }
+};
 
+// Run fn with the locks the command asks for
+static void ExecuteLocked(const CRPCCommand *pcmd, const boost::function<void()>& fn)
+{
+    CRPCCallTimer timer(pcmd->name);
     try
     {
-        // Execute
-        Value result;
-        {
-            if (pcmd->unlocked)
-                result = pcmd->actor(params, false);
-            else {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
-            }
+        if (pcmd->unlocked)
+            fn();
+        else if (pcmd->readonly) {
+            READ_LOCK(cs_blockindex);
+            timer.Locked();
+            fn();
         }
-        return result;
+        else {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            timer.Locked();
+            fn();
+        }
+        timer.Done();
     }
     catch (std::exception& e)
     {
@@ -1164,6 +1848,49 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     }
 }
 
+static void CallActor(const CRPCCommand *pcmd, const Array *pparams, Value *presult)
+{
+    *presult = pcmd->actor(*pparams, false);
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = FindCommand(strMethod);
+
+    Value result;
+    ExecuteLocked(pcmd, boost::bind(&CallActor, pcmd, &params, &result));
+    return result;
+}
+
+static void CallStreamActor(const CRPCStreamCommand *pcmd, const Array *pparams, CJSONWriter *pwriter)
+{
+    pcmd->actor(*pparams, false, *pwriter);
+}
+
+bool CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& writer) const
+{
+    map<string, const CRPCStreamCommand*>::const_iterator it = mapStreamCommands.find(strMethod);
+    if (it == mapStreamCommands.end())
+        return false;
+    const CRPCCommand *pcmd = FindCommand(strMethod);
+
+    ExecuteLocked(pcmd, boost::bind(&CallStreamActor, (*it).second, &params, &writer));
+    return true;
+}
+
+Value StreamedValue(rpcstreamfn_type fn, const Array& params, bool fHelp)
+{
+    CJSONStringSink sink;
+    {
+        CJSONWriter writer(sink);
+        fn(params, fHelp, writer);
+    }
+    Value result;
+    if (!read_string(sink.str, result))
+        throw runtime_error("StreamedValue() : command wrote invalid JSON");
+    return result;
+}
+
 std::vector<std::string> CRPCTable::listCommands() const
 {
     std::vector<std::string> commandList;
@@ -1263,6 +1990,7 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     // Special case non-string parameter types
     //
     if (strMethod == "stop"                   && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "getrpcstats"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "sendtoaddress"          && n > 1) ConvertTo<double>(params[1]);
     if (strMethod == "sendtostealthaddress"   && n > 1) ConvertTo<double>(params[1]);
     if (strMethod == "settxfee"               && n > 0) ConvertTo<double>(params[0]);
@@ -1277,6 +2005,9 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "getblockbynumber"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "getblockbynumber"       && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getaddresstxids"        && n > 3) ConvertTo<boost::int64_t>(params[3]);
     if (strMethod == "getinfo"                && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "move"                   && n > 3) ConvertTo<boost::int64_t>(params[3]);
@@ -1307,12 +2038,19 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listunspent"            && n > 2) ConvertTo<Array>(params[2]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "getspentinfo"           && n > 0) ConvertTo<Object>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<Array>(params[1], true);
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2], true);
     if (strMethod == "scanforalltxns"         && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "scanforstealthtxns"     && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "keypoolrefill"          && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "smsginbox"              && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "smsginbox"              && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "smsginbox"              && n > 3) ConvertTo<boost::int64_t>(params[3]);
+    if (strMethod == "smsgoutbox"             && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "smsgoutbox"             && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "smsgoutbox"             && n > 3) ConvertTo<boost::int64_t>(params[3]);
 
     return params;
 }
@@ -18,6 +18,7 @@ class CBlockIndex;
 
 #include "util.h"
 #include "checkpoints.h"
+#include "jsonwriter.h"
 
 // HTTP status codes
 enum HTTPStatusCode
@@ -28,6 +29,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -68,6 +70,15 @@ enum RPCErrorCode
 
 json_spirit::Object JSONRPCError(int code, const std::string& message);
 
+/** Status line and headers of a reply, nContentLength < 0 announces a chunked body */
+std::string HTTPReplyHeader(int nStatus, bool keepalive, int64_t nContentLength, const char* pszContentType = "application/json");
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive, const char* pszContentType = "application/json");
+
+/** Answer a request for /rest/..., writing the whole reply to sinkClient.
+ * Returns whether the connection stays open for the next request. (in rest.cpp)
+ */
+bool HTTPReq_REST(CJSONSink& sinkClient, const std::string& strMethod, const std::string& strURI, bool fKeepAlive);
+
 void ThreadRPCServer(void* parg);
 int CommandLineRPC(int argc, char *argv[]);
 
@@ -89,6 +100,7 @@ void RPCTypeCheck(const json_spirit::Object& o,
                   const std::map<std::string, json_spirit::Value_type>& typesExpected, bool fAllowNull=false);
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 
 class CRPCCommand
 {
@@ -98,6 +110,15 @@ public:
     rpcfn_type actor;
     bool okSafeMode;
     bool unlocked;
+    bool readonly;      // only reads the block index, runs under a shared lock instead of cs_main
+};
+
+/** A command that can also write its result as JSON text instead of returning a tree */
+class CRPCStreamCommand
+{
+public:
+    std::string name;
+    rpcstreamfn_type actor;
 };
 
 /**
@@ -107,6 +128,7 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, const CRPCStreamCommand*> mapStreamCommands;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -121,6 +143,13 @@ public:
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
 
+    /**
+     * Execute a method that can write its result as JSON text.
+     * @returns false, without running anything, if the method only returns a tree.
+     * @throws an exception (json_spirit::Value) when an error happens.
+     */
+    bool execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& writer) const;
+
     /**
     * Returns a list of registered commands
     * @returns List of registered commands.
@@ -130,6 +159,25 @@ public:
 
 extern const CRPCTable tableRPC;
 
+/** Latency histogram buckets: the first holds calls under 128us, each next one doubles, the last is open ended */
+static const int RPC_STATS_BUCKETS = 20;
+
+/** Calls of one RPC method, as timed by CRPCTable::execute */
+struct CRPCMethodStats
+{
+    uint64_t nCount;
+    uint64_t nErrors;
+    int64_t nTotalMicros;           // from asking for the locks until the call returned
+    int64_t nMaxMicros;
+    int64_t nLockWaitMicros;        // of that, waiting for cs_main/cs_wallet or the block index
+    int64_t nMaxLockWaitMicros;
+    uint64_t vHistogram[RPC_STATS_BUCKETS];
+};
+
+int RPCStatsBucket(int64_t nMicros);
+void RecordRPCCall(const std::string& strMethod, int64_t nLockWaitMicros, int64_t nMicros, bool fError);
+void GetRPCStats(std::map<std::string, CRPCMethodStats>& mapStats, bool fReset = false);
+
 extern int64_t nWalletUnlockTime;
 extern int64_t AmountFromValue(const json_spirit::Value& value);
 extern json_spirit::Value ValueFromAmount(int64_t amount);
@@ -142,6 +190,9 @@ extern std::string HexBits(unsigned int nBits);
 extern std::string HelpRequiringPassphrase();
 extern void EnsureWalletIsUnlocked();
 
+// Run a streaming command and parse its text back into a tree, for callers that need a Value
+extern json_spirit::Value StreamedValue(rpcstreamfn_type fn, const json_spirit::Array& params, bool fHelp);
+
 //
 // Utilities: convert hex-encoded Values
 // (throws error if not hex).
@@ -153,6 +204,8 @@ extern std::vector<unsigned char> ParseHexO(const json_spirit::Object& o, std::s
 
 extern json_spirit::Value getconnectioncount(const json_spirit::Array& params, bool fHelp); // in rpcnet.cpp
 extern json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmessagestats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrpcstats(const json_spirit::Array& params, bool fHelp); // in bitcoinrpc.cpp
 extern json_spirit::Value getnettotals(const json_spirit::Array &params, bool fHelp);
 extern json_spirit::Value dumpwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importwallet(const json_spirit::Array& params, bool fHelp);
@@ -188,6 +241,7 @@ extern json_spirit::Value addredeemscript(const json_spirit::Array& params, bool
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+extern void listtransactions(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
@@ -211,6 +265,7 @@ extern json_spirit::Value getnewpubkey(const json_spirit::Array& params, bool fH
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void listunspent(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decodescript(const json_spirit::Array& params, bool fHelp);
@@ -222,10 +277,17 @@ extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool f
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
+extern void getblockbynumber(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressbalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressutxos(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getspentinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnetworkhashps(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getnewstealthaddress(const json_spirit::Array &params, bool fHelp);
@@ -146,6 +146,15 @@ public:
             condWorker.notify_all();
     }
 
+    // Let the worker threads return once the queue has run empty
+    void Quit() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+    }
+
     ~CCheckQueue() {
     }
 
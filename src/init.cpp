@@ -3,6 +3,8 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "txdb.h"
+#include "addrindex.h"
+#include "pushnotify.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
 #include "net.h"
@@ -90,6 +92,7 @@ void Shutdown(void* parg)
 //        CTxDB().Close();
         bitdb.Flush(false);
         StopNode();
+        StopPushNotify();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -262,6 +265,8 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -netpoll=<method>      " + _("Socket polling method, epoll or select (default: epoll where available)") + "\n" +
+        "  -msgworkers=<n>        " + _("Number of threads handling peer messages that don't need the block chain lock (default: 2)") + "\n" +
 
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -292,9 +297,16 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 18580 or testnet: 28580)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Set the depth of the work queue to service RPC calls (default: 16)") + "\n" +
+        "  -rpcbatchthreads=<n>   " + _("Set the number of threads that share the read-only calls of one batch (default: 4)") + "\n" +
+        "  -rpcstatslog=<n>       " + _("Write the RPC call statistics to the debug log every <n> seconds (default: 0)") + "\n" +
+        "  -rest                  " + _("Accept public REST requests for blocks, transactions and headers on the RPC port (default: 0)") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
+        "  -pushnotify=<port>     " + _("Push new blocks, memory pool transactions and secure messages to subscribers on 127.0.0.1:<port>") + "\n" +
+        "  -pushnotifyqueue=<n>   " + _("Maximum queued push notification data per subscriber, <n>*1000 bytes (default: 8192)") + "\n" +
         "  -confchange            " + _("Require a confirmation for change (default: 0)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
@@ -303,6 +315,9 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
+        "  -addrindex             " + _("Maintain an index of transactions by address, built in the background on first use (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of which transaction spent each output, built in the background on first use (default: 0)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool to mempool.dat on shutdown and every 10 minutes, and restore it at startup (default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
@@ -319,7 +334,11 @@ std::string HelpMessage()
 		"\n" + _("Secure messaging options:") + "\n" +
         "  -nosmsg                                  " + _("Disable secure messaging.") + "\n" +
         "  -debugsmsg                               " + _("Log extra debug messages.") + "\n" +
-        "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n";
+        "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n" +
+        "  -smsgscanthreads=<n>                     " + _("Number of threads that try stored messages against the local addresses and read blocks for -smsgscanchain (default: one per core, up to 16)") + "\n" +
+        "  -smsgpowthreads=<n>                      " + _("Number of threads that search the proof of work of outgoing messages (default: one per core, up to 16)") + "\n" +
+        "  -smsgpowtimeout=<n>                      " + _("Drop an outgoing message if its proof of work takes longer than <n> seconds (default: 0, no limit)") + "\n" +
+        "  -smsgpkcache=<n>                         " + _("Number of public keys of message recipients to keep in memory (default: 10000)") + "\n";
 
     return strUsage;
 }
@@ -442,6 +461,8 @@ bool AppInit2()
         fDebugSmsg = GetBoolArg("-debugsmsg");
     }
     fNoSmsg = GetBoolArg("-nosmsg");
+    fAddrIndex = GetBoolArg("-addrindex");
+    fSpentIndex = GetBoolArg("-spentindex");
     
     bitdb.SetDetach(GetBoolArg("-detachdb", false));
 
@@ -894,6 +915,19 @@ bool AppInit2()
     printf("mapWallet.size() = %" PRIszu "\n",       pwalletMain->mapWallet.size());
     printf("mapAddressBook.size() = %" PRIszu "\n",  pwalletMain->mapAddressBook.size());
 
+    if ((fAddrIndex || fSpentIndex) && !NewThread(ThreadAddrIndexBuild, NULL))
+        printf("Error: NewThread(ThreadAddrIndexBuild) failed\n");
+
+    if (mapArgs.count("-pushnotify"))
+    {
+        std::string strError;
+        if (!StartPushNotify(strError))
+            return InitError(strError);
+    }
+
+    if (GetBoolArg("-persistmempool", true) && !NewThread(ThreadLoadMempool, NULL))
+        printf("Error: NewThread(ThreadLoadMempool) failed\n");
+
     if (!NewThread(StartNode, NULL))
         InitError(_("Error: could not start node"));
 
@@ -0,0 +1,232 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.h"
+
+#include <boost/foreach.hpp>
+#include <stdio.h>
+#include <wctype.h>
+#include <inttypes.h>
+
+using namespace std;
+using namespace json_spirit;
+
+CJSONWriter::CJSONWriter(CJSONSink& sinkIn, size_t nBufferSizeIn) :
+    sink(sinkIn), nBufferSize(nBufferSizeIn), fAfterKey(false), fFailed(false)
+{
+    buf.reserve(nBufferSize + 64);
+}
+
+CJSONWriter::~CJSONWriter()
+{
+    Flush();
+}
+
+bool CJSONWriter::Flush()
+{
+    if (!buf.empty())
+    {
+        if (!fFailed && !sink.Write(buf.data(), buf.size()))
+            fFailed = true;
+        buf.clear();
+    }
+    return !fFailed;
+}
+
+void CJSONWriter::Put(const char* pch, size_t nSize)
+{
+    // Large pieces go out in buffer sized chunks, so a sink never sees much more than that
+    while (nSize > 0)
+    {
+        size_t nChunk = min(nSize, nBufferSize - buf.size());
+        buf.append(pch, nChunk);
+        pch += nChunk;
+        nSize -= nChunk;
+        if (buf.size() >= nBufferSize)
+            Flush();
+    }
+}
+
+// Same escaping as json_spirit::add_esc_chars
+void CJSONWriter::PutString(const string& str)
+{
+    static const char pszHex[] = "0123456789ABCDEF";
+    Put('"');
+    const char* pch = str.data();
+    const char* pend = pch + str.size();
+    while (pch < pend)
+    {
+        // Runs of plain printable ASCII are copied in one go
+        const char* pstart = pch;
+        while (pch < pend && *pch >= 0x20 && *pch < 0x7f && *pch != '"' && *pch != '\\')
+            pch++;
+        if (pch > pstart)
+            Put(pstart, pch - pstart);
+        if (pch == pend)
+            break;
+
+        char c = *pch++;
+        switch (c)
+        {
+            case '"':  Put("\\\"", 2); continue;
+            case '\\': Put("\\\\", 2); continue;
+            case '\b': Put("\\b", 2); continue;
+            case '\f': Put("\\f", 2); continue;
+            case '\n': Put("\\n", 2); continue;
+            case '\r': Put("\\r", 2); continue;
+            case '\t': Put("\\t", 2); continue;
+        }
+        const wint_t unsigned_c((c >= 0) ? c : 256 + c);
+        if (iswprint(unsigned_c))
+            Put(c);
+        else
+        {
+            char pchEsc[6] = { '\\', 'u', '0', '0', pszHex[(unsigned_c >> 4) & 0xf], pszHex[unsigned_c & 0xf] };
+            Put(pchEsc, sizeof(pchEsc));
+        }
+    }
+    Put('"');
+}
+
+void CJSONWriter::BeginValue()
+{
+    if (fAfterKey)
+    {
+        fAfterKey = false;
+        return;
+    }
+    if (!vEmpty.empty())
+    {
+        if (vEmpty.back())
+            vEmpty.back() = false;
+        else
+            Put(',');
+    }
+}
+
+void CJSONWriter::BeginObject()
+{
+    BeginValue();
+    Put('{');
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndObject()
+{
+    vEmpty.pop_back();
+    Put('}');
+}
+
+void CJSONWriter::BeginArray()
+{
+    BeginValue();
+    Put('[');
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndArray()
+{
+    vEmpty.pop_back();
+    Put(']');
+}
+
+void CJSONWriter::Key(const string& strKey)
+{
+    BeginValue();
+    PutString(strKey);
+    Put(':');
+    fAfterKey = true;
+}
+
+void CJSONWriter::String(const string& str)
+{
+    BeginValue();
+    PutString(str);
+}
+
+void CJSONWriter::Int(int64_t n)
+{
+    BeginValue();
+    char pch[32];
+    int nSize = snprintf(pch, sizeof(pch), "%" PRId64, n);
+    Put(pch, nSize);
+}
+
+void CJSONWriter::UInt(uint64_t n)
+{
+    BeginValue();
+    char pch[32];
+    int nSize = snprintf(pch, sizeof(pch), "%" PRIu64, n);
+    Put(pch, nSize);
+}
+
+void CJSONWriter::Real(double d)
+{
+    // json_spirit writes reals with std::fixed and a precision of 8
+    BeginValue();
+    char pch[400];
+    int nSize = snprintf(pch, sizeof(pch), "%.8f", d);
+    Put(pch, min(nSize, (int)sizeof(pch) - 1));
+}
+
+void CJSONWriter::Bool(bool f)
+{
+    BeginValue();
+    if (f)
+        Put("true", 4);
+    else
+        Put("false", 5);
+}
+
+void CJSONWriter::Null()
+{
+    BeginValue();
+    Put("null", 4);
+}
+
+void CJSONWriter::WriteValue(const Value& value)
+{
+    switch (value.type())
+    {
+    case obj_type:
+        BeginObject();
+        BOOST_FOREACH(const Pair& pair, value.get_obj())
+        {
+            Key(pair.name_);
+            WriteValue(pair.value_);
+        }
+        EndObject();
+        break;
+    case array_type:
+        BeginArray();
+        BOOST_FOREACH(const Value& item, value.get_array())
+            WriteValue(item);
+        EndArray();
+        break;
+    case str_type:
+        String(value.get_str());
+        break;
+    case bool_type:
+        Bool(value.get_bool());
+        break;
+    case int_type:
+        if (value.is_uint64())
+            UInt(value.get_uint64());
+        else
+            Int(value.get_int64());
+        break;
+    case real_type:
+        Real(value.get_real());
+        break;
+    case null_type:
+        Null();
+        break;
+    }
+}
+
+void CJSONWriter::Raw(const string& strJSON)
+{
+    BeginValue();
+    Put(strJSON.data(), strJSON.size());
+}
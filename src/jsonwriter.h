@@ -0,0 +1,101 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_JSONWRITER_H
+#define BITCOIN_JSONWRITER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "json/json_spirit_value.h"
+
+/** Destination of the text produced by CJSONWriter */
+class CJSONSink
+{
+public:
+    virtual ~CJSONSink() {}
+
+    /** Take nSize bytes, return false if they could not be delivered */
+    virtual bool Write(const char* pch, size_t nSize) = 0;
+};
+
+/** Sink that collects the text in memory */
+class CJSONStringSink : public CJSONSink
+{
+public:
+    std::string str;
+
+    bool Write(const char* pch, size_t nSize)
+    {
+        str.append(pch, nSize);
+        return true;
+    }
+};
+
+/** Writes compact JSON text, byte for byte what json_spirit::write_string(value, false)
+ * would produce, without building a json_spirit tree first.
+ *
+ * Values are written in document order and the writer puts in the commas:
+ *
+ *     writer.BeginObject();
+ *     writer.Key("height"); writer.Int(nHeight);
+ *     writer.Key("tx"); writer.BeginArray(); ... writer.EndArray();
+ *     writer.EndObject();
+ *
+ * Output is collected in a buffer and handed to the sink whenever it grows
+ * past nBufferSize, and by Flush().  Once the sink refused data everything
+ * else is dropped, check IsFailed() to stop producing early.
+ */
+class CJSONWriter
+{
+private:
+    CJSONSink& sink;
+    std::string buf;
+    size_t nBufferSize;
+
+    // One entry per open object or array, whether it has no members yet
+    std::vector<bool> vEmpty;
+    bool fAfterKey;
+    bool fFailed;
+
+    void Put(char c)
+    {
+        buf.push_back(c);
+        if (buf.size() >= nBufferSize)
+            Flush();
+    }
+    void Put(const char* pch, size_t nSize);
+    void PutString(const std::string& str);
+    void BeginValue();
+
+public:
+    CJSONWriter(CJSONSink& sinkIn, size_t nBufferSizeIn = 65536);
+    ~CJSONWriter();
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+
+    /** Name of the next object member */
+    void Key(const std::string& strKey);
+
+    void String(const std::string& str);
+    void Int(int64_t n);
+    void UInt(uint64_t n);
+    void Real(double d);
+    void Bool(bool f);
+    void Null();
+
+    /** A complete json_spirit value, for handlers that still build trees for parts of their result */
+    void WriteValue(const json_spirit::Value& value);
+    /** Text that is already valid JSON for one value */
+    void Raw(const std::string& strJSON);
+
+    /** Hand everything buffered to the sink, returns false if the sink failed */
+    bool Flush();
+    bool IsFailed() const { return fFailed; }
+};
+
+#endif
@@ -288,14 +288,26 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
+    bool fTargetNegative;
+    bool fTargetOverflow;
+    arith_uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits, &fTargetNegative, &fTargetOverflow);
     int64_t nValueIn = txPrev.vout[prevout.n].nValue;
 
     uint256 hashBlockFrom = blockFrom.GetHash();
 
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
-    targetProofOfStake = CBigNum((bnCoinDayWeight * bnTargetPerCoinDay)).getuint256();
+    // Coin-day weight is computed on magnitudes with the sign tracked
+    // separately; this truncates toward zero exactly like the signed
+    // bignum arithmetic previously used here.
+    int64_t nTimeWeight = GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx);
+    arith_uint256 bnCoinDayWeight = arith_uint256(nValueIn < 0 ? ~(uint64_t)nValueIn + 1 : (uint64_t)nValueIn);
+    bnCoinDayWeight *= arith_uint256(nTimeWeight < 0 ? ~(uint64_t)nTimeWeight + 1 : (uint64_t)nTimeWeight);
+    bnCoinDayWeight /= COIN;
+    bnCoinDayWeight /= (24 * 60 * 60);
+    bool fWeightNegative = (nValueIn < 0) != (nTimeWeight < 0);
+
+    // Low 256 bits of |weight * target|; wrapping multiplication is exact mod 2^256
+    targetProofOfStake = ArithToUint256(bnCoinDayWeight * bnTargetPerCoinDay);
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
@@ -323,7 +335,16 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+    if (!!bnCoinDayWeight && (!!bnTargetPerCoinDay || fTargetOverflow))
+    {
+        // Negative products can never be met; products that do not fit
+        // 256 bits are always met. Otherwise compare in 512 bits.
+        if (fWeightNegative != fTargetNegative)
+            return false;
+        if (!fTargetOverflow && arith_uint512(UintToArith256(hashProofOfStake)) > arith_uint512(bnCoinDayWeight) * arith_uint512(bnTargetPerCoinDay))
+            return false;
+    }
+    else if (!!hashProofOfStake)
         return false;
     if (fDebug && !fPrintProofOfStake)
     {
@@ -0,0 +1,85 @@
+// Copyright (c) 2014 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LRUCACHE_H
+#define BITCOIN_LRUCACHE_H
+
+#include <list>
+#include <map>
+
+/** STL-like map container that keeps the N most recently used elements. */
+template <typename K, typename V> class lrucache
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const key_type, mapped_type> value_type;
+    typedef typename std::list<value_type>::size_type size_type;
+
+protected:
+    std::list<value_type> items;    // most recently used first
+    typedef typename std::list<value_type>::iterator iterator;
+    std::map<K, iterator> index;
+    typedef typename std::map<K, iterator>::iterator index_iterator;
+    size_type nMaxSize;
+
+public:
+    lrucache(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
+    size_type size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+    size_type count(const key_type& k) const { return index.count(k); }
+
+    // Copies the value out and marks it as the most recently used
+    bool get(const key_type& k, mapped_type& v)
+    {
+        index_iterator it = index.find(k);
+        if (it == index.end())
+            return false;
+        items.splice(items.begin(), items, it->second);
+        v = it->second->second;
+        return true;
+    }
+    void insert(const value_type& x)
+    {
+        index_iterator it = index.find(x.first);
+        if (it != index.end())
+        {
+            items.erase(it->second);
+            index.erase(it);
+        }
+        items.push_front(x);
+        index.insert(std::make_pair(x.first, items.begin()));
+        if (nMaxSize && items.size() > nMaxSize)
+        {
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+    void erase(const key_type& k)
+    {
+        index_iterator it = index.find(k);
+        if (it == index.end())
+            return;
+        items.erase(it->second);
+        index.erase(it);
+    }
+    void clear()
+    {
+        items.clear();
+        index.clear();
+    }
+    size_type max_size() const { return nMaxSize; }
+    size_type max_size(size_type s)
+    {
+        nMaxSize = s;
+        if (nMaxSize)
+            while (items.size() > nMaxSize)
+            {
+                index.erase(items.back().first);
+                items.pop_back();
+            }
+        return nMaxSize;
+    }
+};
+
+#endif
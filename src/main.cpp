@@ -7,6 +7,8 @@
 #include "checkpoints.h"
 #include "db.h"
 #include "txdb.h"
+#include "addrindex.h"
+#include "pushnotify.h"
 #include "net.h"
 #include "init.h"
 #include "ui_interface.h"
@@ -33,16 +35,36 @@ set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
 
+// Taken exclusively (inside cs_main) while mapBlockIndex grows or the best
+// chain moves, so read-only RPC calls can walk the index without cs_main
+CSharedCriticalSection cs_blockindex;
+
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
+// Signalled when the best block or the memory pool changes, for long polls.  The
+// tip and update count are copied under csBestBlock by the thread that changed
+// them, waiters only read the copies.
+static CWaitableCriticalSection csBestBlock;
+static boost::condition_variable cvBlockChange;
+static uint256 hashBestChainNotified = 0;
+static unsigned int nTransactionsUpdatedNotified = 0;
+
+static void NotifyChainChange()
+{
+    boost::lock_guard<boost::mutex> lock(csBestBlock);
+    hashBestChainNotified = hashBestChain;
+    nTransactionsUpdatedNotified = nTransactionsUpdated;
+    cvBlockChange.notify_all();
+}
+
 map<uint256, CBlockIndex*> mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
-CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); 
-CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
-CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 20); 
-CBigNum bnProofOfWorkFirstBlock(~uint256(0) >> 20);
+arith_uint256 bnProofOfWorkLimit(~arith_uint256(0) >> 20);
+arith_uint256 bnProofOfStakeLimit(~arith_uint256(0) >> 20);
+arith_uint256 bnProofOfWorkLimitTestNet(~arith_uint256(0) >> 20);
+arith_uint256 bnProofOfWorkFirstBlock(~arith_uint256(0) >> 20);
 
 unsigned int nWorkTargetSpacing = 240;                  // 240 sec block spacing for PoW
 unsigned int nStakeTargetSpacing = 60;			        // 60 sec block spacing for PoS
@@ -55,8 +77,8 @@ int nCoinbaseMaturity = 40;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 
-CBigNum bnBestChainTrust = 0;
-CBigNum bnBestInvalidTrust = 0;
+arith_uint256 bnBestChainTrust = 0;
+arith_uint256 bnBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
@@ -71,6 +93,14 @@ set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
+// "block" messages for blocks near the tip, so a new block that every peer
+// asks for is read, serialized and checksummed once for each send version
+// (protected by cs_main)
+typedef pair<uint256, int> CBlockMessageKey; // block hash, send version
+static map<CBlockMessageKey, CNetMessageRef> mapBlockMessages;
+static deque<CBlockMessageKey> vBlockMessagesOrder;
+static const unsigned int MAX_BLOCK_MESSAGES = 8;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -855,6 +885,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     printf("CTxMemPool::accept() : accepted %s (poolsz %" PRIszu")\n",
            hash.ToString().substr(0,10).c_str(),
            mapTx.size());
+    PushNotifyTransaction(tx);
     return true;
 }
 
@@ -872,6 +903,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
+        NotifyChainChange();
     }
     return true;
 }
@@ -896,6 +928,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
             nTransactionsUpdated++;
+            NotifyChainChange();
         }
     }
     return true;
@@ -922,6 +955,7 @@ void CTxMemPool::clear()
     mapTx.clear();
     mapNextTx.clear();
     ++nTransactionsUpdated;
+    NotifyChainChange();
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -934,6 +968,193 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
         vtxid.push_back((*mi).first);
 }
 
+// Version of the mempool.dat layout: magic, version, transactions, checksum
+static const int MEMPOOL_DUMP_VERSION = 1;
+
+// Set once the saved pool has been read back, so a dump made while the load
+// is still running doesn't overwrite the file with the part loaded so far
+static bool fMempoolLoaded = false;
+
+// Append the parents of hash that are in the pool, then hash itself.  The chain is walked
+// with a stack of (transaction, next input) rather than by recursion, an unconfirmed chain
+// can be as long as the pool.
+static void DumpMempoolOrder(const map<uint256, CTransaction>& mapTx, const uint256& hash,
+                             set<uint256>& setDone, vector<const CTransaction*>& vOrdered)
+{
+    if (!setDone.insert(hash).second)
+        return;
+    vector<pair<const CTransaction*, unsigned int> > vStack;
+    vStack.push_back(make_pair(&mapTx.find(hash)->second, 0U));
+    while (!vStack.empty())
+    {
+        const CTransaction* ptx = vStack.back().first;
+        unsigned int nIn = vStack.back().second;
+        if (nIn == ptx->vin.size())
+        {
+            vOrdered.push_back(ptx);
+            vStack.pop_back();
+            continue;
+        }
+        vStack.back().second++;
+        const uint256& hashPrev = ptx->vin[nIn].prevout.hash;
+        map<uint256, CTransaction>::const_iterator mi = mapTx.find(hashPrev);
+        if (mi != mapTx.end() && setDone.insert(hashPrev).second)
+            vStack.push_back(make_pair(&(*mi).second, 0U));
+    }
+}
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded || !GetBoolArg("-persistmempool", true))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Serialize under the pool lock, it is only held for the copy into the stream
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    unsigned int nCount;
+    {
+        LOCK(mempool.cs);
+        set<uint256> setDone;
+        vector<const CTransaction*> vOrdered;
+        vOrdered.reserve(mempool.mapTx.size());
+        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            DumpMempoolOrder(mempool.mapTx, (*mi).first, setDone, vOrdered);
+
+        nCount = vOrdered.size();
+        ssMempool << FLATDATA(pchMessageStart) << MEMPOOL_DUMP_VERSION;
+        WriteCompactSize(ssMempool, nCount);
+        BOOST_FOREACH(const CTransaction* ptx, vOrdered)
+            ssMempool << *ptx;
+    }
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+    try {
+        fileout << ssMempool;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    if (fDebug)
+        printf("Flushed %u transactions to mempool.dat  %" PRId64 "ms\n", nCount, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool ReadMempool(vector<CTransaction>& vtx)
+{
+    vtx.clear();
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int nDataSize = boost::filesystem::file_size(pathMempool) - sizeof(uint256);
+    if (nDataSize < 0)
+        return error("ReadMempool() : file too short");
+    vector<unsigned char> vchData(nDataSize);
+    uint256 hashIn;
+    try {
+        if (nDataSize > 0)
+            filein.read((char *)&vchData[0], nDataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("ReadMempool() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+    if (hashIn != Hash(ssMempool.begin(), ssMempool.end()))
+        return error("ReadMempool() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    try {
+        ssMempool >> FLATDATA(pchMsgTmp) >> nVersion;
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("ReadMempool() : invalid network magic number");
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("ReadMempool() : unknown version %d", nVersion);
+
+        // The count is only trusted as an upper bound, the data itself decides how many
+        // transactions there are
+        uint64_t nCount = ReadCompactSize(ssMempool);
+        for (uint64_t i = 0; i < nCount && !ssMempool.empty(); i++)
+        {
+            vtx.push_back(CTransaction());
+            ssMempool >> vtx.back();
+        }
+        if (vtx.size() < nCount)
+            printf("ReadMempool() : file lists %" PRIu64 " transactions but holds %" PRIszu "\n", nCount, vtx.size());
+    }
+    catch (std::exception &e) {
+        vtx.clear();
+        return error("ReadMempool() : I/O error or stream data corrupted");
+    }
+    return true;
+}
+
+static void LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    vector<CTransaction> vtx;
+    if (!ReadMempool(vtx))
+        return;
+
+    // Parents were written first, so one pass in file order is enough.  cs_main is
+    // taken per transaction, block and message processing go on in between.
+    int nAccepted = 0, nFailed = 0;
+    CTxDB txdb("r");
+    BOOST_FOREACH(CTransaction& tx, vtx)
+    {
+        if (fShutdown)
+            break;
+        LOCK(cs_main);
+        if (mempool.exists(tx.GetHash()))
+            continue;
+        if (mempool.accept(txdb, tx, true, NULL))
+            nAccepted++;
+        else
+            nFailed++;
+    }
+    printf("Restored %d of %" PRIszu " saved mempool transactions (%d no longer valid)  %" PRId64 "ms\n",
+           nAccepted, vtx.size(), nFailed, GetTimeMillis() - nStart);
+}
+
+void ThreadLoadMempool(void* parg)
+{
+    // Make this thread recognisable as the mempool loading thread
+    RenameThread("DeepOnion-loadmempool");
+    vnThreadsRunning[THREAD_LOADMEMPOOL]++;
+    try
+    {
+        LoadMempool();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadLoadMempool()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadLoadMempool()");
+    }
+    // Not after a shutdown that cut the load short, the file still has the rest
+    if (!fShutdown)
+        fMempoolLoaded = true;
+    vnThreadsRunning[THREAD_LOADMEMPOOL]--;
+}
+
 
 
 
@@ -1047,7 +1268,8 @@ int CTxIndex::GetDepthInMainChain() const
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
     {
-        LOCK(cs_main);
+        // No cs_main: the pool has its own lock and the tx index is only
+        // ever replaced by complete LevelDB batches
         {
             LOCK(mempool.cs);
             if (mempool.exists(hash))
@@ -1082,20 +1304,30 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 //
 
 static CBlockIndex* pblockindexFBBHLast;
+static CCriticalSection cs_FBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
     CBlockIndex *pblockindex;
+    CBlockIndex *pblockindexLast;
+    {
+        // Read-only RPC calls search concurrently
+        LOCK(cs_FBBHLast);
+        pblockindexLast = pblockindexFBBHLast;
+    }
     if (nHeight < nBestHeight / 2)
         pblockindex = pindexGenesisBlock;
     else
         pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
+    if (pblockindexLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexLast->nHeight))
+        pblockindex = pblockindexLast;
     while (pblockindex->nHeight > nHeight)
         pblockindex = pblockindex->pprev;
     while (pblockindex->nHeight < nHeight)
         pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
+    {
+        LOCK(cs_FBBHLast);
+        pblockindexFBBHLast = pblockindex;
+    }
     return pblockindex;
 }
 
@@ -1246,10 +1478,13 @@ int64_t GetProofOfStakeReward(int64_t nCoinAge, const CBlockIndex* pindex)
 //
 // maximum nBits value could possible be required nTime after
 //
-unsigned int ComputeMaxBits(CBigNum bnTargetLimit, unsigned int nBase, int64_t nTime)
+unsigned int ComputeMaxBits(const arith_uint256& bnTargetLimit, unsigned int nBase, int64_t nTime)
 {
-    CBigNum bnResult;
-    bnResult.SetCompact(nBase);
+    arith_uint256 bnResult;
+    bool fOverflow;
+    bnResult.SetCompact(nBase, NULL, &fOverflow);
+    if (fOverflow)
+        return bnTargetLimit.GetCompact();
     bnResult *= 2;
     while (nTime > 0 && bnResult < bnTargetLimit)
     {
@@ -1293,7 +1528,7 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
 	const int64_t nInterval = 60;
-	CBigNum bnTargetLimit = bnProofOfWorkLimit;
+	arith_uint256 bnTargetLimit = bnProofOfWorkLimit;
 
 	if (fProofOfStake)
 	{
@@ -1323,7 +1558,7 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 	if (nActualSpacing > nTargetSpacing * 4)
 		nActualSpacing = nTargetSpacing * 4;
 
-	CBigNum bnNew;
+	arith_uint256 bnNew;
 	bnNew.SetCompact(pindexPrev->nBits);
 
 	bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
@@ -1345,15 +1580,17 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (UintToArith256(hash) > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1365,6 +1602,18 @@ int GetNumBlocksOfPeers()
     return std::max(cPeerBlockCounts.median(), Checkpoints::GetTotalBlocksEstimate());
 }
 
+bool WaitForChainChange(const uint256& hashWatched, unsigned int nTxWatched, bool fPool, int64_t nTimeoutMillis)
+{
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(nTimeoutMillis);
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    while (hashBestChainNotified == hashWatched && (!fPool || nTransactionsUpdatedNotified == nTxWatched))
+    {
+        if (!cvBlockChange.timed_wait(lock, deadline))
+            return hashBestChainNotified != hashWatched || (fPool && nTransactionsUpdatedNotified != nTxWatched);
+    }
+    return true;
+}
+
 bool IsInitialBlockDownload()
 {
     if (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate())
@@ -1391,10 +1640,10 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
 
     printf("InvalidChainFound: invalid block=%s  height=%d  trust=%s  date=%s\n",
       pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight,
-      pindexNew->bnChainTrust.ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
+      pindexNew->bnChainTrust.ToDecimalString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
       pindexNew->GetBlockTime()).c_str());
     printf("InvalidChainFound:  current best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToDecimalString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 }
 
@@ -1708,6 +1957,12 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Needs the spent transactions still in the tx index
+    if (!AddrIndexDisconnectBlock(txdb, *this, pindex))
+        return error("DisconnectBlock() : AddrIndexDisconnectBlock failed");
+    if (!SpentIndexDisconnectBlock(txdb, *this, pindex))
+        return error("DisconnectBlock() : SpentIndexDisconnectBlock failed");
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb))
@@ -1746,6 +2001,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    vector<CTxOut> vAddrPrevOut;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1809,6 +2065,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 
             if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false))
                 return false;
+
+            if ((fAddrIndex || fSpentIndex) && !fJustCheck)
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    vAddrPrevOut.push_back(mapInputs[txin.prevout.hash].second.vout[txin.prevout.n]);
+            }
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -1855,6 +2117,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    if (fAddrIndex && !AddrIndexConnectBlock(txdb, *this, pindex, vAddrPrevOut))
+        return error("ConnectBlock() : AddrIndexConnectBlock failed");
+    if (fSpentIndex && !SpentIndexConnectBlock(txdb, *this, pindex, vAddrPrevOut))
+        return error("ConnectBlock() : SpentIndexConnectBlock failed");
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1921,7 +2188,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     // Connect longer branch
-    vector<CTransaction> vDelete;
+    vector<CBlock> vConnected;
     for (unsigned int i = 0; i < vConnect.size(); i++)
     {
         CBlockIndex* pindex = vConnect[i];
@@ -1934,9 +2201,8 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             return error("Reorganize() : ConnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
         }
 
-        // Queue memory transactions to delete
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+        // Queue to delete its memory transactions and publish it
+        vConnected.push_back(block);
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
@@ -1960,10 +2226,15 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         tx.AcceptToMemoryPool(txdb, false);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
-    }
+    BOOST_FOREACH(CBlock& block, vConnected)
+        BOOST_FOREACH(CTransaction& tx, block.vtx) {
+            mempool.remove(tx);
+            mempool.removeConflicts(tx);
+        }
+
+    // Publish the connected blocks in chain order
+    BOOST_FOREACH(const CBlock& block, vConnected)
+        PushNotifyBlock(block);
 
     printf("REORGANIZE: done\n");
 
@@ -1993,6 +2264,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
     BOOST_FOREACH(CTransaction& tx, vtx)
         mempool.remove(tx);
 
+    PushNotifyBlock(*this);
     return true;
 }
 
@@ -2000,6 +2272,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     uint256 hash = GetHash();
 
+    WRITE_LOCK(cs_blockindex);
+
     if (!txdb.TxnBegin())
         return error("SetBestChain() : TxnBegin failed");
 
@@ -2009,6 +2283,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        PushNotifyBlock(*this);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -2072,18 +2347,21 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    {
+        LOCK(cs_FBBHLast);
+        pblockindexFBBHLast = NULL;
+    }
     nBestHeight = pindexBest->nHeight;
     bnBestChainTrust = pindexNew->bnChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
 
-    CBigNum bnBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->bnChainTrust - pindexBest->pprev->bnChainTrust) : pindexBest->bnChainTrust;
+    arith_uint256 bnBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->bnChainTrust - pindexBest->pprev->bnChainTrust) : pindexBest->bnChainTrust;
     printf("SetBestChain: new best=%s  height=%d  trust=%s  blocktrust=%" PRId64 " \n",
       hashBestChain.ToString().c_str(), 
       nBestHeight,
-      bnBestChainTrust.ToString().c_str(),
-      bnBestBlockTrust.ToString().c_str());
+      bnBestChainTrust.ToDecimalString().c_str(),
+      bnBestBlockTrust.ToDecimalString().c_str());
 
     // Check the version of the last 100 blocks to see if we need to upgrade:
     if (!fIsInitialDownload)
@@ -2103,6 +2381,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
             strMiscWarning = _("Warning: This version is obsolete, upgrade required!");
     }
 
+    NotifyChainChange();
+
     std::string strCmd = GetArg("-blocknotify", "");
 
     if (!fIsInitialDownload && !strCmd.empty())
@@ -2203,7 +2483,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     }
 
     // DeepOnion: compute chain trust score
-    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : arith_uint256(0)) + pindexNew->GetBlockTrust();
 
     // DeepOnion: compute stake entropy bit for stake modifier
     if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit()))
@@ -2223,10 +2503,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    {
+        WRITE_LOCK(cs_blockindex);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-    pindexNew->phashBlock = &((*mi).first);
 
     // Write to disk block index
     CTxDB txdb;
@@ -2430,15 +2713,24 @@ bool CBlock::AcceptBlock()
     return true;
 }
 
-CBigNum CBlockIndex::GetBlockTrust() const
+arith_uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    if (bnTarget <= 0)
+    if (fNegative || fOverflow || bnTarget == 0)
         return 0;
 
-     return (IsProofOfStake() ? (CBigNum(1)<<256) / (bnTarget+1) : 1);
+    if (!IsProofOfStake())
+        return 1;
+
+    // We need to compute 2**256 / (bnTarget+1), but we can't represent 2**256
+    // as it's too large for an arith_uint256. However, as 2**256 is at least as large
+    // as bnTarget+1, it is equal to ((2**256 - bnTarget - 1) / (bnTarget+1)) + 1,
+    // or ~bnTarget / (bnTarget+1) + 1.
+    return (~bnTarget / (bnTarget + 1)) + 1;
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -2477,16 +2769,18 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
         int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        CBigNum bnNewBlock;
-        bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        bool fNegative;
+        bool fOverflow;
+        arith_uint256 bnNewBlock;
+        bnNewBlock.SetCompact(pblock->nBits, &fNegative, &fOverflow);
+        arith_uint256 bnRequired;
 
         if (pblock->IsProofOfStake())
             bnRequired.SetCompact(ComputeMinStake(GetLastBlockIndex(pcheckpoint, true)->nBits, deltaTime, pblock->nTime));
         else
             bnRequired.SetCompact(ComputeMinWork(GetLastBlockIndex(pcheckpoint, false)->nBits, deltaTime));
 
-        if (bnNewBlock > bnRequired)
+        if (!fNegative && (fOverflow || bnNewBlock > bnRequired))
         {
             if (pfrom)
                 pfrom->Misbehaving(100);
@@ -2732,6 +3026,7 @@ bool LoadBlockIndex(bool fAllowNew)
     CTxDB txdb("cr+");
     if (!txdb.LoadBlockIndex())
         return false;
+    NotifyChainChange();
 
     //
     // Init with genesis block
@@ -2767,7 +3062,7 @@ bool LoadBlockIndex(bool fAllowNew)
  		if (false && (block.GetHash() != hashGenesisBlock)) {
 			// This will figure out a valid hash and Nonce if you're
 			// creating a different genesis block:
-			uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+			uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(block.nBits));
 			while (block.GetHash() > hashTarget)
 			{
 				++block.nNonce;
@@ -3052,7 +3347,7 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xd1, 0xf1, 0xdb, 0xf2 };
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+bool static ProcessMessage(CNode* pfrom, string strCommand, CSpanStream& vRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
     RandAddSeedPerfmon();
@@ -3343,9 +3638,28 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    CNetMessageRef msg;
+                    CBlockMessageKey key(inv.hash, pfrom->vSend.GetVersion());
+                    map<CBlockMessageKey, CNetMessageRef>::iterator mb = mapBlockMessages.find(key);
+                    if (mb != mapBlockMessages.end())
+                        msg = (*mb).second;
+                    else
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        msg = MakeNetMessage("block", block, key.second);
+                        if ((*mi).second->nHeight + 10 >= nBestHeight)
+                        {
+                            mapBlockMessages[key] = msg;
+                            vBlockMessagesOrder.push_back(key);
+                            if (vBlockMessagesOrder.size() > MAX_BLOCK_MESSAGES)
+                            {
+                                mapBlockMessages.erase(vBlockMessagesOrder.front());
+                                vBlockMessagesOrder.pop_front();
+                            }
+                        }
+                    }
+                    pfrom->PushMessage(msg);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3366,9 +3680,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CNetMessageRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3481,7 +3795,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
         CTxDB txdb("r");
         CTransaction tx;
         vRecv >> tx;
@@ -3568,7 +3881,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3635,7 +3951,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
         if (!tracker.IsNull())
-            tracker.fn(tracker.param1, vRecv);
+        {
+            CDataStream ssReply(vRecv.begin(), vRecv.end(), vRecv.nType, vRecv.nVersion);
+            tracker.fn(tracker.param1, ssReply);
+        }
     }
 
 
@@ -3710,9 +4029,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
-bool ProcessMessages(CNode* pfrom)
+// Messages that read or change the chainstate, these are handled with cs_main held
+static bool IsValidationMessage(const string& strCommand)
+{
+    return strCommand == "version" || strCommand == "inv" || strCommand == "getdata" ||
+           strCommand == "getblocks" || strCommand == "checkpoint" || strCommand == "getheaders" ||
+           strCommand == "tx" || strCommand == "block" || strCommand == "mempool" ||
+           strCommand == "checkorder" || strCommand == "reply" || strCommand == "alert";
+}
+
+// Called with pfrom->cs_vRecv held.  A message worker (fWorker) stops at the
+// first message that needs cs_main and returns false, the validation thread
+// carries on from there.
+bool ProcessMessages(CNode* pfrom, bool fWorker)
 {
-    CDataStream& vRecv = pfrom->vRecv;
+    CPublicDataStream& vRecv = pfrom->vRecv;
     if (vRecv.empty())
         return true;
     //if (fDebug)
@@ -3730,11 +4061,11 @@ bool ProcessMessages(CNode* pfrom)
     while (true)
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
+        if (pfrom->nSendSize >= SendBufferSize())
             break;
 
         // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
+        CPublicDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
         int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
         if (vRecv.end() - pstart < nHeaderSize)
         {
@@ -3774,6 +4105,14 @@ bool ProcessMessages(CNode* pfrom)
             break;
         }
 
+        bool fValidation = IsValidationMessage(strCommand);
+        if (fValidation && fWorker)
+        {
+            // Rewind and leave it to the validation thread
+            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
+            return false;
+        }
+
         // Checksum
         uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
@@ -3785,17 +4124,26 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        // Read the message in place, vRecv is locked and left untouched until it is consumed below
+        const char* pchMsg = nMessageSize ? &vRecv.begin()[0] : NULL;
+        CSpanStream vMsg(pchMsg, pchMsg + nMessageSize, vRecv.nType, vRecv.nVersion);
 
         // Process message
         bool fRet = false;
         try
         {
+            if (fValidation)
             {
                 LOCK(cs_main);
+                int64_t nStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vMsg);
+                RecordMessageTime(strCommand, GetTimeMicros() - nStart);
+            }
+            else
+            {
+                int64_t nStart = GetTimeMicros();
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
+                RecordMessageTime(strCommand, GetTimeMicros() - nStart);
             }
             if (fShutdown)
                 return true;
@@ -3823,6 +4171,8 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        vRecv.ignore(nMessageSize);
+
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
@@ -3842,7 +4192,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
         // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
             uint64_t nonce = 0;
             if (pto->nVersion > BIP0031_VERSION)
                 pto->PushMessage("ping", nonce);
@@ -3863,7 +4213,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3882,25 +4235,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            // Message workers add to vAddrToSend while we run, take what is there now
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(vAddr.size(), (size_t)i + 1000)));
         }
 
 
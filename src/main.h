@@ -6,6 +6,7 @@
 #define BITCOIN_MAIN_H
 
 #include "bignum.h"
+#include "arith_uint256.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
@@ -59,6 +60,7 @@ static const uint256 hashGenesisBlockTestNet("0x0000054e005ba4c0e13aef3de90c6510
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
+extern CSharedCriticalSection cs_blockindex;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
@@ -66,8 +68,8 @@ extern unsigned int nStakeMinAge;
 extern unsigned int nNodeLifespan;
 extern int nCoinbaseMaturity;
 extern int nBestHeight;
-extern CBigNum bnBestChainTrust;
-extern CBigNum bnBestInvalidTrust;
+extern arith_uint256 bnBestChainTrust;
+extern arith_uint256 bnBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
@@ -110,7 +112,7 @@ FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
-bool ProcessMessages(CNode* pfrom);
+bool ProcessMessages(CNode* pfrom, bool fWorker);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
 int GenerateMTRandom(unsigned int s, int range);
@@ -123,6 +125,15 @@ unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime);
 unsigned int ComputeMinStake(unsigned int nBase, int64_t nTime, unsigned int nBlockTime);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
+/** Wait up to nTimeoutMillis for the best block to move on from hashWatched or, if fPool,
+ * for nTransactionsUpdated to move on from nTxWatched.  Returns whether it did. */
+bool WaitForChainChange(const uint256& hashWatched, unsigned int nTxWatched, bool fPool, int64_t nTimeoutMillis);
+/** Save the memory pool to mempool.dat, each transaction after the pool transactions it spends */
+bool DumpMempool();
+/** Read the transactions saved by DumpMempool, in the order they were written */
+bool ReadMempool(std::vector<CTransaction>& vtx);
+/** Re-validate the saved memory pool into mempool, started at init so it doesn't hold up startup */
+void ThreadLoadMempool(void* parg);
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
@@ -1110,7 +1121,7 @@ public:
     CBlockIndex* pnext;
     unsigned int nFile;
     unsigned int nBlockPos;
-    CBigNum bnChainTrust; // DeepOnion: trust score of block chain
+    arith_uint256 bnChainTrust; // DeepOnion: trust score of block chain
     int nHeight;
 
     int64_t nMint;
@@ -1221,7 +1232,7 @@ public:
         return (int64_t)nTime;
     }
 
-    CBigNum GetBlockTrust() const;
+    arith_uint256 GetBlockTrust() const;
 
     bool IsInMainChain() const
     {
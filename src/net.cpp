@@ -8,6 +8,8 @@
 #include "init.h"
 #include "strlcpy.h"
 #include "addrman.h"
+#include "netpoll.h"
+#include "workqueue.h"
 #include "ui_interface.h"
 #include "util.h"
 #include <sys/stat.h>
@@ -38,6 +40,7 @@ static const int MAX_OUTBOUND_CONNECTIONS = 16;
 #endif
 
 void ThreadMessageHandler2(void *parg);
+void ThreadMessageWorker2(void *parg);
 void ThreadSocketHandler2(void *parg);
 void ThreadOpenConnections2(void *parg);
 void ThreadOpenAddedConnections2(void *parg);
@@ -72,11 +75,12 @@ CAddress addrSeenByPeer(CService("0.0.0.0", 0), nLocalServices);
 uint64_t nLocalHostNonce = 0;
 boost::array<int, THREAD_MAX> vnThreadsRunning;
 static std::vector<SOCKET> vhListenSocket;
+static CSocketPoller *pSocketPoller = NULL;
 CAddrMan addrman;
 
 vector<CNode *> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetMessageRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -495,6 +499,8 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
+        if (fPollWatched)
+            pSocketPoller->Remove(hSocket);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
         vRecv.clear();
@@ -506,6 +512,77 @@ void CNode::Cleanup()
 {
 }
 
+CNetMessage::CNetMessage(CPublicDataStream &ssMsg)
+{
+    ssMsg.swap(vch);
+    assert(vch.size() >= CMessageHeader::HEADER_SIZE);
+
+    // Set the size
+    unsigned int nSize = vch.size() - CMessageHeader::HEADER_SIZE;
+    memcpy(&vch[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(vch.begin() + CMessageHeader::HEADER_SIZE, vch.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy(&vch[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+// Send as much of the queued messages as the socket takes, caller holds cs_vSend.
+// Returns the number of bytes sent, or -1 with the socket error in WSAGetLastError().
+static int SocketSendData(CNode *pnode)
+{
+    if (pnode->vSendMsg.empty())
+        return 0;
+
+#ifdef WIN32
+    // No scatter-gather here, send the front message on its own
+    const CNetMessageRef &msg = pnode->vSendMsg.front();
+    unsigned int nWanted = msg->size() - pnode->nSendOffset;
+    int nBytes = send(pnode->hSocket, msg->data() + pnode->nSendOffset, nWanted, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    // Gather up to 64 queued messages into one sendmsg() call
+    struct iovec iov[64];
+    int nIov = 0;
+    unsigned int nWanted = 0;
+    for (deque<CNetMessageRef>::const_iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < (int)ARRAYLEN(iov); ++it, ++nIov)
+    {
+        unsigned int nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+        iov[nIov].iov_base = (void *)((*it)->data() + nOffset);
+        iov[nIov].iov_len = (*it)->size() - nOffset;
+        nWanted += iov[nIov].iov_len;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nIov;
+    int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+    if (nBytes <= 0)
+        return nBytes;
+
+    // A short write means the socket buffer is full until the poller says otherwise
+    if ((unsigned int)nBytes < nWanted)
+        pnode->fPollSend = false;
+
+    // Drop the messages that went out completely
+    unsigned int nLeft = nBytes;
+    while (nLeft > 0)
+    {
+        unsigned int nFront = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+        if (nLeft < nFront)
+        {
+            pnode->nSendOffset += nLeft;
+            break;
+        }
+        nLeft -= nFront;
+        pnode->nSendOffset = 0;
+        pnode->vSendMsg.pop_front();
+    }
+    pnode->nSendSize -= nBytes;
+    return nBytes;
+}
+
 void CNode::PushVersion()
 {
     /// when NTP implemented, change to just nTime = GetAdjustedTime()
@@ -801,7 +878,7 @@ void ThreadSocketHandler2(void *parg)
             BOOST_FOREACH (CNode *pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSendMsg.empty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -860,70 +937,89 @@ void ThreadSocketHandler2(void *parg)
         }
 
         //
-        // Find which sockets have data to receive
+        // Register new sockets and find out whether any node still has work
+        // left over from the last round
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (SOCKET hListenSocket, vhListenSocket)
-        {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        bool fEdgeTriggered = pSocketPoller->IsEdgeTriggered();
+        bool fPending = false;
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode *pnode, vNodes)
             {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+                if (!pnode->fPollWatched)
+                {
+                    if (!pSocketPoller->Add(pnode->hSocket, pnode))
+                    {
+                        printf("socket poller cannot watch %s, disconnecting\n", pnode->addrName.c_str());
+                        pnode->fDisconnect = true;
+                        continue;
+                    }
+                    pnode->fPollWatched = true;
+                    pnode->fPollSend = true;
+                }
+                if (fEdgeTriggered)
+                {
+                    if (pnode->fPollRecv)
+                        fPending = true;
+                    else if (pnode->fPollSend)
+                    {
+                        // A node whose queue is being pushed to counts as pending,
+                        // its message would otherwise wait for the next poll timeout
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (!lockSend || !pnode->vSendMsg.empty())
+                            fPending = true;
+                    }
+                }
+                else
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    if (lockSend && !pnode->vSendMsg.empty())
+                        pSocketPoller->WantSend(pnode->hSocket);
                 }
             }
         }
 
+        //
+        // Wait for sockets with data to receive or room to send
+        //
+        vector<CPollEvent> vEvents;
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        pSocketPoller->Wait(fPending ? 0 : 50, vEvents); // 50ms: frequency to poll pnode->vSendMsg
         vnThreadsRunning[THREAD_SOCKETHANDLER]++;
         if (fShutdown)
             return;
-        if (nSelect == SOCKET_ERROR)
+
+        vector<SOCKET> vListenReady;
         {
-            if (have_fds)
+            LOCK(cs_vNodes);
+            if (!fEdgeTriggered)
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                BOOST_FOREACH (CNode *pnode, vNodes)
+                    pnode->fPollRecv = pnode->fPollSend = false;
+            }
+            // Events can only name nodes that haven't been deleted yet, nodes
+            // are removed from the poller before their socket is closed
+            BOOST_FOREACH (const CPollEvent &event, vEvents)
+            {
+                if (event.pcookie == NULL)
+                {
+                    vListenReady.push_back(event.hSocket);
+                    continue;
+                }
+                CNode *pnode = (CNode *)event.pcookie;
+                if (event.fRecv)
+                    pnode->fPollRecv = true;
+                if (event.fSend)
+                    pnode->fPollSend = true;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
         }
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH (SOCKET hListenSocket, vhListenSocket)
-            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        BOOST_FOREACH (SOCKET hListenSocket, vListenReady)
             {
 #ifdef USE_IPV6
                 struct sockaddr_storage sockaddr;
@@ -956,6 +1052,11 @@ void ThreadSocketHandler2(void *parg)
                 {
                     closesocket(hSocket);
                 }
+                else if (!pSocketPoller->CanWatch(hSocket))
+                {
+                    printf("connection from %s dropped (too many sockets for %s)\n", addr.ToString().c_str(), pSocketPoller->GetName());
+                    closesocket(hSocket);
+                }
                 else if (CNode::IsBanned(addr))
                 {
                     printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
@@ -993,12 +1094,12 @@ void ThreadSocketHandler2(void *parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fPollRecv)
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
                 {
-                    CDataStream &vRecv = pnode->vRecv;
+                    CPublicDataStream &vRecv = pnode->vRecv;
                     unsigned int nPos = vRecv.size();
 
                     if (nPos > ReceiveBufferSize())
@@ -1019,6 +1120,10 @@ void ThreadSocketHandler2(void *parg)
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            WakeMessageHandler(pnode);
+                            // A short read means the socket is drained, otherwise read more next round
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fPollRecv = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -1031,7 +1136,9 @@ void ThreadSocketHandler2(void *parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fPollRecv = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
@@ -1047,18 +1154,16 @@ void ThreadSocketHandler2(void *parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fPollSend)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                 {
-                    CDataStream &vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    if (!pnode->vSendMsg.empty())
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                        int nBytes = SocketSendData(pnode);
                         if (nBytes > 0)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
                             pnode->nLastSend = GetTime();
                             pnode->nSendBytes += nBytes;
                             pnode->RecordBytesSent(nBytes);
@@ -1067,7 +1172,9 @@ void ThreadSocketHandler2(void *parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fPollSend = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 printf("socket send error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
@@ -1080,7 +1187,7 @@ void ThreadSocketHandler2(void *parg)
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->vSendMsg.empty())
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1426,6 +1533,7 @@ void ThreadDumpAddress2(void *parg)
     while (!fShutdown)
     {
         DumpAddresses();
+        DumpMempool();
         vnThreadsRunning[THREAD_DUMPADDRESS]--;
         MilliSleep(600000);
         vnThreadsRunning[THREAD_DUMPADDRESS]++;
@@ -1792,36 +1900,185 @@ void ThreadMessageHandler(void *parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+//
+// Message handling is split between a pool of workers and one validation
+// thread.  A node is owned by at most one of them at a time, so the messages
+// of a peer are still handled one after the other, in order.  Workers handle
+// everything that doesn't touch the chainstate without cs_main, the first
+// message that does hands the node over to the validation thread, which also
+// runs SendMessages for all nodes.
+//
+static CWorkQueue<CNode *> queueMsgWorker;
+static CWorkQueue<CNode *> queueMsgValidation;
+static int nMsgWorkers = 0;
+
+static map<string, CMessageTimeStats> mapMessageTimes;
+static CCriticalSection cs_mapMessageTimes;
+static const unsigned int MAX_MESSAGE_TIME_COMMANDS = 64;
+
+// Take ownership of pnode for message handling, caller holds cs_vNodes.
+// A node that is already owned is only flagged to be queued again if fWake.
+static bool ClaimNodeForMessages(CNode *pnode, bool fWake)
+{
+    if (pnode->fMsgQueued)
+    {
+        if (fWake)
+            pnode->fMsgMore = true;
+        return false;
+    }
+    pnode->fMsgQueued = true;
+    pnode->fMsgMore = false;
+    pnode->AddRef();
+    return true;
+}
+
+// Give up ownership of pnode, or pass it back to the workers if more
+// messages arrived meanwhile or fRequeue is set
+static void ReleaseNodeForMessages(CNode *pnode, bool fRequeue = false)
+{
+    LOCK(cs_vNodes);
+    if ((fRequeue || pnode->fMsgMore) && !fShutdown)
+    {
+        pnode->fMsgMore = false;
+        queueMsgWorker.Push(pnode);
+        return;
+    }
+    pnode->fMsgQueued = false;
+    pnode->Release();
+}
+
+void WakeMessageHandler(CNode *pnode)
+{
+    LOCK(cs_vNodes);
+    if (ClaimNodeForMessages(pnode, true))
+        queueMsgWorker.Push(pnode);
+}
+
+void RecordMessageTime(const string &strCommand, int64_t nMicros)
+{
+    LOCK(cs_mapMessageTimes);
+    // Peers choose the command names, don't let them grow the map without bound
+    string strKey = strCommand;
+    if (mapMessageTimes.size() >= MAX_MESSAGE_TIME_COMMANDS && !mapMessageTimes.count(strKey))
+        strKey = "other";
+    CMessageTimeStats &stats = mapMessageTimes[strKey];
+    stats.nCount++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = max(stats.nMaxMicros, nMicros);
+}
+
+int GetMessageStats(map<string, CMessageTimeStats> &mapTimes, CMessageQueueStats &statsWorker, CMessageQueueStats &statsValidation)
+{
+    {
+        LOCK(cs_mapMessageTimes);
+        mapTimes = mapMessageTimes;
+    }
+    statsWorker.nDepth = queueMsgWorker.size();
+    statsWorker.nPeakDepth = queueMsgWorker.GetPeakDepth();
+    statsValidation.nDepth = queueMsgValidation.size();
+    statsValidation.nPeakDepth = queueMsgValidation.GetPeakDepth();
+    return nMsgWorkers;
+}
+
+void ThreadMessageWorker(void *parg)
+{
+    // Make this thread recognisable as a message worker thread
+    RenameThread("DeepOnion-msgwork");
+
+    try
+    {
+        vnThreadsRunning[THREAD_MESSAGEWORKER]++;
+        ThreadMessageWorker2(parg);
+        vnThreadsRunning[THREAD_MESSAGEWORKER]--;
+    }
+    catch (std::exception &e)
+    {
+        vnThreadsRunning[THREAD_MESSAGEWORKER]--;
+        PrintException(&e, "ThreadMessageWorker()");
+    }
+    catch (...)
+    {
+        vnThreadsRunning[THREAD_MESSAGEWORKER]--;
+        PrintException(NULL, "ThreadMessageWorker()");
+    }
+    printf("ThreadMessageWorker exited\n");
+}
+
+void ThreadMessageWorker2(void *parg)
+{
+    printf("ThreadMessageWorker started\n");
+    while (!fShutdown)
+    {
+        CNode *pnode = NULL;
+        vnThreadsRunning[THREAD_MESSAGEWORKER]--;
+        bool fHaveNode = queueMsgWorker.Pop(pnode, 100);
+        vnThreadsRunning[THREAD_MESSAGEWORKER]++;
+        if (fShutdown)
+            return;
+        if (!fHaveNode)
+            continue;
+
+        bool fDone;
+        {
+            LOCK(pnode->cs_vRecv);
+            fDone = ProcessMessages(pnode, true);
+        }
+        if (fShutdown)
+            return;
+
+        // The rest of this peer's messages waits for the validation thread
+        if (fDone)
+            ReleaseNodeForMessages(pnode);
+        else
+            queueMsgValidation.Push(pnode);
+    }
+}
+
 void ThreadMessageHandler2(void *parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64_t nLastSendMessages = 0;
     while (!fShutdown)
     {
+        // Handle the messages the workers passed on, until it is time to send
+        int64_t nWait = max((int64_t)0, nLastSendMessages + 100 - GetTimeMillis());
+        CNode *pnodeQueued = NULL;
+        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+        bool fHaveNode = queueMsgValidation.Pop(pnodeQueued, nWait);
+        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
+        if (fShutdown)
+            return;
+        if (fHaveNode)
+        {
+            {
+                LOCK(pnodeQueued->cs_vRecv);
+                ProcessMessages(pnodeQueued, false);
+            }
+            if (fShutdown)
+                return;
+            ReleaseNodeForMessages(pnodeQueued);
+        }
+
+        if (GetTimeMillis() - nLastSendMessages < 100)
+            continue;
+        nLastSendMessages = GetTimeMillis();
+
+        // Nodes a worker is busy with are picked up next round
         vector<CNode *> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode *pnode, vNodesCopy)
-                pnode->AddRef();
+            BOOST_FOREACH (CNode *pnode, vNodes)
+                if (ClaimNodeForMessages(pnode, false))
+                    vNodesCopy.push_back(pnode);
         }
 
-        // Poll the connected nodes for messages
+        // Send messages
         CNode *pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
         BOOST_FOREACH (CNode *pnode, vNodesCopy)
         {
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                    ProcessMessages(pnode);
-            }
-            if (fShutdown)
-                return;
-
-            // Send messages
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1829,24 +2086,19 @@ void ThreadMessageHandler2(void *parg)
             }
             if (fShutdown)
                 return;
-        }
 
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode *pnode, vNodesCopy)
-                pnode->Release();
+            // Messages left behind while the send buffer was full get another go
+            bool fPending = false;
+            {
+                TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                if (lockRecv)
+                    fPending = !pnode->vRecv.empty();
+            }
+            ReleaseNodeForMessages(pnode, fPending);
         }
 
-        // Wait and allow messages to bunch up.
-        // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
         if (fRequestShutdown)
             StartShutdown();
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
-        if (fShutdown)
-            return;
     }
 }
 
@@ -2039,6 +2291,15 @@ void StartNode(void *parg)
         semOutbound = new CSemaphore(nMaxOutbound);
     }
 
+    if (pSocketPoller == NULL)
+    {
+        pSocketPoller = CreateSocketPoller(GetArg("-netpoll", ""));
+        printf("Using %s to poll sockets\n", pSocketPoller->GetName());
+        BOOST_FOREACH (SOCKET hListenSocket, vhListenSocket)
+            if (!pSocketPoller->Add(hListenSocket, NULL, true))
+                printf("Error: cannot poll listening socket %d\n", (int)hListenSocket);
+    }
+
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
@@ -2080,6 +2341,12 @@ void StartNode(void *parg)
     if (!NewThread(ThreadMessageHandler, NULL))
         printf("Error: NewThread(ThreadMessageHandler) failed\n");
 
+    // Handle messages that don't need cs_main on a pool of workers
+    nMsgWorkers = max(1, min(16, (int)GetArg("-msgworkers", 2)));
+    for (int i = 0; i < nMsgWorkers; i++)
+        if (!NewThread(ThreadMessageWorker, NULL))
+            printf("Error: NewThread(ThreadMessageWorker) failed\n");
+
     // Dump network addresses
     if (!NewThread(ThreadDumpAddress, NULL))
         printf("Error; NewThread(ThreadDumpAddress) failed\n");
@@ -2100,6 +2367,8 @@ bool StopNode()
     if (semOutbound)
         for (int i = 0; i < MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
+    queueMsgWorker.Interrupt();
+    queueMsgValidation.Interrupt();
     do
     {
         int nThreadsRunning = 0;
@@ -2119,6 +2388,8 @@ bool StopNode()
         printf("ThreadOpenConnections still running\n");
     if (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0)
         printf("ThreadMessageHandler still running\n");
+    if (vnThreadsRunning[THREAD_MESSAGEWORKER] > 0)
+        printf("ThreadMessageWorker still running\n");
     if (vnThreadsRunning[THREAD_RPCLISTENER] > 0)
         printf("ThreadRPCListener still running\n");
     if (vnThreadsRunning[THREAD_RPCHANDLER] > 0)
@@ -2137,10 +2408,17 @@ bool StopNode()
         printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_STAKE_MINER] > 0)
         printf("ThreadStakeMiner still running\n");
+    if (vnThreadsRunning[THREAD_ADDRINDEX] > 0)
+        printf("ThreadAddrIndexBuild still running\n");
+    if (vnThreadsRunning[THREAD_PUSHNOTIFY] > 0)
+        printf("ThreadPushNotify still running\n");
+    if (vnThreadsRunning[THREAD_LOADMEMPOOL] > 0)
+        printf("ThreadLoadMempool still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         MilliSleep(20);
     MilliSleep(50);
     DumpAddresses();
+    DumpMempool();
     return true;
 }
 
@@ -2170,14 +2448,8 @@ class CNetCleanup
 
 void RelayTransaction(const CTransaction &tx, const uint256 &hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
-}
-
-void RelayTransaction(const CTransaction &tx, const uint256 &hash, const CDataStream &ss)
-{
+    // Serialized once here, every peer that asks for it gets the same message
+    CNetMessageRef msg = MakeNetMessage("tx", tx);
     CInv inv(MSG_TX, hash);
     {
         LOCK(cs_mapRelay);
@@ -2189,7 +2461,7 @@ void RelayTransaction(const CTransaction &tx, const uint256 &hash, const CDataSt
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
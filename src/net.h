@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -110,10 +111,45 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_STAKE_MINER,
+    THREAD_MESSAGEWORKER,
+    THREAD_ADDRINDEX,
+    THREAD_PUSHNOTIFY,
+    THREAD_LOADMEMPOOL,
 
     THREAD_MAX
 };
 
+/** A complete serialized message, header and checksum included.
+ *
+ * Immutable once built, so a message that goes to many peers is serialized
+ * and checksummed once and then shared between their send queues.
+ */
+class CNetMessage
+{
+protected:
+    std::vector<char> vch;
+
+public:
+    /** Take over the message in ssMsg, a header followed by its payload, and fill in size and checksum */
+    explicit CNetMessage(CPublicDataStream &ssMsg);
+
+    const char *data() const { return &vch[0]; }
+    unsigned int size() const { return vch.size(); }
+};
+
+typedef boost::shared_ptr<const CNetMessage> CNetMessageRef;
+
+/** Serialize a message once for every peer that sends at nVersion, a peer's send
+ * version is min(its nVersion, PROTOCOL_VERSION) once the version handshake is done. */
+template <typename T1>
+CNetMessageRef MakeNetMessage(const char *pszCommand, const T1 &a1, int nVersion = PROTOCOL_VERSION)
+{
+    CPublicDataStream ssMsg(SER_NETWORK, nVersion);
+    ssMsg.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(a1, SER_NETWORK, nVersion));
+    ssMsg << CMessageHeader(pszCommand, 0) << a1;
+    return CNetMessageRef(new CNetMessage(ssMsg));
+}
+
 extern bool fClient;
 extern bool fDiscover;
 extern bool fUseUPnP;
@@ -126,7 +162,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode *> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetMessageRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -172,6 +208,7 @@ class SecMsgNode
         ignoreUntil = 0;
         nWakeCounter = 0;
         nPeerId = 0;
+        nVersion = 0;
         fEnabled = false;
     };
 
@@ -182,6 +219,7 @@ class SecMsgNode
     int64_t ignoreUntil;
     uint32_t nWakeCounter;
     uint32_t nPeerId;
+    uint32_t nVersion; // smsg protocol version sent in the peer's smsgPing/smsgPong, 0 if none
     bool fEnabled;
 };
 
@@ -192,8 +230,11 @@ class CNode
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CPublicDataStream vSend;             // message being built between BeginMessage and EndMessage
+    std::deque<CNetMessageRef> vSendMsg; // finished messages waiting for the socket
+    unsigned int nSendOffset;            // bytes of vSendMsg.front() already sent
+    uint64_t nSendSize;                  // bytes queued in vSendMsg and not sent yet
+    CPublicDataStream vRecv;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     uint64_t nSendBytes;
@@ -217,6 +258,11 @@ class CNode
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fPollWatched;  // socket registered with the socket poller
+    bool fPollRecv;     // poller reported the socket readable and it hasn't been drained yet
+    bool fPollSend;     // poller reported the socket writable and it hasn't filled up yet
+    bool fMsgQueued;    // owned by a message handler thread, queued or being processed (cs_vNodes)
+    bool fMsgMore;      // new messages arrived while fMsgQueued, queue the node again (cs_vNodes)
     CSemaphoreGrant grantOutbound;
     int nRefCount;
     NodeId id;
@@ -243,6 +289,7 @@ class CNode
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend; // guards vAddrToSend and setAddrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // last known sent sync-checkpoint
@@ -259,6 +306,8 @@ class CNode
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nSendOffset = 0;
+        nSendSize = 0;
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -279,6 +328,11 @@ class CNode
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fPollWatched = false;
+        fPollRecv = false;
+        fPollSend = false;
+        fMsgQueued = false;
+        fMsgMore = false;
         nRefCount = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
@@ -337,6 +391,7 @@ class CNode
 
     void AddAddressKnown(const CAddress &addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -345,6 +400,7 @@ class CNode
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -423,20 +479,15 @@ class CNode
         if (nHeaderStart < 0)
             return;
 
-        // Set the size
-        unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char *)&vSend[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char *)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+        // Move the finished message over to the send queue
+        assert(nHeaderStart == 0);
+        CNetMessageRef msg(new CNetMessage(vSend));
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
 
         if (fDebug)
         {
-            printf("(%d bytes)\n", nSize);
+            printf("(%d bytes)\n", msg->size() - CMessageHeader::HEADER_SIZE);
         }
 
         nHeaderStart = -1;
@@ -444,6 +495,14 @@ class CNode
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    void PushMessage(const CNetMessageRef &msg)
+    {
+        // Queue a message that was built once with MakeNetMessage for several peers
+        LOCK(cs_vSend);
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
+    }
+
     void EndMessageAbortIfEmpty()
     {
         if (nHeaderStart < 0)
@@ -710,6 +769,26 @@ inline void RelayInventory(const CInv &inv)
 
 class CTransaction;
 void RelayTransaction(const CTransaction &tx, const uint256 &hash);
-void RelayTransaction(const CTransaction &tx, const uint256 &hash, const CDataStream &ss);
+
+/** Hand a node with received data to the message handler threads */
+void WakeMessageHandler(CNode *pnode);
+
+/** Processing time of one message command */
+struct CMessageTimeStats
+{
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+};
+
+/** Depth of one of the message handler queues */
+struct CMessageQueueStats
+{
+    unsigned int nDepth;
+    unsigned int nPeakDepth;
+};
+
+void RecordMessageTime(const std::string &strCommand, int64_t nMicros);
+int GetMessageStats(std::map<std::string, CMessageTimeStats> &mapTimes, CMessageQueueStats &statsWorker, CMessageQueueStats &statsValidation);
 
 #endif
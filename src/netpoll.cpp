@@ -0,0 +1,216 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netpoll.h"
+#include "util.h"
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+using namespace std;
+
+//
+// CSelectPoller
+//
+
+bool CSelectPoller::CanWatch(SOCKET hSocket) const
+{
+    if (hSocket == INVALID_SOCKET)
+        return false;
+#ifdef WIN32
+    // winsock fd_sets are arrays of handles, the limit is on their number
+    return true;
+#else
+    return hSocket < FD_SETSIZE;
+#endif
+}
+
+bool CSelectPoller::Add(SOCKET hSocket, void* pcookie, bool fListen)
+{
+    if (!CanWatch(hSocket))
+        return false;
+    LOCK(cs);
+#ifdef WIN32
+    if (mapWatched.size() >= FD_SETSIZE)
+        return false;
+#endif
+    mapWatched[hSocket] = pcookie;
+    return true;
+}
+
+void CSelectPoller::Remove(SOCKET hSocket)
+{
+    LOCK(cs);
+    mapWatched.erase(hSocket);
+    setWantSend.erase(hSocket);
+}
+
+void CSelectPoller::WantSend(SOCKET hSocket)
+{
+    LOCK(cs);
+    setWantSend.insert(hSocket);
+}
+
+bool CSelectPoller::Wait(int nTimeoutMillis, vector<CPollEvent>& vEvents)
+{
+    vEvents.clear();
+
+    struct timeval timeout;
+    timeout.tv_sec = nTimeoutMillis / 1000;
+    timeout.tv_usec = (nTimeoutMillis % 1000) * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    {
+        LOCK(cs);
+        for (map<SOCKET, void*>::const_iterator it = mapWatched.begin(); it != mapWatched.end(); ++it)
+        {
+            SOCKET hSocket = it->first;
+            FD_SET(hSocket, &fdsetRecv);
+            if (it->second != NULL)
+                FD_SET(hSocket, &fdsetError);
+            if (setWantSend.count(hSocket))
+                FD_SET(hSocket, &fdsetSend);
+            hSocketMax = max(hSocketMax, hSocket);
+            have_fds = true;
+        }
+        setWantSend.clear();
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    bool fError = (nSelect == SOCKET_ERROR);
+    if (fError)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            printf("socket select error %d\n", nErr);
+        }
+        MilliSleep(nTimeoutMillis);
+    }
+
+    LOCK(cs);
+    for (map<SOCKET, void*>::const_iterator it = mapWatched.begin(); it != mapWatched.end(); ++it)
+    {
+        SOCKET hSocket = it->first;
+        CPollEvent event;
+        event.hSocket = hSocket;
+        event.pcookie = it->second;
+        // On error we can't tell which socket is at fault, let the reads find out
+        event.fRecv = fError || FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError);
+        event.fSend = !fError && FD_ISSET(hSocket, &fdsetSend);
+        if (event.fRecv || event.fSend)
+            vEvents.push_back(event);
+    }
+    return !fError;
+}
+
+
+#ifdef USE_EPOLL
+//
+// CEpollPoller
+//
+
+CEpollPoller::CEpollPoller()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll < 0)
+        printf("epoll_create1 failed with error %d\n", errno);
+}
+
+CEpollPoller::~CEpollPoller()
+{
+    if (hEpoll >= 0)
+        close(hEpoll);
+}
+
+bool CEpollPoller::Add(SOCKET hSocket, void* pcookie, bool fListen)
+{
+    if (!CanWatch(hSocket))
+        return false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = fListen ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    ev.data.fd = hSocket;
+
+    LOCK(cs);
+    // A socket number can come back after close(), which drops it from the epoll set
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &ev) != 0
+        && (errno != EEXIST || epoll_ctl(hEpoll, EPOLL_CTL_MOD, hSocket, &ev) != 0))
+    {
+        printf("epoll_ctl add failed for socket %d with error %d\n", (int)hSocket, errno);
+        return false;
+    }
+    mapWatched[hSocket] = pcookie;
+    return true;
+}
+
+void CEpollPoller::Remove(SOCKET hSocket)
+{
+    LOCK(cs);
+    if (mapWatched.erase(hSocket))
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+}
+
+bool CEpollPoller::Wait(int nTimeoutMillis, vector<CPollEvent>& vEvents)
+{
+    vEvents.clear();
+
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hEpoll, events, ARRAYLEN(events), nTimeoutMillis);
+    if (nEvents < 0)
+    {
+        if (errno == EINTR)
+            return true;
+        printf("epoll_wait error %d\n", errno);
+        MilliSleep(nTimeoutMillis);
+        return false;
+    }
+
+    vEvents.reserve(nEvents);
+    LOCK(cs);
+    for (int i = 0; i < nEvents; i++)
+    {
+        // Sockets removed while we were waiting are dropped here
+        map<SOCKET, void*>::const_iterator it = mapWatched.find(events[i].data.fd);
+        if (it == mapWatched.end())
+            continue;
+        CPollEvent event;
+        event.hSocket = it->first;
+        event.pcookie = it->second;
+        event.fRecv = (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+        event.fSend = (events[i].events & EPOLLOUT) != 0;
+        vEvents.push_back(event);
+    }
+    return true;
+}
+#endif
+
+
+CSocketPoller* CreateSocketPoller(const string& strName)
+{
+#ifdef USE_EPOLL
+    if (strName == "" || strName == "epoll")
+    {
+        CEpollPoller* pepoll = new CEpollPoller();
+        if (pepoll->IsValid())
+            return pepoll;
+        delete pepoll;
+        printf("epoll unavailable, falling back to select\n");
+    }
+#endif
+    if (strName != "" && strName != "select")
+        printf("Unknown or unsupported -netpoll=%s, using select\n", strName.c_str());
+    return new CSelectPoller();
+}
@@ -0,0 +1,103 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NETPOLL_H
+#define BITCOIN_NETPOLL_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "compat.h"
+#include "sync.h"
+
+#if defined(__linux__)
+#define USE_EPOLL 1
+#endif
+
+/** Readiness of one watched socket, as reported by CSocketPoller::Wait() */
+struct CPollEvent
+{
+    SOCKET hSocket;
+    void* pcookie;
+    bool fRecv;
+    bool fSend;
+};
+
+/** Waits for activity on a set of sockets.
+ *
+ * Sockets are registered once with Add() and must be unregistered with
+ * Remove() before they are closed.  A level-triggered poller reports every
+ * socket that is ready on each call to Wait(); an edge-triggered one only
+ * reports sockets that became ready since the last call, so the caller must
+ * keep reading/writing until the socket would block before it waits on that
+ * direction again.  Listening sockets are always level-triggered.
+ */
+class CSocketPoller
+{
+protected:
+    CCriticalSection cs;
+    std::map<SOCKET, void*> mapWatched;
+
+public:
+    virtual ~CSocketPoller() {}
+
+    virtual const char* GetName() const = 0;
+    virtual bool IsEdgeTriggered() const = 0;
+
+    /** Whether hSocket can be watched by this poller at all */
+    virtual bool CanWatch(SOCKET hSocket) const { return hSocket != INVALID_SOCKET; }
+
+    /** Start watching hSocket, pcookie is handed back with its events (listening sockets use NULL) */
+    virtual bool Add(SOCKET hSocket, void* pcookie, bool fListen = false) = 0;
+    /** Stop watching hSocket, safe to call from any thread */
+    virtual void Remove(SOCKET hSocket) = 0;
+    /** Level-triggered pollers only watch for writability when asked, once per Wait() */
+    virtual void WantSend(SOCKET hSocket) {}
+
+    /** Wait up to nTimeoutMillis for activity, return false on a polling error */
+    virtual bool Wait(int nTimeoutMillis, std::vector<CPollEvent>& vEvents) = 0;
+};
+
+/** select() based poller, available everywhere but limited to FD_SETSIZE */
+class CSelectPoller : public CSocketPoller
+{
+protected:
+    std::set<SOCKET> setWantSend;
+
+public:
+    const char* GetName() const { return "select"; }
+    bool IsEdgeTriggered() const { return false; }
+    bool CanWatch(SOCKET hSocket) const;
+    bool Add(SOCKET hSocket, void* pcookie, bool fListen = false);
+    void Remove(SOCKET hSocket);
+    void WantSend(SOCKET hSocket);
+    bool Wait(int nTimeoutMillis, std::vector<CPollEvent>& vEvents);
+};
+
+#ifdef USE_EPOLL
+/** Linux epoll based poller, edge-triggered and without a limit on the number of sockets */
+class CEpollPoller : public CSocketPoller
+{
+protected:
+    int hEpoll;
+
+public:
+    CEpollPoller();
+    ~CEpollPoller();
+
+    bool IsValid() const { return hEpoll >= 0; }
+    const char* GetName() const { return "epoll"; }
+    bool IsEdgeTriggered() const { return true; }
+    bool Add(SOCKET hSocket, void* pcookie, bool fListen = false);
+    void Remove(SOCKET hSocket);
+    bool Wait(int nTimeoutMillis, std::vector<CPollEvent>& vEvents);
+};
+#endif
+
+/** Create the best poller available on this platform, or the one named by strName ("epoll" or "select") */
+CSocketPoller* CreateSocketPoller(const std::string& strName = "");
+
+#endif
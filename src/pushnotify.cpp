@@ -0,0 +1,365 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "pushnotify.h"
+#include "main.h"
+#include "net.h"
+#include "netpoll.h"
+#include "smessage.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+typedef boost::shared_ptr<const string> CPushFrameRef;
+
+// Every subscriber costs a queue, there are never more than this many
+static const unsigned int MAX_PUSH_SUBSCRIBERS = 32;
+
+class CPushSubscriber
+{
+public:
+    SOCKET hSocket;
+    deque<CPushFrameRef> vSendQueue;
+    size_t nSendOffset;     // into the front frame
+    size_t nSendSize;       // bytes still to send
+    uint64_t nDropped;
+    bool fDisconnect;
+
+    CPushSubscriber(SOCKET hSocketIn)
+    {
+        hSocket = hSocketIn;
+        nSendOffset = 0;
+        nSendSize = 0;
+        nDropped = 0;
+        fDisconnect = false;
+    }
+};
+
+static CCriticalSection cs_vPushSubscribers;
+static vector<CPushSubscriber*> vPushSubscribers;
+static map<string, unsigned int> mapPushSequence;
+static size_t nPushQueueMax = DEFAULT_PUSHNOTIFY_QUEUE * 1000;
+
+static SOCKET hPushListenSocket = INVALID_SOCKET;
+static CSocketPoller* pPushPoller = NULL;
+static bool fPushNotifyStop = false;
+
+static bool SetNonBlocking(SOCKET hSocket)
+{
+#ifdef WIN32
+    u_long nOne = 1;
+    return ioctlsocket(hSocket, FIONBIO, &nOne) != SOCKET_ERROR;
+#else
+    return fcntl(hSocket, F_SETFL, O_NONBLOCK) != SOCKET_ERROR;
+#endif
+}
+
+// Send as much of the queue as the socket takes, caller holds cs_vPushSubscribers.
+// False if the subscriber has gone away.
+static bool PushSendData(CPushSubscriber* psub)
+{
+    while (!psub->vSendQueue.empty())
+    {
+        const string& strFrame = *psub->vSendQueue.front();
+        size_t nWanted = strFrame.size() - psub->nSendOffset;
+        int nBytes = send(psub->hSocket, strFrame.data() + psub->nSendOffset, nWanted, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nBytes < 0)
+        {
+            int nErr = WSAGetLastError();
+            return (nErr == WSAEWOULDBLOCK || nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS);
+        }
+        psub->nSendSize -= nBytes;
+        if ((size_t)nBytes < nWanted)
+        {
+            psub->nSendOffset += nBytes;
+            return true;
+        }
+        psub->nSendOffset = 0;
+        psub->vSendQueue.pop_front();
+    }
+    return true;
+}
+
+static bool HavePushSubscribers()
+{
+    LOCK(cs_vPushSubscribers);
+    return !vPushSubscribers.empty();
+}
+
+static void PushPublish(const string& strTopic, const CDataStream& ssBody)
+{
+    LOCK(cs_vPushSubscribers);
+    if (vPushSubscribers.empty())
+        return;
+
+    CDataStream ssFrame(SER_NETWORK, PROTOCOL_VERSION);
+    ssFrame << (unsigned int)0 << strTopic << mapPushSequence[strTopic]++;
+    ssFrame += ssBody;
+    unsigned int nSize = ssFrame.size() - sizeof(nSize);
+    memcpy(&ssFrame[0], &nSize, sizeof(nSize));
+    CPushFrameRef frame(new string(ssFrame.begin(), ssFrame.end()));
+
+    BOOST_FOREACH(CPushSubscriber* psub, vPushSubscribers)
+    {
+        if (psub->fDisconnect)
+            continue;
+        // A frame always fits in an empty queue, so a large block is never dropped for size alone
+        if (!psub->vSendQueue.empty() && psub->nSendSize + frame->size() > nPushQueueMax)
+        {
+            if (psub->nDropped++ == 0)
+                printf("pushnotify: subscriber queue full, dropping frames\n");
+            continue;
+        }
+        psub->vSendQueue.push_back(frame);
+        psub->nSendSize += frame->size();
+        // Nothing was waiting, try to get it out now rather than on the next poll
+        if (psub->vSendQueue.size() == 1 && !PushSendData(psub))
+            psub->fDisconnect = true;
+    }
+}
+
+void PushNotifyBlock(const CBlock& block)
+{
+    if (!HavePushSubscribers())
+        return;
+
+    CDataStream ssHash(SER_NETWORK, PROTOCOL_VERSION);
+    ssHash << block.GetHash();
+    PushPublish("hashblock", ssHash);
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    PushPublish("rawblock", ssBlock);
+}
+
+void PushNotifyTransaction(const CTransaction& tx)
+{
+    if (!HavePushSubscribers())
+        return;
+
+    CDataStream ssHash(SER_NETWORK, PROTOCOL_VERSION);
+    ssHash << tx.GetHash();
+    PushPublish("hashtx", ssHash);
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    PushPublish("rawtx", ssTx);
+}
+
+static void PushNotifySecMsgInbox(SecMsgStored& inboxHdr)
+{
+    if (!HavePushSubscribers())
+        return;
+
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << inboxHdr;
+    PushPublish("smsginbox", ssMsg);
+}
+
+static void PushAccept()
+{
+    struct sockaddr_in sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hPushListenSocket, (struct sockaddr*)&sockaddr, &len);
+    if (hSocket == INVALID_SOCKET)
+        return;
+
+    LOCK(cs_vPushSubscribers);
+    if (vPushSubscribers.size() >= MAX_PUSH_SUBSCRIBERS || !pPushPoller->CanWatch(hSocket) || !SetNonBlocking(hSocket))
+    {
+        printf("pushnotify: subscriber refused\n");
+        closesocket(hSocket);
+        return;
+    }
+    CPushSubscriber* psub = new CPushSubscriber(hSocket);
+    if (!pPushPoller->Add(hSocket, psub))
+    {
+        delete psub;
+        closesocket(hSocket);
+        return;
+    }
+    vPushSubscribers.push_back(psub);
+    if (fDebug)
+        printf("pushnotify: subscriber connected, %" PRIszu " now\n", vPushSubscribers.size());
+}
+
+// Caller holds cs_vPushSubscribers
+static void PushClose(CPushSubscriber* psub)
+{
+    if (psub->nDropped > 0)
+        printf("pushnotify: subscriber disconnected, %" PRIu64 " frames were dropped for it\n", psub->nDropped);
+    else if (fDebug)
+        printf("pushnotify: subscriber disconnected\n");
+    pPushPoller->Remove(psub->hSocket);
+    closesocket(psub->hSocket);
+    delete psub;
+}
+
+static void ThreadPushNotify2()
+{
+    vector<CPollEvent> vEvents;
+    while (!fShutdown && !fPushNotifyStop)
+    {
+        {
+            LOCK(cs_vPushSubscribers);
+            BOOST_FOREACH(CPushSubscriber* psub, vPushSubscribers)
+                if (!psub->vSendQueue.empty())
+                    pPushPoller->WantSend(psub->hSocket);
+        }
+        pPushPoller->Wait(50, vEvents);
+
+        LOCK(cs_vPushSubscribers);
+        BOOST_FOREACH(const CPollEvent& event, vEvents)
+        {
+            if (event.pcookie == NULL)
+                continue;
+            CPushSubscriber* psub = (CPushSubscriber*)event.pcookie;
+            if (event.fRecv && !psub->fDisconnect)
+            {
+                // Subscribers have nothing to say, reading only notices them leaving
+                char pchBuf[256];
+                int nBytes = recv(psub->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                if (nBytes == 0)
+                    psub->fDisconnect = true;
+                else if (nBytes < 0)
+                {
+                    int nErr = WSAGetLastError();
+                    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                        psub->fDisconnect = true;
+                }
+            }
+            if (event.fSend && !psub->fDisconnect && !PushSendData(psub))
+                psub->fDisconnect = true;
+        }
+
+        for (vector<CPushSubscriber*>::iterator it = vPushSubscribers.begin(); it != vPushSubscribers.end();)
+        {
+            if ((*it)->fDisconnect)
+            {
+                PushClose(*it);
+                it = vPushSubscribers.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        BOOST_FOREACH(const CPollEvent& event, vEvents)
+            if (event.pcookie == NULL && event.fRecv)
+                PushAccept();
+    }
+}
+
+static void ThreadPushNotify(void* parg)
+{
+    // Make this thread recognisable as the push notification thread
+    RenameThread("DeepOnion-pushnotify");
+    vnThreadsRunning[THREAD_PUSHNOTIFY]++;
+    try
+    {
+        ThreadPushNotify2();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadPushNotify()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadPushNotify()");
+    }
+
+    {
+        LOCK(cs_vPushSubscribers);
+        BOOST_FOREACH(CPushSubscriber* psub, vPushSubscribers)
+            PushClose(psub);
+        vPushSubscribers.clear();
+    }
+    pPushPoller->Remove(hPushListenSocket);
+    closesocket(hPushListenSocket);
+    vnThreadsRunning[THREAD_PUSHNOTIFY]--;
+    printf("ThreadPushNotify exited\n");
+}
+
+bool StartPushNotify(string& strError)
+{
+    int nPort = GetArg("-pushnotify", 0);
+    if (nPort <= 0 || nPort > 65535)
+    {
+        strError = strprintf(_("Invalid port for -pushnotify: '%s'"), GetArg("-pushnotify", "").c_str());
+        return false;
+    }
+    nPushQueueMax = max((int64_t)1, GetArg("-pushnotifyqueue", DEFAULT_PUSHNOTIFY_QUEUE)) * 1000;
+
+#ifdef WIN32
+    WSADATA wsadata;
+    int ret = WSAStartup(MAKEWORD(2, 2), &wsadata);
+    if (ret != NO_ERROR)
+    {
+        strError = strprintf("Error: TCP/IP socket library failed to start (WSAStartup returned error %d)", ret);
+        return false;
+    }
+#endif
+
+    // Only local processes may subscribe
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(nPort);
+
+    hPushListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hPushListenSocket == INVALID_SOCKET)
+    {
+        strError = strprintf("Error: Couldn't open socket for push notifications (socket returned error %d)", WSAGetLastError());
+        return false;
+    }
+
+    int nOne = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(hPushListenSocket, SOL_SOCKET, SO_NOSIGPIPE, (void *)&nOne, sizeof(int));
+#endif
+#ifndef WIN32
+    setsockopt(hPushListenSocket, SOL_SOCKET, SO_REUSEADDR, (void *)&nOne, sizeof(int));
+#endif
+
+    if (!SetNonBlocking(hPushListenSocket) ||
+        ::bind(hPushListenSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR ||
+        listen(hPushListenSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        strError = strprintf(_("Unable to bind to 127.0.0.1:%d for push notifications (error %d)"), nPort, WSAGetLastError());
+        closesocket(hPushListenSocket);
+        return false;
+    }
+
+    // A handful of sockets, all level-triggered is simplest
+    if (pPushPoller == NULL)
+        pPushPoller = CreateSocketPoller("select");
+    pPushPoller->Add(hPushListenSocket, NULL, true);
+
+    fPushNotifyStop = false;
+    NotifySecMsgInboxChanged.connect(boost::bind(&PushNotifySecMsgInbox, _1));
+    if (!NewThread(ThreadPushNotify, NULL))
+    {
+        strError = "Error: NewThread(ThreadPushNotify) failed";
+        NotifySecMsgInboxChanged.disconnect(boost::bind(&PushNotifySecMsgInbox, _1));
+        pPushPoller->Remove(hPushListenSocket);
+        closesocket(hPushListenSocket);
+        return false;
+    }
+    printf("Push notifications on 127.0.0.1:%d\n", nPort);
+    return true;
+}
+
+void StopPushNotify()
+{
+    if (hPushListenSocket == INVALID_SOCKET)
+        return;
+    NotifySecMsgInboxChanged.disconnect(boost::bind(&PushNotifySecMsgInbox, _1));
+    fPushNotifyStop = true;
+    for (int i = 0; i < 40 && vnThreadsRunning[THREAD_PUSHNOTIFY] > 0; i++)
+        MilliSleep(50);
+}
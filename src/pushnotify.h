@@ -0,0 +1,40 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_PUSHNOTIFY_H
+#define BITCOIN_PUSHNOTIFY_H
+
+#include <string>
+
+class CBlock;
+class CTransaction;
+
+/** Publisher of chain and secure message events to local subscribers, the
+ * in-process replacement for -blocknotify style commands.
+ *
+ * Subscribers connect to -pushnotify=<port> on the loopback interface and
+ * only read.  Every event is sent as one frame:
+ *
+ *   uint32   length of the rest of the frame, little endian
+ *   string   topic, serialized: hashblock, rawblock, hashtx, rawtx or smsginbox
+ *   uint32   sequence number within the topic, a gap means frames were dropped
+ *   body     hashes as serialized (32 bytes), blocks and transactions in their
+ *            network serialization, smsginbox a serialized SecMsgStored
+ *
+ * Every subscriber has its own queue of at most -pushnotifyqueue kilobytes.
+ * Frames that don't fit are dropped for that subscriber, publishing never
+ * waits on a socket.
+ */
+
+static const int DEFAULT_PUSHNOTIFY_QUEUE = 8192;
+
+/** Start listening on -pushnotify, false with strError if that isn't possible */
+bool StartPushNotify(std::string& strError);
+void StopPushNotify();
+
+/** A block was connected to the best chain, each block of a reorganization in turn */
+void PushNotifyBlock(const CBlock& block);
+/** A transaction was accepted into the memory pool */
+void PushNotifyTransaction(const CTransaction& tx);
+
+#endif
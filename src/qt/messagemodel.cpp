@@ -153,9 +153,7 @@ public:
             
             std::vector<unsigned char> vchKey;
             vchKey.resize(18);
-            memcpy(&vchKey[0],  sPrefix.data(),  2);
-            memcpy(&vchKey[2],  &psmsg->timestamp, 8);
-            memcpy(&vchKey[10], &smsgStored.vchMessage[SMSG_HDR_LEN], 8);    // sample
+            SecureMsgDbKey(sPrefix.c_str(), psmsg->timestamp, &smsgStored.vchMessage[SMSG_HDR_LEN], &vchKey[0]);
 
             addMessageEntry(MessageTableEntry(vchKey,
                                               MessageTableEntry::Received,
@@ -190,9 +188,7 @@ public:
             SecureMessage* psmsg = (SecureMessage*) &smsgStored.vchMessage[0];
             std::vector<unsigned char> vchKey;
             vchKey.resize(18);
-            memcpy(&vchKey[0],  sPrefix.data(),  2);
-            memcpy(&vchKey[2],  &psmsg->timestamp, 8);
-            memcpy(&vchKey[10], &smsgStored.vchMessage[SMSG_HDR_LEN], 8);    // sample
+            SecureMsgDbKey(sPrefix.c_str(), psmsg->timestamp, &smsgStored.vchMessage[SMSG_HDR_LEN], &vchKey[0]);
 
             addMessageEntry(MessageTableEntry(vchKey,
                                               MessageTableEntry::Sent,
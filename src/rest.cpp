@@ -0,0 +1,309 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "sync.h"
+#include "bitcoinrpc.h"
+
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer);
+
+enum RetFormat
+{
+    RF_BINARY,
+    RF_HEX,
+    RF_JSON,
+};
+
+static const struct
+{
+    RetFormat rf;
+    const char* pszName;
+    const char* pszContentType;
+} rf_names[] =
+{
+    { RF_BINARY, "bin",  "application/octet-stream" },
+    { RF_HEX,    "hex",  "text/plain" },
+    { RF_JSON,   "json", "application/json" },
+};
+
+// Most headers a single /rest/headers request returns
+static const int MAX_REST_HEADERS_RESULTS = 2000;
+
+// Blocks are sent in pieces of this size as they are read from their file
+static const unsigned int REST_FILE_CHUNK_SIZE = 65536;
+
+class RestErr
+{
+public:
+    int nStatus;
+    string strMessage;
+
+    RestErr(int nStatusIn, const string& strMessageIn) : nStatus(nStatusIn), strMessage(strMessageIn) {}
+};
+
+static bool WriteString(CJSONSink& sinkClient, const string& str)
+{
+    return sinkClient.Write(str.data(), str.size());
+}
+
+// Split "<param>.<format>" and look up the format, JSON if there is none
+static RetFormat ParseDataFormat(string& strParam, const string& strReq)
+{
+    size_t nPos = strReq.rfind('.');
+    if (nPos == string::npos)
+    {
+        strParam = strReq;
+        return RF_JSON;
+    }
+
+    strParam = strReq.substr(0, nPos);
+    string strFormat = strReq.substr(nPos + 1);
+    for (unsigned int i = 0; i < ARRAYLEN(rf_names); i++)
+        if (strFormat == rf_names[i].pszName)
+            return rf_names[i].rf;
+
+    throw RestErr(HTTP_NOT_FOUND, "output format not found (available: .bin, .hex, .json)");
+}
+
+static const char* ContentType(RetFormat rf)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(rf_names); i++)
+        if (rf == rf_names[i].rf)
+            return rf_names[i].pszContentType;
+    return "text/plain";
+}
+
+static uint256 ParseHashStr(const string& strHash)
+{
+    if (strHash.size() != 64 || !IsHex(strHash))
+        throw RestErr(HTTP_BAD_REQUEST, "Invalid hash: " + strHash);
+    uint256 hash;
+    hash.SetHex(strHash);
+    return hash;
+}
+
+// Serialized data in the requested format, hex ends with a newline like our JSON does
+static bool RESTReply(CJSONSink& sinkClient, const string& strBody, RetFormat rf, bool fKeepAlive)
+{
+    string strReply;
+    if (rf == RF_HEX)
+    {
+        string strHex = HexStr(strBody.begin(), strBody.end()) + "\n";
+        strReply = HTTPReplyHeader(HTTP_OK, fKeepAlive, strHex.size(), ContentType(rf)) + strHex;
+    }
+    else
+        strReply = HTTPReplyHeader(HTTP_OK, fKeepAlive, strBody.size(), ContentType(rf)) + strBody;
+    return WriteString(sinkClient, strReply);
+}
+
+static bool RESTReplyJSON(CJSONSink& sinkClient, const string& strJSON, bool fKeepAlive)
+{
+    return WriteString(sinkClient, HTTPReplyHeader(HTTP_OK, fKeepAlive, strJSON.size() + 1, ContentType(RF_JSON)) + strJSON + "\n");
+}
+
+// Copy a block straight from its block file to the client, without
+// deserializing it or holding all of it in memory
+static bool RESTStreamBlock(CJSONSink& sinkClient, unsigned int nFile, unsigned int nBlockPos, RetFormat rf, bool fKeepAlive)
+{
+    // The message start and the size are stored in front of every block
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos - sizeof(pchMessageStart) - sizeof(unsigned int), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        throw RestErr(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+    unsigned char pchMagic[sizeof(pchMessageStart)];
+    unsigned int nSize = 0;
+    try {
+        filein >> FLATDATA(pchMagic) >> nSize;
+    }
+    catch (std::exception &e) {
+        throw RestErr(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+    }
+    if (memcmp(pchMagic, pchMessageStart, sizeof(pchMessageStart)) != 0 || nSize > MAX_BLOCK_SIZE)
+        throw RestErr(HTTP_INTERNAL_SERVER_ERROR, "Block file is corrupt");
+
+    int64_t nLength = (rf == RF_HEX) ? 2 * (int64_t)nSize + 1 : nSize;
+    if (!WriteString(sinkClient, HTTPReplyHeader(HTTP_OK, fKeepAlive, nLength, ContentType(rf))))
+        return false;
+
+    // The status line is out, from here on a failure can only drop the connection
+    vector<char> vch(min(nSize, REST_FILE_CHUNK_SIZE));
+    while (nSize > 0)
+    {
+        unsigned int nChunk = min(nSize, REST_FILE_CHUNK_SIZE);
+        if (fread(&vch[0], 1, nChunk, filein) != nChunk)
+            return error("RESTStreamBlock() : short read in block file %u", nFile);
+        bool fOk;
+        if (rf == RF_HEX)
+            fOk = WriteString(sinkClient, HexStr(vch.begin(), vch.begin() + nChunk));
+        else
+            fOk = sinkClient.Write(&vch[0], nChunk);
+        if (!fOk)
+            return false;
+        nSize -= nChunk;
+    }
+    if (rf == RF_HEX)
+        return WriteString(sinkClient, "\n");
+    return true;
+}
+
+static bool rest_block(CJSONSink& sinkClient, const string& strReq, bool fKeepAlive)
+{
+    string strHash;
+    RetFormat rf = ParseDataFormat(strHash, strReq);
+    uint256 hash = ParseHashStr(strHash);
+
+    unsigned int nFile, nBlockPos;
+    CJSONStringSink sinkJSON;
+    {
+        READ_LOCK(cs_blockindex);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw RestErr(HTTP_NOT_FOUND, strHash + " not found");
+        CBlockIndex* pblockindex = mi->second;
+        nFile = pblockindex->nFile;
+        nBlockPos = pblockindex->nBlockPos;
+
+        if (rf == RF_JSON)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pblockindex, true))
+                throw RestErr(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+            CJSONWriter writer(sinkJSON);
+            blockToJSON(block, pblockindex, true, writer);
+        }
+    }
+
+    if (rf == RF_JSON)
+        return RESTReplyJSON(sinkClient, sinkJSON.str, fKeepAlive);
+    return RESTStreamBlock(sinkClient, nFile, nBlockPos, rf, fKeepAlive);
+}
+
+static bool rest_tx(CJSONSink& sinkClient, const string& strReq, bool fKeepAlive)
+{
+    string strHash;
+    RetFormat rf = ParseDataFormat(strHash, strReq);
+    uint256 hash = ParseHashStr(strHash);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock))
+        throw RestErr(HTTP_NOT_FOUND, strHash + " not found");
+
+    if (rf == RF_JSON)
+    {
+        Object objTx;
+        {
+            READ_LOCK(cs_blockindex);
+            TxToJSON(tx, hashBlock, objTx);
+        }
+        CJSONStringSink sinkJSON;
+        {
+            CJSONWriter writer(sinkJSON);
+            writer.WriteValue(objTx);
+        }
+        return RESTReplyJSON(sinkClient, sinkJSON.str, fKeepAlive);
+    }
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    return RESTReply(sinkClient, ssTx.str(), rf, fKeepAlive);
+}
+
+static void headerToJSON(const CBlockIndex* pindex, CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Key("hash"); writer.String(pindex->GetBlockHash().GetHex());
+    writer.Key("confirmations"); writer.Int(pindex->IsInMainChain() ? nBestHeight - pindex->nHeight + 1 : -1);
+    writer.Key("height"); writer.Int(pindex->nHeight);
+    writer.Key("version"); writer.Int(pindex->nVersion);
+    writer.Key("merkleroot"); writer.String(pindex->hashMerkleRoot.GetHex());
+    writer.Key("time"); writer.Int(pindex->GetBlockTime());
+    writer.Key("nonce"); writer.UInt(pindex->nNonce);
+    writer.Key("bits"); writer.String(HexBits(pindex->nBits));
+    writer.Key("difficulty"); writer.Real(GetDifficulty(pindex));
+    if (pindex->pprev)
+    {
+        writer.Key("previousblockhash");
+        writer.String(pindex->pprev->GetBlockHash().GetHex());
+    }
+    if (pindex->pnext)
+    {
+        writer.Key("nextblockhash");
+        writer.String(pindex->pnext->GetBlockHash().GetHex());
+    }
+    writer.EndObject();
+}
+
+// Up to <count> headers of the main chain, starting at <hash>
+static bool rest_headers(CJSONSink& sinkClient, const string& strCount, const string& strReq, bool fKeepAlive)
+{
+    string strHash;
+    RetFormat rf = ParseDataFormat(strHash, strReq);
+    uint256 hash = ParseHashStr(strHash);
+
+    int nCount = atoi(strCount);
+    if (nCount < 1 || nCount > MAX_REST_HEADERS_RESULTS)
+        throw RestErr(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", strCount.c_str()));
+
+    CDataStream ssHeader(SER_NETWORK | SER_BLOCKHEADERONLY, PROTOCOL_VERSION);
+    CJSONStringSink sinkJSON;
+    {
+        READ_LOCK(cs_blockindex);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw RestErr(HTTP_NOT_FOUND, strHash + " not found");
+
+        if (rf == RF_JSON)
+        {
+            CJSONWriter writer(sinkJSON);
+            writer.BeginArray();
+            for (const CBlockIndex* pindex = mi->second; pindex && nCount > 0; pindex = pindex->pnext, nCount--)
+                headerToJSON(pindex, writer);
+            writer.EndArray();
+        }
+        else
+        {
+            for (const CBlockIndex* pindex = mi->second; pindex && nCount > 0; pindex = pindex->pnext, nCount--)
+                ssHeader << pindex->GetBlockHeader();
+        }
+    }
+
+    if (rf == RF_JSON)
+        return RESTReplyJSON(sinkClient, sinkJSON.str, fKeepAlive);
+    return RESTReply(sinkClient, ssHeader.str(), rf, fKeepAlive);
+}
+
+bool HTTPReq_REST(CJSONSink& sinkClient, const string& strMethod, const string& strURI, bool fKeepAlive)
+{
+    try
+    {
+        if (strMethod != "GET")
+            throw RestErr(HTTP_BAD_REQUEST, "Only GET requests are supported");
+
+        string strPath = strURI.substr(strlen("/rest/"));
+        strPath = strPath.substr(0, strPath.find('?'));
+        vector<string> vPath;
+        boost::split(vPath, strPath, boost::is_any_of("/"));
+
+        bool fOk;
+        if (vPath.size() == 2 && vPath[0] == "block")
+            fOk = rest_block(sinkClient, vPath[1], fKeepAlive);
+        else if (vPath.size() == 2 && vPath[0] == "tx")
+            fOk = rest_tx(sinkClient, vPath[1], fKeepAlive);
+        else if (vPath.size() == 3 && vPath[0] == "headers")
+            fOk = rest_headers(sinkClient, vPath[1], vPath[2], fKeepAlive);
+        else
+            throw RestErr(HTTP_NOT_FOUND, "Unknown REST request");
+        return fOk && fKeepAlive;
+    }
+    catch (RestErr& re)
+    {
+        return WriteString(sinkClient, HTTPReply(re.nStatus, re.strMessage + "\r\n", fKeepAlive, "text/plain")) && fKeepAlive;
+    }
+}
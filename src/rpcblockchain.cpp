@@ -4,8 +4,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
+#include "base58.h"
 #include "bitcoinrpc.h"
 
+#include <boost/bind.hpp>
+
 using namespace json_spirit;
 using namespace std;
 
@@ -102,56 +106,64 @@ Value getnetworkhashps(const Array& params, bool fHelp)
     return GetPoWMHashPS();
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
-    result.push_back(Pair("time", (boost::int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (boost::uint64_t)block.nNonce));
-	result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0')));
-    result.push_back(Pair("chaintrust", leftTrim(blockindex->bnChainTrust.GetHex(), '0')));
+    writer.BeginObject();
+    writer.Key("hash"); writer.String(block.GetHash().GetHex());
+    // Same as the coinbase depth, without building its merkle branch or touching the mempool
+    writer.Key("confirmations"); writer.Int(blockindex->IsInMainChain() ? nBestHeight - blockindex->nHeight + 1 : -1);
+    writer.Key("size"); writer.Int((int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Key("height"); writer.Int(blockindex->nHeight);
+    writer.Key("version"); writer.Int(block.nVersion);
+    writer.Key("merkleroot"); writer.String(block.hashMerkleRoot.GetHex());
+    writer.Key("mint"); writer.WriteValue(ValueFromAmount(blockindex->nMint));
+    writer.Key("time"); writer.Int(block.GetBlockTime());
+    writer.Key("nonce"); writer.UInt(block.nNonce);
+    writer.Key("bits"); writer.String(HexBits(block.nBits));
+    writer.Key("difficulty"); writer.Real(GetDifficulty(blockindex));
+    writer.Key("blocktrust"); writer.String(leftTrim(blockindex->GetBlockTrust().GetHex(), '0'));
+    writer.Key("chaintrust"); writer.String(leftTrim(blockindex->bnChainTrust.GetHex(), '0'));
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
+    {
+        writer.Key("previousblockhash");
+        writer.String(blockindex->pprev->GetBlockHash().GetHex());
+    }
     if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
-    result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
-    result.push_back(Pair("modifier", strprintf("%016" PRIx64, blockindex->nStakeModifier)));
-    result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
-    Array txinfo;
+    {
+        writer.Key("nextblockhash");
+        writer.String(blockindex->pnext->GetBlockHash().GetHex());
+    }
+
+    writer.Key("flags"); writer.String(strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": ""));
+    writer.Key("proofhash"); writer.String(blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex());
+    writer.Key("entropybit"); writer.Int((int)blockindex->GetStakeEntropyBit());
+    writer.Key("modifier"); writer.String(strprintf("%016" PRIx64, blockindex->nStakeModifier));
+    writer.Key("modifierchecksum"); writer.String(strprintf("%08x", blockindex->nStakeModifierChecksum));
+    writer.Key("tx");
+    writer.BeginArray();
     BOOST_FOREACH (const CTransaction& tx, block.vtx)
     {
         if (fPrintTransactionDetail)
         {
+            // Only one transaction at a time is held as a tree
             Object entry;
 
             entry.push_back(Pair("txid", tx.GetHash().GetHex()));
             TxToJSON(tx, 0, entry);
 
-            txinfo.push_back(entry);
+            writer.WriteValue(entry);
         }
         else
-            txinfo.push_back(tx.GetHash().GetHex());
+            writer.String(tx.GetHash().GetHex());
     }
-
-    result.push_back(Pair("tx", txinfo));
+    writer.EndArray();
 
     if (block.IsProofOfStake())
-        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
-
-    return result;
+    {
+        writer.Key("signature");
+        writer.String(HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
+    }
+    writer.EndObject();
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -203,7 +215,7 @@ Value settxfee(const Array& params, bool fHelp)
     return true;
 }
 
-Value getrawmempool(const Array& params, bool fHelp)
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
@@ -213,11 +225,15 @@ Value getrawmempool(const Array& params, bool fHelp)
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    writer.BeginArray();
     BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+        writer.String(hash.ToString());
+    writer.EndArray();
+}
 
-    return a;
+Value getrawmempool(const Array& params, bool fHelp)
+{
+    return StreamedValue(getrawmempool, params, fHelp);
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -235,7 +251,7 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->phashBlock->GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+void getblock(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -253,10 +269,15 @@ Value getblock(const Array& params, bool fHelp)
     CBlockIndex* pblockindex = mapBlockIndex[hash];
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
 }
 
-Value getblockbynumber(const Array& params, bool fHelp)
+Value getblock(const Array& params, bool fHelp)
+{
+    return StreamedValue(getblock, params, fHelp);
+}
+
+void getblockbynumber(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -278,7 +299,12 @@ Value getblockbynumber(const Array& params, bool fHelp)
     pblockindex = mapBlockIndex[hash];
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
+}
+
+Value getblockbynumber(const Array& params, bool fHelp)
+{
+    return StreamedValue(getblockbynumber, params, fHelp);
 }
 
 // DeepOnion: get information of sync-checkpoint
@@ -312,3 +338,184 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+// Address and index key of an address parameter, once the index can answer
+static CBitcoinAddress AddrIndexParam(CTxDB& txdb, const Value& param, unsigned char& nAddrType, uint160& hash)
+{
+    if (!fAddrIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addrindex");
+    int nIndexed = -1;
+    txdb.ReadAddrIndexHeight(nIndexed);
+    if (nIndexed < nBestHeight)
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Address index is being built, at block %d of %d", nIndexed, nBestHeight));
+
+    CBitcoinAddress address(param.get_str());
+    if (!address.IsValid() || !AddrIndexDestination(address.Get(), nAddrType, hash))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid DeepOnion address");
+    return address;
+}
+
+static bool SumAddrIndex(int64_t* pnBalance, int64_t* pnReceived, const CAddrIndexKey& key, int64_t nValue)
+{
+    *pnBalance += nValue;
+    if (nValue > 0)
+        *pnReceived += nValue;
+    return true;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address>\n"
+            "Returns the balance of an address and the total it received, from the address index.");
+
+    CTxDB txdb("r");
+    unsigned char nAddrType;
+    uint160 hash;
+    AddrIndexParam(txdb, params[0], nAddrType, hash);
+
+    int64_t nBalance = 0, nReceived = 0;
+    if (!txdb.ScanAddrIndex(nAddrType, hash, 0, boost::bind(&SumAddrIndex, &nBalance, &nReceived, _1, _2)))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Reading the address index failed");
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <address>\n"
+            "Returns the unspent outputs of an address in the best chain, from the address index.");
+
+    CTxDB txdb("r");
+    unsigned char nAddrType;
+    uint160 hash;
+    CBitcoinAddress address = AddrIndexParam(txdb, params[0], nAddrType, hash);
+
+    vector<pair<CAddrUnspentKey, CAddrUnspentValue> > vUnspent;
+    if (!txdb.ReadAddrUnspent(nAddrType, hash, vUnspent))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Reading the address index failed");
+    int nHeight = nBestHeight;
+
+    Array result;
+    for (unsigned int i = 0; i < vUnspent.size(); i++)
+    {
+        const CAddrUnspentKey& key = vUnspent[i].first;
+        const CAddrUnspentValue& value = vUnspent[i].second;
+        Object entry;
+        entry.push_back(Pair("address", address.ToString()));
+        entry.push_back(Pair("txid", key.txhash.GetHex()));
+        entry.push_back(Pair("vout", (boost::int64_t)key.nIndex));
+        entry.push_back(Pair("scriptPubKey", HexStr(value.scriptPubKey.begin(), value.scriptPubKey.end())));
+        entry.push_back(Pair("amount", ValueFromAmount(value.nValue)));
+        entry.push_back(Pair("height", value.nHeight));
+        entry.push_back(Pair("confirmations", max(nHeight - value.nHeight + 1, 0)));
+        result.push_back(entry);
+    }
+    return result;
+}
+
+// Collects txids in height order, each once, skipping the first nFrom
+class CAddrTxidCollector
+{
+public:
+    int nFrom;
+    int nCount;
+    int nSeen;
+    uint256 hashLast;
+    Array result;
+
+    CAddrTxidCollector(int nFromIn, int nCountIn) : nFrom(nFromIn), nCount(nCountIn), nSeen(0), hashLast(0) {}
+
+    bool Add(const CAddrIndexKey& key, int64_t nValue)
+    {
+        // The rows of a transaction are next to each other
+        if (key.txhash == hashLast)
+            return true;
+        hashLast = key.txhash;
+        if (nSeen++ >= nFrom)
+            result.push_back(key.txhash.GetHex());
+        return (int)result.size() < nCount;
+    }
+};
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 4)
+        throw runtime_error(
+            "getaddresstxids <address> [count=100] [from=0] [startheight=0]\n"
+            "Returns up to [count] ids of transactions paying to or spending from an address,\n"
+            "oldest first, skipping the first [from] of those at or above [startheight].");
+
+    CTxDB txdb("r");
+    unsigned char nAddrType;
+    uint160 hash;
+    AddrIndexParam(txdb, params[0], nAddrType, hash);
+
+    int nCount = 100;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    int nFrom = 0;
+    if (params.size() > 2)
+        nFrom = params[2].get_int();
+    int nStartHeight = 0;
+    if (params.size() > 3)
+        nStartHeight = params[3].get_int();
+    if (nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+    if (nFrom < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+    if (nCount == 0)
+        return Array();
+
+    CAddrTxidCollector collector(nFrom, nCount);
+    if (!txdb.ScanAddrIndex(nAddrType, hash, nStartHeight, boost::bind(&CAddrTxidCollector::Add, &collector, _1, _2)))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Reading the address index failed");
+    return collector.result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getspentinfo {\"txid\":txid,\"index\":n}\n"
+            "Returns the transaction input in the best chain spending an output, from the spent index.");
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled, restart with -spentindex");
+
+    const Object& o = params[0].get_obj();
+    const Value& txid_v = find_value(o, "txid");
+    if (txid_v.type() != str_type || !IsHex(txid_v.get_str()))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected hex txid");
+    const Value& index_v = find_value(o, "index");
+    if (index_v.type() != int_type || index_v.get_int() < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected output index");
+
+    CTxDB txdb("r");
+    CSpentIndexValue spent;
+    if (!txdb.ReadSpentIndex(COutPoint(uint256(txid_v.get_str()), index_v.get_int()), spent))
+    {
+        int nIndexed = -1;
+        txdb.ReadSpentIndexHeight(nIndexed);
+        if (nIndexed < nBestHeight)
+            throw JSONRPCError(RPC_MISC_ERROR, strprintf("Spent index is being built, at block %d of %d", nIndexed, nBestHeight));
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+    }
+
+    Object result;
+    result.push_back(Pair("txid", spent.txhash.GetHex()));
+    result.push_back(Pair("index", (boost::int64_t)spent.nInput));
+    result.push_back(Pair("height", spent.nHeight));
+    result.push_back(Pair("value", ValueFromAmount(spent.nValue)));
+    if (spent.nAddrType == ADDRINDEX_PUBKEYHASH)
+        result.push_back(Pair("address", CBitcoinAddress(CKeyID(spent.hashBytes)).ToString()));
+    else if (spent.nAddrType == ADDRINDEX_SCRIPTHASH)
+        result.push_back(Pair("address", CBitcoinAddress(CScriptID(spent.hashBytes)).ToString()));
+    return result;
+}
@@ -26,7 +26,7 @@ Value getsubsidy(const Array& params, bool fHelp)
 
     if (params.size() != 0)
     {
-        CBigNum bnTarget(uint256(params[0].get_str()));
+        arith_uint256 bnTarget = UintToArith256(uint256(params[0].get_str()));
         nBits = bnTarget.GetCompact();
     }
     else
@@ -172,7 +172,7 @@ Value getworkex(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
 
         CTransaction coinbaseTx = pblock->vtx[0];
         std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
@@ -234,6 +234,48 @@ Value getworkex(const Array& params, bool fHelp)
 }
 
 
+// A new best block ends a long poll at once, memory pool changes only after this long
+static const int64_t LONGPOLL_MEMPOOL_MILLIS = 60 * 1000;
+
+// Long polls each hold an RPC worker, at least one is always left for other calls
+static CCriticalSection cs_nLongPolls;
+static int nLongPolls = 0;
+
+static string LongPollId(const CBlockIndex* pindexPrev, unsigned int nTxUpdated)
+{
+    return pindexPrev->GetBlockHash().GetHex() + strprintf("%u", nTxUpdated);
+}
+
+// BIP22 long polling: wait, holding no locks, until the work identified by
+// strLongPollId is stale
+static void LongPollWait(const string& strLongPollId)
+{
+    if (strLongPollId.size() <= 64 || !IsHex(strLongPollId.substr(0, 64)))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+    uint256 hashWatched(strLongPollId.substr(0, 64));
+    unsigned int nTxWatched = (unsigned int)atoi64(strLongPollId.substr(64));
+
+    {
+        LOCK(cs_nLongPolls);
+        if (nLongPolls >= GetArg("-rpcthreads", 4) - 1)
+            return;
+        nLongPolls++;
+    }
+
+    int64_t nPoolAfter = GetTimeMillis() + LONGPOLL_MEMPOOL_MILLIS;
+    while (!fShutdown)
+    {
+        // Wake up every second to notice a shutdown
+        int64_t nNow = GetTimeMillis();
+        bool fPool = (nNow >= nPoolAfter);
+        if (WaitForChainChange(hashWatched, nTxWatched, fPool, fPool ? 1000 : min((int64_t)1000, nPoolAfter - nNow)))
+            break;
+    }
+
+    LOCK(cs_nLongPolls);
+    nLongPolls--;
+}
+
 Value getwork(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -244,6 +286,7 @@ Value getwork(const Array& params, bool fHelp)
             "  \"data\" : block data\n"
             "  \"hash1\" : formatted hash buffer for second hash (DEPRECATED)\n" // deprecated
             "  \"target\" : little endian hash target\n"
+            "  \"longpollid\" : pass as {\"longpollid\":id} instead of [data] to wait for new work\n"
             "If [data] is specified, tries to solve the block and returns true if it was successful.");
 
     if (vNodes.empty())
@@ -252,12 +295,25 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "DeepOnion is downloading blocks...");
 
+    // An object instead of data is a long poll for the next work
+    bool fData = (params.size() > 0 && params[0].type() != obj_type);
+    if (params.size() > 0 && !fData)
+    {
+        const Value& lpval = find_value(params[0].get_obj(), "longpollid");
+        if (lpval.type() != str_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Missing longpollid");
+        LongPollWait(lpval.get_str());
+    }
+
+    // Registered unlocked so the long poll above doesn't hold cs_main
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
     typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
     static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
     static vector<CBlock*> vNewBlock;
     static CReserveKey reservekey(pwalletMain);
 
-    if (params.size() == 0)
+    if (!fData)
     {
         // Update block
         static unsigned int nTransactionsUpdatedLast;
@@ -311,13 +367,14 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
         result.push_back(Pair("hash1",    HexStr(BEGIN(phash1), END(phash1)))); // deprecated
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
+        result.push_back(Pair("longpollid", LongPollId(pindexPrev, nTransactionsUpdatedLast)));
         return result;
     }
     else
@@ -367,9 +424,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass back in [params] to wait until this template is stale\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -382,6 +441,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -393,6 +453,14 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "DeepOnion is downloading blocks...");
 
+    if (lpval.type() == str_type)
+        LongPollWait(lpval.get_str());
+    else if (lpval.type() != null_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+
+    // Registered unlocked so the long poll above doesn't hold cs_main
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
     static CReserveKey reservekey(pwalletMain);
 
     // Update block
@@ -477,7 +545,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
 
     static Array aMutable;
     if (aMutable.empty())
@@ -503,6 +571,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", LongPollId(pindexPrev, nTransactionsUpdatedLast)));
 
     return result;
 }
@@ -69,7 +69,47 @@ Value getpeerinfo(const Array& params, bool fHelp)
 
     return ret;
 }
- 
+
+Value getmessagestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmessagestats\n"
+            "Returns the depth of the message handler queues and the time spent handling each message command.");
+
+    map<string, CMessageTimeStats> mapTimes;
+    CMessageQueueStats statsWorker, statsValidation;
+    int nWorkers = GetMessageStats(mapTimes, statsWorker, statsValidation);
+
+    Object ret;
+    ret.push_back(Pair("workers", nWorkers));
+
+    Object objWorker;
+    objWorker.push_back(Pair("depth", (int)statsWorker.nDepth));
+    objWorker.push_back(Pair("peak", (int)statsWorker.nPeakDepth));
+    ret.push_back(Pair("workerqueue", objWorker));
+
+    Object objValidation;
+    objValidation.push_back(Pair("depth", (int)statsValidation.nDepth));
+    objValidation.push_back(Pair("peak", (int)statsValidation.nPeakDepth));
+    ret.push_back(Pair("validationqueue", objValidation));
+
+    Object objCommands;
+    BOOST_FOREACH(const PAIRTYPE(string, CMessageTimeStats)& item, mapTimes)
+    {
+        const CMessageTimeStats& stats = item.second;
+        Object obj;
+        obj.push_back(Pair("count", (boost::int64_t)stats.nCount));
+        obj.push_back(Pair("totalus", (boost::int64_t)stats.nTotalMicros));
+        obj.push_back(Pair("avgus", (boost::int64_t)(stats.nCount ? stats.nTotalMicros / (int64_t)stats.nCount : 0)));
+        obj.push_back(Pair("maxus", (boost::int64_t)stats.nMaxMicros));
+        objCommands.push_back(Pair(item.first, obj));
+    }
+    ret.push_back(Pair("commands", objCommands));
+
+    return ret;
+}
+
 // DeepOnion: send alert.
 // There is a known deadlock situation with ThreadMessageHandler
 // ThreadMessageHandler: holds cs_vSend and acquiring cs_main in SendMessages()
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "base58.h"
 #include "bitcoinrpc.h"
@@ -69,6 +70,12 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         vin.push_back(in);
     }
     entry.push_back(Pair("vin", vin));
+    // Spenders of the outputs of a confirmed transaction, one spent index read each.
+    // The db is only opened when there is a spent index to read.
+    boost::scoped_ptr<CTxDB> ptxdb;
+    if (fSpentIndex && hashBlock != 0)
+        ptxdb.reset(new CTxDB("r"));
+    uint256 hashTx = tx.GetHash();
     Array vout;
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
@@ -79,6 +86,13 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         Object o;
         ScriptPubKeyToJSON(txout.scriptPubKey, o, false);
         out.push_back(Pair("scriptPubKey", o));
+        CSpentIndexValue spent;
+        if (ptxdb && ptxdb->ReadSpentIndex(COutPoint(hashTx, i), spent))
+        {
+            out.push_back(Pair("spentTxId", spent.txhash.GetHex()));
+            out.push_back(Pair("spentIndex", (boost::int64_t)spent.nInput));
+            out.push_back(Pair("spentHeight", spent.nHeight));
+        }
         vout.push_back(out);
     }
     entry.push_back(Pair("vout", vout));
@@ -137,7 +151,7 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
-Value listunspent(const Array& params, bool fHelp)
+void listunspent(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -173,9 +187,9 @@ Value listunspent(const Array& params, bool fHelp)
         }
     }
 
-    Array results;
     vector<COutput> vecOutputs;
     pwalletMain->AvailableCoins(vecOutputs, false);
+    writer.BeginArray();
     BOOST_FOREACH(const COutput& out, vecOutputs)
     {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
@@ -206,10 +220,14 @@ Value listunspent(const Array& params, bool fHelp)
         entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
         entry.push_back(Pair("amount",ValueFromAmount(nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        writer.WriteValue(entry);
     }
+    writer.EndArray();
+}
 
-    return results;
+Value listunspent(const Array& params, bool fHelp)
+{
+    return StreamedValue(listunspent, params, fHelp);
 }
 
 Value createrawtransaction(const Array& params, bool fHelp)
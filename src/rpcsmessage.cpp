@@ -77,6 +77,19 @@ Value smsgoptions(const Array& params, bool fHelp)
     {
         result.push_back(Pair("option", std::string("newAddressRecv = ") + (smsgOptions.fNewAddressRecv ? "true" : "false")));
         result.push_back(Pair("option", std::string("newAddressAnon = ") + (smsgOptions.fNewAddressAnon ? "true" : "false")));
+        result.push_back(Pair("option", std::string("compressHigh = ") + (smsgOptions.fCompressHigh ? "true" : "false")));
+        
+        uint32_t nSize, nMaxSize;
+        uint64_t nHits, nMisses;
+        SecureMsgPKCacheStats(nSize, nMaxSize, nHits, nMisses);
+        Object objC;
+        objC.push_back(Pair("keys", (uint64_t)nSize));
+        objC.push_back(Pair("max keys", (uint64_t)nMaxSize));
+        objC.push_back(Pair("hits", nHits));
+        objC.push_back(Pair("misses", nMisses));
+        if (nHits + nMisses > 0)
+            objC.push_back(Pair("hit rate", (double)nHits / (nHits + nMisses)));
+        result.push_back(Pair("public key cache", objC));
         
         result.push_back(Pair("result", "Success."));
     } else
@@ -124,6 +137,22 @@ Value smsgoptions(const Array& params, bool fHelp)
             };
             result.push_back(Pair("set option", std::string("newAddressAnon = ") + (smsgOptions.fNewAddressAnon ? "true" : "false")));
         } else
+        if (optname == "compressHigh")
+        {
+            if (value == "+" || value == "on"  || value == "true"  || value == "1")
+            {
+                smsgOptions.fCompressHigh = true;
+            } else
+            if (value == "-" || value == "off" || value == "false" || value == "0")
+            {
+                smsgOptions.fCompressHigh = false;
+            } else
+            {
+                result.push_back(Pair("result", "Unknown value."));
+                return result;
+            };
+            result.push_back(Pair("set option", std::string("compressHigh = ") + (smsgOptions.fCompressHigh ? "true" : "false")));
+        } else
         {
             result.push_back(Pair("result", "Option not found."));
             return result;
@@ -346,16 +375,26 @@ Value smsglocalkeys(const Array& params, bool fHelp)
 
 Value smsgscanchain(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "smsgscanchain \n"
-            "Look for public keys in the block chain.");
+            "smsgscanchain [full]\n"
+            "Look for public keys in the block chain.\n"
+            "Carries on from the last block scanned, full starts again from the genesis block.");
     
     if (!fSecMsgEnabled)
         throw runtime_error("Secure messaging is disabled.");
     
+    bool fFull = false;
+    if (params.size() > 0)
+    {
+        std::string mode = params[0].get_str();
+        if (mode != "full")
+            throw runtime_error("Unknown mode, expected full.");
+        fFull = true;
+    };
+    
     Object result;
-    if (!SecureMsgScanBlockChain())
+    if (!SecureMsgScanBlockChain(fFull))
     {
         result.push_back(Pair("result", "Scan Chain Failed."));
     } else
@@ -562,12 +601,30 @@ Value smsgsendanon(const Array& params, bool fHelp)
     return result;
 }
 
+// count, from and since parameters of smsginbox and smsgoutbox
+static void GetPageParams(const Array& params, int& nCount, int& nFrom, int64_t& nSince)
+{
+    nCount = 0;
+    nFrom = 0;
+    nSince = 0;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    if (params.size() > 2)
+        nFrom = params[2].get_int();
+    if (params.size() > 3)
+        nSince = params[3].get_int64();
+    
+    if (nCount < 0 || nFrom < 0 || nSince < 0)
+        throw runtime_error("count, from and since must not be negative.");
+};
+
 Value smsginbox(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (fHelp || params.size() > 4) // defaults to read
         throw runtime_error(
-            "smsginbox [all|unread|clear]\n" 
-            "Decrypt and display all received messages.\n"
+            "smsginbox [all|unread|clear] [count=0] [from=0] [since=0]\n" 
+            "Decrypt and display received messages, oldest first.\n"
+            "Shows at most count messages (0 for all) sent at or after unix time since, skipping the first from of them.\n"
             "Warning: clear will delete all messages.");
     
     if (!fSecMsgEnabled)
@@ -582,13 +639,12 @@ Value smsginbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     }
     
+    int nCount, nFrom;
+    int64_t nSince;
+    GetPageParams(params, nCount, nFrom, nSince);
     
     Object result;
     
-    std::vector<unsigned char> vchKey;
-    vchKey.resize(16);
-    memset(&vchKey[0], 0, 16);
-    
     {
         LOCK(cs_smsgDB);
         
@@ -615,6 +671,7 @@ Value smsginbox(const Array& params, bool fHelp)
             };
             delete it;
             dbInbox.TxnCommit();
+            SecureMsgClearPlainCache();
             
             snprintf(cbuf, sizeof(cbuf), "Deleted %u messages.", nMessages);
             result.push_back(Pair("result", std::string(cbuf)));
@@ -626,18 +683,33 @@ Value smsginbox(const Array& params, bool fHelp)
             
             SecMsgStored smsgStored;
             MessageData msg;
+            int nSkipped = 0;
+            bool fMore = false;
             
             dbInbox.TxnBegin();
             
+            // -- keys are in order of time sent, only the page asked for is decrypted
             leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
+            dbInbox.SeekSmesg(it, sPrefix, nSince);
             while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
                 if (fCheckReadStatus
                     && !(smsgStored.status & SMSG_MASK_UNREAD))
                     continue;
                 
-                uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
-                if (SecureMsgDecrypt(false, smsgStored.sAddrTo, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
+                if (nSkipped < nFrom)
+                {
+                    nSkipped++;
+                    continue;
+                };
+                
+                if (nCount > 0 && nMessages >= (uint32_t)nCount)
+                {
+                    fMore = true;
+                    break;
+                };
+                
+                if (SecureMsgDecryptStored(chKey, smsgStored.sAddrTo, smsgStored, msg) == 0)
                 {
                     Object objM;
                     objM.push_back(Pair("received", getTimeString(smsgStored.timeReceived, cbuf, sizeof(cbuf))));
@@ -664,6 +736,8 @@ Value smsginbox(const Array& params, bool fHelp)
             
             snprintf(cbuf, sizeof(cbuf), "%u messages shown.", nMessages);
             result.push_back(Pair("result", std::string(cbuf)));
+            if (nCount > 0)
+                result.push_back(Pair("more", fMore));
             
         } else
         {
@@ -677,10 +751,11 @@ Value smsginbox(const Array& params, bool fHelp)
 
 Value smsgoutbox(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (fHelp || params.size() > 4) // defaults to read
         throw runtime_error(
-            "smsgoutbox [all|clear]\n" 
-            "Decrypt and display all sent messages.\n"
+            "smsgoutbox [all|clear] [count=0] [from=0] [since=0]\n" 
+            "Decrypt and display sent messages, oldest first.\n"
+            "Shows at most count messages (0 for all) sent at or after unix time since, skipping the first from of them.\n"
             "Warning: clear will delete all sent messages.");
     
     if (!fSecMsgEnabled)
@@ -695,6 +770,9 @@ Value smsgoutbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     }
     
+    int nCount, nFrom;
+    int64_t nSince;
+    GetPageParams(params, nCount, nFrom, nSince);
     
     Object result;
     
@@ -725,6 +803,7 @@ Value smsgoutbox(const Array& params, bool fHelp)
             };
             delete it;
             dbOutbox.TxnCommit();
+            SecureMsgClearPlainCache();
             
             
             snprintf(cbuf, sizeof(cbuf), "Deleted %u messages.", nMessages);
@@ -734,12 +813,26 @@ Value smsgoutbox(const Array& params, bool fHelp)
         {
             SecMsgStored smsgStored;
             MessageData msg;
+            int nSkipped = 0;
+            bool fMore = false;
+            
             leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+            dbOutbox.SeekSmesg(it, sPrefix, nSince);
             while (dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
-                uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
+                if (nSkipped < nFrom)
+                {
+                    nSkipped++;
+                    continue;
+                };
+                
+                if (nCount > 0 && nMessages >= (uint32_t)nCount)
+                {
+                    fMore = true;
+                    break;
+                };
                 
-                if (SecureMsgDecrypt(false, smsgStored.sAddrOutbox, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
+                if (SecureMsgDecryptStored(chKey, smsgStored.sAddrOutbox, smsgStored, msg) == 0)
                 {
                     Object objM;
                     objM.push_back(Pair("sent", getTimeString(msg.timestamp, cbuf, sizeof(cbuf))));
@@ -758,6 +851,8 @@ Value smsgoutbox(const Array& params, bool fHelp)
             
             snprintf(cbuf, sizeof(cbuf), "%u sent messages shown.", nMessages);
             result.push_back(Pair("result", std::string(cbuf)));
+            if (nCount > 0)
+                result.push_back(Pair("more", fMore));
         } else
         {
             result.push_back(Pair("result", "Unknown Mode."));
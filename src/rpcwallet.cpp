@@ -1121,7 +1121,7 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+void listtransactions(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -1143,6 +1143,11 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
+    // Entries are turned into text as soon as they are made, so only the
+    // entries of one wallet transaction exist as a tree at any time
+    vector<string> vEntries;
+    CJSONStringSink sinkEntry;
+    CJSONWriter writerEntry(sinkEntry);
     Array ret;
 
     std::list<CAccountingEntry> acentries;
@@ -1151,6 +1156,7 @@ Value listtransactions(const Array& params, bool fHelp)
     // iterate backwards until we have nCount items to return:
     for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
+        ret.clear();
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
             ListTransactions(*pwtx, strAccount, 0, true, ret);
@@ -1158,28 +1164,34 @@ Value listtransactions(const Array& params, bool fHelp)
         if (pacentry != 0)
             AcentryToJSON(*pacentry, strAccount, ret);
 
-        if ((int)ret.size() >= (nCount + nFrom))
+        BOOST_FOREACH(const Value& entry, ret)
+        {
+            writerEntry.WriteValue(entry);
+            writerEntry.Flush();
+            vEntries.push_back(string());
+            vEntries.back().swap(sinkEntry.str);
+        }
+
+        if ((int)vEntries.size() >= (nCount + nFrom))
             break;
     }
-    // ret is newest to oldest
-
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom + nCount);
-
-    if (last != ret.end())
-        ret.erase(last, ret.end());
-    if (first != ret.begin())
-        ret.erase(ret.begin(), first);
-
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
+    // vEntries is newest to oldest
+
+    if (nFrom > (int)vEntries.size())
+        nFrom = vEntries.size();
+    if ((nFrom + nCount) > (int)vEntries.size())
+        nCount = vEntries.size() - nFrom;
+
+    // Return oldest to newest
+    writer.BeginArray();
+    for (int i = nFrom + nCount - 1; i >= nFrom; i--)
+        writer.Raw(vEntries[i]);
+    writer.EndArray();
+}
 
-    return ret;
+Value listtransactions(const Array& params, bool fHelp)
+{
+    return StreamedValue(listtransactions, params, fHelp);
 }
 
 Value listaccounts(const Array& params, bool fHelp)
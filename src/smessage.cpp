@@ -10,7 +10,15 @@ Notes:
     parameters:
         -nosmsg             Disable secure messaging (fNoSmsg)
         -debugsmsg          Show extra debug messages (fDebug)
-        -smsgscanchain      Scan the block chain for public key addresses on startup
+        -smsgscanchain      Scan the block chain for public key addresses on startup, from the last block scanned
+    
+    
+    Message Store
+        Messages are kept per bucket in segment files with a token index, see smsgstore.cpp
+    
+    
+    Bucket Reconciliation
+        Peers at SMSG_RECON_VERSION exchange only the tokens that differ, see smsgrecon.cpp
     
     
     Wallet Locked
@@ -28,10 +36,14 @@ Notes:
 */
 
 #include "smessage.h"
+#include "smsgstore.h"
+#include "smsgrecon.h"
+#include "smsgcompress.h"
 
 #include <stdint.h>
 #include <time.h>
 #include <map>
+#include <queue>
 #include <stdexcept>
 #include <sstream>
 #include <errno.h>
@@ -47,10 +59,14 @@ Notes:
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include "base58.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h" // pwalletMain
+#include "lrucache.h"
 #include "txdb.h"
 
 #include "lz4/lz4.c"
@@ -93,6 +109,12 @@ CCriticalSection cs_smsgDB;
 
 leveldb::DB *smsgDB = NULL;
 
+// -- public keys read from the db, keys are never removed from the db so entries don't go stale
+static lrucache<CKeyID, CPubKey> smsgPKCache(SMSG_PK_CACHE_SIZE);
+static uint64_t nPKCacheHits = 0;
+static uint64_t nPKCacheMisses = 0;
+static CCriticalSection cs_smsgPKCache;
+
 namespace fs = boost::filesystem;
 
 bool SecMsgCrypter::SetKey(const std::vector<unsigned char> &vchNewKey, unsigned char *chNewIV)
@@ -197,6 +219,74 @@ void SecMsgBucket::hashBucket()
         printf("Hashed %" PRIszu " messages, hash %u\n", setTokens.size(), hash);
 };
 
+void SecureMsgDbKey(const char *pszPrefix, int64_t timestamp, const unsigned char *pSample, unsigned char *chKey)
+{
+    memcpy(&chKey[0], pszPrefix, 2);
+    for (int i = 0; i < 8; ++i)
+        chKey[2 + i] = (timestamp >> (56 - 8 * i)) & 0xFF;
+    memcpy(&chKey[10], pSample, 8);
+};
+
+static void SecureMsgUpgradeDB(leveldb::DB *pdb)
+{
+    // -- rewrite message keys made before SMSG_DB_VERSION 1, which held the time little endian
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'd';
+    ssKey << 'v';
+
+    int nVersion = 0;
+    std::string strValue;
+    if (pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue).ok())
+    {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> nVersion;
+    };
+
+    if (nVersion >= SMSG_DB_VERSION)
+        return;
+
+    leveldb::WriteBatch batch;
+    uint32_t nMessages = 0;
+    const char *aPrefix[] = {"im", "sm", "qm"};
+
+    leveldb::Iterator *it = pdb->NewIterator(leveldb::ReadOptions());
+    for (unsigned int p = 0; p < sizeof(aPrefix) / sizeof(aPrefix[0]); ++p)
+    {
+        for (it->Seek(aPrefix[p]); it->Valid(); it->Next())
+        {
+            leveldb::Slice key = it->key();
+            if (key.size() != 18 || memcmp(key.data(), aPrefix[p], 2) != 0)
+                break;
+
+            int64_t timestamp;
+            memcpy(&timestamp, key.data() + 2, 8);
+            unsigned char chKey[18];
+            SecureMsgDbKey(aPrefix[p], timestamp, (const unsigned char *)key.data() + 10, chKey);
+
+            batch.Delete(key);
+            batch.Put(leveldb::Slice((const char *)chKey, 18), it->value());
+            nMessages++;
+        };
+    };
+    delete it;
+
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << SMSG_DB_VERSION;
+    batch.Put(ssKey.str(), ssValue.str());
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
+    if (!s.ok())
+    {
+        printf("SecMsgDB upgrade failure: %s\n", s.ToString().c_str());
+        return;
+    };
+
+    if (nMessages > 0)
+        printf("Upgraded keys of %u stored messages to db version %d.\n", nMessages, SMSG_DB_VERSION);
+};
+
 bool SecMsgDB::Open(const char *pszMode)
 {
     if (smsgDB)
@@ -225,6 +315,8 @@ bool SecMsgDB::Open(const char *pszMode)
         return false;
     };
 
+    SecureMsgUpgradeDB(smsgDB);
+
     pdb = smsgDB;
 
     return true;
@@ -320,11 +412,23 @@ bool SecMsgDB::TxnAbort()
     return true;
 };
 
+static bool SecureMsgCachedPK(const CKeyID &addr, CPubKey &pubkey)
+{
+    LOCK(cs_smsgPKCache);
+    if (!smsgPKCache.get(addr, pubkey))
+        return false;
+    nPKCacheHits++;
+    return true;
+};
+
 bool SecMsgDB::ReadPK(CKeyID &addr, CPubKey &pubkey)
 {
     if (!pdb)
         return false;
 
+    if (SecureMsgCachedPK(addr, pubkey))
+        return true;
+
     CDataStream ssKey(SER_DISK, CLIENT_VERSION);
     ssKey.reserve(sizeof(addr) + 2);
     ssKey << 'p';
@@ -344,6 +448,10 @@ bool SecMsgDB::ReadPK(CKeyID &addr, CPubKey &pubkey)
 
     if (readFromDb)
     {
+        {
+            LOCK(cs_smsgPKCache);
+            nPKCacheMisses++;
+        }
         leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
         if (!s.ok())
         {
@@ -356,7 +464,7 @@ bool SecMsgDB::ReadPK(CKeyID &addr, CPubKey &pubkey)
 
     try
     {
-        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        CSpanStream ssValue(strValue, SER_DISK, CLIENT_VERSION);
         ssValue >> pubkey;
     }
     catch (std::exception &e)
@@ -365,6 +473,13 @@ bool SecMsgDB::ReadPK(CKeyID &addr, CPubKey &pubkey)
         return false;
     }
 
+    // -- only committed keys are cached, a batch may still be aborted
+    if (readFromDb)
+    {
+        LOCK(cs_smsgPKCache);
+        smsgPKCache.insert(std::make_pair(addr, pubkey));
+    };
+
     return true;
 };
 
@@ -405,6 +520,13 @@ bool SecMsgDB::ExistsPK(CKeyID &addr)
     if (!pdb)
         return false;
 
+    {
+        // -- count() leaves the order alone, the chain scan probes many keys that are never sent to
+        LOCK(cs_smsgPKCache);
+        if (smsgPKCache.count(addr))
+            return true;
+    }
+
     CDataStream ssKey(SER_DISK, CLIENT_VERSION);
     ssKey.reserve(sizeof(addr) + 2);
     ssKey << 'p';
@@ -425,6 +547,83 @@ bool SecMsgDB::ExistsPK(CKeyID &addr)
     return s.IsNotFound() == false;
 };
 
+bool SecMsgDB::ReadChainScan(int &nHeight, uint256 &hashBlock)
+{
+    // -- last block ScanChainForPublicKeys got through
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'c';
+    ssKey << 's';
+    std::string strValue;
+
+    bool readFromDb = true;
+    if (activeBatch)
+    {
+        bool deleted = false;
+        readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted)
+            return false;
+    };
+
+    if (readFromDb)
+    {
+        leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+        if (!s.ok())
+        {
+            if (s.IsNotFound())
+                return false;
+            printf("LevelDB read failure: %s\n", s.ToString().c_str());
+            return false;
+        };
+    };
+
+    try
+    {
+        CSpanStream ssValue(strValue, SER_DISK, CLIENT_VERSION);
+        ssValue >> nHeight;
+        ssValue >> hashBlock;
+    }
+    catch (std::exception &e)
+    {
+        printf("SecMsgDB::ReadChainScan() unserialize threw: %s.\n", e.what());
+        return false;
+    }
+
+    return true;
+};
+
+bool SecMsgDB::WriteChainScan(int nHeight, uint256 &hashBlock)
+{
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'c';
+    ssKey << 's';
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << nHeight;
+    ssValue << hashBlock;
+
+    if (activeBatch)
+    {
+        activeBatch->Put(ssKey.str(), ssValue.str());
+        return true;
+    };
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    if (!s.ok())
+    {
+        printf("SecMsgDB write failure: %s\n", s.ToString().c_str());
+        return false;
+    };
+
+    return true;
+};
+
 bool SecMsgDB::NextSmesg(leveldb::Iterator *it, std::string &prefix, unsigned char *chKey, SecMsgStored &smsgStored)
 {
     if (!pdb)
@@ -442,7 +641,7 @@ bool SecMsgDB::NextSmesg(leveldb::Iterator *it, std::string &prefix, unsigned ch
 
     try
     {
-        CDataStream ssValue(it->value().data(), it->value().data() + it->value().size(), SER_DISK, CLIENT_VERSION);
+        CSpanStream ssValue(it->value().data(), it->value().data() + it->value().size(), SER_DISK, CLIENT_VERSION);
         ssValue >> smsgStored;
     }
     catch (std::exception &e)
@@ -472,6 +671,21 @@ bool SecMsgDB::NextSmesgKey(leveldb::Iterator *it, std::string &prefix, unsigned
     return true;
 };
 
+void SecMsgDB::SeekSmesg(leveldb::Iterator *it, std::string &prefix, int64_t nSince)
+{
+    // -- position it so the next NextSmesg or NextSmesgKey returns the first message under prefix sent at or after nSince
+    unsigned char chKey[18];
+    unsigned char sample[8];
+    memset(sample, 0, 8);
+    SecureMsgDbKey(prefix.data(), nSince, sample, chKey);
+
+    it->Seek(leveldb::Slice((const char *)chKey, 18));
+    if (it->Valid())
+        it->Prev(); // left invalid if nothing sorts before chKey, the next call then seeks to prefix
+    else
+        it->SeekToLast();
+};
+
 bool SecMsgDB::ReadSmesg(unsigned char *chKey, SecMsgStored &smsgStored)
 {
     if (!pdb)
@@ -505,7 +719,7 @@ bool SecMsgDB::ReadSmesg(unsigned char *chKey, SecMsgStored &smsgStored)
 
     try
     {
-        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        CSpanStream ssValue(strValue, SER_DISK, CLIENT_VERSION);
         ssValue >> smsgStored;
     }
     catch (std::exception &e)
@@ -589,118 +803,102 @@ bool SecMsgDB::EraseSmesg(unsigned char *chKey)
     return false;
 };
 
-void ThreadSecureMsg(void *parg)
+// -- buckets waiting for the messages asked for in an smsgWant, soonest timeout first.
+//    Entries are left in place when a lock is released early, they are skipped when they
+//    no longer match the bucket's lock.
+typedef std::pair<int64_t, int64_t> SecMsgLockTimeout; // timeLockExpires, bucket
+static std::priority_queue<SecMsgLockTimeout, std::vector<SecMsgLockTimeout>, std::greater<SecMsgLockTimeout> > smsgLockTimeouts;
+
+void SecureMsgLockBucket(int64_t bucket, SecMsgBucket &smsgBucket, uint32_t nPeerId, int64_t now)
 {
-    // -- bucket management thread
-    RenameThread("shadowcoin-smsg"); // Make this thread recognisable
+    // -- should have LOCK(cs_smsg)
+    smsgBucket.timeLockExpires = now + SMSG_LOCK_TIMEOUT;
+    smsgBucket.nLockPeerId = nPeerId;
+    smsgLockTimeouts.push(std::make_pair(smsgBucket.timeLockExpires, bucket));
+};
 
-    uint32_t delay = 0;
+void SecureMsgExpire(int64_t now)
+{
+    /*  Remove buckets past SMSG_RETENTION and time out bucket locks that are due.
+        Only the due items are touched, smsgBuckets is ordered by time so expired
+        buckets are at the front.
+    */
+    int64_t cutoffTime = now - SMSG_RETENTION;
 
-    while (fSecMsgEnabled)
+    std::vector<uint32_t> vTimedOut;
+    std::vector<fs::path> vDetached;
     {
-        // shutdown thread waits 5 seconds, this should be less
-        MilliSleep(1000); // milliseconds
+        LOCK(cs_smsg);
+        // -- the files are renamed with the bucket under cs_smsg, so a store to the bucket
+        //    starts a new segment, and are unlinked once the lock is released
+        while (!smsgBuckets.empty() && smsgBuckets.begin()->first < cutoffTime)
+        {
+            int64_t bucket = smsgBuckets.begin()->first;
+            smsgBuckets.erase(smsgBuckets.begin());
 
-        if (!fSecMsgEnabled) // check again after sleep
-            break;
+            if (fDebug)
+                printf("Removing bucket %" PRId64 " \n", bucket);
+            SecureMsgSegmentDetach(bucket, vDetached);
+        };
 
-        delay++;
-        if (delay < SMSG_THREAD_DELAY) // check every SMSG_THREAD_DELAY seconds
-            continue;
-        delay = 0;
+        while (!smsgLockTimeouts.empty() && smsgLockTimeouts.top().first <= now)
+        {
+            SecMsgLockTimeout timeout = smsgLockTimeouts.top();
+            smsgLockTimeouts.pop();
 
-        int64_t now = GetTime();
+            std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.find(timeout.second);
+            if (it == smsgBuckets.end()
+                || it->second.timeLockExpires != timeout.first) // released, or locked again since
+                continue;
 
-        if (fDebug)
-            printf("SecureMsgThread %" PRId64 " \n", now);
+            if (fDebug)
+                printf("Lock on bucket %" PRId64 " for peer %u timed out.\n", it->first, it->second.nLockPeerId);
+            vTimedOut.push_back(it->second.nLockPeerId);
+            it->second.timeLockExpires = 0;
+            it->second.nLockPeerId = 0;
+        };
+    }; // LOCK(cs_smsg);
 
-        int64_t cutoffTime = now - SMSG_RETENTION;
+    SecureMsgRemoveDetached(vDetached);
 
-        {
-            LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
+    if (vTimedOut.empty())
+        return;
 
-            while (it != smsgBuckets.end())
-            {
-                //if (fDebug)
-                //    printf("Checking bucket %"PRId64", size %"PRIszu" \n", it->first, it->second.setTokens.size());
-                if (it->first < cutoffTime)
-                {
-                    if (fDebug)
-                        printf("Removing bucket %" PRId64 " \n", it->first);
-                    std::string fileName = boost::lexical_cast<std::string>(it->first) + "_01.dat";
-                    fs::path fullPath = GetDataDir() / "smsgStore" / fileName;
-                    if (fs::exists(fullPath))
-                    {
-                        try
-                        {
-                            fs::remove(fullPath);
-                        }
-                        catch (const fs::filesystem_error &ex)
-                        {
-                            printf("Error removing bucket file %s.\n", ex.what());
-                        };
-                    }
-                    else
-                        printf("Path %s does not exist \n", fullPath.string().c_str());
+    // -- ignore the peers that failed to send the data they were asked for
+    int64_t ignoreUntil = now + SMSG_TIME_IGNORE;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode *pnode, vNodes)
+    {
+        if (std::find(vTimedOut.begin(), vTimedOut.end(), pnode->smsgData.nPeerId) == vTimedOut.end())
+            continue;
+        pnode->smsgData.ignoreUntil = ignoreUntil;
 
-                    // -- look for a wl file, it stores incoming messages when wallet is locked
-                    fileName = boost::lexical_cast<std::string>(it->first) + "_01_wl.dat";
-                    fullPath = GetDataDir() / "smsgStore" / fileName;
-                    if (fs::exists(fullPath))
-                    {
-                        try
-                        {
-                            fs::remove(fullPath);
-                        }
-                        catch (const fs::filesystem_error &ex)
-                        {
-                            printf("Error removing wallet locked file %s.\n", ex.what());
-                        };
-                    };
+        // -- alert peer that they are being ignored
+        std::vector<unsigned char> vchData;
+        vchData.resize(8);
+        memcpy(&vchData[0], &ignoreUntil, 8);
+        pnode->PushMessage("smsgIgnore", vchData);
 
-                    smsgBuckets.erase(it++);
-                }
-                else
-                {
-                    // -- tick down nLockCount, so will eventually expire if peer never sends data
-                    if (it->second.nLockCount > 0)
-                    {
-                        it->second.nLockCount--;
+        if (fDebug)
+            printf("This node will ignore peer %u until %" PRId64 ".\n", pnode->smsgData.nPeerId, ignoreUntil);
+    };
+};
 
-                        if (it->second.nLockCount == 0) // lock timed out
-                        {
-                            uint32_t nPeerId = it->second.nLockPeerId;
-                            int64_t ignoreUntil = GetTime() + SMSG_TIME_IGNORE;
-
-                            if (fDebug)
-                                printf("Lock on bucket %" PRId64 " for peer %u timed out.\n", it->first, nPeerId);
-                            // -- look through the nodes for the peer that locked this bucket
-                            LOCK(cs_vNodes);
-                            BOOST_FOREACH (CNode *pnode, vNodes)
-                            {
-                                if (pnode->smsgData.nPeerId != nPeerId)
-                                    continue;
-                                pnode->smsgData.ignoreUntil = ignoreUntil;
-
-                                // -- alert peer that they are being ignored
-                                std::vector<unsigned char> vchData;
-                                vchData.resize(8);
-                                memcpy(&vchData[0], &ignoreUntil, 8);
-                                pnode->PushMessage("smsgIgnore", vchData);
-
-                                if (fDebug)
-                                    printf("This node will ignore peer %u until %" PRId64 ".\n", nPeerId, ignoreUntil);
-                                break;
-                            };
-                            it->second.nLockPeerId = 0;
-                        }; // if (it->second.nLockCount == 0)
-                    };
-                    ++it;
-                }; // ! if (it->first < cutoffTime)
-            };
-        }; // LOCK(cs_smsg);
+void ThreadSecureMsg(void *parg)
+{
+    // -- bucket management thread
+    RenameThread("shadowcoin-smsg"); // Make this thread recognisable
+
+    while (fSecMsgEnabled)
+    {
+        // shutdown thread waits 5 seconds, this should be less
+        MilliSleep(1000); // milliseconds
+
+        if (!fSecMsgEnabled) // check again after sleep
+            break;
+
+        // -- each pass only touches what is due, so locks time out to the second
+        SecureMsgExpire(GetTime());
     };
 
     printf("ThreadSecureMsg exited.\n");
@@ -748,7 +946,8 @@ void ThreadSecureMsgPow(void *parg)
             SecureMessage *psmsg = (SecureMessage *)pHeader;
 
             // -- do proof of work
-            rv = SecureMsgSetHash(pHeader, pPayload, psmsg->nPayload);
+            rv = SecureMsgSetHash(pHeader, pPayload, psmsg->nPayload,
+                                  GetArg("-smsgpowthreads", 0), GetArg("-smsgpowtimeout", 0) * 1000);
             if (rv == 2)
                 break; // /eave message in db, if terminated due to shutdown
 
@@ -832,6 +1031,7 @@ int SecureMsgBuildBucketSet()
     int64_t now = GetTime();
     uint32_t nFiles = 0;
     uint32_t nMessages = 0;
+    uint32_t nRebuilt = 0;
 
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
     fs::directory_iterator itend;
@@ -849,6 +1049,20 @@ int SecureMsgBuildBucketSet()
 
         std::string fileType = (*itd).path().extension().string();
 
+        // -- detached by SecureMsgExpire but not yet removed when the node stopped
+        if (fileType.compare(".del") == 0)
+        {
+            try
+            {
+                fs::remove((*itd).path());
+            }
+            catch (const fs::filesystem_error &ex)
+            {
+                printf("Error removing bucket file %s.\n", ex.what());
+            };
+            continue;
+        };
+
         if (fileType.compare(".dat") != 0)
             continue;
 
@@ -875,6 +1089,8 @@ int SecureMsgBuildBucketSet()
             try
             {
                 fs::remove((*itd).path());
+                if (!boost::algorithm::ends_with(fileName, "_wl.dat"))
+                    fs::remove(SecureMsgSegmentPath(fileTime, true));
             }
             catch (const fs::filesystem_error &ex)
             {
@@ -890,58 +1106,18 @@ int SecureMsgBuildBucketSet()
             continue;
         };
 
-        SecureMessage smsg;
         std::set<SecMsgToken> &tokenSet = smsgBuckets[fileTime].setTokens;
 
         {
             LOCK(cs_smsg);
-            FILE *fp;
-
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            bool fRebuilt;
+            if (SecureMsgSegmentLoad(fileTime, tokenSet, fRebuilt) != 0)
             {
-                printf("Error opening file: %s\n", strerror(errno));
+                printf("Error loading segment: %s\n", fileName.c_str());
                 continue;
             };
-
-            for (;;)
-            {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-
-                if (smsg.nPayload < 8)
-                    continue;
-
-                if (fread(token.sample, sizeof(unsigned char), 8, fp) != 8)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                if (fseek(fp, smsg.nPayload - 8, SEEK_CUR) != 0)
-                {
-                    printf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
-
-                tokenSet.insert(token);
-            };
-
-            fclose(fp);
+            if (fRebuilt)
+                nRebuilt++;
         };
         smsgBuckets[fileTime].hashBucket();
 
@@ -951,7 +1127,7 @@ int SecureMsgBuildBucketSet()
             printf("Bucket %" PRId64 " contains %" PRIszu " messages.\n", fileTime, tokenSet.size());
     };
 
-    printf("Processed %u files, loaded %" PRIszu " buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
+    printf("Processed %u files, loaded %" PRIszu " buckets containing %u messages, rebuilt %u indexes.\n", nFiles, smsgBuckets.size(), nMessages, nRebuilt);
 
     return 0;
 };
@@ -1045,6 +1221,10 @@ int SecureMsgReadIni()
         {
             smsgOptions.fNewAddressAnon = (strcmp(pValue, "true") == 0) ? true : false;
         }
+        else if (strcmp(pName, "compressHigh") == 0)
+        {
+            smsgOptions.fCompressHigh = (strcmp(pValue, "true") == 0) ? true : false;
+        }
         else if (strcmp(pName, "key") == 0)
         {
             int rv = sscanf(pValue, "%64[^|]|%d|%d", cAddress, &addrRecv, &addrRecvAnon);
@@ -1095,7 +1275,8 @@ int SecureMsgWriteIni()
         return false;
     };
 
-    if (fprintf(fp, "newAddressRecv=%s\n", smsgOptions.fNewAddressRecv ? "true" : "false") < 0 || fprintf(fp, "newAddressAnon=%s\n", smsgOptions.fNewAddressAnon ? "true" : "false") < 0)
+    if (fprintf(fp, "newAddressRecv=%s\n", smsgOptions.fNewAddressRecv ? "true" : "false") < 0 || fprintf(fp, "newAddressAnon=%s\n", smsgOptions.fNewAddressAnon ? "true" : "false") < 0
+        || fprintf(fp, "compressHigh=%s\n", smsgOptions.fCompressHigh ? "true" : "false") < 0)
     {
         printf("fprintf error: %s\n", strerror(errno));
         fclose(fp);
@@ -1132,9 +1313,19 @@ int SecureMsgWriteIni()
     return 0;
 };
 
+static void NotifyKeyStoreStatusChanged(CCryptoKeyStore *wallet)
+{
+    // -- no plaintext stays readable after the wallet is locked
+    if (wallet->IsLocked())
+        SecureMsgClearPlainCache();
+};
+
 /** called from AppInit2() in init.cpp */
 bool SecureMsgStart(bool fDontStart, bool fScanChain)
 {
+    // -- connected even when not started, messaging can be enabled at runtime
+    pwalletMain->NotifyStatusChanged.connect(boost::bind(&NotifyKeyStoreStatusChanged, _1));
+
     if (fDontStart)
     {
         printf("Secure messaging not started.\n");
@@ -1145,6 +1336,11 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
 
     fSecMsgEnabled = true;
 
+    {
+        LOCK(cs_smsgPKCache);
+        smsgPKCache.max_size(std::max((int64_t)1, GetArg("-smsgpkcache", SMSG_PK_CACHE_SIZE)));
+    }
+
     if (SecureMsgReadIni() != 0)
         printf("Failed to read smsg.ini\n");
 
@@ -1181,6 +1377,9 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
 /** called from Shutdown() in init.cpp */
 bool SecureMsgShutdown()
 {
+    if (pwalletMain)
+        pwalletMain->NotifyStatusChanged.disconnect(boost::bind(&NotifyKeyStoreStatusChanged, _1));
+
     if (!fSecMsgEnabled)
         return false;
 
@@ -1251,8 +1450,8 @@ bool SecureMsgEnable()
         LOCK(cs_vNodes);
         BOOST_FOREACH (CNode *pnode, vNodes)
         {
-            pnode->PushMessage("smsgPing");
-            pnode->PushMessage("smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
+            pnode->PushMessage("smsgPing", SMSG_PROTOCOL_VERSION);
+            pnode->PushMessage("smsgPong", SMSG_PROTOCOL_VERSION); // Send pong as have missed initial ping sent by peer when it connected
         };
     }
 
@@ -1302,6 +1501,8 @@ bool SecureMsgDisable()
 
     }; // LOCK(cs_smsg);
 
+    SecureMsgClearPlainCache();
+
     // -- allow time for threads to stop
     MilliSleep(3000); // milliseconds
     // TODO be certain that threads have stopped
@@ -1317,11 +1518,11 @@ bool SecureMsgDisable()
     return true;
 };
 
-bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRecv)
+bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CSpanStream &vRecv)
 {
     /*
         Called from ProcessMessage
-        Runs in ThreadMessageHandler2
+        Runs in a message worker thread (ThreadMessageWorker2), without cs_main
     */
 
     if (fDebug)
@@ -1377,6 +1578,7 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
             vchDataOut.reserve(4 + 8 * nInvBuckets); // reserve max possible size
             vchDataOut.resize(4);
             uint32_t nShowBuckets = 0;
+            uint32_t nReconBuckets = 0;
 
             unsigned char *p = &vchData[4];
             for (uint32_t i = 0; i < nInvBuckets; ++i)
@@ -1420,10 +1622,10 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
                     printf("this bucket %" PRId64 " %" PRIszu " %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].hash);
                 };
 
-                if (smsgBuckets[time].nLockCount > 0)
+                if (smsgBuckets[time].timeLockExpires > 0)
                 {
                     if (fDebug)
-                        printf("Bucket is locked %u, waiting for peer %u to send data.\n", smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                        printf("Bucket is locked until %" PRId64 ", waiting for peer %u to send data.\n", smsgBuckets[time].timeLockExpires, smsgBuckets[time].nLockPeerId);
                     nLocked++;
                     continue;
                 };
@@ -1432,6 +1634,19 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
                 //    if then peer node has more this node will pull fom peer
                 if (smsgBuckets[time].setTokens.size() < ncontent || (smsgBuckets[time].setTokens.size() == ncontent && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
                 {
+                    // -- a peer that can reconcile is sent this node's tokens in a table sized
+                    //    for the difference, instead of being asked for all of its own
+                    std::vector<unsigned char> vchRecon;
+                    if (pfrom->smsgData.nVersion >= SMSG_RECON_VERSION
+                        && SecureMsgReconRequest(time, smsgBuckets[time].setTokens, ncontent, vchRecon))
+                    {
+                        if (fDebug)
+                            printf("Reconciling bucket %" PRId64 ", %" PRIszu " bytes.\n", time, vchRecon.size());
+                        pfrom->PushMessage("smsgRecon", vchRecon);
+                        nReconBuckets++;
+                        continue;
+                    };
+
                     if (fDebug)
                         printf("Requesting contents of bucket %" PRId64 ".\n", time);
 
@@ -1449,7 +1664,7 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
             {
                 pfrom->PushMessage("smsgShow", vchDataOut);
             }
-            else if (nLocked < 1) // Don't report buckets as matched if any are locked
+            else if (nLocked < 1 && nReconBuckets < 1) // Don't report buckets as matched if any are locked or being reconciled
             {
                 // -- peer has no buckets we want, don't send them again until something changes
                 //    peer will still request buckets from this node if needed (< ncontent)
@@ -1519,25 +1734,97 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
                 pfrom->PushMessage("smsgHave", vchDataOut);
             };
         }
-        else if (strCommand == "smsgHave")
+        else if (strCommand == "smsgRecon")
         {
-            // -- peer has these messages in bucket
+            // -- peer sent a table of its tokens in a bucket, reply with the difference
             std::vector<unsigned char> vchData;
             vRecv >> vchData;
 
-            if (vchData.size() < 8)
-                return false;
-
-            int n = (vchData.size() - 8) / 16;
-
+            std::map<int64_t, SecMsgBucket>::iterator itb;
+            std::set<SecMsgToken> setEmpty;
             int64_t time;
-            memcpy(&time, &vchData[0], 8);
-
-            // -- Check time valid:
-            int64_t now = GetTime();
-            if (time < now - SMSG_RETENTION)
+            if (vchData.size() >= 8)
             {
-                if (fDebug)
+                memcpy(&time, &vchData[0], 8);
+                itb = smsgBuckets.find(time);
+            };
+            std::set<SecMsgToken> &tokenSet = (vchData.size() < 8 || itb == smsgBuckets.end()) ? setEmpty : itb->second.setTokens;
+
+            std::vector<SecMsgToken> vPeerLacks, vThisLacks;
+            int rv = SecureMsgReconReply(vchData, tokenSet, time, vPeerLacks, vThisLacks);
+            if (rv == 1)
+            {
+                printf("smsgRecon, malformed data %" PRIszu ".\n", vchData.size());
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            // -- Check time valid:
+            int64_t now = GetTime();
+            if (time < now - SMSG_RETENTION)
+            {
+                if (fDebug)
+                    printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
+                return false;
+            };
+            if (time > now + SMSG_TIME_LEEWAY)
+            {
+                if (fDebug)
+                    printf("Not interested in peer bucket %" PRId64 ", in the future.\n", time);
+                pfrom->Misbehaving(1);
+                return false;
+            };
+
+            std::vector<unsigned char> vchDataOut;
+            if (rv == 2)
+            {
+                // -- too different to list, send the whole bucket as for smsgShow
+                if (fDebug)
+                    printf("Could not reconcile bucket %" PRId64 ", sending %" PRIszu " tokens.\n", time, tokenSet.size());
+                if (tokenSet.size() > 0)
+                {
+                    SecureMsgTokenList(time, std::vector<SecMsgToken>(tokenSet.begin(), tokenSet.end()), vchDataOut);
+                    pfrom->PushMessage("smsgHave", vchDataOut);
+                };
+                return true;
+            };
+
+            if (fDebug)
+                printf("Reconciled bucket %" PRId64 ", peer lacks %" PRIszu ", this node lacks %" PRIszu ".\n",
+                       time, vPeerLacks.size(), vThisLacks.size());
+
+            if (vPeerLacks.size() > 0)
+            {
+                SecureMsgTokenList(time, vPeerLacks, vchDataOut);
+                pfrom->PushMessage("smsgHave", vchDataOut);
+            };
+
+            if (vThisLacks.size() > 0 && smsgBuckets[time].timeLockExpires == 0)
+            {
+                SecureMsgTokenList(time, vThisLacks, vchDataOut);
+                SecureMsgLockBucket(time, smsgBuckets[time], pfrom->smsgData.nPeerId, now); // as for smsgHave, unset when peer sends smsgMsg
+                pfrom->PushMessage("smsgWant", vchDataOut);
+            };
+        }
+        else if (strCommand == "smsgHave")
+        {
+            // -- peer has these messages in bucket
+            std::vector<unsigned char> vchData;
+            vRecv >> vchData;
+
+            if (vchData.size() < 8)
+                return false;
+
+            int n = (vchData.size() - 8) / 16;
+
+            int64_t time;
+            memcpy(&time, &vchData[0], 8);
+
+            // -- Check time valid:
+            int64_t now = GetTime();
+            if (time < now - SMSG_RETENTION)
+            {
+                if (fDebug)
                     printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
                 return false;
             };
@@ -1549,10 +1836,10 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
                 return false;
             };
 
-            if (smsgBuckets[time].nLockCount > 0)
+            if (smsgBuckets[time].timeLockExpires > 0)
             {
                 if (fDebug)
-                    printf("Bucket %" PRId64 " lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                    printf("Bucket %" PRId64 " locked until %" PRId64 ", waiting for message data from peer %u.\n", time, smsgBuckets[time].timeLockExpires, smsgBuckets[time].nLockPeerId);
                 return false;
             };
 
@@ -1600,8 +1887,7 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
                     printf("Asking peer for  %" PRIszu " messages.\n", (vchDataOut.size() - 8) / 16);
                     printf("Locking bucket %" PRIszu " for peer %u.\n", time, pfrom->smsgData.nPeerId);
                 };
-                smsgBuckets[time].nLockCount = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
-                smsgBuckets[time].nLockPeerId = pfrom->smsgData.nPeerId;
+                SecureMsgLockBucket(time, smsgBuckets[time], pfrom->smsgData.nPeerId, now); // unset when peer sends smsgMsg
                 pfrom->PushMessage("smsgWant", vchDataOut);
             };
         }
@@ -1613,7 +1899,6 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
             if (vchData.size() < 8)
                 return false;
 
-            std::vector<unsigned char> vchOne;
             std::vector<unsigned char> vchBunch;
 
             vchBunch.resize(4 + 8); // nmessages + bucketTime
@@ -1621,7 +1906,6 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
             int n = (vchData.size() - 8) / 16;
 
             int64_t time;
-            uint32_t nBunch = 0;
             memcpy(&time, &vchData[0], 8);
 
             std::map<int64_t, SecMsgBucket>::iterator itb;
@@ -1635,9 +1919,10 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
 
             std::set<SecMsgToken> &tokenSet = itb->second.setTokens;
             std::set<SecMsgToken>::iterator it;
+            std::vector<SecMsgToken> vWanted;
             SecMsgToken token;
             unsigned char *p = &vchData[8];
-            for (int i = 0; i < n; ++i)
+            for (int i = 0; i < n; ++i, p += 16)
             {
                 memcpy(&token.timestamp, p, 8);
                 memcpy(&token.sample, p + 8, 8);
@@ -1647,34 +1932,14 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
                 {
                     if (fDebug)
                         printf("Don't have wanted message %" PRId64 ".\n", token.timestamp);
-                }
-                else
-                {
-                    //printf("Have message at %"PRId64".\n", it->offset); // DEBUG
-                    token.offset = it->offset;
-                    //printf("winb before SecureMsgRetrieve %"PRId64".\n", token.timestamp);
-
-                    // -- place in vchOne so if SecureMsgRetrieve fails it won't corrupt vchBunch
-                    if (SecureMsgRetrieve(token, vchOne) == 0)
-                    {
-                        nBunch++;
-                        vchBunch.insert(vchBunch.end(), vchOne.begin(), vchOne.end()); // append
-                    }
-                    else
-                    {
-                        printf("SecureMsgRetrieve failed %" PRId64 ".\n", token.timestamp);
-                    };
-
-                    if (nBunch >= 500 || vchBunch.size() >= 96000)
-                    {
-                        if (fDebug)
-                            printf("Break bunch %u, %" PRIszu ".\n", nBunch, vchBunch.size());
-                        break; // end here, peer will send more want messages if needed.
-                    };
+                    continue;
                 };
-                p += 16;
+                vWanted.push_back(*it);
             };
 
+            // -- read from the segment in one go, peer will send more want messages if this stops short
+            uint32_t nBunch = SecureMsgRetrieveBatch(time, vWanted, vchBunch, 500, 96000);
+
             if (nBunch > 0)
             {
                 if (fDebug)
@@ -1727,12 +1992,18 @@ bool SecureMsgReceiveData(CNode *pfrom, std::string strCommand, CDataStream &vRe
         else if (strCommand == "smsgPing")
         {
             // -- smsgPing is the initial message, send reply
-            pfrom->PushMessage("smsgPong");
+            //    older nodes send no version, and ignore the one sent to them
+            if (vRecv.size() >= 4)
+                vRecv >> pfrom->smsgData.nVersion;
+            pfrom->PushMessage("smsgPong", SMSG_PROTOCOL_VERSION);
         }
         else if (strCommand == "smsgPong")
         {
+            if (vRecv.size() >= 4)
+                vRecv >> pfrom->smsgData.nVersion;
+
             if (fDebug)
-                printf("Peer replied, secure messaging enabled.\n");
+                printf("Peer replied, secure messaging enabled, protocol version %u.\n", pfrom->smsgData.nVersion);
 
             pfrom->smsgData.fEnabled = true;
         }
@@ -1795,7 +2066,7 @@ bool SecureMsgSendData(CNode *pto, bool fSendTrickle)
         if (fDebug)
             printf("SecureMsgSendData() new node %s, peer id %u.\n", pto->addrName.c_str(), pto->smsgData.nPeerId);
         // -- Send smsgPing once, do nothing until receive 1st smsgPong (then set fEnabled)
-        pto->PushMessage("smsgPing");
+        pto->PushMessage("smsgPing", SMSG_PROTOCOL_VERSION);
         pto->smsgData.lastSeen = GetTime();
         return true;
     }
@@ -1918,6 +2189,14 @@ static int SecureMsgInsertAddress(CKeyID &hashKey, CPubKey &pubKey, SecMsgDB &ad
 
 int SecureMsgInsertAddress(CKeyID &hashKey, CPubKey &pubKey)
 {
+    CPubKey cpkCheck;
+    if (SecureMsgCachedPK(hashKey, cpkCheck))
+    {
+        if (cpkCheck != pubKey)
+            printf("DB already contains existing public key that does not match .\n");
+        return 4;
+    };
+
     int rv;
     {
         LOCK(cs_smsgDB);
@@ -1931,10 +2210,10 @@ int SecureMsgInsertAddress(CKeyID &hashKey, CPubKey &pubKey)
     return rv;
 };
 
-static bool ScanBlock(CBlock &block, CTxDB &txdb, SecMsgDB &addrpkdb,
-                      uint32_t &nTransactions, uint32_t &nInputs, uint32_t &nPubkeys, uint32_t &nDuplicates)
+static void ExtractPublicKeys(CBlock &block, CTxDB &txdb, std::vector<std::pair<CKeyID, CPubKey> > &vKeys,
+                              uint32_t &nTransactions, uint32_t &nInputs)
 {
-    // -- should have LOCK(cs_smsg) where db is opened
+    // -- no locks needed, runs on the chain scan threads
     BOOST_FOREACH (CTransaction &tx, block.vtx)
     {
         if (!IsStandardTx(tx))
@@ -2014,14 +2293,7 @@ static bool ScanBlock(CBlock &block, CTxDB &txdb, SecMsgDB &addrpkdb,
                         break;
                     };
 
-                    int rv = SecureMsgInsertAddress(hashKey, pubKey, addrpkdb);
-                    if (rv != 0)
-                    {
-                        if (rv == 4)
-                            nDuplicates++;
-                        break;
-                    };
-                    nPubkeys++;
+                    vKeys.push_back(std::make_pair(hashKey, pubKey));
                     break;
                 };
 
@@ -2030,13 +2302,7 @@ static bool ScanBlock(CBlock &block, CTxDB &txdb, SecMsgDB &addrpkdb,
             nInputs++;
         };
         nTransactions++;
-
-        if (nTransactions % 10000 == 0) // for ScanChainForPublicKeys
-        {
-            printf("Scanning transaction no. %u.\n", nTransactions);
-        };
     };
-    return true;
 };
 
 bool SecureMsgScanBlock(CBlock &block)
@@ -2062,8 +2328,17 @@ bool SecureMsgScanBlock(CBlock &block)
         if (!addrpkdb.Open("cw") || !addrpkdb.TxnBegin())
             return false;
 
-        ScanBlock(block, txdb, addrpkdb,
-                  nTransactions, nInputs, nPubkeys, nDuplicates);
+        std::vector<std::pair<CKeyID, CPubKey> > vKeys;
+        ExtractPublicKeys(block, txdb, vKeys, nTransactions, nInputs);
+
+        for (std::vector<std::pair<CKeyID, CPubKey> >::iterator it = vKeys.begin(); it != vKeys.end(); ++it)
+        {
+            int rv = SecureMsgInsertAddress(it->first, it->second, addrpkdb);
+            if (rv == 0)
+                nPubkeys++;
+            else if (rv == 4)
+                nDuplicates++;
+        };
 
         addrpkdb.TxnCommit();
     }
@@ -2074,8 +2349,157 @@ bool SecureMsgScanBlock(CBlock &block)
     return true;
 };
 
+class SecMsgKeyFilter
+{
+    /*
+    Bloom filter over the key ids in the public key db.
+    Key ids are hashes already, their words serve as the hash functions.
+    */
+public:
+    SecMsgKeyFilter(uint32_t nBitsIn)
+    {
+        nBits = nBitsIn;
+        vBits.resize((nBits + 7) / 8, 0);
+    };
+
+    void insert(const CKeyID &keyId)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            uint32_t n = Bit(keyId, i);
+            vBits[n >> 3] |= 1 << (n & 7);
+        };
+    };
+
+    bool contains(const CKeyID &keyId) const
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            uint32_t n = Bit(keyId, i);
+            if (!(vBits[n >> 3] & (1 << (n & 7))))
+                return false;
+        };
+        return true;
+    };
+
+private:
+    uint32_t Bit(const CKeyID &keyId, int i) const
+    {
+        uint32_t n;
+        memcpy(&n, keyId.begin() + i * 4, 4);
+        return n % nBits;
+    };
+
+    std::vector<unsigned char> vBits;
+    uint32_t nBits;
+};
+
+static uint32_t SecureMsgFillKeyFilter(SecMsgDB &addrpkdb, SecMsgKeyFilter &filter)
+{
+    // -- add the key id of every public key in the db, returns the number added
+    CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+    ssStart << 'p';
+    ssStart << 'k';
+    std::string strPrefix = ssStart.str();
+
+    uint32_t nKeys = 0;
+    leveldb::Iterator *it = addrpkdb.pdb->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(strPrefix); it->Valid(); it->Next())
+    {
+        leveldb::Slice key = it->key();
+        if (key.size() < 2 || memcmp(key.data(), strPrefix.data(), 2) != 0)
+            break;
+        if (key.size() != 2 + sizeof(CKeyID))
+            continue;
+
+        CKeyID keyId;
+        memcpy(keyId.begin(), key.data() + 2, sizeof(CKeyID));
+        filter.insert(keyId);
+        nKeys++;
+    };
+    delete it;
+
+    return nKeys;
+};
+
+class SecMsgChainScanBlock
+{
+public:
+    SecMsgChainScanBlock()
+    {
+        nTransactions = 0;
+        nInputs = 0;
+        fFailed = false;
+    };
+
+    std::vector<std::pair<CKeyID, CPubKey> > vKeys;
+    uint32_t nTransactions;
+    uint32_t nInputs;
+    bool fFailed;       // block could not be read, the scan must not be recorded past it
+};
+
+class SecMsgChainScanCheck
+{
+    /*
+    One block to read and take the public keys from on a chain scan thread.
+    The keys are written to a slot of their own, kept in the db afterwards in chain order.
+    */
+private:
+    CBlockIndex *pindex;
+    SecMsgChainScanBlock *pResult;
+
+public:
+    SecMsgChainScanCheck()
+    {
+        pindex = NULL;
+        pResult = NULL;
+    };
+
+    SecMsgChainScanCheck(CBlockIndex *pindexIn, SecMsgChainScanBlock *pResultIn)
+    {
+        pindex = pindexIn;
+        pResult = pResultIn;
+    };
+
+    bool operator()()
+    {
+        try
+        {
+            CTxDB txdb("r");
+            CBlock block;
+            if (!block.ReadFromDisk(pindex, true))
+            {
+                printf("ScanChainForPublicKeys() could not read block at height %d.\n", pindex->nHeight);
+                pResult->fFailed = true;
+                return true;
+            };
+            ExtractPublicKeys(block, txdb, pResult->vKeys, pResult->nTransactions, pResult->nInputs);
+        }
+        catch (std::exception &e)
+        {
+            printf("ScanChainForPublicKeys() block %d threw: %s.\n", pindex->nHeight, e.what());
+            pResult->fFailed = true;
+        };
+        return true;
+    };
+
+    void swap(SecMsgChainScanCheck &check)
+    {
+        std::swap(pindex, check.pindex);
+        std::swap(pResult, check.pResult);
+    };
+};
+
 bool ScanChainForPublicKeys(CBlockIndex *pindexStart)
 {
+    /*
+    Blocks are read and their public keys taken out on -smsgscanthreads threads,
+    SMSG_SCAN_CHAIN_BLOCKS at a time.  New keys are written in one batch per lot
+    together with the height reached, a scan stopped part way resumes from there.
+    A block that can't be read ends the scan, only the blocks before it are recorded.
+    Called with cs_main held.
+    */
+
     printf("Scanning block chain for public keys.\n");
     int64_t nStart = GetTimeMillis();
 
@@ -2090,40 +2514,127 @@ bool ScanChainForPublicKeys(CBlockIndex *pindexStart)
     uint32_t nInputs = 0;
     uint32_t nPubkeys = 0;
     uint32_t nDuplicates = 0;
+    uint32_t nProbes = 0;
+
+    int nThreads = GetArg("-smsgscanthreads", 0);
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, SMSG_MAX_SCAN_THREADS));
 
+    bool fOk = true;
     {
         LOCK(cs_smsgDB);
 
-        CTxDB txdb("r");
-
         SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw") || !addrpkdb.TxnBegin())
+        if (!addrpkdb.Open("cw"))
             return false;
 
+        // -- a key id the filter doesn't hold is not in the db, only the others need looking up
+        SecMsgKeyFilter filter(SMSG_SCAN_CHAIN_FILTER_BITS);
+        uint32_t nKnown = SecureMsgFillKeyFilter(addrpkdb, filter);
+        if (fDebug)
+            printf("%u public keys in db.\n", nKnown);
+
+        CCheckQueue<SecMsgChainScanCheck> queue(4);
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads - 1; ++i)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<SecMsgChainScanCheck>::Thread, &queue));
+
         CBlockIndex *pindex = pindexStart;
-        while (pindex)
+        while (pindex && !fShutdown)
         {
-            nBlocks++;
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
+            std::vector<CBlockIndex *> vBlocks;
+            for (; pindex && vBlocks.size() < SMSG_SCAN_CHAIN_BLOCKS; pindex = pindex->pnext)
+                vBlocks.push_back(pindex);
 
-            ScanBlock(block, txdb, addrpkdb,
-                      nTransactions, nInputs, nPubkeys, nDuplicates);
+            std::vector<SecMsgChainScanBlock> vResults(vBlocks.size());
+            {
+                CCheckQueueControl<SecMsgChainScanCheck> control(&queue);
+                std::vector<SecMsgChainScanCheck> vChecks;
+                vChecks.reserve(vBlocks.size());
+                for (unsigned int i = 0; i < vBlocks.size(); ++i)
+                    vChecks.push_back(SecMsgChainScanCheck(vBlocks[i], &vResults[i]));
+                control.Add(vChecks);
+                control.Wait();
+            }
+
+            // -- blocks after one that failed are not kept, the next scan starts again at it
+            unsigned int nDone = 0;
+            while (nDone < vResults.size() && !vResults[nDone].fFailed)
+                nDone++;
+
+            // -- in chain order, the first public key found for an address is the one kept
+            std::set<CKeyID> setPending;
+            addrpkdb.TxnBegin();
+            for (unsigned int i = 0; i < nDone; ++i)
+            {
+                nBlocks++;
+                nTransactions += vResults[i].nTransactions;
+                nInputs += vResults[i].nInputs;
+
+                std::vector<std::pair<CKeyID, CPubKey> >::iterator it;
+                for (it = vResults[i].vKeys.begin(); it != vResults[i].vKeys.end(); ++it)
+                {
+                    if (filter.contains(it->first))
+                    {
+                        if (setPending.count(it->first))
+                        {
+                            nDuplicates++;
+                            continue;
+                        };
+                        nProbes++;
+                        if (addrpkdb.ExistsPK(it->first))
+                        {
+                            nDuplicates++;
+                            continue;
+                        };
+                    };
+
+                    if (!addrpkdb.WritePK(it->first, it->second))
+                    {
+                        printf("Write pair failed.\n");
+                        continue;
+                    };
+                    filter.insert(it->first);
+                    setPending.insert(it->first);
+                    nPubkeys++;
+                };
+            };
+
+            if (nDone > 0)
+            {
+                uint256 hashLast = vBlocks[nDone - 1]->GetBlockHash();
+                addrpkdb.WriteChainScan(vBlocks[nDone - 1]->nHeight, hashLast);
+            };
+            if (!addrpkdb.TxnCommit())
+            {
+                fOk = false;
+                break;
+            };
 
-            pindex = pindex->pnext;
+            if (nDone < vBlocks.size())
+            {
+                printf("ScanChainForPublicKeys() stopped at height %d.\n", vBlocks[nDone]->nHeight);
+                fOk = false;
+                break;
+            };
+
+            if (nBlocks % (20 * SMSG_SCAN_CHAIN_BLOCKS) == 0)
+                printf("Scanned public keys to height %d.\n", vBlocks.back()->nHeight);
         };
 
-        addrpkdb.TxnCommit();
+        queue.Quit();
+        threadGroup.join_all();
     };
 
     printf("Scanned %u blocks, %u transactions, %u inputs\n", nBlocks, nTransactions, nInputs);
-    printf("Found %u public keys, %u duplicates.\n", nPubkeys, nDuplicates);
+    printf("Found %u public keys, %u duplicates, %u db lookups.\n", nPubkeys, nDuplicates, nProbes);
     printf("Took %" PRId64 " ms\n", GetTimeMillis() - nStart);
 
-    return true;
+    return fOk;
 };
 
-bool SecureMsgScanBlockChain()
+bool SecureMsgScanBlockChain(bool fFull)
 {
     TRY_LOCK(cs_main, lockMain);
     if (lockMain)
@@ -2137,6 +2648,33 @@ bool SecureMsgScanBlockChain()
 
         try
         { // -- in try to catch errors opening db,
+            int nHeight;
+            uint256 hashBlock;
+            bool fResume = false;
+            if (!fFull)
+            {
+                LOCK(cs_smsgDB);
+                SecMsgDB addrpkdb;
+                fResume = addrpkdb.Open("cr+") && addrpkdb.ReadChainScan(nHeight, hashBlock);
+            };
+
+            std::map<uint256, CBlockIndex *>::iterator mi;
+            if (fResume && (mi = mapBlockIndex.find(hashBlock)) != mapBlockIndex.end())
+            {
+                // -- keys from blocks since reorganised away are valid still, carry on from the fork
+                CBlockIndex *pindex = mi->second;
+                while (pindex->pprev && !pindex->IsInMainChain())
+                    pindex = pindex->pprev;
+
+                if (!pindex->pnext)
+                {
+                    printf("Public keys already scanned to height %d.\n", pindex->nHeight);
+                    return true;
+                };
+                pindexScan = pindex->pnext;
+                printf("Resuming public key scan after height %d.\n", pindex->nHeight);
+            };
+
             if (!ScanChainForPublicKeys(pindexScan))
                 return false;
         }
@@ -2164,144 +2702,63 @@ bool SecureMsgScanBuckets()
         return false;
 
     int64_t mStart = GetTimeMillis();
-    int64_t now = GetTime();
     uint32_t nFiles = 0;
     uint32_t nMessages = 0;
     uint32_t nFoundMessages = 0;
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
-
-    if (!fs::exists(pathSmsgDir) || !fs::is_directory(pathSmsgDir))
+    std::vector<int64_t> vBuckets;
     {
-        printf("Message store directory does not exist.\n");
-        return 0; // not an error
-    };
+        LOCK(cs_smsg);
+        std::map<int64_t, SecMsgBucket>::iterator itb;
+        for (itb = smsgBuckets.begin(); itb != smsgBuckets.end(); ++itb)
+            vBuckets.push_back(itb->first);
+    }
 
-    SecureMessage smsg;
-    std::vector<unsigned char> vchData;
+    std::vector<std::vector<unsigned char> > vMessages;
 
-    for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
+    for (std::vector<int64_t>::iterator itv = vBuckets.begin(); itv != vBuckets.end(); ++itv)
     {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
-
-        std::string fileType = (*itd).path().extension().string();
-
-        if (fileType.compare(".dat") != 0)
-            continue;
-
-        std::string fileName = (*itd).path().filename().string();
-
-        if (fDebug)
-            printf("Processing file: %s.\n", fileName.c_str());
-
-        nFiles++;
-
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
-
-        std::string stime = fileName.substr(0, sep);
-
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
-
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            printf("Dropping file %s, expired.\n", fileName.c_str());
-            try
-            {
-                fs::remove((*itd).path());
-            }
-            catch (const fs::filesystem_error &ex)
-            {
-                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
-            continue;
-        };
-
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
-        {
-            if (fDebug)
-                printf("Skipping wallet locked file: %s.\n", fileName.c_str());
-            continue;
-        };
-
         {
+            // -- lock per bucket, ThreadSecureMsg may have expired it in between
             LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                printf("Error opening file: %s\n", strerror(errno));
+            std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(*itv);
+            if (itb == smsgBuckets.end() || itb->second.setTokens.empty())
                 continue;
-            };
 
-            for (;;)
+            SecMsgSegmentReader reader;
+            if (!reader.Open(SecureMsgSegmentPath(*itv, false)))
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try
-                {
-                    vchData.resize(smsg.nPayload);
-                }
-                catch (std::exception &e)
-                {
-                    printf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                }
-                else if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages++;
+                printf("Error opening segment %" PRId64 ".\n", *itv);
+                continue;
             };
 
-            fclose(fp);
+            nFiles++;
 
-            // -- remove wl file when scanned
-            try
-            {
-                fs::remove((*itd).path());
-            }
-            catch (const boost::filesystem::filesystem_error &ex)
+            std::set<SecMsgToken>::iterator it;
+            for (it = itb->second.setTokens.begin(); it != itb->second.setTokens.end(); ++it)
             {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
+                uint32_t nPayload;
+                const unsigned char *p = reader.GetMessage(it->offset, nPayload);
+                if (!p)
+                    continue;
+
+                // -- the mapping is read only and goes with the lock, scan a copy
+                vMessages.push_back(std::vector<unsigned char>(p, p + SMSG_HDR_LEN + nPayload));
             };
+        }
+
+        // -- decrypt without cs_smsg, in batches large enough to keep the scan threads busy
+        if (vMessages.size() >= SMSG_SCAN_BATCH)
+        {
+            nMessages += vMessages.size();
+            nFoundMessages += SecureMsgScanMessages(vMessages, false);
+            vMessages.clear();
         };
     };
 
+    nMessages += vMessages.size();
+    nFoundMessages += SecureMsgScanMessages(vMessages, false);
+
     printf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
     printf("Took %" PRId64 " ms\n", GetTimeMillis() - mStart);
 
@@ -2324,6 +2781,7 @@ int SecureMsgWalletUnlocked()
         return 1;
     };
 
+    int64_t mStart = GetTimeMillis();
     int64_t now = GetTime();
     uint32_t nFiles = 0;
     uint32_t nMessages = 0;
@@ -2338,8 +2796,7 @@ int SecureMsgWalletUnlocked()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<unsigned char> vchData;
+    std::vector<std::vector<unsigned char> > vMessages;
 
     for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
     {
@@ -2382,79 +2839,51 @@ int SecureMsgWalletUnlocked()
         };
 
         {
+            // -- wl files have the layout of a segment, without an index
             LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            SecMsgSegmentReader reader;
+            if (!reader.Open((*itd).path()))
             {
-                printf("Error opening file: %s\n", strerror(errno));
+                printf("Error opening file: %s\n", fileName.c_str());
                 continue;
             };
 
-            for (;;)
+            const unsigned char *p;
+            uint32_t nPayload;
+            int64_t nOffset = 0;
+            while ((p = reader.GetMessage(nOffset, nPayload)) != NULL)
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try
-                {
-                    vchData.resize(smsg.nPayload);
-                }
-                catch (std::exception &e)
-                {
-                    printf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                }
-                else if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages++;
+                vMessages.push_back(std::vector<unsigned char>(p, p + SMSG_HDR_LEN + nPayload));
+                nOffset += SMSG_HDR_LEN + nPayload;
             };
+        }
 
-            fclose(fp);
+        // -- don't report to gui, decrypt without cs_smsg
+        nMessages += vMessages.size();
+        nFoundMessages += SecureMsgScanMessages(vMessages, false);
+        vMessages.clear();
 
-            // -- remove wl file when scanned
-            try
-            {
-                fs::remove((*itd).path());
-            }
-            catch (const boost::filesystem::filesystem_error &ex)
-            {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
+        if (pwalletMain->IsLocked())
+        {
+            // -- locked again part way, keep the file for the next unlock
+            printf("Wallet locked during scan, stopping.\n");
+            return 1;
+        };
+
+        // -- remove wl file when scanned
+        try
+        {
+            fs::remove((*itd).path());
+        }
+        catch (const boost::filesystem::filesystem_error &ex)
+        {
+            printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
+            return 1;
         };
     };
 
     printf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
+    printf("Took %" PRId64 " ms\n", GetTimeMillis() - mStart);
 
     // -- notify gui
     NotifySecMsgWalletUnlocked();
@@ -2497,6 +2926,98 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
     return 0;
 };
 
+static bool SecureMsgMatchMessage(const std::vector<SecMsgAddress> &vAddresses, unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, std::string &addressTo)
+{
+    /*
+    Find the owned address the message is for, trying each in turn.
+    Only reads its arguments and the wallet keys, safe to run on several threads.
+    */
+
+    MessageData msg; // placeholder
+
+    for (std::vector<SecMsgAddress>::const_iterator it = vAddresses.begin(); it != vAddresses.end(); ++it)
+    {
+        if (!it->fReceiveEnabled)
+            continue;
+
+        CBitcoinAddress coinAddress(it->sAddress);
+        addressTo = coinAddress.ToString();
+
+        if (!it->fReceiveAnon)
+        {
+            // -- have to do full decrypt to see address from
+            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
+            {
+                if (fDebug)
+                    printf("Decrypted message with %s.\n", addressTo.c_str());
+
+                return msg.sFromAddress.compare("anon") != 0;
+            };
+        }
+        else
+        {
+            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
+            {
+                if (fDebug)
+                    printf("Decrypted message with %s.\n", addressTo.c_str());
+
+                return true;
+            };
+        }
+    };
+
+    return false;
+};
+
+static int SecureMsgSaveToInbox(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, const std::string &addressTo, bool reportToGui)
+{
+    SecureMessage *psmsg = (SecureMessage *)pHeader;
+    unsigned char chKey[18];
+    SecureMsgDbKey("im", psmsg->timestamp, pPayload, chKey);
+
+    SecMsgStored smsgInbox;
+    smsgInbox.timeReceived = GetTime();
+    smsgInbox.status = (SMSG_MASK_UNREAD)&0xFF;
+    smsgInbox.sAddrTo = addressTo;
+
+    // -- data may not be contiguous
+    try
+    {
+        smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
+    }
+    catch (std::exception &e)
+    {
+        printf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+        return 1;
+    };
+    memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
+    memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
+
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB dbInbox;
+
+        if (dbInbox.Open("cw"))
+        {
+            if (dbInbox.ExistsSmesg(chKey))
+            {
+                if (fDebug)
+                    printf("Message already exists in inbox db.\n");
+            }
+            else
+            {
+                dbInbox.WriteSmesg(chKey, smsgInbox);
+
+                if (reportToGui)
+                    NotifySecMsgInboxChanged(smsgInbox);
+                printf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
+            };
+        };
+    }
+
+    return 0;
+};
+
 int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui)
 {
     /* 
@@ -2529,96 +3050,127 @@ int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32
     };
 
     std::string addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
+    if (SecureMsgMatchMessage(smsgAddresses, pHeader, pPayload, nPayload, addressTo))
+    {
+        // -- save to inbox
+        return SecureMsgSaveToInbox(pHeader, pPayload, nPayload, addressTo, reportToGui);
+    };
 
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    return 0;
+};
+
+class SecMsgScanCheck
+{
+    /*
+    One message to trial decrypt on a scan thread.
+    The result is written to a slot of its own, the checks of a batch can finish in any order.
+    */
+private:
+    const std::vector<SecMsgAddress> *pvAddresses;
+    std::vector<unsigned char> *pvchMessage;
+    std::string *pAddressTo;        // left empty if not for this node
+
+public:
+    SecMsgScanCheck()
+    {
+        pvAddresses = NULL;
+        pvchMessage = NULL;
+        pAddressTo = NULL;
+    };
+
+    SecMsgScanCheck(const std::vector<SecMsgAddress> *pvAddressesIn, std::vector<unsigned char> *pvchMessageIn, std::string *pAddressToIn)
+    {
+        pvAddresses = pvAddressesIn;
+        pvchMessage = pvchMessageIn;
+        pAddressTo = pAddressToIn;
+    };
+
+    bool operator()()
+    {
+        std::vector<unsigned char> &vchMessage = *pvchMessage;
+        SecureMessage *psmsg = (SecureMessage *)&vchMessage[0];
+        std::string addressTo;
+        if (SecureMsgMatchMessage(*pvAddresses, &vchMessage[0], &vchMessage[SMSG_HDR_LEN], psmsg->nPayload, addressTo))
+            *pAddressTo = addressTo;
+        return true;
+    };
+
+    void swap(SecMsgScanCheck &check)
     {
-        if (!it->fReceiveEnabled)
-            continue;
+        std::swap(pvAddresses, check.pvAddresses);
+        std::swap(pvchMessage, check.pvchMessage);
+        std::swap(pAddressTo, check.pAddressTo);
+    };
+};
 
-        CBitcoinAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
+uint32_t SecureMsgScanMessages(std::vector<std::vector<unsigned char> > &vMessages, bool reportToGui)
+{
+    /*
+    Trial decrypt a batch of messages, each header + payload, on -smsgscanthreads threads.
+    The messages for this node are saved to the inbox afterwards, in the order given.
+    Called without cs_smsg, returns the number of messages for this node.
+    */
 
-        if (!it->fReceiveAnon)
-        {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebug)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
+    if (vMessages.empty() || pwalletMain->IsLocked())
+        return 0;
 
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
-        }
-        else
-        {
+    // -- messages too short to hold the payload they claim are left out
+    std::vector<std::vector<unsigned char> *> vpMessages;
+    vpMessages.reserve(vMessages.size());
+    for (std::vector<std::vector<unsigned char> >::iterator it = vMessages.begin(); it != vMessages.end(); ++it)
+    {
+        if (it->size() <= SMSG_HDR_LEN || it->size() - SMSG_HDR_LEN < ((SecureMessage *)&(*it)[0])->nPayload)
+            continue;
+        vpMessages.push_back(&(*it));
+    };
 
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebug)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
+    std::vector<SecMsgAddress> vAddresses;
+    {
+        LOCK(cs_smsg);
+        vAddresses = smsgAddresses;
+    }
 
-                fOwnMessage = true;
-                break;
-            };
-        }
-    };
+    int nThreads = GetArg("-smsgscanthreads", 0);
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, SMSG_MAX_SCAN_THREADS));
 
-    if (fOwnMessage)
+    std::vector<std::string> vAddressTo(vpMessages.size());
     {
-        // -- save to inbox
-        SecureMessage *psmsg = (SecureMessage *)pHeader;
-        std::string sPrefix("im");
-        unsigned char chKey[18];
-        memcpy(&chKey[0], sPrefix.data(), 2);
-        memcpy(&chKey[2], &psmsg->timestamp, 8);
-        memcpy(&chKey[10], pPayload, 8);
-
-        SecMsgStored smsgInbox;
-        smsgInbox.timeReceived = GetTime();
-        smsgInbox.status = (SMSG_MASK_UNREAD)&0xFF;
-        smsgInbox.sAddrTo = addressTo;
-
-        // -- data may not be contiguous
-        try
+        CCheckQueue<SecMsgScanCheck> queue(16);
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads - 1; ++i)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<SecMsgScanCheck>::Thread, &queue));
+
         {
-            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
+            CCheckQueueControl<SecMsgScanCheck> control(&queue);
+            std::vector<SecMsgScanCheck> vChecks;
+            vChecks.reserve(vpMessages.size());
+            for (unsigned int i = 0; i < vpMessages.size(); ++i)
+                vChecks.push_back(SecMsgScanCheck(&vAddresses, vpMessages[i], &vAddressTo[i]));
+            control.Add(vChecks);
+
+            // -- this thread works through the queue too, until it is empty
+            control.Wait();
         }
-        catch (std::exception &e)
-        {
-            printf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
-        };
-        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
-        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
 
-        {
-            LOCK(cs_smsgDB);
-            SecMsgDB dbInbox;
+        queue.Quit();
+        threadGroup.join_all();
+    }
 
-            if (dbInbox.Open("cw"))
-            {
-                if (dbInbox.ExistsSmesg(chKey))
-                {
-                    if (fDebug)
-                        printf("Message already exists in inbox db.\n");
-                }
-                else
-                {
-                    dbInbox.WriteSmesg(chKey, smsgInbox);
+    uint32_t nFound = 0;
+    for (unsigned int i = 0; i < vpMessages.size(); ++i)
+    {
+        if (vAddressTo[i].empty())
+            continue;
 
-                    if (reportToGui)
-                        NotifySecMsgInboxChanged(smsgInbox);
-                    printf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
-                };
-            };
-        }
+        std::vector<unsigned char> &vchMessage = *vpMessages[i];
+        SecureMessage *psmsg = (SecureMessage *)&vchMessage[0];
+        if (SecureMsgSaveToInbox(&vchMessage[0], &vchMessage[SMSG_HDR_LEN], psmsg->nPayload, vAddressTo[i], reportToGui) == 0)
+            nFound++;
     };
 
-    return 0;
+    return nFound;
 };
 
 int SecureMsgGetLocalKey(CKeyID &ckid, CPubKey &cpkOut)
@@ -2680,6 +3232,9 @@ int SecureMsgGetStoredKey(CKeyID &ckid, CPubKey &cpkOut)
     if (fDebug)
         printf("SecureMsgGetStoredKey().\n");
 
+    if (SecureMsgCachedPK(ckid, cpkOut))
+        return 0;
+
     {
         LOCK(cs_smsgDB);
         SecMsgDB addrpkdb;
@@ -2761,62 +3316,12 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char> &vchData)
 
     // -- has cs_smsg lock from SecureMsgReceiveData
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-
-    //printf("token.offset %"PRId64".\n", token.offset); // DEBUG
     int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
-
-    //printf("bucket %"PRId64".\n", bucket);
-    //printf("bucket lld %lld.\n", bucket);
-    //printf("fileName %s.\n", fileName.c_str());
-
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
-    {
-        printf("Error opening file: %s\nPath %s\n", strerror(errno), fullpath.string().c_str());
-        return 1;
-    };
-
-    errno = 0;
-    if (fseek(fp, token.offset, SEEK_SET) != 0)
-    {
-        printf("fseek, strerror: %s.\n", strerror(errno));
-        fclose(fp);
-        return 1;
-    };
-
-    SecureMessage smsg;
-    errno = 0;
-    if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-    {
-        printf("fread header failed: %s\n", strerror(errno));
-        fclose(fp);
-        return 1;
-    };
-
-    try
-    {
-        vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
-    }
-    catch (std::exception &e)
-    {
-        printf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + smsg.nPayload, e.what());
-        return 1;
-    };
 
-    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
-    errno = 0;
-    if (fread(&vchData[SMSG_HDR_LEN], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
-    {
-        printf("fread data failed: %s. Wanted %u bytes.\n", strerror(errno), smsg.nPayload);
-        fclose(fp);
+    vchData.clear();
+    std::vector<SecMsgToken> vTokens(1, token);
+    if (SecureMsgRetrieveBatch(bucket, vTokens, vchData, 1, 0) != 1)
         return 1;
-    };
-
-    fclose(fp);
 
     return 0;
 };
@@ -2866,7 +3371,7 @@ int SecureMsgReceive(CNode *pfrom, std::vector<unsigned char> &vchData)
         // -- release lock on bucket if it exists
         itb = smsgBuckets.find(bktTime);
         if (itb != smsgBuckets.end())
-            itb->second.nLockCount = 0;
+            itb->second.timeLockExpires = 0;
         return 1;
     };
 
@@ -2921,7 +3426,7 @@ int SecureMsgReceive(CNode *pfrom, std::vector<unsigned char> &vchData)
         return 1;
     };
 
-    itb->second.nLockCount = 0; // this node has received data from peer, release lock
+    itb->second.timeLockExpires = 0; // this node has received data from peer, release lock
     itb->second.nLockPeerId = 0;
     itb->second.hashBucket();
 
@@ -3007,7 +3512,7 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
 
     SecureMessage *psmsg = (SecureMessage *)pHeader;
 
-    long int ofs;
+    int64_t ofs;
     fs::path pathSmsgDir;
     try
     {
@@ -3070,35 +3575,8 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
             return 1;
         };
 
-        std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-        fs::path fullpath = pathSmsgDir / fileName;
-
-        FILE *fp;
-        errno = 0;
-        if (!(fp = fopen(fullpath.string().c_str(), "ab")))
-        {
-            printf("Error opening file: %s\n", strerror(errno));
-            return 1;
-        };
-
-        // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
-        errno = 0;
-        if (fseek(fp, 0, SEEK_END) != 0)
-        {
-            printf("Error fseek failed: %s\n", strerror(errno));
+        if (SecureMsgSegmentAppend(bucket, pHeader, pPayload, nPayload, ofs) != 0)
             return 1;
-        };
-
-        ofs = ftell(fp);
-
-        if (fwrite(pHeader, sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN || fwrite(pPayload, sizeof(unsigned char), nPayload, fp) != nPayload)
-        {
-            printf("fwrite failed: %s\n", strerror(errno));
-            fclose(fp);
-            return 1;
-        };
-
-        fclose(fp);
 
         token.offset = ofs;
 
@@ -3119,6 +3597,11 @@ int SecureMsgStore(SecureMessage &smsg, bool fUpdateBucket)
     return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload, fUpdateBucket);
 };
 
+static bool SecureMsgPowValid(const unsigned char *sha256Hash)
+{
+    return sha256Hash[31] == 0 && sha256Hash[30] == 0 && (~(sha256Hash[29]) & ((1 << 0) | (1 << 1) | (1 << 2)));
+};
+
 int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
 {
     /*
@@ -3138,154 +3621,238 @@ int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t
     if (nPayload > SMSG_MAX_MSG_WORST)
         return 5;
 
-    unsigned char civ[32];
     unsigned char sha256Hash[32];
     int rv = 2; // invalid
 
-    uint32_t nonse;
-    memcpy(&nonse, &psmsg->nonse[0], 4);
-
     if (fDebug)
+    {
+        uint32_t nonse;
+        memcpy(&nonse, &psmsg->nonse[0], 4);
         printf("SecureMsgValidate() nonse %u.\n", nonse);
+    };
 
-    for (int i = 0; i < 32; i += 4)
-        memcpy(civ + i, &nonse, 4);
+    SecureMsgPowHash(pHeader, pPayload, nPayload, sha256Hash);
 
-    HMAC_CTX *ctx = HMAC_CTX_new();
+    if (SecureMsgPowValid(sha256Hash))
+    {
+        if (fDebug)
+            printf("Hash Valid.\n");
+        rv = 0; // smsg is valid
+    };
 
-    unsigned int nBytes;
-    if (!HMAC_Init_ex(ctx, &civ[0], 32, EVP_sha256(), NULL) || !HMAC_Update(ctx, (unsigned char *)pHeader + 4, SMSG_HDR_LEN - 4) || !HMAC_Update(ctx, (unsigned char *)pPayload, nPayload) || !HMAC_Update(ctx, pPayload, nPayload) || !HMAC_Final(ctx, sha256Hash, &nBytes) || nBytes != 32)
+    if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
     {
         if (fDebug)
-            printf("HMAC error.\n");
-        rv = 1; // error
+            printf("Checksum mismatch.\n");
+        rv = 3; // checksum mismatch
     }
-    else
+
+    return rv;
+};
+
+void SecureMsgPowHash(const unsigned char *pHeader, const unsigned char *pPayload, uint32_t nPayload, unsigned char *pHash)
+{
+    /*
+    HMAC-SHA256 over the header after the hash field and the payload twice, keyed with the
+    nonse repeated over 32 bytes.
+    The key changes with every nonse tried, so the pads are built here on SHA256 contexts
+    instead of going through HMAC_Init_ex and the EVP setup each time.
+    */
+
+    unsigned char nonse[4];
+    memcpy(nonse, ((const SecureMessage *)pHeader)->nonse, 4);
+
+    unsigned char ipad[64];
+    unsigned char opad[64];
+    for (int i = 0; i < 32; ++i)
     {
-        if (sha256Hash[31] == 0 && sha256Hash[30] == 0 && (~(sha256Hash[29]) & ((1 << 0) | (1 << 1) | (1 << 2))))
-        {
-            if (fDebug)
-                printf("Hash Valid.\n");
-            rv = 0; // smsg is valid
-        };
+        ipad[i] = nonse[i % 4] ^ 0x36;
+        opad[i] = nonse[i % 4] ^ 0x5c;
+    };
+    memset(ipad + 32, 0x36, 32);
+    memset(opad + 32, 0x5c, 32);
+
+    unsigned char inner[32];
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, ipad, 64);
+    SHA256_Update(&ctx, pHeader + 4, SMSG_HDR_LEN - 4);
+    SHA256_Update(&ctx, pPayload, nPayload);
+    SHA256_Update(&ctx, pPayload, nPayload);
+    SHA256_Final(inner, &ctx);
+
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, opad, 64);
+    SHA256_Update(&ctx, inner, 32);
+    SHA256_Final(pHash, &ctx);
+};
+
+class SecMsgPowSearch
+{
+    // -- the nonse space of one message, handed out in chunks to the SecureMsgSetHash threads
+public:
+    SecMsgPowSearch()
+    {
+        nNext = 0;
+        nRunning = 0;
+        fFound = false;
+        fStop = false;
+        nonseFound = 0;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;     // notified when a thread finds a nonse or runs out
+    uint64_t nNext;                     // next nonse to hand out, past 0xFFFFFFFF once all are
+    int nRunning;
+    bool fFound;
+    bool fStop;
+    uint32_t nonseFound;
+    unsigned char hashFound[32];
+};
+
+static void SecureMsgPowThread(SecMsgPowSearch *psearch, const unsigned char *pHeader, const unsigned char *pPayload, uint32_t nPayload)
+{
+    // -- each thread writes the nonse into a header of its own
+    unsigned char header[SMSG_HDR_LEN];
+    memcpy(header, pHeader, SMSG_HDR_LEN);
+    SecureMessage *psmsg = (SecureMessage *)header;
+    unsigned char sha256Hash[32];
 
-        if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
+    for (;;)
+    {
+        uint64_t nBegin;
         {
-            if (fDebug)
-                printf("Checksum mismatch.\n");
-            rv = 3; // checksum mismatch
+            boost::unique_lock<boost::mutex> lock(psearch->mutex);
+            if (psearch->fFound || psearch->fStop || psearch->nNext > 0xFFFFFFFFULL)
+                break;
+            nBegin = psearch->nNext;
+            psearch->nNext += SMSG_POW_CHUNK;
         }
-    }
 
-    HMAC_CTX_free(ctx);
+        uint64_t nEnd = std::min(nBegin + SMSG_POW_CHUNK, (uint64_t)0x100000000ULL);
+        for (uint64_t n = nBegin; n < nEnd; ++n)
+        {
+            uint32_t nonse = (uint32_t)n;
+            memcpy(&psmsg->nonse[0], &nonse, 4);
+            SecureMsgPowHash(header, pPayload, nPayload, sha256Hash);
 
-    return rv;
+            if (SecureMsgPowValid(sha256Hash))
+            {
+                boost::unique_lock<boost::mutex> lock(psearch->mutex);
+                if (!psearch->fFound)
+                {
+                    psearch->fFound = true;
+                    psearch->nonseFound = nonse;
+                    memcpy(psearch->hashFound, sha256Hash, 32);
+                };
+                break;
+            };
+        };
+    };
+
+    {
+        boost::unique_lock<boost::mutex> lock(psearch->mutex);
+        psearch->nRunning--;
+    }
+    psearch->cond.notify_all();
 };
 
-int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
+int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, int nThreads, int64_t nTimeoutMillis, const volatile bool *pfCancel)
 {
     /*  proof of work and checksum
         
         May run in a thread, if shutdown detected, return.
+        The nonse space is split over nThreads threads (0 for one per core).
         
         returns:
             0 success
             1 error
-            2 stopped due to node shutdown
+            2 stopped due to node shutdown or *pfCancel
+            3 not found within nTimeoutMillis (if > 0)
         
     */
 
     SecureMessage *psmsg = (SecureMessage *)pHeader;
 
     int64_t nStart = GetTimeMillis();
-    unsigned char civ[32];
-    unsigned char sha256Hash[32];
 
-    //std::vector<unsigned char> vchHash;
-    //vchHash.resize(32);
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, SMSG_MAX_POW_THREADS));
 
-    bool found = false;
-    HMAC_CTX *ctx = HMAC_CTX_new();
-
-    uint32_t nonse = 0;
+    SecMsgPowSearch search;
+    search.nRunning = nThreads;
 
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
+    int rv = 1;
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; ++i)
+        threadGroup.create_thread(boost::bind(&SecureMsgPowThread, &search, pHeader, pPayload, nPayload));
 
-    // -- break for HMAC_CTX_cleanup
-    for (;;)
     {
-        if (!fSecMsgEnabled)
-            break;
-
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
-        memcpy(&psmsg->nonse[0], &nonse, 4);
-
-        for (int i = 0; i < 32; i += 4)
-            memcpy(civ + i, &nonse, 4);
-
-        unsigned int nBytes;
-        if (!HMAC_Init_ex(ctx, &civ[0], 32, EVP_sha256(), NULL) || !HMAC_Update(ctx, (unsigned char *)pHeader + 4, SMSG_HDR_LEN - 4) || !HMAC_Update(ctx, (unsigned char *)pPayload, nPayload) || !HMAC_Update(ctx, pPayload, nPayload) || !HMAC_Final(ctx, sha256Hash, &nBytes)
-            //|| !HMAC_Final(&ctx, &vchHash[0], &nBytes)
-            || nBytes != 32)
-            break;
-
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
-        {
-            found = true;
-            if (fDebug)
-                printf("Match %u\n", nonse);
-            break;
-        };
-        */
-
-        if (sha256Hash[31] == 0 && sha256Hash[30] == 0 && (~(sha256Hash[29]) & ((1 << 0) | (1 << 1) | (1 << 2))))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebug)
-            //    printf("Match %u\n", nonse);
-            break;
-        }
-
-        //if (nonse >= UINT32_MAX)
-        if (nonse >= 4294967295U)
+        boost::unique_lock<boost::mutex> lock(search.mutex);
+        for (;;)
         {
-            if (fDebug)
-                printf("No match %u\n", nonse);
-            break;
-            //return 1;
-        }
-        nonse++;
-    };
+            if (search.fFound)
+            {
+                rv = 0;
+                break;
+            };
+            if (search.nRunning == 0)
+                break; // every nonse tried
+            if (!fSecMsgEnabled || (pfCancel && *pfCancel))
+            {
+                rv = 2;
+                break;
+            };
+            if (nTimeoutMillis > 0 && GetTimeMillis() - nStart > nTimeoutMillis)
+            {
+                rv = 3;
+                break;
+            };
 
-    HMAC_CTX_free(ctx);
+            // -- wake up now and then to look at the shutdown and cancel flags
+            search.cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+        };
+        search.fStop = true;
+    }
+    threadGroup.join_all();
 
-    if (!fSecMsgEnabled)
+    switch (rv)
     {
+    case 0:
+        break;
+    case 2:
         if (fDebug)
             printf("SecureMsgSetHash() stopped, shutdown detected.\n");
         return 2;
-    };
-
-    if (!found)
-    {
+    case 3:
+        printf("SecureMsgSetHash() gave up after %" PRId64 " ms.\n", GetTimeMillis() - nStart);
+        return 3;
+    default:
         if (fDebug)
-            printf("SecureMsgSetHash() failed, took %" PRId64 " ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+            printf("SecureMsgSetHash() failed, took %" PRId64 " ms, no nonse found\n", GetTimeMillis() - nStart);
         return 1;
     };
 
-    memcpy(psmsg->hash, sha256Hash, 4);
-    //memcpy(psmsg->hash, &vchHash[0], 4);
+    memcpy(&psmsg->nonse[0], &search.nonseFound, 4);
+    memcpy(psmsg->hash, search.hashFound, 4);
 
     if (fDebug)
-        printf("SecureMsgSetHash() took %" PRId64 " ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+        printf("SecureMsgSetHash() took %" PRId64 " ms, %d threads, nonse %u\n", GetTimeMillis() - nStart, nThreads, search.nonseFound);
 
     return 0;
 };
 
+// -- wipes this thread's compressed copy of the message when SecureMsgEncrypt returns
+class SecMsgCompressCleanse
+{
+public:
+    ~SecMsgCompressCleanse()
+    {
+        SecureMsgCompressCleanse();
+    };
+};
+
 int SecureMsgEncrypt(SecureMessage &smsg, std::string &addressFrom, std::string &addressTo, std::string &message)
 {
     /* Create a secure message
@@ -3427,33 +3994,23 @@ int SecureMsgEncrypt(SecureMessage &smsg, std::string &addressFrom, std::string
     std::vector<unsigned char> key_m(&vchHashed[32], &vchHashed[32] + 32);
 
     std::vector<unsigned char> vchPayload;
-    std::vector<unsigned char> vchCompressed;
-    unsigned char *pMsgData;
+    const unsigned char *pMsgData;
     uint32_t lenMsgData;
 
+    // -- the compressed copy is wiped when this returns, after it has been encrypted
+    SecMsgCompressCleanse cleanseCompressed;
+
     uint32_t lenMsg = message.size();
     if (lenMsg > 128)
     {
-        // -- only compress if over 128 bytes
-        int worstCase = LZ4_compressBound(message.size());
-        try
-        {
-            vchCompressed.resize(worstCase);
-        }
-        catch (std::exception &e)
-        {
-            printf("vchCompressed.resize %u threw: %s.\n", worstCase, e.what());
-            return 8;
-        };
-
-        int lenComp = LZ4_compress((char *)message.c_str(), (char *)&vchCompressed[0], lenMsg);
+        // -- only compress if over 128 bytes, into a buffer kept for this thread
+        int lenComp = SecureMsgCompress((const unsigned char *)message.c_str(), lenMsg, smsgOptions.fCompressHigh, pMsgData);
         if (lenComp < 1)
         {
             printf("Could not compress message data.\n");
             return 9;
         };
 
-        pMsgData = &vchCompressed[0];
         lenMsgData = lenComp;
     }
     else
@@ -3631,11 +4188,8 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
     };
 
     // -- Place message in send queue, proof of work will happen in a thread.
-    std::string sPrefix("qm");
     unsigned char chKey[18];
-    memcpy(&chKey[0], sPrefix.data(), 2);
-    memcpy(&chKey[2], &smsg.timestamp, 8);
-    memcpy(&chKey[10], &smsg.pPayload, 8);
+    SecureMsgDbKey("qm", smsg.timestamp, smsg.pPayload, chKey);
 
     SecMsgStored smsgSQ;
 
@@ -3708,11 +4262,8 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
         else
         {
             // -- save sent message to db
-            std::string sPrefix("sm");
             unsigned char chKey[18];
-            memcpy(&chKey[0], sPrefix.data(), 2);
-            memcpy(&chKey[2], &smsgForOutbox.timestamp, 8);
-            memcpy(&chKey[10], &smsgForOutbox.pPayload, 8); // sample
+            SecureMsgDbKey("sm", smsgForOutbox.timestamp, smsgForOutbox.pPayload, chKey);
 
             SecMsgStored smsgOutbox;
 
@@ -3752,6 +4303,28 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
     return 0;
 };
 
+static boost::thread_specific_ptr<std::vector<unsigned char> > smsgPayloadScratch;
+
+// -- wipes the range of the scratch buffer a decrypt used, on every way out of it
+class SecMsgScratchCleanse
+{
+public:
+    SecMsgScratchCleanse(std::vector<unsigned char> &vch, uint32_t nUsed) : vch(vch), nUsed(nUsed) {};
+    ~SecMsgScratchCleanse()
+    {
+        // -- Decrypt writes up to nUsed bytes before trimming the padding
+        if (vch.size() < nUsed)
+            vch.resize(nUsed);
+        if (!vch.empty())
+            OPENSSL_cleanse(&vch[0], vch.size());
+        vch.clear();
+    };
+
+private:
+    std::vector<unsigned char> &vch;
+    uint32_t nUsed;
+};
+
 int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, MessageData &msg)
 {
     /* Decrypt secure message
@@ -3876,9 +4449,14 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
     if (fTestOnly)
         return 0;
 
+    // -- decrypted into a buffer kept for this thread, the scan threads decrypt a message each
+    if (!smsgPayloadScratch.get())
+        smsgPayloadScratch.reset(new std::vector<unsigned char>());
+    std::vector<unsigned char> &vchPayload = *smsgPayloadScratch;
+    SecMsgScratchCleanse cleanse(vchPayload, nPayload);
+
     SecMsgCrypter crypter;
     crypter.SetKey(key_e, psmsg->iv);
-    std::vector<unsigned char> vchPayload;
     if (!crypter.Decrypt(pPayload, nPayload, vchPayload))
     {
         printf("Decrypt failed.\n");
@@ -3919,7 +4497,7 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
     if (lenPlain > 128)
     {
         // -- decompress
-        if (LZ4_decompress_safe((char *)pMsgData, (char *)&msg.vchMessage[0], lenData, lenPlain) != (int)lenPlain)
+        if (!SecureMsgDecompress(pMsgData, lenData, &msg.vchMessage[0], lenPlain))
         {
             printf("Could not decompress message data.\n");
             return 1;
@@ -4018,4 +4596,58 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, unsigned char *pHeade
 int SecureMsgDecrypt(bool fTestOnly, std::string &address, SecureMessage &smsg, MessageData &msg)
 {
     return SecureMsgDecrypt(fTestOnly, address, &smsg.hash[0], smsg.pPayload, smsg.nPayload, msg);
-};
\ No newline at end of file
+};
+
+// -- plaintext of messages recently shown from the inbox and outbox, by db key
+static lrucache<std::string, MessageData> smsgPlainCache(SMSG_PLAIN_CACHE_SIZE);
+static CCriticalSection cs_smsgPlainCache;
+static uint64_t nPlainCacheGeneration = 0;   // counts clears, a decrypt begun before one isn't cached
+
+int SecureMsgDecryptStored(const unsigned char *chKey, std::string &address, SecMsgStored &smsgStored, MessageData &msg)
+{
+    /*
+    Decrypt a message read from the inbox or outbox db under chKey, or take it from the cache.
+    returns as SecureMsgDecrypt
+    */
+
+    std::string sKey((const char *)chKey, 18);
+    uint64_t nGeneration;
+    {
+        LOCK(cs_smsgPlainCache);
+        if (smsgPlainCache.get(sKey, msg))
+            return 0;
+        nGeneration = nPlainCacheGeneration;
+    }
+
+    if (smsgStored.vchMessage.size() < SMSG_HDR_LEN)
+        return 1;
+
+    uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
+    int rv = SecureMsgDecrypt(false, address, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg);
+    if (rv != 0)
+        return rv;
+
+    {
+        // -- the wallet may have been locked while decrypting, the plaintext is returned but not kept
+        LOCK(cs_smsgPlainCache);
+        if (nGeneration == nPlainCacheGeneration)
+            smsgPlainCache.insert(std::make_pair(sKey, msg));
+    }
+    return 0;
+};
+
+void SecureMsgClearPlainCache()
+{
+    LOCK(cs_smsgPlainCache);
+    smsgPlainCache.clear();
+    nPlainCacheGeneration++;
+};
+
+void SecureMsgPKCacheStats(uint32_t &nSize, uint32_t &nMaxSize, uint64_t &nHits, uint64_t &nMisses)
+{
+    LOCK(cs_smsgPKCache);
+    nSize = smsgPKCache.size();
+    nMaxSize = smsgPKCache.max_size();
+    nHits = nPKCacheHits;
+    nMisses = nPKCacheMisses;
+};
@@ -20,6 +20,21 @@ const unsigned int SMSG_BUCKET_LEN      = 60 * 10;           // in seconds
 const unsigned int SMSG_RETENTION       = 60 * 60 * 48;      // in seconds
 const unsigned int SMSG_SEND_DELAY      = 2;                 // in seconds, SecureMsgSendData will delay this long between firing
 const unsigned int SMSG_THREAD_DELAY    = 20;
+const unsigned int SMSG_LOCK_TIMEOUT    = 3 * SMSG_THREAD_DELAY; // seconds a bucket waits for the messages asked for in an smsgWant
+
+const unsigned int SMSG_SCAN_BATCH      = 1024;              // messages decrypted together by SecureMsgScanMessages
+const int SMSG_MAX_SCAN_THREADS         = 16;
+const unsigned int SMSG_SCAN_CHAIN_BLOCKS = 500;            // blocks read together by ScanChainForPublicKeys, the db is written after each lot
+const unsigned int SMSG_SCAN_CHAIN_FILTER_BITS = 1 << 23;   // 1MB, ~2% false positives at a million keys
+const int SMSG_MAX_POW_THREADS          = 16;
+const unsigned int SMSG_POW_CHUNK       = 1024;              // nonses a SecureMsgSetHash thread takes at a time
+
+const uint32_t SMSG_PROTOCOL_VERSION    = 2;                 // sent with smsgPing and smsgPong
+const uint32_t SMSG_RECON_VERSION       = 2;                 // peer understands smsgRecon
+
+const int SMSG_DB_VERSION                = 1;                 // 1: message keys hold the time big endian
+const unsigned int SMSG_PLAIN_CACHE_SIZE = 1000;             // decrypted messages kept for smsginbox/smsgoutbox
+const unsigned int SMSG_PK_CACHE_SIZE    = 10000;            // public keys of recipients kept in memory, -smsgpkcache
 
 const unsigned int SMSG_TIME_LEEWAY     = 60;
 const unsigned int SMSG_TIME_IGNORE     = 90;                // seconds that a peer is ignored for if they fail to deliver messages for a smsgWant
@@ -146,7 +161,7 @@ public:
     {
         timeChanged     = 0;
         hash            = 0;
-        nLockCount      = 0;
+        timeLockExpires = 0;
         nLockPeerId     = 0;
     };
     ~SecMsgBucket() {};
@@ -155,7 +170,7 @@ public:
     
     int64_t                     timeChanged;
     uint32_t                    hash;           // token set should get ordered the same on each node
-    uint32_t                    nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
+    int64_t                     timeLockExpires; // set when smsgWant first sent, unset at end of smsgMsg, timed out by SecureMsgExpire()
     uint32_t                    nLockPeerId;    // id of peer that bucket is locked for
     std::set<SecMsgToken>       setTokens;
     
@@ -213,10 +228,12 @@ public:
         // -- default options
         fNewAddressRecv = true;
         fNewAddressAnon = true;
+        fCompressHigh   = false;
     }
     
     bool fNewAddressRecv;
     bool fNewAddressAnon;
+    bool fCompressHigh;     // compress sent messages harder, smaller payloads take less proof of work and bandwidth
 };
 
 
@@ -305,8 +322,12 @@ public:
     bool WritePK(CKeyID& addr, CPubKey& pubkey);
     bool ExistsPK(CKeyID& addr);
     
+    bool ReadChainScan(int& nHeight, uint256& hashBlock);
+    bool WriteChainScan(int nHeight, uint256& hashBlock);
+    
     bool NextSmesg(leveldb::Iterator* it, std::string& prefix, unsigned char* vchKey, SecMsgStored& smsgStored);
     bool NextSmesgKey(leveldb::Iterator* it, std::string& prefix, unsigned char* vchKey);
+    void SeekSmesg(leveldb::Iterator* it, std::string& prefix, int64_t nSince);
     bool ReadSmesg(unsigned char* chKey, SecMsgStored& smsgStored);
     bool WriteSmesg(unsigned char* chKey, SecMsgStored& smsgStored);
     bool ExistsSmesg(unsigned char* chKey);
@@ -317,6 +338,9 @@ public:
     
 };
 
+// Inbox, outbox and send queue db key: 2 char prefix, time sent big endian so keys sort by time, first 8 bytes of payload
+void SecureMsgDbKey(const char *pszPrefix, int64_t timestamp, const unsigned char *pSample, unsigned char *chKey);
+
 std::string getTimeString(int64_t timestamp, char *buffer, size_t nBuffer);
 std::string fsReadable(uint64_t nBytes);
 
@@ -327,19 +351,22 @@ int SecureMsgAddWalletAddresses();
 int SecureMsgReadIni();
 int SecureMsgWriteIni();
 
+void SecureMsgLockBucket(int64_t bucket, SecMsgBucket& smsgBucket, uint32_t nPeerId, int64_t now);
+void SecureMsgExpire(int64_t now);
+
 bool SecureMsgStart(bool fDontStart, bool fScanChain);
 bool SecureMsgShutdown();
 
 bool SecureMsgEnable();
 bool SecureMsgDisable();
 
-bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
+bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CSpanStream& vRecv);
 bool SecureMsgSendData(CNode* pto, bool fSendTrickle);
 
 
 bool SecureMsgScanBlock(CBlock& block);
 bool ScanChainForPublicKeys(CBlockIndex* pindexStart);
-bool SecureMsgScanBlockChain();
+bool SecureMsgScanBlockChain(bool fFull = false);
 bool SecureMsgScanBuckets();
 
 
@@ -347,6 +374,7 @@ int SecureMsgWalletUnlocked();
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui);
+uint32_t SecureMsgScanMessages(std::vector<std::vector<unsigned char> >& vMessages, bool reportToGui);
 
 int SecureMsgGetStoredKey(CKeyID& ckid, CPubKey& cpkOut);
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut);
@@ -367,13 +395,20 @@ int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket);
 int SecureMsgSend(std::string& addressFrom, std::string& addressTo, std::string& message, std::string& sError);
 
 int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
-int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
+int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload,
+                     int nThreads = 0, int64_t nTimeoutMillis = 0, const volatile bool *pfCancel = NULL);
+void SecureMsgPowHash(const unsigned char *pHeader, const unsigned char *pPayload, uint32_t nPayload, unsigned char *pHash);
 
 int SecureMsgEncrypt(SecureMessage& smsg, std::string& addressFrom, std::string& addressTo, std::string& message);
 
 int SecureMsgDecrypt(bool fTestOnly, std::string& address, unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, MessageData& msg);
 int SecureMsgDecrypt(bool fTestOnly, std::string& address, SecureMessage& smsg, MessageData& msg);
 
+int SecureMsgDecryptStored(const unsigned char *chKey, std::string& address, SecMsgStored& smsgStored, MessageData& msg);
+void SecureMsgClearPlainCache();
+
+void SecureMsgPKCacheStats(uint32_t& nSize, uint32_t& nMaxSize, uint64_t& nHits, uint64_t& nMisses);
+
 
 
 #endif // SEC_MESSAGE_H
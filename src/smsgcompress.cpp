@@ -0,0 +1,229 @@
+// Copyright (c) 2014 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/*
+Notes:
+    Message compression
+
+    Messages over 128 bytes are sent as one LZ4 block, every message is decompressed on
+    its own so no dictionary is carried from one message to the next.
+
+    The fast compressor is the bundled LZ4_compress, run on a hash table kept for the
+    thread instead of one cleared on the stack for every message.
+
+    The high compression mode chains every position to the earlier ones with the same
+    hash and takes the longest match of up to SMSG_LZ4HC_ATTEMPTS of them, putting a
+    match off by one byte if the next position has a longer one.  It writes the same
+    block format, with the same end of block rules as LZ4_compress:
+        the last 5 bytes are literals
+        no match starts in the last 12 bytes
+*/
+
+#include "smsgcompress.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+#include <boost/thread/tss.hpp>
+
+#include <openssl/crypto.h>
+
+#include "lz4/lz4.h"
+
+
+static const int LZ4_MINMATCH       = 4;
+static const int LZ4_LASTLITERALS   = 5;
+static const int LZ4_MFLIMIT        = 12;
+static const int LZ4_MAX_DISTANCE   = 0xFFFF;
+
+
+// State for the compressors and the output buffer, one for each thread that compresses
+class SecMsgLZ4Context
+{
+public:
+    SecMsgLZ4Context()
+    {
+        vState.resize((LZ4_sizeofState() + 3) / 4);
+        vHead.resize(1 << SMSG_LZ4HC_HASH_LOG);
+        vChain.resize(LZ4_MAX_DISTANCE + 1);
+    };
+
+    std::vector<uint32_t>       vState;     // fast compressor's hash table, 4 byte aligned
+    std::vector<int32_t>        vHead;      // last position with each hash
+    std::vector<uint16_t>       vChain;     // distance back to the previous position with the same hash
+    std::vector<unsigned char>  vchOut;
+};
+
+static boost::thread_specific_ptr<SecMsgLZ4Context> smsgLZ4Context;
+
+static SecMsgLZ4Context &GetContext()
+{
+    if (!smsgLZ4Context.get())
+        smsgLZ4Context.reset(new SecMsgLZ4Context());
+    return *smsgLZ4Context;
+};
+
+
+static inline uint32_t HCHash(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761U) >> (32 - SMSG_LZ4HC_HASH_LOG);
+};
+
+class SecMsgLZ4HC
+{
+public:
+    SecMsgLZ4HC(SecMsgLZ4Context &ctx, const unsigned char *pSrc) : ctx(ctx), pSrc(pSrc), nNext(0)
+    {
+        std::fill(ctx.vHead.begin(), ctx.vHead.end(), -1);
+    };
+
+    // Longest match for nPos ending by nLimit, 0 if none of LZ4_MINMATCH bytes
+    int FindMatch(int nPos, int nLimit, int &nMatchPos)
+    {
+        // -- chain the positions before nPos
+        for (; nNext < nPos; ++nNext)
+        {
+            uint32_t h = HCHash(pSrc + nNext);
+            int32_t nPrev = ctx.vHead[h];
+            int nDelta = nPrev < 0 ? 0 : nNext - nPrev;
+            ctx.vChain[nNext & LZ4_MAX_DISTANCE] = nDelta > LZ4_MAX_DISTANCE ? 0 : nDelta;
+            ctx.vHead[h] = nNext;
+        };
+
+        int nBest = 0;
+        int nCandidate = ctx.vHead[HCHash(pSrc + nPos)];
+        for (int nAttempts = SMSG_LZ4HC_ATTEMPTS; nCandidate >= 0 && nAttempts > 0; --nAttempts)
+        {
+            if (nPos - nCandidate > LZ4_MAX_DISTANCE)
+                break;
+
+            if (pSrc[nCandidate + nBest] == pSrc[nPos + nBest]
+                && memcmp(pSrc + nCandidate, pSrc + nPos, LZ4_MINMATCH) == 0)
+            {
+                int nLen = LZ4_MINMATCH;
+                while (nPos + nLen < nLimit && pSrc[nCandidate + nLen] == pSrc[nPos + nLen])
+                    nLen++;
+                if (nLen > nBest)
+                {
+                    nBest = nLen;
+                    nMatchPos = nCandidate;
+                    if (nPos + nLen >= nLimit)
+                        break;
+                };
+            };
+
+            int nDelta = ctx.vChain[nCandidate & LZ4_MAX_DISTANCE];
+            if (nDelta == 0)
+                break;
+            nCandidate -= nDelta;
+        };
+
+        return nBest;
+    };
+
+private:
+    SecMsgLZ4Context &ctx;
+    const unsigned char *pSrc;
+    int nNext;                  // first position not yet chained
+};
+
+static unsigned char *WriteLength(unsigned char *op, int nLength)
+{
+    for (; nLength >= 255; nLength -= 255)
+        *op++ = 255;
+    *op++ = nLength;
+    return op;
+};
+
+static unsigned char *WriteSequence(unsigned char *op, const unsigned char *pLiterals, int nLiterals, int nOffset, int nMatch)
+{
+    unsigned char *pToken = op++;
+    *pToken = (nLiterals < 15 ? nLiterals : 15) << 4;
+    if (nLiterals >= 15)
+        op = WriteLength(op, nLiterals - 15);
+    memcpy(op, pLiterals, nLiterals);
+    op += nLiterals;
+
+    if (nMatch < LZ4_MINMATCH)
+        return op; // last literals
+
+    *op++ = nOffset & 0xFF;
+    *op++ = nOffset >> 8;
+    nMatch -= LZ4_MINMATCH;
+    *pToken |= nMatch < 15 ? nMatch : 15;
+    if (nMatch >= 15)
+        op = WriteLength(op, nMatch - 15);
+    return op;
+};
+
+static int CompressHC(SecMsgLZ4Context &ctx, const unsigned char *pSrc, int nSrc, unsigned char *pDest)
+{
+    unsigned char *op = pDest;
+    int nAnchor = 0;
+    int nPos = 0;
+    int nMatchLimit = nSrc - LZ4_LASTLITERALS;
+    int nStartLimit = nSrc - LZ4_MFLIMIT;
+
+    SecMsgLZ4HC hc(ctx, pSrc);
+    while (nPos < nStartLimit)
+    {
+        int nMatchPos = 0;
+        int nLen = hc.FindMatch(nPos, nMatchLimit, nMatchPos);
+        if (nLen < LZ4_MINMATCH)
+        {
+            nPos++;
+            continue;
+        };
+
+        // -- take the next position instead if it matches longer
+        int nNextMatchPos = 0;
+        if (nPos + 1 < nStartLimit
+            && hc.FindMatch(nPos + 1, nMatchLimit, nNextMatchPos) > nLen + 1)
+        {
+            nPos++;
+            nLen = hc.FindMatch(nPos, nMatchLimit, nMatchPos);
+        };
+
+        op = WriteSequence(op, pSrc + nAnchor, nPos - nAnchor, nPos - nMatchPos, nLen);
+        nPos += nLen;
+        nAnchor = nPos;
+    };
+
+    op = WriteSequence(op, pSrc + nAnchor, nSrc - nAnchor, 0, 0);
+    return op - pDest;
+};
+
+int SecureMsgCompress(const unsigned char *pSrc, int nSrc, bool fHigh, const unsigned char *&pOut)
+{
+    if (nSrc < 1)
+        return 0;
+
+    SecMsgLZ4Context &ctx = GetContext();
+    ctx.vchOut.resize(LZ4_compressBound(nSrc));
+
+    int nOut;
+    if (fHigh)
+        nOut = CompressHC(ctx, pSrc, nSrc, &ctx.vchOut[0]);
+    else
+        nOut = LZ4_compress_withState(&ctx.vState[0], (const char *)pSrc, (char *)&ctx.vchOut[0], nSrc);
+
+    pOut = &ctx.vchOut[0];
+    return nOut;
+};
+
+void SecureMsgCompressCleanse()
+{
+    SecMsgLZ4Context &ctx = GetContext();
+    if (!ctx.vchOut.empty())
+        OPENSSL_cleanse(&ctx.vchOut[0], ctx.vchOut.size());
+    ctx.vchOut.clear();
+};
+
+bool SecureMsgDecompress(const unsigned char *pSrc, int nSrc, unsigned char *pDest, int nDest)
+{
+    return LZ4_decompress_safe((const char *)pSrc, (char *)pDest, nSrc, nDest) == nDest;
+};
@@ -0,0 +1,28 @@
+// Copyright (c) 2014 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SEC_MESSAGE_COMPRESS_H
+#define SEC_MESSAGE_COMPRESS_H
+
+#include <stdint.h>
+
+
+const int SMSG_LZ4HC_HASH_LOG   = 13;
+const int SMSG_LZ4HC_ATTEMPTS   = 256;      // earlier positions with the same hash tried for each match
+
+
+// Compress nSrc bytes of pSrc to LZ4 block format.  fHigh searches harder for longer
+// matches, it is slower but the output decompresses the same way, older nodes included.
+// pOut points into a buffer kept for the calling thread, valid until its next call.
+// Returns the compressed length, 0 on failure.
+int SecureMsgCompress(const unsigned char *pSrc, int nSrc, bool fHigh, const unsigned char *&pOut);
+
+// Wipe the calling thread's output buffer, it holds the last message compressed in an
+// easily reversed form.  The buffer keeps its capacity for the next message.
+void SecureMsgCompressCleanse();
+
+// Returns false unless pSrc decompresses to exactly nDest bytes
+bool SecureMsgDecompress(const unsigned char *pSrc, int nSrc, unsigned char *pDest, int nDest);
+
+
+#endif // SEC_MESSAGE_COMPRESS_H
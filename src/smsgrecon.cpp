@@ -0,0 +1,275 @@
+// Copyright (c) 2014 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/*
+Notes:
+    Bucket reconciliation
+
+    Peers that announce SMSG_RECON_VERSION in smsgPing/smsgPong no longer send smsgShow
+    for a bucket that differs.  The node sends an smsgRecon holding an invertible bloom
+    lookup table of its own tokens instead, sized for the difference it expects from the
+    token counts in the smsgInv.  The peer subtracts the table of its own tokens, lists
+    what is left and replies with an smsgHave of only the tokens this node lacks, and an
+    smsgWant for the ones it lacks itself.  If the difference turns out too large to be
+    listed the peer sends its full token list, as for smsgShow.
+
+    smsgRecon:
+        8   bucket
+        4   no. of tokens the sender holds in the bucket
+        4   no. of cells
+        24  per cell: count, timestamp + sample xor, check xor
+*/
+
+#include "smsgrecon.h"
+
+#include "xxhash/xxhash.h"
+
+
+static void TokenKey(const SecMsgToken& token, unsigned char* key)
+{
+    memcpy(key, &token.timestamp, 8);
+    memcpy(key + 8, token.sample, 8);
+};
+
+static uint32_t KeyCheck(const unsigned char* key)
+{
+    return XXH32(key, SMSG_RECON_KEY_LEN, 0);
+};
+
+SecMsgIBLT::SecMsgIBLT(uint32_t nCells)
+{
+    Cell empty;
+    memset(&empty, 0, sizeof(empty));
+    vCells.resize(nCells, empty);
+};
+
+void SecMsgIBLT::Update(const unsigned char* key, int32_t n)
+{
+    uint32_t nSub = vCells.size() / SMSG_RECON_HASHES;
+    if (nSub < 1)
+        return;
+
+    uint32_t nCheck = KeyCheck(key);
+    for (uint32_t k = 0; k < SMSG_RECON_HASHES; ++k)
+    {
+        Cell& cell = vCells[k * nSub + XXH32(key, SMSG_RECON_KEY_LEN, k + 1) % nSub];
+        cell.nCount += n;
+        for (uint32_t i = 0; i < SMSG_RECON_KEY_LEN; ++i)
+            cell.key[i] ^= key[i];
+        cell.nCheck ^= nCheck;
+    };
+};
+
+void SecMsgIBLT::Insert(const SecMsgToken& token)
+{
+    unsigned char key[SMSG_RECON_KEY_LEN];
+    TokenKey(token, key);
+    Update(key, 1);
+};
+
+void SecMsgIBLT::Insert(const std::set<SecMsgToken>& setTokens)
+{
+    std::set<SecMsgToken>::const_iterator it;
+    for (it = setTokens.begin(); it != setTokens.end(); ++it)
+        Insert(*it);
+};
+
+bool SecMsgIBLT::Subtract(const SecMsgIBLT& other)
+{
+    if (other.vCells.size() != vCells.size())
+        return false;
+
+    for (uint32_t c = 0; c < vCells.size(); ++c)
+    {
+        vCells[c].nCount -= other.vCells[c].nCount;
+        for (uint32_t i = 0; i < SMSG_RECON_KEY_LEN; ++i)
+            vCells[c].key[i] ^= other.vCells[c].key[i];
+        vCells[c].nCheck ^= other.vCells[c].nCheck;
+    };
+    return true;
+};
+
+bool SecMsgIBLT::Decode(std::vector<SecMsgToken>& vThis, std::vector<SecMsgToken>& vOther) const
+{
+    // -- peel off cells holding a single token until none are left
+    SecMsgIBLT peel(*this);
+
+    bool fProgress = true;
+    while (fProgress)
+    {
+        fProgress = false;
+        for (uint32_t c = 0; c < peel.vCells.size(); ++c)
+        {
+            Cell& cell = peel.vCells[c];
+            if ((cell.nCount != 1 && cell.nCount != -1)
+                || cell.nCheck != KeyCheck(cell.key))
+                continue;
+
+            SecMsgToken token;
+            memcpy(&token.timestamp, cell.key, 8);
+            memcpy(token.sample, cell.key + 8, 8);
+            token.offset = 0;
+
+            if (cell.nCount == 1)
+                vThis.push_back(token);
+            else
+                vOther.push_back(token);
+
+            // -- more tokens than cells means the table is garbage
+            if (vThis.size() + vOther.size() > vCells.size())
+                return false;
+
+            unsigned char key[SMSG_RECON_KEY_LEN];
+            memcpy(key, cell.key, SMSG_RECON_KEY_LEN);
+            peel.Update(key, -cell.nCount);
+            fProgress = true;
+        };
+    };
+
+    for (uint32_t c = 0; c < peel.vCells.size(); ++c)
+    {
+        const Cell& cell = peel.vCells[c];
+        if (cell.nCount != 0 || cell.nCheck != 0)
+            return false;
+        for (uint32_t i = 0; i < SMSG_RECON_KEY_LEN; ++i)
+            if (cell.key[i] != 0)
+                return false;
+    };
+
+    return true;
+};
+
+void SecMsgIBLT::Serialize(std::vector<unsigned char>& vch) const
+{
+    uint32_t nStart = vch.size();
+    vch.resize(nStart + vCells.size() * SMSG_RECON_CELL_LEN);
+
+    unsigned char *p = &vch[nStart];
+    for (uint32_t c = 0; c < vCells.size(); ++c, p += SMSG_RECON_CELL_LEN)
+    {
+        memcpy(p, &vCells[c].nCount, 4);
+        memcpy(p + 4, vCells[c].key, SMSG_RECON_KEY_LEN);
+        memcpy(p + 4 + SMSG_RECON_KEY_LEN, &vCells[c].nCheck, 4);
+    };
+};
+
+bool SecMsgIBLT::Deserialize(const unsigned char* p, uint32_t nCells)
+{
+    if (nCells < SMSG_RECON_HASHES || nCells % SMSG_RECON_HASHES != 0)
+        return false;
+
+    vCells.resize(nCells);
+    for (uint32_t c = 0; c < nCells; ++c, p += SMSG_RECON_CELL_LEN)
+    {
+        memcpy(&vCells[c].nCount, p, 4);
+        memcpy(vCells[c].key, p + 4, SMSG_RECON_KEY_LEN);
+        memcpy(&vCells[c].nCheck, p + 4 + SMSG_RECON_KEY_LEN, 4);
+    };
+    return true;
+};
+
+uint32_t SecMsgIBLT::CellsFor(uint32_t nDifference)
+{
+    // -- with three hashes a table lists nearly every difference of up to 2/3 its size,
+    //    small tables need more room than that
+    uint32_t nCells = 2 * nDifference + 6;
+    if (nCells < SMSG_RECON_MIN_CELLS)
+        nCells = SMSG_RECON_MIN_CELLS;
+    return nCells + (SMSG_RECON_HASHES - nCells % SMSG_RECON_HASHES) % SMSG_RECON_HASHES;
+};
+
+bool SecureMsgReconRequest(int64_t bucket, const std::set<SecMsgToken>& setTokens, uint32_t nPeerTokens, std::vector<unsigned char>& vchData)
+{
+    uint32_t nTokens = setTokens.size();
+    if (nTokens < 1)
+        return false; // nothing to leave out of the peer's list
+
+    // -- the counts only give a lower bound, each node may also hold messages the other lacks,
+    //    allow for a few of those, more in busier buckets
+    uint32_t nDifference = nPeerTokens > nTokens ? nPeerTokens - nTokens : nTokens - nPeerTokens;
+    nDifference += SMSG_RECON_SLACK + nTokens / 128;
+
+    uint32_t nCells = SecMsgIBLT::CellsFor(nDifference);
+    if (nCells > SMSG_RECON_MAX_CELLS
+        || 16 + (uint64_t)nCells * SMSG_RECON_CELL_LEN >= 8 + (uint64_t)nPeerTokens * 16)
+        return false;
+
+    SecMsgIBLT iblt(nCells);
+    iblt.Insert(setTokens);
+
+    vchData.resize(16);
+    memcpy(&vchData[0], &bucket, 8);
+    memcpy(&vchData[8], &nTokens, 4);
+    memcpy(&vchData[12], &nCells, 4);
+    iblt.Serialize(vchData);
+    return true;
+};
+
+int SecureMsgReconReply(const std::vector<unsigned char>& vchData, const std::set<SecMsgToken>& setTokens, int64_t& bucket,
+                        std::vector<SecMsgToken>& vPeerLacks, std::vector<SecMsgToken>& vThisLacks)
+{
+    if (vchData.size() < 16)
+        return 1;
+
+    uint32_t nPeerTokens, nCells;
+    memcpy(&bucket, &vchData[0], 8);
+    memcpy(&nPeerTokens, &vchData[8], 4);
+    memcpy(&nCells, &vchData[12], 4);
+
+    if (nCells > SMSG_RECON_MAX_CELLS
+        || vchData.size() < 16 + nCells * SMSG_RECON_CELL_LEN)
+        return 1;
+
+    SecMsgIBLT ibltPeer;
+    if (!ibltPeer.Deserialize(&vchData[16], nCells))
+        return 1;
+
+    SecMsgIBLT iblt(nCells);
+    iblt.Insert(setTokens);
+    iblt.Subtract(ibltPeer);
+
+    if (!iblt.Decode(vPeerLacks, vThisLacks))
+    {
+        vPeerLacks.clear();
+        vThisLacks.clear();
+        return 2;
+    };
+
+    // -- tokens listed as held by this node must really be here, else the table was not the peer's
+    std::vector<SecMsgToken>::iterator it;
+    for (it = vPeerLacks.begin(); it != vPeerLacks.end(); ++it)
+    {
+        std::set<SecMsgToken>::const_iterator itt = setTokens.find(*it);
+        if (itt == setTokens.end())
+        {
+            vPeerLacks.clear();
+            vThisLacks.clear();
+            return 2;
+        };
+        *it = *itt;
+    };
+
+    if (setTokens.size() + vThisLacks.size() - vPeerLacks.size() != nPeerTokens)
+    {
+        vPeerLacks.clear();
+        vThisLacks.clear();
+        return 2;
+    };
+
+    return 0;
+};
+
+void SecureMsgTokenList(int64_t bucket, const std::vector<SecMsgToken>& vTokens, std::vector<unsigned char>& vchData)
+{
+    vchData.resize(8 + 16 * vTokens.size());
+    memcpy(&vchData[0], &bucket, 8);
+
+    unsigned char *p = &vchData[8];
+    std::vector<SecMsgToken>::const_iterator it;
+    for (it = vTokens.begin(); it != vTokens.end(); ++it, p += 16)
+    {
+        memcpy(p, &it->timestamp, 8);
+        memcpy(p + 8, it->sample, 8);
+    };
+};
@@ -0,0 +1,76 @@
+// Copyright (c) 2014 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SEC_MESSAGE_RECON_H
+#define SEC_MESSAGE_RECON_H
+
+#include "smessage.h"
+
+
+const unsigned int SMSG_RECON_HASHES    = 3;                 // cells each token is added to, one in each third of the table
+const unsigned int SMSG_RECON_KEY_LEN   = 16;                // token timestamp + sample
+const unsigned int SMSG_RECON_CELL_LEN  = 4 + SMSG_RECON_KEY_LEN + 4;
+const unsigned int SMSG_RECON_MIN_CELLS = 12;
+const unsigned int SMSG_RECON_SLACK     = 8;                 // differences allowed for beyond the difference in token counts
+const unsigned int SMSG_RECON_MAX_CELLS = 3000;              // ~72KB, larger differences go through smsgShow
+
+
+// Invertible bloom lookup table over the tokens of a bucket.
+// Subtracting the table of one node from the table of another leaves only the tokens
+// held by one of them, which can be listed again while the difference is small enough
+// for the table.
+class SecMsgIBLT
+{
+public:
+    SecMsgIBLT(uint32_t nCells = 0);
+
+    void Insert(const SecMsgToken& token);
+    void Insert(const std::set<SecMsgToken>& setTokens);
+
+    // Both tables must have the same number of cells
+    bool Subtract(const SecMsgIBLT& other);
+
+    // Tokens only in this table to vThis, tokens only in the subtracted one to vOther.
+    // Returns false if the difference was too large to be listed in full.
+    bool Decode(std::vector<SecMsgToken>& vThis, std::vector<SecMsgToken>& vOther) const;
+
+    uint32_t size() const { return vCells.size(); }
+
+    void Serialize(std::vector<unsigned char>& vch) const;
+    bool Deserialize(const unsigned char* p, uint32_t nCells);
+
+    // Cells for a table that will most likely list nDifference tokens
+    static uint32_t CellsFor(uint32_t nDifference);
+
+private:
+    struct Cell
+    {
+        int32_t         nCount;
+        unsigned char   key[SMSG_RECON_KEY_LEN];
+        uint32_t        nCheck;
+    };
+
+    void Update(const unsigned char* key, int32_t n);
+
+    std::vector<Cell> vCells;
+};
+
+
+// smsgRecon payload for a bucket this node holds setTokens of, the peer nPeerTokens.
+// Returns false if sending the peer's full token list would be no larger.
+bool SecureMsgReconRequest(int64_t bucket, const std::set<SecMsgToken>& setTokens, uint32_t nPeerTokens, std::vector<unsigned char>& vchData);
+
+/*  Reconcile an smsgRecon payload with setTokens
+    returns
+        0 success, vPeerLacks and vThisLacks hold the difference
+        1 malformed payload
+        2 difference too large, fall back to the full token list
+*/
+int SecureMsgReconReply(const std::vector<unsigned char>& vchData, const std::set<SecMsgToken>& setTokens, int64_t& bucket,
+                        std::vector<SecMsgToken>& vPeerLacks, std::vector<SecMsgToken>& vThisLacks);
+
+// smsgHave / smsgWant payload: bucket then timestamp + sample of each token
+void SecureMsgTokenList(int64_t bucket, const std::vector<SecMsgToken>& vTokens, std::vector<unsigned char>& vchData);
+
+
+#endif // SEC_MESSAGE_RECON_H
@@ -0,0 +1,454 @@
+// Copyright (c) 2014 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/*
+Notes:
+    Message store segments
+
+    Each bucket is a segment: smsgStore/<bucket>_01.dat holds the messages, header then
+    payload, appended as they arrive, and smsgStore/<bucket>_01.idx holds a SecMsgIndexRecord
+    for each of them, appended after the message.
+
+    The bucket set is built from the index files at startup.  A segment's data file is only
+    read through when its index is missing or doesn't account for the whole file (stores
+    written before the index existed, or a crash between the two appends), the index is
+    then rewritten from the data.
+
+    Messages are read from a mapping of the segment file, a whole smsgWant request is
+    served from one mapping.
+
+    All of these are called with cs_smsg held.
+*/
+
+#include "smsgstore.h"
+
+#include <errno.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+namespace fs = boost::filesystem;
+
+
+SecMsgSegmentReader::SecMsgSegmentReader()
+{
+    pBegin = NULL;
+    nSize = 0;
+    fMapped = false;
+};
+
+SecMsgSegmentReader::~SecMsgSegmentReader()
+{
+    Close();
+};
+
+bool SecMsgSegmentReader::Open(const fs::path& path)
+{
+    Close();
+
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    };
+
+    if (st.st_size > 0)
+    {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            printf("mmap %s failed: %s\n", path.string().c_str(), strerror(errno));
+            close(fd);
+            return false;
+        };
+        pBegin = (const unsigned char*)p;
+        nSize = st.st_size;
+        fMapped = true;
+    };
+    close(fd); // the mapping stays valid
+#else
+    // -- segments are small, read the whole file instead of mapping it
+    FILE *fp;
+    if (!(fp = fopen(path.string().c_str(), "rb")))
+        return false;
+
+    long int nLen = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        nLen = ftell(fp);
+    if (nLen < 0 || fseek(fp, 0, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return false;
+    };
+
+    vchData.resize(nLen);
+    if (nLen > 0 && fread(&vchData[0], sizeof(unsigned char), nLen, fp) != (size_t)nLen)
+    {
+        printf("fread %s failed: %s\n", path.string().c_str(), strerror(errno));
+        fclose(fp);
+        vchData.clear();
+        return false;
+    };
+    fclose(fp);
+
+    pBegin = nLen > 0 ? &vchData[0] : NULL;
+    nSize = nLen;
+#endif
+
+    return true;
+};
+
+void SecMsgSegmentReader::Close()
+{
+#ifndef WIN32
+    if (fMapped)
+        munmap((void*)pBegin, nSize);
+#endif
+    pBegin = NULL;
+    nSize = 0;
+    fMapped = false;
+    vchData.clear();
+};
+
+const unsigned char* SecMsgSegmentReader::GetMessage(int64_t nOffset, uint32_t& nPayload) const
+{
+    if (nOffset < 0 || (uint64_t)nOffset + SMSG_HDR_LEN > nSize)
+        return NULL;
+
+    const unsigned char *p = pBegin + nOffset;
+
+    // -- nPayload is the last field of the header
+    memcpy(&nPayload, p + SMSG_HDR_LEN - 4, 4);
+    if ((uint64_t)nOffset + SMSG_HDR_LEN + nPayload > nSize)
+        return NULL;
+
+    return p;
+};
+
+
+fs::path SecureMsgSegmentPath(int64_t bucket, bool fIndex)
+{
+    std::string fileName = boost::lexical_cast<std::string>(bucket) + (fIndex ? "_01.idx" : "_01.dat");
+    return GetDataDir() / "smsgStore" / fileName;
+};
+
+static void MakeIndexRecord(const unsigned char *pHeader, const unsigned char *pPayload, uint32_t nPayload,
+                            int64_t nOffset, SecMsgIndexRecord& record)
+{
+    const SecureMessage *psmsg = (const SecureMessage*)pHeader;
+    record.timestamp = psmsg->timestamp;
+
+    if (nPayload < 8) // same as SecMsgToken
+        memset(record.sample, 0, 8);
+    else
+        memcpy(record.sample, pPayload, 8);
+
+    record.offset = nOffset;
+    record.nPayload = nPayload;
+};
+
+int SecureMsgSegmentAppend(int64_t bucket, unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, int64_t& nOffset)
+{
+    fs::path pathData = SecureMsgSegmentPath(bucket, false);
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathData.string().c_str(), "ab")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+
+    // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
+    errno = 0;
+    if (fseek(fp, 0, SEEK_END) != 0)
+    {
+        printf("Error fseek failed: %s\n", strerror(errno));
+        fclose(fp);
+        return 1;
+    };
+
+    nOffset = ftell(fp);
+
+    if (fwrite(pHeader, sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN || fwrite(pPayload, sizeof(unsigned char), nPayload, fp) != nPayload)
+    {
+        printf("fwrite failed: %s\n", strerror(errno));
+        fclose(fp);
+        return 1;
+    };
+
+    fclose(fp);
+
+    // -- a record missing here is noticed by SecureMsgSegmentLoad, which rebuilds the index
+    SecMsgIndexRecord record;
+    MakeIndexRecord(pHeader, pPayload, nPayload, nOffset, record);
+
+    fs::path pathIndex = SecureMsgSegmentPath(bucket, true);
+    errno = 0;
+    if (!(fp = fopen(pathIndex.string().c_str(), "ab")))
+    {
+        printf("Error opening index file: %s\n", strerror(errno));
+        return 0;
+    };
+    if (fwrite(&record, sizeof(record), 1, fp) != 1)
+        printf("fwrite index failed: %s\n", strerror(errno));
+    fclose(fp);
+
+    return 0;
+};
+
+static bool ReadIndex(const fs::path& pathIndex, uint64_t nDataSize, std::vector<SecMsgIndexRecord>& vRecords)
+{
+    // -- true if the index describes every message in the data file, in order
+    vRecords.clear();
+
+    FILE *fp;
+    if (!(fp = fopen(pathIndex.string().c_str(), "rb")))
+        return false;
+
+    long int nLen = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        nLen = ftell(fp);
+    if (nLen < 0 || nLen % sizeof(SecMsgIndexRecord) != 0 || fseek(fp, 0, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return false;
+    };
+
+    vRecords.resize(nLen / sizeof(SecMsgIndexRecord));
+    if (vRecords.size() > 0
+        && fread(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) != vRecords.size())
+    {
+        fclose(fp);
+        return false;
+    };
+    fclose(fp);
+
+    uint64_t nEnd = 0;
+    for (std::vector<SecMsgIndexRecord>::iterator it = vRecords.begin(); it != vRecords.end(); ++it)
+    {
+        if (it->offset != (int64_t)nEnd)
+            return false;
+        nEnd += SMSG_HDR_LEN + it->nPayload;
+    };
+
+    return nEnd == nDataSize;
+};
+
+static int RebuildIndex(const fs::path& pathData, const fs::path& pathIndex, std::vector<SecMsgIndexRecord>& vRecords)
+{
+    vRecords.clear();
+
+    uint64_t nValid = 0;
+    uint64_t nSize;
+    {
+        SecMsgSegmentReader reader;
+        if (!reader.Open(pathData))
+        {
+            printf("Error opening file: %s\n", pathData.string().c_str());
+            return 1;
+        };
+        nSize = reader.size();
+
+        const unsigned char *p;
+        uint32_t nPayload;
+        while ((p = reader.GetMessage(nValid, nPayload)) != NULL)
+        {
+            SecMsgIndexRecord record;
+            MakeIndexRecord(p, p + SMSG_HDR_LEN, nPayload, nValid, record);
+            vRecords.push_back(record);
+            nValid += SMSG_HDR_LEN + nPayload;
+        };
+    }
+
+    try
+    {
+        // -- a message cut short by a crash would misplace everything appended after it
+        if (nValid != nSize)
+        {
+            printf("Truncating %s to %" PRIu64 " bytes, dropping a partly written message.\n",
+                pathData.filename().string().c_str(), nValid);
+            fs::resize_file(pathData, nValid);
+        };
+    }
+    catch (const fs::filesystem_error &ex)
+    {
+        printf("Error truncating segment %s.\n", ex.what());
+        return 1;
+    };
+
+    fs::path pathTmp = pathIndex;
+    pathTmp.replace_extension(".tmp");
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathTmp.string().c_str(), "wb")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+    if (vRecords.size() > 0
+        && fwrite(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) != vRecords.size())
+    {
+        printf("fwrite failed: %s\n", strerror(errno));
+        fclose(fp);
+        return 1;
+    };
+    fclose(fp);
+
+    if (!RenameOver(pathTmp, pathIndex))
+    {
+        printf("Error renaming %s.\n", pathTmp.string().c_str());
+        return 1;
+    };
+
+    return 0;
+};
+
+int SecureMsgSegmentLoad(int64_t bucket, std::set<SecMsgToken>& setTokens, bool& fRebuilt)
+{
+    fRebuilt = false;
+
+    fs::path pathData = SecureMsgSegmentPath(bucket, false);
+    fs::path pathIndex = SecureMsgSegmentPath(bucket, true);
+
+    uint64_t nDataSize;
+    try
+    {
+        nDataSize = fs::file_size(pathData);
+    }
+    catch (const fs::filesystem_error &ex)
+    {
+        printf("Error reading segment size %s.\n", ex.what());
+        return 1;
+    };
+
+    std::vector<SecMsgIndexRecord> vRecords;
+    if (!ReadIndex(pathIndex, nDataSize, vRecords))
+    {
+        if (fDebug)
+            printf("Rebuilding index of segment %" PRId64 ".\n", bucket);
+        if (RebuildIndex(pathData, pathIndex, vRecords) != 0)
+            return 1;
+        fRebuilt = true;
+    };
+
+    for (std::vector<SecMsgIndexRecord>::iterator it = vRecords.begin(); it != vRecords.end(); ++it)
+    {
+        if (it->nPayload < 8)
+            continue;
+
+        SecMsgToken token;
+        token.timestamp = it->timestamp;
+        memcpy(token.sample, it->sample, 8);
+        token.offset = it->offset;
+        setTokens.insert(token);
+    };
+
+    return 0;
+};
+
+void SecureMsgSegmentRemove(int64_t bucket)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        fs::path fullPath = SecureMsgSegmentPath(bucket, i == 1);
+        try
+        {
+            fs::remove(fullPath);
+        }
+        catch (const fs::filesystem_error &ex)
+        {
+            printf("Error removing bucket file %s.\n", ex.what());
+        };
+    };
+};
+
+void SecureMsgSegmentDetach(int64_t bucket, std::vector<fs::path>& vDetached)
+{
+    fs::path aPaths[3] = {SecureMsgSegmentPath(bucket, false), SecureMsgSegmentPath(bucket, true),
+                          GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(bucket) + "_01_wl.dat")};
+    for (int i = 0; i < 3; ++i)
+    {
+        fs::path pathDetached(aPaths[i].string() + ".del");
+        try
+        {
+            if (!fs::exists(aPaths[i]))
+                continue;
+            fs::rename(aPaths[i], pathDetached);
+            vDetached.push_back(pathDetached);
+        }
+        catch (const fs::filesystem_error &ex)
+        {
+            printf("Error detaching bucket file %s.\n", ex.what());
+        };
+    };
+};
+
+void SecureMsgRemoveDetached(const std::vector<fs::path>& vDetached)
+{
+    for (std::vector<fs::path>::const_iterator it = vDetached.begin(); it != vDetached.end(); ++it)
+    {
+        try
+        {
+            fs::remove(*it);
+        }
+        catch (const fs::filesystem_error &ex)
+        {
+            printf("Error removing bucket file %s.\n", ex.what());
+        };
+    };
+};
+
+uint32_t SecureMsgRetrieveBatch(int64_t bucket, const std::vector<SecMsgToken>& vTokens, std::vector<unsigned char>& vchBunch,
+                                uint32_t nMaxMessages, size_t nMaxBytes)
+{
+    if (vTokens.empty())
+        return 0;
+
+    SecMsgSegmentReader reader;
+    fs::path pathData = SecureMsgSegmentPath(bucket, false);
+    if (!reader.Open(pathData))
+    {
+        printf("Error opening file: %s\n", pathData.string().c_str());
+        return 0;
+    };
+
+    uint32_t nMessages = 0;
+    for (std::vector<SecMsgToken>::const_iterator it = vTokens.begin(); it != vTokens.end(); ++it)
+    {
+        uint32_t nPayload;
+        const unsigned char *p = reader.GetMessage(it->offset, nPayload);
+
+        // -- the sample guards against an offset that no longer points at this message
+        if (!p || nPayload < 8 || memcmp(p + SMSG_HDR_LEN, it->sample, 8) != 0)
+        {
+            printf("SecureMsgRetrieve failed %" PRId64 ".\n", it->timestamp);
+            continue;
+        };
+
+        vchBunch.insert(vchBunch.end(), p, p + SMSG_HDR_LEN + nPayload);
+        nMessages++;
+
+        if (nMessages >= nMaxMessages || vchBunch.size() >= nMaxBytes)
+            break;
+    };
+
+    return nMessages;
+};
@@ -0,0 +1,69 @@
+// Copyright (c) 2014 The DeepOnion developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SEC_MESSAGE_STORE_H
+#define SEC_MESSAGE_STORE_H
+
+#include <boost/filesystem/path.hpp>
+
+#include "smessage.h"
+
+
+// One record per message in a segment's token index, <bucket>_01.idx
+#pragma pack(push, 1)
+class SecMsgIndexRecord
+{
+public:
+    int64_t         timestamp;
+    unsigned char   sample[8];      // first 8 bytes of payload, as in SecMsgToken
+    int64_t         offset;         // of the header in <bucket>_01.dat
+    uint32_t        nPayload;
+};
+#pragma pack(pop)
+
+
+// Read only view of a segment file, memory mapped where the platform allows it
+class SecMsgSegmentReader
+{
+public:
+    SecMsgSegmentReader();
+    ~SecMsgSegmentReader();
+
+    bool Open(const boost::filesystem::path& path);
+    void Close();
+
+    // Header and payload of the message at nOffset, NULL if it runs past the end of the segment
+    const unsigned char* GetMessage(int64_t nOffset, uint32_t& nPayload) const;
+
+    size_t size() const { return nSize; }
+
+private:
+    SecMsgSegmentReader(const SecMsgSegmentReader&);
+    SecMsgSegmentReader& operator=(const SecMsgSegmentReader&);
+
+    const unsigned char*        pBegin;
+    size_t                      nSize;
+    bool                        fMapped;
+    std::vector<unsigned char>  vchData;    // file contents where it isn't mapped
+};
+
+
+boost::filesystem::path SecureMsgSegmentPath(int64_t bucket, bool fIndex);
+
+int SecureMsgSegmentAppend(int64_t bucket, unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, int64_t& nOffset);
+int SecureMsgSegmentLoad(int64_t bucket, std::set<SecMsgToken>& setTokens, bool& fRebuilt);
+void SecureMsgSegmentRemove(int64_t bucket);
+
+// Rename the segment and wallet locked files of an expired bucket to <name>.del, adding the
+// new paths to vDetached.  A store to the bucket after this starts a new segment.  Called
+// under cs_smsg, the unlinking is left to SecureMsgRemoveDetached once the lock is released.
+void SecureMsgSegmentDetach(int64_t bucket, std::vector<boost::filesystem::path>& vDetached);
+void SecureMsgRemoveDetached(const std::vector<boost::filesystem::path>& vDetached);
+
+// Append the messages of one bucket to vchBunch, reading the segment once, until
+// nMaxMessages or nMaxBytes is reached.  Returns the number of messages added.
+uint32_t SecureMsgRetrieveBatch(int64_t bucket, const std::vector<SecMsgToken>& vTokens, std::vector<unsigned char>& vchBunch,
+                                uint32_t nMaxMessages, size_t nMaxBytes);
+
+
+#endif // SEC_MESSAGE_STORE_H
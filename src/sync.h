@@ -9,6 +9,7 @@
 #include <boost/thread/recursive_mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 
 
@@ -19,6 +20,9 @@ typedef boost::recursive_mutex CCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef boost::mutex CWaitableCriticalSection;
 
+/** Wrapped boost mutex: many readers or one writer, not recursive */
+typedef boost::shared_mutex CSharedCriticalSection;
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -108,6 +112,9 @@ typedef CMutexLock<CCriticalSection> CCriticalBlock;
 #define LOCK2(cs1,cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__)
 #define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
 
+#define READ_LOCK(cs) boost::shared_lock<CSharedCriticalSection> readlock(cs)
+#define WRITE_LOCK(cs) boost::unique_lock<CSharedCriticalSection> writelock(cs)
+
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
         EnterCritical(#cs, __FILE__, __LINE__, (void*)(&cs)); \
@@ -0,0 +1,196 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+
+#include "addrindex.h"
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+static bool CollectRows(vector<CAddrIndexKey>* pvKeys, vector<int64_t>* pvValues, const CAddrIndexKey& key, int64_t nValue)
+{
+    pvKeys->push_back(key);
+    pvValues->push_back(nValue);
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(addrindex_tests)
+
+BOOST_AUTO_TEST_CASE(addrindex_key_order)
+{
+    // Rows of one address must sort by height, whatever the byte order of the machine
+    uint160 hash(1);
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION), ss3(SER_DISK, CLIENT_VERSION);
+    ss1 << CAddrIndexKey(ADDRINDEX_PUBKEYHASH, hash, 255, uint256(9), 0, false);
+    ss2 << CAddrIndexKey(ADDRINDEX_PUBKEYHASH, hash, 256, uint256(1), 0, false);
+    ss3 << CAddrIndexKey(ADDRINDEX_PUBKEYHASH, hash, 70000, uint256(0), 0, false);
+    BOOST_CHECK(ss1.str() < ss2.str());
+    BOOST_CHECK(ss2.str() < ss3.str());
+    BOOST_CHECK_EQUAL(ss1.size(), ::GetSerializeSize(CAddrIndexKey(), SER_DISK, CLIENT_VERSION));
+
+    CAddrIndexKey key;
+    ss3 >> key;
+    BOOST_CHECK_EQUAL(key.nHeight, 70000);
+    BOOST_CHECK(key.hashBytes == hash);
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_destination)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID keyID = key.GetPubKey().GetID();
+
+    unsigned char nAddrType;
+    uint160 hash;
+    CScript scriptPKH;
+    scriptPKH.SetDestination(keyID);
+    BOOST_CHECK(AddrIndexDestination(scriptPKH, nAddrType, hash));
+    BOOST_CHECK(nAddrType == ADDRINDEX_PUBKEYHASH && hash == keyID);
+
+    // Paying to the key itself files under the same address
+    CScript scriptPK;
+    scriptPK << key.GetPubKey() << OP_CHECKSIG;
+    BOOST_CHECK(AddrIndexDestination(scriptPK, nAddrType, hash));
+    BOOST_CHECK(nAddrType == ADDRINDEX_PUBKEYHASH && hash == keyID);
+
+    CScript scriptP2SH;
+    scriptP2SH.SetDestination(scriptPKH.GetID());
+    BOOST_CHECK(AddrIndexDestination(scriptP2SH, nAddrType, hash));
+    BOOST_CHECK(nAddrType == ADDRINDEX_SCRIPTHASH && hash == scriptPKH.GetID());
+
+    CScript scriptData;
+    scriptData << OP_RETURN;
+    BOOST_CHECK(!AddrIndexDestination(scriptData, nAddrType, hash));
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_connect_disconnect)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID keyID = key.GetPubKey().GetID();
+
+    CBlock block;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey.SetDestination(keyID);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[1].scriptPubKey << OP_RETURN;
+    tx.vout[1].nValue = 0;
+    block.vtx.push_back(tx);
+
+    // Far above anything else in the test chain
+    CBlockIndex index;
+    index.nHeight = 1000000;
+
+    CTxDB txdb;
+    int nOldHeight = -1;
+    bool fOldHeight = txdb.ReadAddrIndexHeight(nOldHeight);
+
+    // Not next in line, nothing happens
+    BOOST_CHECK(txdb.WriteAddrIndexHeight(index.nHeight - 2));
+    BOOST_CHECK(AddrIndexConnectBlock(txdb, block, &index, vector<CTxOut>()));
+    vector<pair<CAddrUnspentKey, CAddrUnspentValue> > vUnspent;
+    BOOST_CHECK(txdb.ReadAddrUnspent(ADDRINDEX_PUBKEYHASH, keyID, vUnspent));
+    BOOST_CHECK(vUnspent.empty());
+
+    BOOST_CHECK(txdb.WriteAddrIndexHeight(index.nHeight - 1));
+    BOOST_CHECK(AddrIndexConnectBlock(txdb, block, &index, vector<CTxOut>()));
+    int nHeight;
+    BOOST_CHECK(txdb.ReadAddrIndexHeight(nHeight));
+    BOOST_CHECK_EQUAL(nHeight, index.nHeight);
+
+    vector<CAddrIndexKey> vKeys;
+    vector<int64_t> vValues;
+    BOOST_CHECK(txdb.ScanAddrIndex(ADDRINDEX_PUBKEYHASH, keyID, 0, boost::bind(&CollectRows, &vKeys, &vValues, _1, _2)));
+    BOOST_CHECK_EQUAL(vKeys.size(), 1U);
+    if (vKeys.size() == 1)
+    {
+        BOOST_CHECK(vKeys[0].txhash == tx.GetHash());
+        BOOST_CHECK_EQUAL(vKeys[0].nHeight, index.nHeight);
+        BOOST_CHECK(!vKeys[0].fSpending);
+        BOOST_CHECK_EQUAL(vValues[0], 5 * COIN);
+    }
+
+    // Starting above the block finds nothing
+    vKeys.clear();
+    BOOST_CHECK(txdb.ScanAddrIndex(ADDRINDEX_PUBKEYHASH, keyID, index.nHeight + 1, boost::bind(&CollectRows, &vKeys, &vValues, _1, _2)));
+    BOOST_CHECK(vKeys.empty());
+
+    BOOST_CHECK(txdb.ReadAddrUnspent(ADDRINDEX_PUBKEYHASH, keyID, vUnspent));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    if (vUnspent.size() == 1)
+    {
+        BOOST_CHECK(vUnspent[0].first.txhash == tx.GetHash());
+        BOOST_CHECK_EQUAL(vUnspent[0].second.nValue, 5 * COIN);
+        BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, index.nHeight);
+    }
+
+    BOOST_CHECK(AddrIndexDisconnectBlock(txdb, block, &index));
+    BOOST_CHECK(txdb.ReadAddrIndexHeight(nHeight));
+    BOOST_CHECK_EQUAL(nHeight, index.nHeight - 1);
+    vKeys.clear();
+    vUnspent.clear();
+    BOOST_CHECK(txdb.ScanAddrIndex(ADDRINDEX_PUBKEYHASH, keyID, 0, boost::bind(&CollectRows, &vKeys, &vValues, _1, _2)));
+    BOOST_CHECK(txdb.ReadAddrUnspent(ADDRINDEX_PUBKEYHASH, keyID, vUnspent));
+    BOOST_CHECK(vKeys.empty());
+    BOOST_CHECK(vUnspent.empty());
+
+    if (fOldHeight)
+        txdb.WriteAddrIndexHeight(nOldHeight);
+    else
+        txdb.WriteAddrIndexHeight(-1);
+}
+
+BOOST_AUTO_TEST_CASE(spentindex_connect_disconnect)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID keyID = key.GetPubKey().GetID();
+
+    CTxOut prevout;
+    prevout.nValue = 3 * COIN;
+    prevout.scriptPubKey.SetDestination(keyID);
+    COutPoint outpoint(uint256(12345), 1);
+
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.resize(1);
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(outpoint));
+    tx.vout.resize(1);
+    CBlock block;
+    block.vtx.push_back(txCoinBase);
+    block.vtx.push_back(tx);
+
+    CBlockIndex index;
+    index.nHeight = 1000000;
+
+    CTxDB txdb;
+    int nOldHeight = -1;
+    bool fOldHeight = txdb.ReadSpentIndexHeight(nOldHeight);
+
+    BOOST_CHECK(txdb.WriteSpentIndexHeight(index.nHeight - 1));
+    BOOST_CHECK(SpentIndexConnectBlock(txdb, block, &index, vector<CTxOut>(1, prevout)));
+
+    CSpentIndexValue spent;
+    BOOST_CHECK(txdb.ReadSpentIndex(outpoint, spent));
+    BOOST_CHECK(spent.txhash == tx.GetHash());
+    BOOST_CHECK_EQUAL(spent.nInput, 0U);
+    BOOST_CHECK_EQUAL(spent.nHeight, index.nHeight);
+    BOOST_CHECK_EQUAL(spent.nValue, 3 * COIN);
+    BOOST_CHECK(spent.nAddrType == ADDRINDEX_PUBKEYHASH && spent.hashBytes == keyID);
+    BOOST_CHECK(!txdb.ReadSpentIndex(COutPoint(outpoint.hash, 0), spent));
+
+    BOOST_CHECK(SpentIndexDisconnectBlock(txdb, block, &index));
+    BOOST_CHECK(!txdb.ReadSpentIndex(outpoint, spent));
+    int nHeight;
+    BOOST_CHECK(txdb.ReadSpentIndexHeight(nHeight));
+    BOOST_CHECK_EQUAL(nHeight, index.nHeight - 1);
+
+    txdb.WriteSpentIndexHeight(fOldHeight ? nOldHeight : -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,55 @@
+#ifndef BITCOIN_TEST_BENCH_H
+#define BITCOIN_TEST_BENCH_H
+
+#include <stdlib.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include "util.h"
+
+/** Benchmarks of the optimised paths, kept next to the unit tests of the code they time.
+ *
+ * They only print timings and check nothing the unit tests don't, so they are skipped
+ * unless the test binary runs with DEEPONION_BENCH set:
+ *
+ *   DEEPONION_BENCH=1 test_deeponion --run_test=smessage_tests/smsg_bench_sync
+ *
+ * Each prints one or more lines starting with "bench ".
+ */
+inline bool BenchEnabled()
+{
+    return getenv("DEEPONION_BENCH") != NULL;
+}
+
+/** Microseconds since the timer was started or last restarted */
+class CBenchTimer
+{
+public:
+    CBenchTimer() : nStart(GetTimeMicros()) {}
+
+    int64_t Elapsed() const { return GetTimeMicros() - nStart; }
+
+    /** Elapsed time, and start timing the next step */
+    int64_t Lap()
+    {
+        int64_t nNow = GetTimeMicros();
+        int64_t nElapsed = nNow - nStart;
+        nStart = nNow;
+        return nElapsed;
+    }
+
+private:
+    int64_t nStart;
+};
+
+/** A test case that runs its body only when benchmarks are enabled */
+#define BENCH_TEST_CASE(name)       \
+    static void name##_bench();     \
+    BOOST_AUTO_TEST_CASE(name)      \
+    {                               \
+        if (BenchEnabled())         \
+            name##_bench();         \
+    }                               \
+    static void name##_bench()
+
+#endif
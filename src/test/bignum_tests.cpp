@@ -1,6 +1,7 @@
 #include <boost/test/unit_test.hpp>
 #include <limits>
 
+#include "arith_uint256.h"
 #include "bignum.h"
 #include "util.h"
 
@@ -122,4 +123,117 @@ BOOST_AUTO_TEST_CASE(bignum_setint64)
     }
 }
 
+// Deterministic generator so that a failing random case can be reproduced.
+static uint64_t nArithTestState = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t arithtest_rand64()
+{
+    // xorshift64*
+    nArithTestState ^= nArithTestState >> 12;
+    nArithTestState ^= nArithTestState << 25;
+    nArithTestState ^= nArithTestState >> 27;
+    return nArithTestState * 2685821657736338717ULL;
+}
+
+// Random value with a random number of significant bits (0..nMaxBits)
+static uint256 arithtest_randbits(unsigned int nMaxBits)
+{
+    uint256 n;
+    for (int i = 0; i < 4; i++)
+        n |= uint256(arithtest_rand64()) << (64 * i);
+    unsigned int nBits = arithtest_rand64() % (nMaxBits + 1);
+    if (nBits == 0)
+        return 0;
+    return n >> (256 - nBits);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_compact)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        // exercise all exponents, mantissas with and without the sign bit
+        unsigned int nCompact = (unsigned int)arithtest_rand64();
+        if (i % 2)
+            nCompact = (nCompact & 0x00ffffff) | ((i % 40) << 24);
+
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        bool fNegative, fOverflow;
+        arith_uint256 a;
+        a.SetCompact(nCompact, &fNegative, &fOverflow);
+
+        if (fNegative)
+            BOOST_CHECK(bn < 0);
+        else if (fOverflow)
+            BOOST_CHECK(bn > CBigNum(~uint256(0)));
+        else
+        {
+            BOOST_CHECK(bn >= 0);
+            BOOST_CHECK(ArithToUint256(a) == bn.getuint256());
+            BOOST_CHECK(a.GetCompact() == bn.GetCompact());
+        }
+    }
+
+    for (int i = 0; i < 20000; i++)
+    {
+        uint256 n = arithtest_randbits(256);
+        BOOST_CHECK(UintToArith256(n).GetCompact() == CBigNum(n).GetCompact());
+        BOOST_CHECK(UintToArith256(n).ToDecimalString() == CBigNum(n).ToString());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_arithmetic)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        uint256 x = arithtest_randbits(256);
+        uint256 y = arithtest_randbits(256);
+        uint256 s = arithtest_randbits(128);
+        uint256 t = arithtest_randbits(128);
+        arith_uint256 ax = UintToArith256(x), ay = UintToArith256(y);
+        arith_uint256 as = UintToArith256(s), at = UintToArith256(t);
+        CBigNum bx(x), by(y), bs(s), bt(t);
+
+        BOOST_CHECK((ax < ay) == (bx < by));
+        BOOST_CHECK((ax > ay) == (bx > by));
+        BOOST_CHECK((ax == ay) == (bx == by));
+        if (bx >= by)
+            BOOST_CHECK(ArithToUint256(ax - ay) == CBigNum(bx - by).getuint256());
+        BOOST_CHECK(ArithToUint256(as + at) == CBigNum(bs + bt).getuint256());
+        BOOST_CHECK(ArithToUint256(as * at) == CBigNum(bs * bt).getuint256());
+        if (!!y)
+            BOOST_CHECK(ArithToUint256(ax / ay) == CBigNum(bx / by).getuint256());
+        if (!!t)
+            BOOST_CHECK(ArithToUint256(ax / at) == CBigNum(bx / bt).getuint256());
+        unsigned int nShift = arithtest_rand64() % 256;
+        BOOST_CHECK(ArithToUint256(ax >> nShift) == CBigNum(bx >> nShift).getuint256());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_consensus)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        // block trust: 2^256 / (target + 1)
+        uint256 target = arithtest_randbits(256);
+        arith_uint256 aTarget = UintToArith256(target);
+        CBigNum bnTrust = (CBigNum(1) << 256) / (CBigNum(target) + 1);
+        BOOST_CHECK(ArithToUint256((~aTarget / (aTarget + 1)) + 1) == bnTrust.getuint256());
+
+        // kernel: coin-day weight times target in 512 bits, truncated to 256
+        int64 nValueIn = arithtest_rand64() >> 1;
+        int64 nTimeWeight = arithtest_rand64() % (60 * 60 * 24 * 30);
+        CBigNum bnWeight = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
+        arith_uint256 aWeight = arith_uint256(nValueIn) * arith_uint256(nTimeWeight);
+        aWeight /= COIN;
+        aWeight /= (24 * 60 * 60);
+        BOOST_CHECK(ArithToUint256(aWeight) == bnWeight.getuint256());
+
+        uint256 hash = arithtest_randbits(256);
+        BOOST_CHECK(ArithToUint256(aWeight * aTarget) == CBigNum(bnWeight * CBigNum(target)).getuint256());
+        BOOST_CHECK((arith_uint512(UintToArith256(hash)) > arith_uint512(aWeight) * arith_uint512(aTarget)) ==
+                    (CBigNum(hash) > bnWeight * CBigNum(target)));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
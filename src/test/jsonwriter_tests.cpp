@@ -0,0 +1,204 @@
+#include <boost/test/unit_test.hpp>
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_reader_template.h"
+#include "bench.h"
+#include "jsonwriter.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// Remembers the size of every piece it was handed
+class CRecordingSink : public CJSONSink
+{
+public:
+    string str;
+    vector<size_t> vWrites;
+    size_t nFailAfter;
+
+    CRecordingSink() : nFailAfter(numeric_limits<size_t>::max()) {}
+
+    bool Write(const char* pch, size_t nSize)
+    {
+        if (vWrites.size() >= nFailAfter)
+            return false;
+        str.append(pch, nSize);
+        vWrites.push_back(nSize);
+        return true;
+    }
+};
+
+static string Streamed(const Value& value, size_t nBufferSize = 65536)
+{
+    CJSONStringSink sink;
+    {
+        CJSONWriter writer(sink, nBufferSize);
+        writer.WriteValue(value);
+    }
+    return sink.str;
+}
+
+static Value SampleValue()
+{
+    Object obj;
+    obj.push_back(Pair("str", "plain"));
+    obj.push_back(Pair("escapes", "quote\" backslash\\ tab\t nl\n cr\r ff\f bs\b ctl\x01 del\x7f high\xc3\xa9"));
+    obj.push_back(Pair("empty", ""));
+    obj.push_back(Pair("int", 42));
+    obj.push_back(Pair("neg", (boost::int64_t)-9223372036854775807LL));
+    obj.push_back(Pair("uint64", (boost::uint64_t)18446744073709551615ULL));
+    obj.push_back(Pair("real", 1.5));
+    obj.push_back(Pair("amount", 12345678.12345678));
+    obj.push_back(Pair("negreal", -0.00000001));
+    obj.push_back(Pair("true", true));
+    obj.push_back(Pair("false", false));
+    obj.push_back(Pair("null", Value::null));
+    obj.push_back(Pair("emptyobj", Object()));
+    obj.push_back(Pair("emptyarr", Array()));
+    Array arr;
+    arr.push_back(1);
+    arr.push_back("two");
+    Array inner;
+    inner.push_back(Object());
+    inner.push_back(Array());
+    arr.push_back(inner);
+    arr.push_back(obj);
+    Object top;
+    top.push_back(Pair("result", arr));
+    top.push_back(Pair("error", Value::null));
+    top.push_back(Pair("id", 1));
+    return top;
+}
+
+BOOST_AUTO_TEST_SUITE(jsonwriter_tests)
+
+BOOST_AUTO_TEST_CASE(jsonwriter_matches_json_spirit)
+{
+    Value value = SampleValue();
+    BOOST_CHECK_EQUAL(Streamed(value), write_string(value, false));
+
+    // Tiny buffers must not change the text
+    BOOST_CHECK_EQUAL(Streamed(value, 1), write_string(value, false));
+    BOOST_CHECK_EQUAL(Streamed(value, 7), write_string(value, false));
+
+    // Every byte value survives a round trip through the reader
+    string strAll;
+    for (int i = 1; i < 256; i++)
+        strAll += (char)i;
+    Value valAll(strAll);
+    BOOST_CHECK_EQUAL(Streamed(valAll), write_string(valAll, false));
+    Value valBack;
+    BOOST_CHECK(read_string(Streamed(valAll), valBack));
+    BOOST_CHECK(valBack.type() == str_type && valBack.get_str() == strAll);
+
+    BOOST_CHECK_EQUAL(Streamed(Value(Array())), "[]");
+    BOOST_CHECK_EQUAL(Streamed(Value::null), "null");
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_direct)
+{
+    CJSONStringSink sink;
+    {
+        CJSONWriter writer(sink);
+        writer.BeginObject();
+        writer.Key("a");
+        writer.BeginArray();
+        writer.Int(1);
+        writer.Raw("{\"pre\":true}");
+        writer.Real(0.1);
+        writer.Null();
+        writer.EndArray();
+        writer.Key("b");
+        writer.String("x");
+        writer.Key("c");
+        writer.Bool(false);
+        writer.EndObject();
+    }
+    BOOST_CHECK_EQUAL(sink.str, "{\"a\":[1,{\"pre\":true},0.10000000,null],\"b\":\"x\",\"c\":false}");
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_chunks)
+{
+    Array arr;
+    for (int i = 0; i < 10000; i++)
+        arr.push_back(strprintf("entry %d", i));
+    string strExpected = write_string(Value(arr), false);
+
+    CRecordingSink sink;
+    {
+        CJSONWriter writer(sink, 4096);
+        writer.WriteValue(arr);
+        BOOST_CHECK(writer.Flush());
+    }
+    BOOST_CHECK_EQUAL(sink.str, strExpected);
+    BOOST_CHECK(sink.vWrites.size() > 1);
+    for (unsigned int i = 0; i < sink.vWrites.size(); i++)
+        BOOST_CHECK(sink.vWrites[i] <= 4096);
+
+    // A long raw value is cut up as well
+    CRecordingSink sinkRaw;
+    {
+        CJSONWriter writer(sinkRaw, 4096);
+        writer.Raw(strExpected);
+    }
+    BOOST_CHECK_EQUAL(sinkRaw.str, strExpected);
+    for (unsigned int i = 0; i < sinkRaw.vWrites.size(); i++)
+        BOOST_CHECK(sinkRaw.vWrites[i] <= 4096);
+
+    // Nothing more reaches a sink after it failed
+    CRecordingSink sinkFail;
+    sinkFail.nFailAfter = 2;
+    {
+        CJSONWriter writer(sinkFail, 4096);
+        writer.WriteValue(arr);
+        BOOST_CHECK(writer.IsFailed());
+        BOOST_CHECK(!writer.Flush());
+    }
+    BOOST_CHECK_EQUAL(sinkFail.vWrites.size(), 2U);
+}
+
+// Shaped like a listtransactions reply of nEntries
+static Value ListShaped(int nEntries)
+{
+    Array arr;
+    for (int i = 0; i < nEntries; i++)
+    {
+        Object entry;
+        entry.push_back(Pair("account", ""));
+        entry.push_back(Pair("address", "DeepOnionAddressxxxxxxxxxxxxxxxxx"));
+        entry.push_back(Pair("category", "receive"));
+        entry.push_back(Pair("amount", 1.23456789 * i));
+        entry.push_back(Pair("confirmations", i));
+        entry.push_back(Pair("txid", "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+        entry.push_back(Pair("time", (boost::int64_t)1500000000 + i));
+        arr.push_back(entry);
+    }
+    return Value(arr);
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_list)
+{
+    Value value = ListShaped(200);
+    BOOST_CHECK_EQUAL(Streamed(value), write_string(value, false));
+}
+
+BENCH_TEST_CASE(jsonwriter_bench)
+{
+    Value value = ListShaped(10000);
+
+    CBenchTimer timer;
+    string strOld = write_string(value, false);
+    int64_t nOld = timer.Lap();
+    string strNew = Streamed(value);
+    int64_t nNew = timer.Lap();
+
+    printf("bench jsonwriter 10000 entries, %" PRIszu " bytes: json_spirit %" PRId64 " us, CJSONWriter %" PRId64 " us\n",
+           strNew.size(), nOld, nNew);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
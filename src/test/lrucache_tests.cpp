@@ -0,0 +1,64 @@
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+#include "lrucache.h"
+#include "util.h"
+
+#define MAX_SIZE 100
+
+BOOST_AUTO_TEST_SUITE(lrucache_tests)
+
+// Test that an lrucache holds what a map does, as long as no more than MAX_SIZE keys are in it
+BOOST_AUTO_TEST_CASE(lrucache_like_map)
+{
+    lrucache<int, int> lru(MAX_SIZE);
+    map<int, int> m;
+    while (m.size() < MAX_SIZE)
+    {
+        int k = GetRandInt(2 * MAX_SIZE);
+        int v = GetRandInt(1000);
+        lru.insert(make_pair(k, v));
+        m[k] = v;
+        BOOST_CHECK_EQUAL(lru.size(), m.size());
+    }
+    for (map<int, int>::iterator it = m.begin(); it != m.end(); ++it)
+    {
+        int v;
+        BOOST_CHECK(lru.get(it->first, v));
+        BOOST_CHECK_EQUAL(v, it->second);
+    }
+}
+
+// Test that the least recently used key is the one dropped
+BOOST_AUTO_TEST_CASE(lrucache_evicts_lru)
+{
+    lrucache<int, int> lru(3);
+    lru.insert(make_pair(1, 10));
+    lru.insert(make_pair(2, 20));
+    lru.insert(make_pair(3, 30));
+
+    int v;
+    BOOST_CHECK(lru.get(1, v)); // 2 is now the oldest
+    lru.insert(make_pair(4, 40));
+    BOOST_CHECK_EQUAL(lru.size(), 3U);
+    BOOST_CHECK(!lru.count(2));
+    BOOST_CHECK(lru.count(1) && lru.count(3) && lru.count(4));
+
+    // Inserting a key again replaces its value and makes it the newest
+    lru.insert(make_pair(3, 31));
+    lru.insert(make_pair(5, 50));
+    BOOST_CHECK(!lru.count(1));
+    BOOST_CHECK(lru.get(3, v));
+    BOOST_CHECK_EQUAL(v, 31);
+
+    lru.erase(3);
+    BOOST_CHECK(!lru.get(3, v));
+    lru.max_size(1);
+    BOOST_CHECK_EQUAL(lru.size(), 1U);
+    BOOST_CHECK(lru.count(5));
+    lru.clear();
+    BOOST_CHECK(lru.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
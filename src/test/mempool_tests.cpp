@@ -0,0 +1,120 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_dump_read)
+{
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::remove(pathMempool);
+
+    // Nothing saved yet, and nothing is dumped until the load has run
+    vector<CTransaction> vtx;
+    BOOST_CHECK(!ReadMempool(vtx));
+    ThreadLoadMempool(NULL);
+
+    // A chain of transactions, each spending the one before, added in reverse so
+    // the pool's hash order doesn't happen to match the spending order
+    vector<CTransaction> vChain(8);
+    for (unsigned int i = 0; i < vChain.size(); i++)
+    {
+        vChain[i].vin.resize(1);
+        vChain[i].vin[0].prevout = COutPoint(i == 0 ? uint256(1) : vChain[i - 1].GetHash(), 0);
+        vChain[i].vout.resize(1);
+        vChain[i].vout[0].nValue = (100 - i) * CENT;
+    }
+    {
+        LOCK(mempool.cs);
+        for (int i = vChain.size() - 1; i >= 0; i--)
+            mempool.addUnchecked(vChain[i].GetHash(), vChain[i]);
+    }
+
+    BOOST_REQUIRE(DumpMempool());
+    BOOST_REQUIRE(ReadMempool(vtx));
+    BOOST_CHECK_EQUAL(vtx.size(), vChain.size());
+    for (unsigned int i = 0; i < vtx.size() && i < vChain.size(); i++)
+        BOOST_CHECK(vtx[i] == vChain[i]);
+
+    // A damaged file is rejected as a whole
+    FILE* file = fopen(pathMempool.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, 10, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, 10, SEEK_SET);
+    fputc(c ^ 0xff, file);
+    fclose(file);
+    BOOST_CHECK(!ReadMempool(vtx));
+    BOOST_CHECK(vtx.empty());
+
+    mempool.remove(vChain[0], true);
+    BOOST_CHECK(!mempool.exists(vChain.back().GetHash()));
+    boost::filesystem::remove(pathMempool);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_dump_long_chain)
+{
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+
+    // Parents still come first for a chain far longer than the dump could recurse through
+    vector<CTransaction> vChain(20000);
+    for (unsigned int i = 0; i < vChain.size(); i++)
+    {
+        vChain[i].vin.resize(1);
+        vChain[i].vin[0].prevout = COutPoint(i == 0 ? uint256(2) : vChain[i - 1].GetHash(), 0);
+        vChain[i].vout.resize(1);
+        vChain[i].vout[0].nValue = CENT;
+    }
+    {
+        LOCK(mempool.cs);
+        for (int i = vChain.size() - 1; i >= 0; i--)
+            mempool.addUnchecked(vChain[i].GetHash(), vChain[i]);
+    }
+
+    vector<CTransaction> vtx;
+    BOOST_REQUIRE(DumpMempool());
+    BOOST_REQUIRE(ReadMempool(vtx));
+    BOOST_REQUIRE_EQUAL(vtx.size(), vChain.size());
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        BOOST_REQUIRE(vtx[i] == vChain[i]);
+
+    mempool.clear();
+    boost::filesystem::remove(pathMempool);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_read_count_past_end)
+{
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+
+    // A count far beyond the data isn't allocated for, the transactions there are are read
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(3), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = CENT;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(pchMessageStart) << 1;
+    WriteCompactSize(ss, (uint64_t)0xffffffff);
+    ss << tx;
+    ss << Hash(ss.begin(), ss.end());
+
+    FILE* file = fopen(pathMempool.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    fileout << ss;
+    fileout.fclose();
+
+    vector<CTransaction> vtx;
+    BOOST_CHECK(ReadMempool(vtx));
+    BOOST_REQUIRE_EQUAL(vtx.size(), 1U);
+    BOOST_CHECK(vtx[0] == tx);
+
+    boost::filesystem::remove(pathMempool);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
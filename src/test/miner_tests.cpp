@@ -224,4 +224,18 @@ BOOST_AUTO_TEST_CASE(sha256transform_equality)
     BOOST_CHECK(hash == hash_reference);
 }
 
+BOOST_AUTO_TEST_CASE(longpoll_wait)
+{
+    // Nothing changes in the test, the wait runs into its timeout
+    int64_t nStart = GetTimeMillis();
+    BOOST_CHECK(!WaitForChainChange(hashBestChain, nTransactionsUpdated, true, 100));
+    BOOST_CHECK(GetTimeMillis() - nStart >= 90);
+
+    // Stale work is reported at once
+    BOOST_CHECK(WaitForChainChange(uint256(1), nTransactionsUpdated, false, 10000));
+    BOOST_CHECK(WaitForChainChange(hashBestChain, nTransactionsUpdated + 1, true, 10000));
+    // Memory pool changes only count once the caller asks for them
+    BOOST_CHECK(!WaitForChainChange(hashBestChain, nTransactionsUpdated + 1, false, 10));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,238 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "bench.h"
+#include "netpoll.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#endif
+
+using namespace std;
+
+#ifndef WIN32
+static void SetNonBlocking(SOCKET hSocket)
+{
+    fcntl(hSocket, F_SETFL, fcntl(hSocket, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Open up to nConnections loopback connections, returns the number opened
+static int OpenLoopbackPairs(int nConnections, vector<SOCKET>& vClient, vector<SOCKET>& vServer)
+{
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    BOOST_REQUIRE(listen(hListen, SOMAXCONN) == 0);
+    socklen_t len = sizeof(addr);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&addr, &len) == 0);
+
+    for (int i = 0; i < nConnections; i++)
+    {
+        SOCKET hClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (hClient == INVALID_SOCKET)
+            break;
+        if (connect(hClient, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            closesocket(hClient);
+            break;
+        }
+        SOCKET hServer = accept(hListen, NULL, NULL);
+        if (hServer == INVALID_SOCKET)
+        {
+            closesocket(hClient);
+            break;
+        }
+        int nOne = 1;
+        setsockopt(hClient, IPPROTO_TCP, TCP_NODELAY, (const char*)&nOne, sizeof(nOne));
+        SetNonBlocking(hServer);
+        vClient.push_back(hClient);
+        vServer.push_back(hServer);
+    }
+    closesocket(hListen);
+    return vClient.size();
+}
+
+static void ClosePairs(vector<SOCKET>& vClient, vector<SOCKET>& vServer)
+{
+    for (unsigned int i = 0; i < vClient.size(); i++)
+    {
+        closesocket(vClient[i]);
+        closesocket(vServer[i]);
+    }
+    vClient.clear();
+    vServer.clear();
+}
+
+// Read everything pending on a server socket, as an edge-triggered poller requires
+static int Drain(SOCKET hSocket)
+{
+    char pchBuf[4096];
+    int nTotal = 0;
+    while (true)
+    {
+        int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes <= 0)
+            break;
+        nTotal += nBytes;
+    }
+    return nTotal;
+}
+
+// Send one message per connection, ping-pong style, and check the poller reports it
+// on the accepting side.  fReport prints how long that took.
+static void StressPoller(CSocketPoller* poller, int nWanted, bool fReport)
+{
+    vector<SOCKET> vClient, vServer;
+    int nConnections = OpenLoopbackPairs(nWanted, vClient, vServer);
+    BOOST_TEST_MESSAGE(strprintf("%s: %d of %d loopback connections", poller->GetName(), nConnections, nWanted));
+    BOOST_REQUIRE(nConnections > 0);
+
+    int nWatched = 0;
+    for (int i = 0; i < nConnections; i++)
+        if (poller->Add(vServer[i], (void*)(intptr_t)(i + 1)))
+            nWatched++;
+    BOOST_REQUIRE(nWatched > 0);
+
+    // Swallow the initial writability events
+    vector<CPollEvent> vEvents;
+    poller->Wait(0, vEvents);
+
+    const char pchMsg[64] = "ping";
+    vector<int64_t> vLatency;
+    int nLost = 0;
+    for (int i = 0; i < nWatched; i++)
+    {
+        int64_t nStart = GetTimeMicros();
+        BOOST_REQUIRE(send(vClient[i], pchMsg, sizeof(pchMsg), MSG_NOSIGNAL) == (int)sizeof(pchMsg));
+        bool fFound = false;
+        while (!fFound && GetTimeMicros() - nStart < 1000000)
+        {
+            poller->Wait(100, vEvents);
+            BOOST_FOREACH(const CPollEvent& event, vEvents)
+            {
+                int n = (int)(intptr_t)event.pcookie - 1;
+                if (event.fRecv && Drain(vServer[n]) > 0 && n == i)
+                    fFound = true;
+            }
+        }
+        if (fFound)
+            vLatency.push_back(GetTimeMicros() - nStart);
+        else
+            nLost++;
+    }
+    BOOST_CHECK_EQUAL(nLost, 0);
+
+    // Everybody talks at once, every socket must be reported
+    for (int i = 0; i < nWatched; i++)
+        send(vClient[i], pchMsg, sizeof(pchMsg), MSG_NOSIGNAL);
+    vector<bool> vSeen(nWatched, false);
+    int nSeen = 0;
+    int64_t nStart = GetTimeMicros();
+    while (nSeen < nWatched && GetTimeMicros() - nStart < 5000000)
+    {
+        poller->Wait(100, vEvents);
+        BOOST_FOREACH(const CPollEvent& event, vEvents)
+        {
+            int n = (int)(intptr_t)event.pcookie - 1;
+            if (event.fRecv && Drain(vServer[n]) > 0 && !vSeen[n])
+            {
+                vSeen[n] = true;
+                nSeen++;
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL(nSeen, nWatched);
+    int64_t nBurst = GetTimeMicros() - nStart;
+
+    // A removed socket is never reported again
+    poller->Remove(vServer[0]);
+    send(vClient[0], pchMsg, sizeof(pchMsg), MSG_NOSIGNAL);
+    poller->Wait(50, vEvents);
+    BOOST_FOREACH(const CPollEvent& event, vEvents)
+        BOOST_CHECK(event.hSocket != vServer[0]);
+
+    if (fReport && !vLatency.empty())
+    {
+        sort(vLatency.begin(), vLatency.end());
+        int64_t nSum = 0;
+        BOOST_FOREACH(int64_t n, vLatency)
+            nSum += n;
+        printf("bench netpoll %-6s %5d connections: latency avg %" PRId64 " us, p99 %" PRId64 " us, max %" PRId64 " us, burst %" PRId64 " us\n",
+               poller->GetName(), nWatched, nSum / (int64_t)vLatency.size(),
+               vLatency[vLatency.size() * 99 / 100], vLatency.back(), nBurst);
+    }
+
+    for (int i = 1; i < nWatched; i++)
+        poller->Remove(vServer[i]);
+    ClosePairs(vClient, vServer);
+}
+
+// Each connection takes two descriptors in this process
+static int RaiseDescriptorLimit(int nConnections)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return nConnections;
+    rlim_t nWanted = 2 * nConnections + 64;
+    if (limit.rlim_cur < nWanted)
+    {
+        limit.rlim_cur = min(nWanted, limit.rlim_max);
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return min(nConnections, (int)((limit.rlim_cur - 64) / 2));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE(netpoll_tests)
+
+#ifndef WIN32
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(netpoll_epoll_loopback)
+{
+    CEpollPoller poller;
+    BOOST_REQUIRE(poller.IsValid());
+    StressPoller(&poller, RaiseDescriptorLimit(64), false);
+}
+
+BENCH_TEST_CASE(netpoll_epoll_bench)
+{
+    CEpollPoller poller;
+    BOOST_REQUIRE(poller.IsValid());
+    StressPoller(&poller, RaiseDescriptorLimit(2000), true);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(netpoll_select_loopback)
+{
+    CSelectPoller poller;
+    StressPoller(&poller, RaiseDescriptorLimit(64), false);
+}
+
+BENCH_TEST_CASE(netpoll_select_bench)
+{
+    // select() can't go past FD_SETSIZE, stay well below it
+    CSelectPoller poller;
+    StressPoller(&poller, min(RaiseDescriptorLimit(2000), (FD_SETSIZE - 64) / 2), true);
+}
+
+BOOST_AUTO_TEST_CASE(netpoll_select_limit)
+{
+    CSelectPoller poller;
+    BOOST_CHECK(!poller.CanWatch(INVALID_SOCKET));
+    BOOST_CHECK(!poller.CanWatch(FD_SETSIZE));
+    BOOST_CHECK(poller.CanWatch(FD_SETSIZE - 1));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,97 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "netbase.h"
+#include "pushnotify.h"
+
+using namespace std;
+
+// Read exactly nSize bytes, false on timeout or error
+static bool RecvAll(SOCKET hSocket, char* pch, size_t nSize)
+{
+    while (nSize > 0)
+    {
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+        struct timeval timeout = { 2, 0 };
+        if (select(hSocket + 1, &fdset, NULL, NULL, &timeout) <= 0)
+            return false;
+        int nBytes = recv(hSocket, pch, nSize, 0);
+        if (nBytes <= 0)
+            return false;
+        pch += nBytes;
+        nSize -= nBytes;
+    }
+    return true;
+}
+
+static bool RecvFrame(SOCKET hSocket, string& strTopic, unsigned int& nSequence, string& strBody)
+{
+    unsigned int nSize;
+    if (!RecvAll(hSocket, (char*)&nSize, sizeof(nSize)) || nSize > 10000000)
+        return false;
+    vector<char> vch(nSize);
+    if (!RecvAll(hSocket, &vch[0], nSize))
+        return false;
+    CDataStream ss(vch, SER_NETWORK, PROTOCOL_VERSION);
+    ss >> strTopic >> nSequence;
+    strBody = string(ss.begin(), ss.end());
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(pushnotify_tests)
+
+BOOST_AUTO_TEST_CASE(pushnotify_frames)
+{
+    mapArgs["-pushnotify"] = "28593";
+    string strError;
+    BOOST_REQUIRE_MESSAGE(StartPushNotify(strError), strError);
+
+    SOCKET hSocket;
+    BOOST_REQUIRE(ConnectSocket(CService("127.0.0.1", 28593), hSocket));
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+
+    // Nothing is sent until the publisher has taken the connection
+    bool fReady = false;
+    for (int i = 0; i < 50 && !fReady; i++)
+    {
+        PushNotifyTransaction(tx);
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+        struct timeval timeout = { 0, 100000 };
+        fReady = select(hSocket + 1, &fdset, NULL, NULL, &timeout) > 0;
+    }
+    BOOST_REQUIRE(fReady);
+
+    string strTopic, strBody;
+    unsigned int nSequence, nSequenceRaw;
+    BOOST_REQUIRE(RecvFrame(hSocket, strTopic, nSequence, strBody));
+    BOOST_CHECK_EQUAL(strTopic, "hashtx");
+    uint256 hash = tx.GetHash();
+    BOOST_CHECK(strBody == string((const char*)hash.begin(), (const char*)hash.end()));
+
+    BOOST_REQUIRE(RecvFrame(hSocket, strTopic, nSequenceRaw, strBody));
+    BOOST_CHECK_EQUAL(strTopic, "rawtx");
+    BOOST_CHECK_EQUAL(nSequence, nSequenceRaw);
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    BOOST_CHECK(strBody == ssTx.str());
+
+    // Sequence numbers count up per topic
+    PushNotifyTransaction(tx);
+    BOOST_REQUIRE(RecvFrame(hSocket, strTopic, nSequenceRaw, strBody));
+    BOOST_CHECK_EQUAL(strTopic, "hashtx");
+    BOOST_CHECK_EQUAL(nSequenceRaw, nSequence + 1);
+
+    closesocket(hSocket);
+    StopPushNotify();
+    mapArgs.erase("-pushnotify");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
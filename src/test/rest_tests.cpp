@@ -0,0 +1,112 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bitcoinrpc.h"
+#include "main.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// Splits what the handler sent into status, headers and body
+class CRESTReply : public CJSONSink
+{
+public:
+    string str;
+
+    bool Write(const char* pch, size_t nSize)
+    {
+        str.append(pch, nSize);
+        return true;
+    }
+
+    int Status() const
+    {
+        return atoi(str.substr(str.find(' ') + 1, 3));
+    }
+
+    string Header(const string& strName) const
+    {
+        size_t nPos = str.find("\r\n" + strName + ": ");
+        if (nPos == string::npos)
+            return "";
+        nPos += strName.size() + 4;
+        return str.substr(nPos, str.find("\r\n", nPos) - nPos);
+    }
+
+    string Body() const
+    {
+        return str.substr(str.find("\r\n\r\n") + 4);
+    }
+};
+
+static CRESTReply REST(const string& strURI, const string& strMethod = "GET")
+{
+    CRESTReply reply;
+    HTTPReq_REST(reply, strMethod, strURI, true);
+    return reply;
+}
+
+BOOST_AUTO_TEST_SUITE(rest_tests)
+
+BOOST_AUTO_TEST_CASE(rest_errors)
+{
+    string strGenesis = hashGenesisBlock.GetHex();
+    BOOST_CHECK_EQUAL(REST("/rest/nothing").Status(), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(REST("/rest/block/" + strGenesis + ".xml").Status(), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(REST("/rest/block/1234.bin").Status(), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(REST("/rest/block/" + uint256(1).GetHex() + ".bin").Status(), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(REST("/rest/block/" + strGenesis + ".bin", "POST").Status(), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(REST("/rest/headers/0/" + strGenesis + ".bin").Status(), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(REST("/rest/headers/2001/" + strGenesis + ".bin").Status(), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(REST("/rest/nothing").Header("Content-Type"), "text/plain");
+}
+
+BOOST_AUTO_TEST_CASE(rest_block)
+{
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexGenesisBlock, true));
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    string strGenesis = hashGenesisBlock.GetHex();
+
+    // Binary comes straight from the block file
+    CRESTReply reply = REST("/rest/block/" + strGenesis + ".bin");
+    BOOST_CHECK_EQUAL(reply.Status(), HTTP_OK);
+    BOOST_CHECK_EQUAL(reply.Header("Content-Type"), "application/octet-stream");
+    BOOST_CHECK_EQUAL(atoi(reply.Header("Content-Length")), (int)ssBlock.size());
+    BOOST_CHECK(reply.Body() == ssBlock.str());
+
+    reply = REST("/rest/block/" + strGenesis + ".hex");
+    BOOST_CHECK_EQUAL(reply.Status(), HTTP_OK);
+    BOOST_CHECK_EQUAL(reply.Body(), HexStr(ssBlock.begin(), ssBlock.end()) + "\n");
+    BOOST_CHECK_EQUAL(atoi(reply.Header("Content-Length")), (int)reply.Body().size());
+
+    reply = REST("/rest/block/" + strGenesis + ".json");
+    BOOST_CHECK_EQUAL(reply.Status(), HTTP_OK);
+    Value value;
+    BOOST_CHECK(read_string(reply.Body(), value));
+    BOOST_CHECK(value.type() == obj_type);
+    BOOST_CHECK_EQUAL(find_value(value.get_obj(), "hash").get_str(), strGenesis);
+    BOOST_CHECK_EQUAL(find_value(value.get_obj(), "height").get_int(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rest_headers_and_tx)
+{
+    string strGenesis = hashGenesisBlock.GetHex();
+
+    CRESTReply reply = REST("/rest/headers/5/" + strGenesis + ".bin");
+    BOOST_CHECK_EQUAL(reply.Status(), HTTP_OK);
+    CDataStream ssHeader(SER_NETWORK | SER_BLOCKHEADERONLY, PROTOCOL_VERSION);
+    ssHeader << pindexGenesisBlock->GetBlockHeader();
+    BOOST_CHECK(reply.Body() == ssHeader.str());
+    BOOST_CHECK_EQUAL(reply.Body().size(), 80U);
+
+    reply = REST("/rest/headers/1/" + strGenesis);
+    Value value;
+    BOOST_CHECK(read_string(reply.Body(), value));
+    BOOST_CHECK(value.type() == array_type && value.get_array().size() == 1);
+
+    BOOST_CHECK_EQUAL(REST("/rest/tx/" + uint256(1).GetHex() + ".hex").Status(), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(REST("/rest/tx/xyz.bin").Status(), HTTP_BAD_REQUEST);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
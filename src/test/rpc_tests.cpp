@@ -2,8 +2,11 @@
 #include <boost/foreach.hpp>
 
 #include "base58.h"
+#include "bench.h"
 #include "util.h"
 #include "bitcoinrpc.h"
+#include "wallet.h"
+#include "init.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -59,4 +62,147 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_readonly_commands)
+{
+    // Read-only calls run concurrently under cs_blockindex, they must not be
+    // ones that change the wallet or the chain
+    BOOST_CHECK(tableRPC["getblock"]->readonly);
+    BOOST_CHECK(tableRPC["getblockhash"]->readonly);
+    BOOST_CHECK(tableRPC["getrawtransaction"]->readonly);
+    BOOST_CHECK(!tableRPC["sendtoaddress"]->readonly);
+    BOOST_CHECK(!tableRPC["submitblock"]->readonly);
+    BOOST_CHECK(!tableRPC["getbalance"]->readonly);
+
+    BOOST_FOREACH(const string& strMethod, tableRPC.listCommands())
+    {
+        const CRPCCommand *pcmd = tableRPC[strMethod];
+        BOOST_CHECK_MESSAGE(!(pcmd->readonly && pcmd->unlocked), strMethod);
+        BOOST_CHECK_MESSAGE(!pcmd->readonly || pcmd->category == "blockchain" || pcmd->category == "rawtransactions", strMethod);
+    }
+}
+
+extern void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, Array& ret);
+
+// nTransactions payments to somebody else, faked as sent by us, listed the way listtransactions
+// used to, as a tree written out as one string, into strOld, and streamed into strNew.  The
+// time each took in nOld and nNew.
+static void ListTransactionsBothWays(int nTransactions, string& strOld, string& strNew, int64_t& nOld, int64_t& nNew)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    vector<uint256> vHashes;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        for (int i = 0; i < nTransactions; i++)
+        {
+            CTransaction tx;
+            tx.nLockTime = i;
+            tx.vin.resize(1);
+            tx.vout.push_back(CTxOut((i + 1) * CENT, scriptPubKey));
+            CWalletTx wtx(pwalletMain, tx);
+            wtx.fDebitCached = true;
+            wtx.nDebitCached = (i + 1) * CENT + MIN_TX_FEE;
+            wtx.nOrderPos = 1000000 + i;
+            wtx.nTimeReceived = 1500000000 + i;
+            pwalletMain->mapWallet[tx.GetHash()] = wtx;
+            vHashes.push_back(tx.GetHash());
+        }
+    }
+
+    Array params;
+    params.push_back("*");
+    params.push_back(nTransactions);
+
+    CBenchTimer timer;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        Array ret;
+        list<CAccountingEntry> acentries;
+        CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, "*");
+        for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+        {
+            if ((*it).second.first)
+                ListTransactions(*(*it).second.first, "*", 0, true, ret);
+            if ((int)ret.size() >= nTransactions)
+                break;
+        }
+        reverse(ret.begin(), ret.end());
+        strOld = write_string(Value(ret), false);
+    }
+    nOld = timer.Lap();
+
+    CJSONStringSink sink;
+    {
+        CJSONWriter writer(sink);
+        BOOST_CHECK(tableRPC.execute("listtransactions", params, writer));
+    }
+    nNew = timer.Lap();
+    strNew = sink.str;
+
+    // The Value interface still gives the same result
+    BOOST_CHECK_EQUAL(write_string(tableRPC.execute("listtransactions", params), false), strNew);
+
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_FOREACH(const uint256& hash, vHashes)
+            pwalletMain->mapWallet.erase(hash);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpc_listtransactions_streamed)
+{
+    string strOld, strNew;
+    int64_t nOld, nNew;
+    ListTransactionsBothWays(200, strOld, strNew, nOld, nNew);
+    BOOST_CHECK_EQUAL(strOld, strNew);
+}
+
+BENCH_TEST_CASE(rpc_listtransactions_bench)
+{
+    const int nTransactions = 10000;
+    string strOld, strNew;
+    int64_t nOld, nNew;
+    ListTransactionsBothWays(nTransactions, strOld, strNew, nOld, nNew);
+
+    printf("bench listtransactions %d transactions, %" PRIszu " bytes: tree %" PRId64 " us, streamed %" PRId64 " us\n",
+           nTransactions, strNew.size(), nOld, nNew);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_stats)
+{
+    BOOST_CHECK_EQUAL(RPCStatsBucket(0), 0);
+    BOOST_CHECK_EQUAL(RPCStatsBucket(127), 0);
+    BOOST_CHECK_EQUAL(RPCStatsBucket(128), 1);
+    BOOST_CHECK_EQUAL(RPCStatsBucket(255), 1);
+    BOOST_CHECK_EQUAL(RPCStatsBucket(256), 2);
+    BOOST_CHECK_EQUAL(RPCStatsBucket(std::numeric_limits<int64_t>::max()), RPC_STATS_BUCKETS - 1);
+
+    map<string, CRPCMethodStats> mapStats;
+    GetRPCStats(mapStats, true);
+
+    // Timed by execute, including the calls that fail
+    tableRPC.execute("getblockcount", Array());
+    tableRPC.execute("getblockcount", Array());
+    Array params;
+    params.push_back(1);
+    BOOST_CHECK_THROW(tableRPC.execute("getblockcount", params), Object);
+    RecordRPCCall("test", 50, 1000, false);
+
+    GetRPCStats(mapStats);
+    BOOST_CHECK_EQUAL(mapStats["getblockcount"].nCount, 3U);
+    BOOST_CHECK_EQUAL(mapStats["getblockcount"].nErrors, 1U);
+    BOOST_CHECK_EQUAL(mapStats["test"].nMaxMicros, 1000);
+    BOOST_CHECK_EQUAL(mapStats["test"].nLockWaitMicros, 50);
+    BOOST_CHECK_EQUAL(mapStats["test"].vHistogram[RPCStatsBucket(1000)], 1U);
+
+    Value value = tableRPC.execute("getrpcstats", Array());
+    const Object& obj = find_value(value.get_obj(), "test").get_obj();
+    BOOST_CHECK_EQUAL(find_value(obj, "count").get_int(), 1);
+    BOOST_CHECK_EQUAL(find_value(find_value(obj, "histogram").get_obj(), "<1024").get_int(), 1);
+
+    GetRPCStats(mapStats, true);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,221 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bench.h"
+#include "main.h"
+#include "serialize.h"
+#include "util.h"
+
+using namespace std;
+
+// Build a block with nTx simple pay-to-pubkey-hash style transactions
+static CBlock MakeBenchBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0fffff;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.nTime = block.nTime;
+        tx.vin.resize(2);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = i;
+        tx.vin[0].scriptSig << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+        tx.vin[1] = tx.vin[0];
+        tx.vin[1].prevout.n = i + 1;
+        tx.vout.resize(2);
+        tx.vout[0].nValue = 50 * COIN;
+        tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i & 0xff) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1] = tx.vout[0];
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(serialize_tests)
+
+BOOST_AUTO_TEST_CASE(spanstream_matches_datastream)
+{
+    CBlock block = MakeBenchBlock(10);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    string str = ss.str();
+
+    CBlock blockData;
+    CDataStream ssRead(str.data(), str.data() + str.size(), SER_NETWORK, PROTOCOL_VERSION);
+    ssRead >> blockData;
+
+    CBlock blockSpan;
+    CSpanStream ssSpan(str, SER_NETWORK, PROTOCOL_VERSION);
+    ssSpan >> blockSpan;
+
+    BOOST_CHECK(ssSpan.empty());
+    BOOST_CHECK(blockSpan.GetHash() == block.GetHash());
+    BOOST_CHECK(blockSpan.GetHash() == blockData.GetHash());
+    BOOST_CHECK(blockSpan.vtx.size() == block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(blockSpan.vtx[i].GetHash() == block.vtx[i].GetHash());
+
+    // The borrowed buffer is never consumed
+    BOOST_CHECK(str.size() == ss.size());
+}
+
+BOOST_AUTO_TEST_CASE(spanstream_end_of_data)
+{
+    const char pch[] = { 1, 2, 3 };
+    CSpanStream ss(pch, pch + sizeof(pch), SER_NETWORK, PROTOCOL_VERSION);
+
+    unsigned char ch;
+    ss >> ch;
+    BOOST_CHECK(ch == 1);
+    BOOST_CHECK(ss.size() == 2);
+
+    BOOST_CHECK(ss.Rewind(1));
+    BOOST_CHECK(!ss.Rewind(2));
+    BOOST_CHECK(ss.size() == 3);
+
+    unsigned int n;
+    BOOST_CHECK_THROW(ss >> n, std::ios_base::failure);
+
+    // Reads past the end must not touch memory beyond the span
+    CSpanStream ssEmpty(pch, pch, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ssEmpty.empty());
+    BOOST_CHECK_THROW(ssEmpty >> ch, std::ios_base::failure);
+    BOOST_CHECK_THROW(ssEmpty.ignore(1), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(publicdatastream_roundtrip)
+{
+    CTransaction tx = MakeBenchBlock(1).vtx[0];
+    CPublicDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << tx;
+
+    string str = ss.str();
+    CDataStream ssCopy(str.data(), str.data() + str.size(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(ssCopy.str() == str);
+
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    BOOST_CHECK(ss.empty());
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_header_and_checksum)
+{
+    CTransaction tx = MakeBenchBlock(1).vtx[0];
+    CNetMessageRef msg = MakeNetMessage("tx", tx);
+    unsigned int nPayload = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE + nPayload);
+
+    // The header reads back as a valid one for this payload
+    CSpanStream ss(msg->data(), msg->data() + msg->size(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK(hdr.GetCommand() == "tx");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, nPayload);
+
+    uint256 hash = Hash(ss.begin(), ss.begin() + hdr.nMessageSize);
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(nChecksum, hdr.nChecksum);
+
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    BOOST_CHECK(ss.empty());
+}
+
+//
+// Microbenchmarks, timings are printed rather than checked
+//
+static void PrintBench(const char* pszName, int64_t nElapsed, unsigned int nIters, unsigned int nBytes)
+{
+    if (nElapsed <= 0)
+        nElapsed = 1;
+    printf("bench %-32s %8.2f us/op %8.1f MB/s\n", pszName, (double)nElapsed / nIters,
+           (double)nBytes * nIters / nElapsed);
+}
+
+BENCH_TEST_CASE(block_deserialize_bench)
+{
+    CBlock block = MakeBenchBlock(1000);
+    CPublicDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    string str = ss.str();
+    const unsigned int nIters = 50;
+
+    CBenchTimer timer;
+    for (unsigned int i = 0; i < nIters; i++)
+    {
+        CDataStream ssCopy(str.data(), str.data() + str.size(), SER_NETWORK, PROTOCOL_VERSION);
+        CBlock blockRead;
+        ssCopy >> blockRead;
+    }
+    PrintBench("block CDataStream copy", timer.Lap(), nIters, str.size());
+
+    timer.Lap();
+    for (unsigned int i = 0; i < nIters; i++)
+    {
+        CSpanStream ssSpan(str, SER_NETWORK, PROTOCOL_VERSION);
+        CBlock blockRead;
+        ssSpan >> blockRead;
+    }
+    PrintBench("block CSpanStream", timer.Lap(), nIters, str.size());
+}
+
+BENCH_TEST_CASE(block_serialize_bench)
+{
+    CBlock block = MakeBenchBlock(1000);
+    const unsigned int nIters = 50;
+    unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+
+    CBenchTimer timer;
+    for (unsigned int i = 0; i < nIters; i++)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss.reserve(nSize);
+        ss << block;
+    }
+    PrintBench("block CDataStream serialize", timer.Lap(), nIters, nSize);
+
+    timer.Lap();
+    for (unsigned int i = 0; i < nIters; i++)
+    {
+        CPublicDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss.reserve(nSize);
+        ss << block;
+    }
+    PrintBench("block CPublicDataStream serialize", timer.Lap(), nIters, nSize);
+}
+
+BENCH_TEST_CASE(tx_deserialize_bench)
+{
+    CTransaction tx = MakeBenchBlock(1).vtx[0];
+    CPublicDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    string str = ss.str();
+    const unsigned int nIters = 20000;
+
+    CBenchTimer timer;
+    for (unsigned int i = 0; i < nIters; i++)
+    {
+        CDataStream ssCopy(str.data(), str.data() + str.size(), SER_NETWORK, PROTOCOL_VERSION);
+        CTransaction txRead;
+        ssCopy >> txRead;
+    }
+    PrintBench("tx CDataStream copy", timer.Lap(), nIters, str.size());
+
+    timer.Lap();
+    for (unsigned int i = 0; i < nIters; i++)
+    {
+        CSpanStream ssSpan(str, SER_NETWORK, PROTOCOL_VERSION);
+        CTransaction txRead;
+        ssSpan >> txRead;
+    }
+    PrintBench("tx CSpanStream", timer.Lap(), nIters, str.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,935 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "base58.h"
+#include "bench.h"
+#include "init.h"
+#include "main.h"
+#include "net.h"
+#include "smessage.h"
+#include "smsgstore.h"
+#include "util.h"
+
+using namespace std;
+
+// Messages stored as the scan takes them, header then payload
+static vector<unsigned char> ToVector(SecureMessage& smsg)
+{
+    vector<unsigned char> vch(&smsg.hash[0], &smsg.hash[0] + SMSG_HDR_LEN);
+    vch.insert(vch.end(), smsg.pPayload, smsg.pPayload + smsg.nPayload);
+    return vch;
+}
+
+// nMessages synthetic messages from anon, every nOwnEvery'th one to one of
+// vOwn and the rest to strForeign.  vfOwn says which is which.
+static void GenerateMessages(int nMessages, int nOwnEvery, const vector<string>& vOwn, const string& strForeign,
+                             vector<vector<unsigned char> >& vMessages, vector<bool>& vfOwn)
+{
+    string strFrom = "anon";
+    for (int i = 0; i < nMessages; i++)
+    {
+        bool fOwn = i % nOwnEvery == 0;
+        string strTo = fOwn ? vOwn[i % vOwn.size()] : strForeign;
+        string strMessage = strprintf("synthetic message %d", i);
+        SecureMessage smsg;
+        BOOST_REQUIRE(SecureMsgEncrypt(smsg, strFrom, strTo, strMessage) == 0);
+        vMessages.push_back(ToVector(smsg));
+        vfOwn.push_back(fOwn);
+    }
+}
+
+static vector<vector<unsigned char> > vInboxOrder;
+
+static void InboxChanged(SecMsgStored& smsgStored)
+{
+    vInboxOrder.push_back(smsgStored.vchMessage);
+}
+
+static void EraseFromInbox(const vector<vector<unsigned char> >& vMessages)
+{
+    LOCK(cs_smsgDB);
+    SecMsgDB dbInbox;
+    if (!dbInbox.Open("cw"))
+        return;
+    BOOST_FOREACH(const vector<unsigned char>& vch, vMessages)
+    {
+        unsigned char chKey[18];
+        SecureMsgDbKey("im", ((SecureMessage*)&vch[0])->timestamp, &vch[SMSG_HDR_LEN], chKey);
+        dbInbox.EraseSmesg(chKey);
+    }
+}
+
+// Printable text of nBytes that doesn't compress much, like a user's message
+static string RandomText(unsigned int nBytes)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,";
+    string str(nBytes, ' ');
+    for (unsigned int i = 0; i < nBytes; i++)
+        str[i] = chars[GetRandInt(sizeof(chars) - 1)];
+    return str;
+}
+
+// A message from anon to strTo, sent at timestamp, with a valid proof of work
+static vector<unsigned char> MakeRelayMessage(const string& strTo, int64_t timestamp)
+{
+    string strFrom = "anon";
+    string strAddress(strTo);
+    string strMessage = RandomText(64);
+    SecureMessage smsg;
+    BOOST_REQUIRE(SecureMsgEncrypt(smsg, strFrom, strAddress, strMessage) == 0);
+    smsg.timestamp = timestamp;
+    BOOST_REQUIRE(SecureMsgSetHash(&smsg.hash[0], smsg.pPayload, smsg.nPayload, 1) == 0);
+    return ToVector(smsg);
+}
+
+// One end of an in-process link between two nodes.  Each node keeps its own buckets,
+// swapped into smsgBuckets while it runs.  Both append to the same segment files,
+// which is fine as each node's tokens point at its own copy of a message.
+class SyncNode
+{
+public:
+    SyncNode(const CService& addrPeer) : peer(INVALID_SOCKET, CAddress(addrPeer)), nBytesSent(0), nMessagesSent(0) {}
+
+    map<int64_t, SecMsgBucket> buckets;
+    CNode peer;             // the other node as this one sees it, what is pushed to it goes to the other node
+    size_t nBytesSent;
+    size_t nMessagesSent;
+};
+
+// Queue an smsgInv from node, as SecureMsgSendData does when the node next wakes up
+static void SendInventory(SyncNode& node)
+{
+    LOCK(cs_smsg);
+    smsgBuckets.swap(node.buckets);
+    if (node.peer.smsgData.lastSeen != 0)
+    {
+        node.peer.smsgData.lastSeen = GetTime() - SMSG_SEND_DELAY;
+        node.peer.smsgData.nWakeCounter = 0;
+    }
+    SecureMsgSendData(&node.peer, false);
+    smsgBuckets.swap(node.buckets);
+}
+
+// Hand the messages queued by from to to, as ProcessMessages would.  Returns how many there were.
+static size_t Deliver(SyncNode& from, SyncNode& to)
+{
+    deque<CNetMessageRef> vMsg;
+    {
+        LOCK(from.peer.cs_vSend);
+        vMsg.swap(from.peer.vSendMsg);
+        from.peer.nSendSize = 0;
+    }
+
+    LOCK(cs_smsg);
+    smsgBuckets.swap(to.buckets);
+    BOOST_FOREACH(const CNetMessageRef& msg, vMsg)
+    {
+        CSpanStream ssMsg(msg->data(), msg->data() + msg->size(), SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr;
+        ssMsg >> hdr;
+        from.nBytesSent += msg->size();
+        from.nMessagesSent++;
+        SecureMsgReceiveData(&to.peer, hdr.GetCommand(), ssMsg);
+    }
+    smsgBuckets.swap(to.buckets);
+    return vMsg.size();
+}
+
+static void Pump(SyncNode& a, SyncNode& b)
+{
+    while (Deliver(a, b) + Deliver(b, a) > 0)
+        ;
+}
+
+static bool SameTokens(const set<SecMsgToken>& setA, const set<SecMsgToken>& setB)
+{
+    if (setA.size() != setB.size())
+        return false;
+    BOOST_FOREACH(const SecMsgToken& token, setA)
+        if (!setB.count(token))
+            return false;
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(smessage_tests)
+
+// nAddresses new local addresses to scan with in vOwn, in place of smsgAddresses, and a
+// wallet address that doesn't receive messages in strForeign
+static void SetScanAddresses(int nAddresses, vector<string>& vOwn, string& strForeign)
+{
+    smsgAddresses.clear();
+    for (int i = 0; i < nAddresses; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        BOOST_REQUIRE(pwalletMain->AddKey(key));
+        string strAddress = CBitcoinAddress(key.GetPubKey().GetID()).ToString();
+        vOwn.push_back(strAddress);
+        smsgAddresses.push_back(SecMsgAddress(strAddress, true, true));
+    }
+
+    // Messages to others are the ones every address is tried on.  Encrypting
+    // needs the recipient's public key, the wallet holds it but doesn't receive on it.
+    CKey keyForeign;
+    keyForeign.MakeNewKey(true);
+    BOOST_REQUIRE(pwalletMain->AddKey(keyForeign));
+    strForeign = CBitcoinAddress(keyForeign.GetPubKey().GetID()).ToString();
+}
+
+BOOST_AUTO_TEST_CASE(smsg_scan_parallel)
+{
+    vector<SecMsgAddress> vSaved = smsgAddresses;
+    vector<string> vOwn;
+    string strForeign;
+    SetScanAddresses(4, vOwn, strForeign);
+
+    vector<vector<unsigned char> > vMessages;
+    vector<bool> vfOwn;
+    GenerateMessages(40, 3, vOwn, strForeign, vMessages, vfOwn); // every address gets some
+
+    vector<vector<unsigned char> > vExpected;
+    for (unsigned int i = 0; i < vMessages.size(); i++)
+        if (vfOwn[i])
+            vExpected.push_back(vMessages[i]);
+    EraseFromInbox(vMessages);
+
+    // Worker threads finish out of order, the inbox is still written in the order given
+    vInboxOrder.clear();
+    NotifySecMsgInboxChanged.connect(InboxChanged);
+    vector<vector<unsigned char> > vScan(vMessages);
+    uint32_t nFound = SecureMsgScanMessages(vScan, true);
+    NotifySecMsgInboxChanged.disconnect(InboxChanged);
+
+    BOOST_CHECK_EQUAL(nFound, vExpected.size());
+    BOOST_CHECK(vInboxOrder == vExpected);
+
+    EraseFromInbox(vMessages);
+    smsgAddresses = vSaved;
+}
+
+BENCH_TEST_CASE(smsg_scan_bench)
+{
+    const int nMessages = 400;
+    const int nOwnEvery = 8;
+    const int nAddresses = 12;
+
+    vector<SecMsgAddress> vSaved = smsgAddresses;
+    vector<string> vOwn;
+    string strForeign;
+    SetScanAddresses(nAddresses, vOwn, strForeign);
+
+    vector<vector<unsigned char> > vMessages;
+    vector<bool> vfOwn;
+    CBenchTimer timer;
+    GenerateMessages(nMessages, nOwnEvery, vOwn, strForeign, vMessages, vfOwn);
+    int64_t nGenerate = timer.Lap();
+    EraseFromInbox(vMessages);
+
+    timer.Lap();
+    vector<vector<unsigned char> > vScan(vMessages);
+    SecureMsgScanMessages(vScan, true);
+    int64_t nParallel = timer.Lap();
+
+    // What the scans did before, one message after the other
+    EraseFromInbox(vMessages);
+    timer.Lap();
+    BOOST_FOREACH(vector<unsigned char>& vch, vMessages)
+        SecureMsgScanMessage(&vch[0], &vch[SMSG_HDR_LEN], ((SecureMessage*)&vch[0])->nPayload, false);
+    int64_t nSerial = timer.Lap();
+
+    printf("bench smsg scan %d messages, %d addresses: generate %" PRId64 " us, serial %" PRId64 " us, parallel %" PRId64 " us\n",
+           nMessages, nAddresses, nGenerate, nSerial, nParallel);
+
+    EraseFromInbox(vMessages);
+    smsgAddresses = vSaved;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_pow)
+{
+    // The hash written out on SHA256 contexts is the HMAC it replaces
+    vector<unsigned char> vch(SMSG_HDR_LEN + 1000);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = i * 7 + 3;
+    SecureMessage *psmsg = (SecureMessage*)&vch[0];
+    psmsg->nPayload = vch.size() - SMSG_HDR_LEN;
+    unsigned char *pPayload = &vch[SMSG_HDR_LEN];
+    for (uint32_t nonse = 0; nonse < 100; nonse += 33)
+    {
+        memcpy(psmsg->nonse, &nonse, 4);
+        unsigned char key[32];
+        for (int i = 0; i < 32; i += 4)
+            memcpy(key + i, &nonse, 4);
+        vector<unsigned char> vchData(&vch[4], &vch[SMSG_HDR_LEN]);
+        vchData.insert(vchData.end(), pPayload, pPayload + psmsg->nPayload);
+        vchData.insert(vchData.end(), pPayload, pPayload + psmsg->nPayload);
+        unsigned char hmac[32], hash[32];
+        unsigned int nBytes = 32;
+        HMAC(EVP_sha256(), key, 32, &vchData[0], vchData.size(), hmac, &nBytes);
+        SecureMsgPowHash(&vch[0], pPayload, psmsg->nPayload, hash);
+        BOOST_CHECK(memcmp(hmac, hash, 32) == 0);
+    }
+
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    psmsg->version[0] = 1;
+    vector<unsigned char> vchOne(vch);
+    BOOST_CHECK(SecureMsgSetHash(&vchOne[0], &vchOne[SMSG_HDR_LEN], psmsg->nPayload, 1) == 0);
+    BOOST_CHECK(SecureMsgValidate(&vchOne[0], &vchOne[SMSG_HDR_LEN], psmsg->nPayload) == 0);
+
+    BOOST_CHECK(SecureMsgSetHash(&vch[0], pPayload, psmsg->nPayload, 4) == 0);
+    BOOST_CHECK(SecureMsgValidate(&vch[0], pPayload, psmsg->nPayload) == 0);
+
+    // Cancelled, or the node shutting messaging down, stops the search
+    volatile bool fCancel = true;
+    BOOST_CHECK(SecureMsgSetHash(&vch[0], pPayload, psmsg->nPayload, 2, 0, &fCancel) == 2);
+    fSecMsgEnabled = false;
+    BOOST_CHECK(SecureMsgSetHash(&vch[0], pPayload, psmsg->nPayload, 2) == 2);
+
+    fSecMsgEnabled = fWasEnabled;
+}
+
+BENCH_TEST_CASE(smsg_bench_pow)
+{
+    // The proof of work search on one thread and on every core
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    vector<unsigned char> vch(SMSG_HDR_LEN + 1000);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = GetRandInt(256);
+    SecureMessage *psmsg = (SecureMessage*)&vch[0];
+    psmsg->version[0] = 1;
+    psmsg->nPayload = vch.size() - SMSG_HDR_LEN;
+    vector<unsigned char> vchOne(vch);
+
+    CBenchTimer timer;
+    SecureMsgSetHash(&vchOne[0], &vchOne[SMSG_HDR_LEN], psmsg->nPayload, 1);
+    int64_t nOne = timer.Lap();
+
+    int nThreads = boost::thread::hardware_concurrency();
+    SecureMsgSetHash(&vch[0], &vch[SMSG_HDR_LEN], psmsg->nPayload, nThreads);
+    int64_t nMany = timer.Lap();
+
+    printf("bench smsg pow %u byte payload: 1 thread %" PRId64 " us, %d threads %" PRId64 " us\n",
+           psmsg->nPayload, nOne, nThreads, nMany);
+
+    fSecMsgEnabled = fWasEnabled;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_db_time_order)
+{
+    // Written out of order, read back by time sent from wherever the seek starts
+    const int64_t nBase = 4000000000LL; // after anything other tests leave in the inbox
+    const int aOffsets[] = {300, 5, 70000, 256, 0, 65536};
+    const int nWritten = sizeof(aOffsets) / sizeof(aOffsets[0]);
+    string sPrefix("im");
+
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    BOOST_REQUIRE(db.Open("cw"));
+
+    vector<int64_t> vTimes;
+    for (int i = 0; i < nWritten; i++)
+    {
+        SecMsgStored smsgStored;
+        smsgStored.timeReceived = i;
+        smsgStored.status = 0;
+        smsgStored.folderId = 0;
+        smsgStored.vchMessage.resize(SMSG_HDR_LEN + 8, i);
+        unsigned char chKey[18];
+        SecureMsgDbKey("im", nBase + aOffsets[i], &smsgStored.vchMessage[SMSG_HDR_LEN], chKey);
+        BOOST_REQUIRE(db.WriteSmesg(chKey, smsgStored));
+        vTimes.push_back(nBase + aOffsets[i]);
+    }
+    sort(vTimes.begin(), vTimes.end());
+
+    const int64_t aSince[] = {0, nBase, nBase + 6, nBase + 65536, nBase + 70001};
+    for (unsigned int s = 0; s < sizeof(aSince) / sizeof(aSince[0]); s++)
+    {
+        vector<int64_t> vExpected;
+        BOOST_FOREACH(int64_t t, vTimes)
+            if (t >= aSince[s])
+                vExpected.push_back(t);
+
+        vector<int64_t> vRead;
+        unsigned char chKey[18];
+        leveldb::Iterator* it = db.pdb->NewIterator(leveldb::ReadOptions());
+        db.SeekSmesg(it, sPrefix, aSince[s]);
+        while (db.NextSmesgKey(it, sPrefix, chKey))
+        {
+            int64_t t = 0;
+            for (int i = 0; i < 8; i++)
+                t = (t << 8) | chKey[2 + i];
+            if (t >= nBase)
+                vRead.push_back(t);
+        }
+        delete it;
+        BOOST_CHECK(vRead == vExpected);
+    }
+
+    BOOST_FOREACH(int64_t t, vTimes)
+    {
+        int i = find(aOffsets, aOffsets + nWritten, t - nBase) - aOffsets;
+        unsigned char sample[8];
+        memset(sample, i, 8);
+        unsigned char chKey[18];
+        SecureMsgDbKey("im", t, sample, chKey);
+        BOOST_CHECK(db.EraseSmesg(chKey));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(smsg_scan_chain_resume)
+{
+    BOOST_REQUIRE(pindexGenesisBlock);
+
+    // A full scan records the last block it got through
+    BOOST_CHECK(SecureMsgScanBlockChain(true));
+    int nHeight = -1;
+    uint256 hashBlock;
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
+        BOOST_REQUIRE(addrpkdb.Open("cr+"));
+        BOOST_REQUIRE(addrpkdb.ReadChainScan(nHeight, hashBlock));
+    }
+    BOOST_CHECK_EQUAL(nHeight, pindexBest->nHeight);
+    BOOST_CHECK(hashBlock == pindexBest->GetBlockHash());
+
+    // Nothing new to scan, the next one returns straight away
+    BOOST_CHECK(SecureMsgScanBlockChain());
+
+    // Written in a batch it is read back before the batch is committed
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
+        BOOST_REQUIRE(addrpkdb.Open("cr+"));
+        BOOST_REQUIRE(addrpkdb.TxnBegin());
+        uint256 hashOther = 1;
+        BOOST_CHECK(addrpkdb.WriteChainScan(7, hashOther));
+        BOOST_REQUIRE(addrpkdb.ReadChainScan(nHeight, hashBlock));
+        BOOST_CHECK_EQUAL(nHeight, 7);
+        BOOST_CHECK(hashBlock == hashOther);
+        addrpkdb.TxnAbort();
+        BOOST_REQUIRE(addrpkdb.ReadChainScan(nHeight, hashBlock));
+        BOOST_CHECK_EQUAL(nHeight, pindexBest->nHeight);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(smsg_scan_chain_read_failure)
+{
+    BOOST_REQUIRE(pindexBest && !pindexBest->pnext);
+    BOOST_CHECK(SecureMsgScanBlockChain(true));
+
+    // A block past the tip with no block file behind it can't be read
+    CBlockIndex indexUnreadable;
+    indexUnreadable.nHeight = pindexBest->nHeight + 1;
+    indexUnreadable.pprev = pindexBest;
+    indexUnreadable.nFile = 0;
+
+    int nHeight = -1;
+    uint256 hashBlock;
+    {
+        LOCK(cs_main);
+        pindexBest->pnext = &indexUnreadable;
+
+        // The scan stops there and records only the blocks before it, alone or after others
+        BOOST_CHECK(!ScanChainForPublicKeys(&indexUnreadable));
+        BOOST_CHECK(!ScanChainForPublicKeys(pindexBest));
+        pindexBest->pnext = NULL;
+    }
+    LOCK(cs_smsgDB);
+    SecMsgDB addrpkdb;
+    BOOST_REQUIRE(addrpkdb.Open("cr+"));
+    BOOST_REQUIRE(addrpkdb.ReadChainScan(nHeight, hashBlock));
+    BOOST_CHECK_EQUAL(nHeight, pindexBest->nHeight);
+    BOOST_CHECK(hashBlock == pindexBest->GetBlockHash());
+}
+
+BOOST_AUTO_TEST_CASE(smsg_expire)
+{
+    const int64_t now = GetTime();
+    const int64_t bucketOld = now - SMSG_RETENTION - 2 * SMSG_BUCKET_LEN - (now % SMSG_BUCKET_LEN);
+    const int64_t bucketA = now - (now % SMSG_BUCKET_LEN) - 4 * SMSG_BUCKET_LEN;
+    const int64_t bucketB = bucketA + SMSG_BUCKET_LEN;
+    {
+        LOCK(cs_smsg);
+        smsgBuckets[bucketOld].timeChanged = now;
+        SecureMsgLockBucket(bucketA, smsgBuckets[bucketA], 7, now);
+        SecureMsgLockBucket(bucketB, smsgBuckets[bucketB], 8, now);
+    }
+
+    // Expired buckets go straight away, locks stay until they time out
+    SecureMsgExpire(now);
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK(!smsgBuckets.count(bucketOld));
+        BOOST_CHECK_EQUAL(smsgBuckets[bucketA].timeLockExpires, now + SMSG_LOCK_TIMEOUT);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucketB].nLockPeerId, 8U);
+
+        // B's data arrives and it is locked again later, only the later lock counts
+        smsgBuckets[bucketB].timeLockExpires = 0;
+        smsgBuckets[bucketB].nLockPeerId = 0;
+        SecureMsgLockBucket(bucketB, smsgBuckets[bucketB], 9, now + 10);
+    }
+
+    SecureMsgExpire(now + SMSG_LOCK_TIMEOUT - 1);
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK(smsgBuckets[bucketA].timeLockExpires > 0);
+    }
+
+    SecureMsgExpire(now + SMSG_LOCK_TIMEOUT);
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucketA].timeLockExpires, 0);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucketA].nLockPeerId, 0U);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucketB].timeLockExpires, now + 10 + SMSG_LOCK_TIMEOUT);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucketB].nLockPeerId, 9U);
+    }
+
+    SecureMsgExpire(now + 10 + SMSG_LOCK_TIMEOUT);
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucketB].timeLockExpires, 0);
+        if (smsgBuckets[bucketA].setTokens.empty())
+            smsgBuckets.erase(bucketA);
+        if (smsgBuckets[bucketB].setTokens.empty())
+            smsgBuckets.erase(bucketB);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(smsg_pk_cache)
+{
+    // Other cases leave keys in the cache, counted from what is there now
+    uint32_t nSize, nMaxSize, nSizeStart;
+    uint64_t nHits, nMisses, nHitsStart, nMissesStart;
+    SecureMsgPKCacheStats(nSizeStart, nMaxSize, nHitsStart, nMissesStart);
+
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubKey = key.GetPubKey();
+    CKeyID keyId = pubKey.GetID();
+    string strAddress = CBitcoinAddress(keyId).ToString();
+    string strPublicKey = EncodeBase58(pubKey.Raw());
+    CPubKey cpkOut;
+
+    // Added but not yet read, the first lookup goes to the db and the rest are served from memory
+    BOOST_CHECK_EQUAL(SecureMsgAddAddress(strAddress, strPublicKey), 0);
+    BOOST_CHECK_EQUAL(SecureMsgGetStoredKey(keyId, cpkOut), 0);
+    BOOST_CHECK(cpkOut == pubKey);
+    for (int i = 0; i < 9; i++)
+    {
+        cpkOut = CPubKey();
+        BOOST_CHECK_EQUAL(SecureMsgGetStoredKey(keyId, cpkOut), 0);
+        BOOST_CHECK(cpkOut == pubKey);
+    }
+    SecureMsgPKCacheStats(nSize, nMaxSize, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nSize, nSizeStart + 1);
+    BOOST_CHECK_EQUAL(nHits, nHitsStart + 9);
+    BOOST_CHECK_EQUAL(nMisses, nMissesStart + 1);
+
+    // Adding it again is answered from the cache
+    BOOST_CHECK_EQUAL(SecureMsgAddAddress(strAddress, strPublicKey), 4);
+
+    // Unknown keys are not cached
+    CKey keyUnknown;
+    keyUnknown.MakeNewKey(true);
+    CKeyID unknownId = keyUnknown.GetPubKey().GetID();
+    BOOST_CHECK_EQUAL(SecureMsgGetStoredKey(unknownId, cpkOut), 2);
+    BOOST_CHECK_EQUAL(SecureMsgGetStoredKey(unknownId, cpkOut), 2);
+    SecureMsgPKCacheStats(nSize, nMaxSize, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nSize, nSizeStart + 1);
+    BOOST_CHECK_EQUAL(nMisses, nMissesStart + 3);
+
+    // Keys written in an aborted batch never reach the cache
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
+        BOOST_REQUIRE(addrpkdb.Open("cr+"));
+        BOOST_REQUIRE(addrpkdb.TxnBegin());
+        CPubKey pubKeyUnknown = keyUnknown.GetPubKey();
+        BOOST_CHECK(addrpkdb.WritePK(unknownId, pubKeyUnknown));
+        BOOST_CHECK(addrpkdb.ReadPK(unknownId, cpkOut));
+        addrpkdb.TxnAbort();
+        BOOST_CHECK(!addrpkdb.ReadPK(unknownId, cpkOut));
+        BOOST_CHECK(!addrpkdb.ExistsPK(unknownId));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(smsg_encrypt_decrypt)
+{
+    // Every step a sent message goes through, for sizes sent plain and compressed
+    const unsigned int aSizes[] = {16, 256, 1024, SMSG_MAX_MSG_BYTES};
+
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_REQUIRE(pwalletMain->AddKey(key));
+    string strTo = CBitcoinAddress(key.GetPubKey().GetID()).ToString();
+    string strFrom = "anon";
+
+    for (unsigned int s = 0; s < sizeof(aSizes) / sizeof(aSizes[0]); s++)
+    {
+        string strMessage = RandomText(aSizes[s]);
+        SecureMessage smsg;
+        BOOST_REQUIRE(SecureMsgEncrypt(smsg, strFrom, strTo, strMessage) == 0);
+        BOOST_REQUIRE(SecureMsgSetHash(&smsg.hash[0], smsg.pPayload, smsg.nPayload, 1) == 0);
+        BOOST_CHECK(SecureMsgValidate(&smsg.hash[0], smsg.pPayload, smsg.nPayload) == 0);
+
+        MessageData msg;
+        BOOST_REQUIRE(SecureMsgDecrypt(false, strTo, smsg, msg) == 0);
+        BOOST_CHECK_EQUAL(string((char*)&msg.vchMessage[0]), strMessage);
+    }
+
+    fSecMsgEnabled = fWasEnabled;
+}
+
+BENCH_TEST_CASE(smsg_bench_crypto)
+{
+    // Per message cost of each step a sent message goes through, by message size
+    const unsigned int aSizes[] = {16, 256, 1024, SMSG_MAX_MSG_BYTES};
+    const int nRounds = 3;
+
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_REQUIRE(pwalletMain->AddKey(key));
+    string strTo = CBitcoinAddress(key.GetPubKey().GetID()).ToString();
+    string strFrom = "anon";
+
+    for (unsigned int s = 0; s < sizeof(aSizes) / sizeof(aSizes[0]); s++)
+    {
+        int64_t nEncrypt = 0, nPow = 0, nValidate = 0, nDecrypt = 0;
+        uint32_t nPayload = 0;
+        for (int r = 0; r < nRounds; r++)
+        {
+            string strMessage = RandomText(aSizes[s]);
+            SecureMessage smsg;
+            MessageData msg;
+
+            CBenchTimer timer;
+            BOOST_REQUIRE(SecureMsgEncrypt(smsg, strFrom, strTo, strMessage) == 0);
+            nEncrypt += timer.Lap();
+            BOOST_REQUIRE(SecureMsgSetHash(&smsg.hash[0], smsg.pPayload, smsg.nPayload, 1) == 0);
+            nPow += timer.Lap();
+            SecureMsgValidate(&smsg.hash[0], smsg.pPayload, smsg.nPayload);
+            nValidate += timer.Lap();
+            BOOST_REQUIRE(SecureMsgDecrypt(false, strTo, smsg, msg) == 0);
+            nDecrypt += timer.Lap();
+            nPayload = smsg.nPayload;
+        }
+
+        printf("bench smsg crypto %u byte message, %u byte payload: encrypt %" PRId64 " us, pow %" PRId64 " us, validate %" PRId64 " us, decrypt %" PRId64 " us\n",
+               aSizes[s], nPayload, nEncrypt / nRounds, nPow / nRounds, nValidate / nRounds, nDecrypt / nRounds);
+    }
+
+    fSecMsgEnabled = fWasEnabled;
+}
+
+// nMessages of random content in bucket, as the store takes them without validating
+static vector<vector<unsigned char> > RandomStoreMessages(int64_t bucket, int nMessages)
+{
+    vector<vector<unsigned char> > vMessages;
+    for (int i = 0; i < nMessages; i++)
+    {
+        vector<unsigned char> vch(SMSG_HDR_LEN + 100 + GetRandInt(400));
+        for (unsigned int k = 0; k < vch.size(); k++)
+            vch[k] = GetRandInt(256);
+        SecureMessage *psmsg = (SecureMessage*)&vch[0];
+        psmsg->timestamp = bucket + GetRandInt(SMSG_BUCKET_LEN);
+        psmsg->nPayload = vch.size() - SMSG_HDR_LEN;
+        vMessages.push_back(vch);
+    }
+    return vMessages;
+}
+
+// Read back the message a token of smsgBuckets[bucket] points at, caller holds cs_smsg
+static bool RetrieveStored(int64_t bucket, vector<unsigned char>& vch)
+{
+    SecMsgToken token(((SecureMessage*)&vch[0])->timestamp, &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, 0);
+    set<SecMsgToken>::iterator it = smsgBuckets[bucket].setTokens.find(token);
+    if (it == smsgBuckets[bucket].setTokens.end())
+        return false;
+    token = *it;
+    vector<unsigned char> vchData;
+    return SecureMsgRetrieve(token, vchData) == 0 && vchData == vch;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_store_retrieve)
+{
+    const int64_t now = GetTime();
+    const int64_t bucket = now - (now % SMSG_BUCKET_LEN) - 11 * SMSG_BUCKET_LEN;
+
+    LOCK(cs_smsg);
+    map<int64_t, SecMsgBucket> saved;
+    smsgBuckets.swap(saved);
+    boost::filesystem::create_directory(GetDataDir() / "smsgStore");
+    SecureMsgSegmentRemove(bucket);
+
+    vector<vector<unsigned char> > vMessages = RandomStoreMessages(bucket, 50);
+    BOOST_FOREACH(vector<unsigned char>& vch, vMessages)
+        BOOST_CHECK(SecureMsgStore(&vch[0], &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, false) == 0);
+    BOOST_CHECK_EQUAL(smsgBuckets[bucket].setTokens.size(), vMessages.size());
+
+    BOOST_FOREACH(vector<unsigned char>& vch, vMessages)
+        BOOST_CHECK(RetrieveStored(bucket, vch));
+
+    SecureMsgSegmentRemove(bucket);
+    smsgBuckets.swap(saved);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_expire_files)
+{
+    const int64_t now = GetTime();
+    const int64_t bucket = now - (now % SMSG_BUCKET_LEN) - 11 * SMSG_BUCKET_LEN;
+    const int64_t expireTime = bucket + SMSG_RETENTION + SMSG_BUCKET_LEN;
+    boost::filesystem::path pathData = SecureMsgSegmentPath(bucket, false);
+    boost::filesystem::path pathIndex = SecureMsgSegmentPath(bucket, true);
+    boost::filesystem::path pathLocked = GetDataDir() / "smsgStore" / strprintf("%" PRId64 "_01_wl.dat", bucket);
+
+    map<int64_t, SecMsgBucket> saved;
+    vector<vector<unsigned char> > vMessages = RandomStoreMessages(bucket, 10);
+    {
+        LOCK(cs_smsg);
+        smsgBuckets.swap(saved);
+        boost::filesystem::create_directory(GetDataDir() / "smsgStore");
+        SecureMsgSegmentRemove(bucket);
+        BOOST_FOREACH(vector<unsigned char>& vch, vMessages)
+            BOOST_REQUIRE(SecureMsgStore(&vch[0], &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, false) == 0);
+    }
+    FILE *fp = fopen(pathLocked.string().c_str(), "wb");
+    BOOST_REQUIRE(fp);
+    fwrite(&vMessages[0][0], 1, vMessages[0].size(), fp);
+    fclose(fp);
+    BOOST_REQUIRE(boost::filesystem::exists(pathData) && boost::filesystem::exists(pathIndex));
+
+    // Every file of the bucket goes, none is left renamed aside
+    SecureMsgExpire(expireTime);
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK(!smsgBuckets.count(bucket));
+    }
+    boost::filesystem::path aPaths[3] = {pathData, pathIndex, pathLocked};
+    for (int i = 0; i < 3; i++)
+    {
+        BOOST_CHECK(!boost::filesystem::exists(aPaths[i]));
+        BOOST_CHECK(!boost::filesystem::exists(aPaths[i].string() + ".del"));
+    }
+
+    // A store to the same bucket time afterwards starts a new segment
+    {
+        LOCK(cs_smsg);
+        vector<unsigned char>& vch = vMessages[1];
+        BOOST_REQUIRE(SecureMsgStore(&vch[0], &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, false) == 0);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucket].setTokens.size(), 1U);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucket].setTokens.begin()->offset, 0);
+        BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathData), vch.size());
+        BOOST_CHECK(RetrieveStored(bucket, vch));
+
+        SecureMsgSegmentRemove(bucket);
+        smsgBuckets.swap(saved);
+    }
+}
+
+BENCH_TEST_CASE(smsg_bench_store)
+{
+    const int64_t now = GetTime();
+    const int64_t bucket = now - (now % SMSG_BUCKET_LEN) - 11 * SMSG_BUCKET_LEN;
+    const int nMessages = 500;
+    const int nTokens = 20000;
+
+    LOCK(cs_smsg);
+    map<int64_t, SecMsgBucket> saved;
+    smsgBuckets.swap(saved);
+    boost::filesystem::create_directory(GetDataDir() / "smsgStore");
+    SecureMsgSegmentRemove(bucket);
+
+    // Only the store is timed, messages are not validated there
+    vector<vector<unsigned char> > vMessages = RandomStoreMessages(bucket, nMessages);
+
+    CBenchTimer timer;
+    BOOST_FOREACH(vector<unsigned char>& vch, vMessages)
+        SecureMsgStore(&vch[0], &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, false);
+    int64_t nStore = timer.Lap();
+
+    smsgBuckets[bucket].hashBucket();
+    int64_t nHash = timer.Lap();
+
+    BOOST_FOREACH(vector<unsigned char>& vch, vMessages)
+        RetrieveStored(bucket, vch);
+    int64_t nRetrieve = timer.Lap();
+
+    // A bucket as full as a busy network leaves them
+    SecMsgBucket bucketLarge;
+    for (int i = 0; i < nTokens; i++)
+    {
+        unsigned char sample[8];
+        for (int k = 0; k < 8; k++)
+            sample[k] = GetRandInt(256);
+        bucketLarge.setTokens.insert(SecMsgToken(bucket + GetRandInt(SMSG_BUCKET_LEN), sample, 8, 0));
+    }
+    timer.Lap();
+    bucketLarge.hashBucket();
+    int64_t nHashLarge = timer.Lap();
+
+    printf("bench smsg store %d messages: store %" PRId64 " us, retrieve %" PRId64 " us each; hash bucket of %d %" PRId64 " us, of %" PRIszu " %" PRId64 " us\n",
+           nMessages, nStore / nMessages, nRetrieve / nMessages, nMessages, nHash, bucketLarge.setTokens.size(), nHashLarge);
+
+    SecureMsgSegmentRemove(bucket);
+    smsgBuckets.swap(saved);
+}
+
+// Messaging enabled with no local addresses and no buckets of its own, for the sync tests
+struct SyncSetup
+{
+    SyncSetup()
+    {
+        fWasEnabled = fSecMsgEnabled;
+        fSecMsgEnabled = true;
+        vSavedAddresses.swap(smsgAddresses);
+        {
+            LOCK(cs_smsg);
+            smsgBuckets.swap(saved);
+        }
+        boost::filesystem::create_directory(GetDataDir() / "smsgStore");
+
+        CKey key;
+        key.MakeNewKey(true);
+        BOOST_REQUIRE(pwalletMain->AddKey(key));
+        strTo = CBitcoinAddress(key.GetPubKey().GetID()).ToString();
+    }
+
+    ~SyncSetup()
+    {
+        {
+            LOCK(cs_smsg);
+            smsgBuckets.swap(saved);
+        }
+        smsgAddresses.swap(vSavedAddresses);
+        fSecMsgEnabled = fWasEnabled;
+    }
+
+    bool fWasEnabled;
+    vector<SecMsgAddress> vSavedAddresses;
+    map<int64_t, SecMsgBucket> saved;
+    string strTo;
+};
+
+// Give a the first nShared + nOnlyA of vMessages and b the first nShared and the rest,
+// then let them trade smsgInv, smsgShow or smsgRecon, smsgHave, smsgWant and smsgMsg
+// at nVersion until each has them all.  Returns the rounds it took, at most 5, and
+// nMicros the time they took.
+static int SyncBucket(SyncNode& a, SyncNode& b, int64_t bucket, vector<vector<unsigned char> >& vMessages,
+                      int nShared, int nOnlyA, int nVersion, int64_t& nMicros)
+{
+    SecureMsgSegmentRemove(bucket);
+    {
+        LOCK(cs_smsg);
+        for (unsigned int i = 0; i < vMessages.size(); i++)
+        {
+            vector<unsigned char>& vch = vMessages[i];
+            if (i < (unsigned int)(nShared + nOnlyA))
+            {
+                smsgBuckets.swap(a.buckets);
+                BOOST_REQUIRE(SecureMsgStore(&vch[0], &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, true) == 0);
+                smsgBuckets.swap(a.buckets);
+            }
+            if (i < (unsigned int)nShared || i >= (unsigned int)(nShared + nOnlyA))
+            {
+                smsgBuckets.swap(b.buckets);
+                BOOST_REQUIRE(SecureMsgStore(&vch[0], &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, true) == 0);
+                smsgBuckets.swap(b.buckets);
+            }
+        }
+    }
+
+    // smsgPing and smsgPong, then the older protocol if asked for
+    SendInventory(a);
+    SendInventory(b);
+    Pump(a, b);
+    BOOST_REQUIRE(a.peer.smsgData.fEnabled && b.peer.smsgData.fEnabled);
+    a.peer.smsgData.nVersion = nVersion;
+    b.peer.smsgData.nVersion = nVersion;
+    a.nBytesSent = b.nBytesSent = a.nMessagesSent = b.nMessagesSent = 0;
+
+    CBenchTimer timer;
+    int nRounds = 0;
+    while (nRounds < 5 && !SameTokens(a.buckets[bucket].setTokens, b.buckets[bucket].setTokens))
+    {
+        SendInventory(a);
+        SendInventory(b);
+        Pump(a, b);
+        nRounds++;
+    }
+    nMicros = timer.Elapsed();
+    return nRounds;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_sync)
+{
+    // Two nodes holding different messages of a bucket end up with all of them, as nodes
+    // of this version and as older nodes
+    const int64_t now = GetTime();
+    const int64_t bucket = now - (now % SMSG_BUCKET_LEN) - 10 * SMSG_BUCKET_LEN;
+    const int nShared = 80; // enough for a reconciliation table to be smaller than the token list
+    const int nOnlyA = 6;
+    const int nOnlyB = 4;
+
+    SyncSetup setup;
+    vector<vector<unsigned char> > vMessages;
+    for (int i = 0; i < nShared + nOnlyA + nOnlyB; i++)
+        vMessages.push_back(MakeRelayMessage(setup.strTo, bucket + i));
+
+    for (int nVersion = SMSG_PROTOCOL_VERSION; nVersion >= 0; nVersion -= SMSG_PROTOCOL_VERSION)
+    {
+        SyncNode a(CService("127.0.0.1", 17571)), b(CService("127.0.0.1", 17572));
+        int64_t nSync;
+        SyncBucket(a, b, bucket, vMessages, nShared, nOnlyA, nVersion, nSync);
+
+        BOOST_CHECK(SameTokens(a.buckets[bucket].setTokens, b.buckets[bucket].setTokens));
+        BOOST_CHECK_EQUAL(a.buckets[bucket].setTokens.size(), vMessages.size());
+        BOOST_CHECK_EQUAL(a.buckets[bucket].hash, b.buckets[bucket].hash);
+        BOOST_CHECK_EQUAL(a.buckets[bucket].timeLockExpires, 0);
+        BOOST_CHECK_EQUAL(b.buckets[bucket].timeLockExpires, 0);
+    }
+
+    SecureMsgSegmentRemove(bucket);
+}
+
+BENCH_TEST_CASE(smsg_bench_sync)
+{
+    // Time and traffic of the sync smsg_sync checks
+    const int64_t now = GetTime();
+    const int64_t bucket = now - (now % SMSG_BUCKET_LEN) - 10 * SMSG_BUCKET_LEN;
+    const int nShared = 80;
+    const int nOnlyA = 6;
+    const int nOnlyB = 4;
+
+    SyncSetup setup;
+    vector<vector<unsigned char> > vMessages;
+    for (int i = 0; i < nShared + nOnlyA + nOnlyB; i++)
+        vMessages.push_back(MakeRelayMessage(setup.strTo, bucket + i));
+
+    for (int nVersion = SMSG_PROTOCOL_VERSION; nVersion >= 0; nVersion -= SMSG_PROTOCOL_VERSION)
+    {
+        SyncNode a(CService("127.0.0.1", 17571)), b(CService("127.0.0.1", 17572));
+        int64_t nSync;
+        int nRounds = SyncBucket(a, b, bucket, vMessages, nShared, nOnlyA, nVersion, nSync);
+
+        printf("bench smsg sync protocol %d, %d shared, %d only on A, %d only on B: %d rounds, %" PRIszu " messages, %" PRIszu " bytes, %" PRId64 " us\n",
+               nVersion, nShared, nOnlyA, nOnlyB, nRounds, a.nMessagesSent + b.nMessagesSent, a.nBytesSent + b.nBytesSent, nSync);
+    }
+
+    SecureMsgSegmentRemove(bucket);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
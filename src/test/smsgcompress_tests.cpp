@@ -0,0 +1,148 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bench.h"
+#include "smsgcompress.h"
+#include "smessage.h"
+#include "util.h"
+
+using namespace std;
+
+// Messages like the ones users send, nBytes long
+static string CorpusMessage(int nKind, unsigned int nBytes)
+{
+    static const char *words[] = {"the", "meeting", "is", "at", "tomorrow", "please", "send", "order", "address",
+                                  "payment", "confirmed", "thanks", "hello", "we", "will", "ship", "to", "your", "new", "key"};
+    static const char base58[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+    string str;
+    while (str.size() < nBytes)
+    {
+        switch (nKind)
+        {
+        case 0: // chat
+            str += words[GetRandInt(20)];
+            str += GetRandInt(8) == 0 ? ". " : " ";
+            break;
+        case 1: // order records
+            str += strprintf("{\"id\":%d,\"item\":\"%s\",\"qty\":%d,\"ship\":\"%s\"},",
+                             GetRandInt(100000), words[GetRandInt(20)], GetRandInt(10), words[GetRandInt(20)]);
+            break;
+        case 2: // a list of addresses
+            str += "D";
+            for (int i = 0; i < 33; i++)
+                str += base58[GetRandInt(58)];
+            str += "\n";
+            break;
+        default: // already compressed or encrypted
+            str += (char)GetRandInt(256);
+        };
+    }
+    str.resize(nBytes);
+    return str;
+}
+
+static const char *aKinds[] = {"chat", "orders", "addresses", "random"};
+
+BOOST_AUTO_TEST_SUITE(smsgcompress_tests)
+
+BOOST_AUTO_TEST_CASE(smsgcompress_roundtrip)
+{
+    // Both modes read back with the LZ4 decompressor every node has, for sizes around
+    // the end of block limits and up to the largest message
+    const unsigned int aSizes[] = {1, 5, 12, 13, 17, 129, 300, 1000, SMSG_MAX_MSG_BYTES};
+    for (int nKind = 0; nKind < 4; nKind++)
+    {
+        for (unsigned int s = 0; s < sizeof(aSizes) / sizeof(aSizes[0]); s++)
+        {
+            string str = CorpusMessage(nKind, aSizes[s]);
+            int nLen[2];
+            for (int fHigh = 0; fHigh < 2; fHigh++)
+            {
+                const unsigned char *pOut;
+                nLen[fHigh] = SecureMsgCompress((const unsigned char*)str.data(), str.size(), fHigh, pOut);
+                BOOST_REQUIRE(nLen[fHigh] > 0);
+                BOOST_CHECK(nLen[fHigh] <= LZ4_compressBound(str.size()));
+
+                vector<unsigned char> vch(str.size());
+                BOOST_CHECK(SecureMsgDecompress(pOut, nLen[fHigh], &vch[0], vch.size()));
+                BOOST_CHECK(string(vch.begin(), vch.end()) == str);
+
+                // The length is part of the message, one that doesn't fit is an error
+                if (str.size() > 1)
+                    BOOST_CHECK(!SecureMsgDecompress(pOut, nLen[fHigh], &vch[0], vch.size() - 1));
+            }
+            if (nKind < 2 && aSizes[s] >= 300)
+                BOOST_CHECK(nLen[1] <= nLen[0]);
+        }
+    }
+
+    // A message of one repeated byte is a single long match
+    string strRepeat(SMSG_MAX_MSG_BYTES, 'a');
+    const unsigned char *pOut;
+    int nLen = SecureMsgCompress((const unsigned char*)strRepeat.data(), strRepeat.size(), true, pOut);
+    BOOST_CHECK(nLen > 0 && nLen < 32);
+    vector<unsigned char> vch(strRepeat.size());
+    BOOST_CHECK(SecureMsgDecompress(pOut, nLen, &vch[0], vch.size()));
+    BOOST_CHECK(string(vch.begin(), vch.end()) == strRepeat);
+}
+
+BOOST_AUTO_TEST_CASE(smsgcompress_cleanse)
+{
+    // The buffer is wiped and emptied but keeps its memory for the next message
+    string str = CorpusMessage(0, 1000);
+    for (int fHigh = 0; fHigh < 2; fHigh++)
+    {
+        const unsigned char *pOut, *pOutNext;
+        int nLen = SecureMsgCompress((const unsigned char*)str.data(), str.size(), fHigh, pOut);
+        BOOST_REQUIRE(nLen > 0);
+        SecureMsgCompressCleanse();
+
+        BOOST_CHECK_EQUAL(SecureMsgCompress((const unsigned char*)str.data(), str.size(), fHigh, pOutNext), nLen);
+        BOOST_CHECK(pOutNext == pOut);
+        vector<unsigned char> vch(str.size());
+        BOOST_CHECK(SecureMsgDecompress(pOutNext, nLen, &vch[0], vch.size()));
+        BOOST_CHECK(string(vch.begin(), vch.end()) == str);
+        SecureMsgCompressCleanse();
+    }
+}
+
+BENCH_TEST_CASE(smsgcompress_bench)
+{
+    const int nMessages = 200;
+    for (int nKind = 0; nKind < 4; nKind++)
+    {
+        vector<string> vMessages;
+        size_t nBytes = 0;
+        for (int i = 0; i < nMessages; i++)
+        {
+            vMessages.push_back(CorpusMessage(nKind, 129 + GetRandInt(SMSG_MAX_MSG_BYTES - 128)));
+            nBytes += vMessages.back().size();
+        }
+
+        size_t nCompressed[2] = {0, 0};
+        int64_t nCompress[2], nDecompress[2];
+        for (int fHigh = 0; fHigh < 2; fHigh++)
+        {
+            vector<vector<unsigned char> > vOut;
+            CBenchTimer timer;
+            for (int i = 0; i < nMessages; i++)
+            {
+                const unsigned char *pOut;
+                int nLen = SecureMsgCompress((const unsigned char*)vMessages[i].data(), vMessages[i].size(), fHigh, pOut);
+                vOut.push_back(vector<unsigned char>(pOut, pOut + nLen));
+                nCompressed[fHigh] += nLen;
+            }
+            nCompress[fHigh] = timer.Lap();
+
+            vector<unsigned char> vch(SMSG_MAX_MSG_BYTES);
+            timer.Lap();
+            for (int i = 0; i < nMessages; i++)
+                SecureMsgDecompress(&vOut[i][0], vOut[i].size(), &vch[0], vMessages[i].size());
+            nDecompress[fHigh] = timer.Lap();
+        }
+
+        printf("bench smsg compress %d %s messages, %" PRIszu " bytes: fast %" PRIszu " bytes %" PRId64 " us, high %" PRIszu " bytes %" PRId64 " us, decompress %" PRId64 " / %" PRId64 " us\n",
+               nMessages, aKinds[nKind], nBytes, nCompressed[0], nCompress[0], nCompressed[1], nCompress[1], nDecompress[0], nDecompress[1]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,183 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include <openssl/rand.h>
+
+#include "bench.h"
+#include "smsgrecon.h"
+#include "util.h"
+
+using namespace std;
+
+static SecMsgToken RandomToken(int64_t bucket)
+{
+    SecMsgToken token;
+    token.timestamp = bucket + GetRandInt(SMSG_BUCKET_LEN);
+    RAND_bytes(token.sample, 8);
+    token.offset = 0;
+    return token;
+}
+
+// Two nodes holding nShared tokens of a bucket, nOnlyA more on A and nOnlyB more on B
+static void MakeNodes(int64_t bucket, int nShared, int nOnlyA, int nOnlyB, set<SecMsgToken>& setA, set<SecMsgToken>& setB)
+{
+    setA.clear();
+    setB.clear();
+    for (int i = 0; i < nShared; i++)
+    {
+        SecMsgToken token = RandomToken(bucket);
+        setA.insert(token);
+        setB.insert(token);
+    }
+    for (int i = 0; i < nOnlyA; i++)
+        setA.insert(RandomToken(bucket));
+    for (int i = 0; i < nOnlyB; i++)
+        setB.insert(RandomToken(bucket));
+}
+
+static vector<SecMsgToken> Missing(const set<SecMsgToken>& setFrom, const set<SecMsgToken>& setTo)
+{
+    vector<SecMsgToken> v;
+    BOOST_FOREACH(const SecMsgToken& token, setFrom)
+        if (!setTo.count(token))
+            v.push_back(token);
+    return v;
+}
+
+// Payload bytes for A to pull what it lacks from B through smsgShow: smsgInv, smsgShow, smsgHave, smsgWant
+static size_t ShowBytes(const set<SecMsgToken>& setA, const set<SecMsgToken>& setB)
+{
+    size_t nMissing = Missing(setB, setA).size();
+    return (4 + 16) + (4 + 8) + (8 + 16 * setB.size()) + (nMissing ? 8 + 16 * nMissing : 0);
+}
+
+BOOST_AUTO_TEST_SUITE(smsgrecon_tests)
+
+BOOST_AUTO_TEST_CASE(smsgrecon_iblt)
+{
+    const int64_t bucket = 1500000000 - (1500000000 % SMSG_BUCKET_LEN);
+    set<SecMsgToken> setA, setB;
+    MakeNodes(bucket, 500, 7, 5, setA, setB);
+
+    SecMsgIBLT ibltA(SecMsgIBLT::CellsFor(12)), ibltB(SecMsgIBLT::CellsFor(12));
+    ibltA.Insert(setA);
+    ibltB.Insert(setB);
+    BOOST_CHECK(ibltA.size() % SMSG_RECON_HASHES == 0);
+
+    // Serialized and read back, as sent
+    vector<unsigned char> vch;
+    ibltB.Serialize(vch);
+    BOOST_CHECK_EQUAL(vch.size(), ibltB.size() * SMSG_RECON_CELL_LEN);
+    SecMsgIBLT ibltPeer;
+    BOOST_REQUIRE(ibltPeer.Deserialize(&vch[0], ibltB.size()));
+
+    BOOST_REQUIRE(ibltA.Subtract(ibltPeer));
+    vector<SecMsgToken> vOnlyA, vOnlyB;
+    BOOST_REQUIRE(ibltA.Decode(vOnlyA, vOnlyB));
+    sort(vOnlyA.begin(), vOnlyA.end());
+    sort(vOnlyB.begin(), vOnlyB.end());
+    vector<SecMsgToken> vExpectA = Missing(setA, setB), vExpectB = Missing(setB, setA);
+    BOOST_REQUIRE_EQUAL(vOnlyA.size(), vExpectA.size());
+    BOOST_REQUIRE_EQUAL(vOnlyB.size(), vExpectB.size());
+    for (unsigned int i = 0; i < vOnlyA.size(); i++)
+        BOOST_CHECK(!(vOnlyA[i] < vExpectA[i]) && !(vExpectA[i] < vOnlyA[i]));
+    for (unsigned int i = 0; i < vOnlyB.size(); i++)
+        BOOST_CHECK(!(vOnlyB[i] < vExpectB[i]) && !(vExpectB[i] < vOnlyB[i]));
+
+    // Too many differences for the table is reported, not listed wrongly
+    MakeNodes(bucket, 500, 40, 40, setA, setB);
+    SecMsgIBLT ibltSmallA(SMSG_RECON_MIN_CELLS), ibltSmallB(SMSG_RECON_MIN_CELLS);
+    ibltSmallA.Insert(setA);
+    ibltSmallB.Insert(setB);
+    ibltSmallA.Subtract(ibltSmallB);
+    vOnlyA.clear();
+    vOnlyB.clear();
+    BOOST_CHECK(!ibltSmallA.Decode(vOnlyA, vOnlyB));
+
+    // Tables of different sizes don't mix, nor do sizes that aren't a multiple of the hashes
+    BOOST_CHECK(!ibltA.Subtract(ibltSmallA));
+    BOOST_CHECK(!ibltPeer.Deserialize(&vch[0], SMSG_RECON_MIN_CELLS + 1));
+}
+
+BOOST_AUTO_TEST_CASE(smsgrecon_two_nodes)
+{
+    // Node A receives an smsgInv from B showing a bucket that differs, the bytes each way
+    // are counted until A has everything B has and B everything A has
+    const int64_t bucket = 1500000000 - (1500000000 % SMSG_BUCKET_LEN);
+    const int nShared = 2000;
+    const int vDiff[][2] = {{1, 0}, {5, 0}, {5, 5}, {20, 3}, {100, 100}, {600, 0}};
+
+    for (unsigned int d = 0; d < sizeof(vDiff) / sizeof(vDiff[0]); d++)
+    {
+        set<SecMsgToken> setA, setB;
+        MakeNodes(bucket, nShared, vDiff[d][1], vDiff[d][0], setA, setB);
+
+        // Before: A pulls from B, later B pulls from A the same way if it is missing any
+        size_t nShow = ShowBytes(setA, setB);
+        if (Missing(setA, setB).size() > 0)
+            nShow += ShowBytes(setB, setA);
+
+        // Reconciling: smsgInv, smsgRecon, then B's smsgHave and smsgWant and A's smsgWant
+        size_t nRecon = 4 + 16;
+        set<SecMsgToken> setAfterA(setA), setAfterB(setB);
+        vector<unsigned char> vchRecon;
+        if (!SecureMsgReconRequest(bucket, setA, setB.size(), vchRecon))
+        {
+            nRecon = nShow;
+            setAfterA.insert(setB.begin(), setB.end());
+            setAfterB.insert(setA.begin(), setA.end());
+        } else
+        {
+            nRecon += vchRecon.size();
+
+            int64_t bucketPeer;
+            vector<SecMsgToken> vALacks, vBLacks;
+            int rv = SecureMsgReconReply(vchRecon, setB, bucketPeer, vALacks, vBLacks);
+            BOOST_REQUIRE(rv == 0 || rv == 2);
+            BOOST_CHECK_EQUAL(bucketPeer, bucket);
+
+            vector<unsigned char> vchList;
+            if (rv == 2)
+            {
+                // B sends its full list, B pulls from A later as before
+                vector<SecMsgToken> vAll(setB.begin(), setB.end());
+                SecureMsgTokenList(bucket, vAll, vchList);
+                nRecon += vchList.size();
+                vALacks = Missing(setB, setA);
+                if (Missing(setA, setB).size() > 0)
+                    nRecon += ShowBytes(setB, setA);
+                vBLacks = Missing(setA, setB);
+            } else
+            {
+                if (vALacks.size() > 0)
+                {
+                    SecureMsgTokenList(bucket, vALacks, vchList);
+                    nRecon += vchList.size();
+                }
+                if (vBLacks.size() > 0)
+                {
+                    SecureMsgTokenList(bucket, vBLacks, vchList);
+                    nRecon += vchList.size();
+                }
+            }
+            if (vALacks.size() > 0)
+            {
+                SecureMsgTokenList(bucket, vALacks, vchList);
+                nRecon += vchList.size();
+            }
+            setAfterA.insert(vALacks.begin(), vALacks.end());
+            setAfterB.insert(vBLacks.begin(), vBLacks.end());
+        }
+
+        BOOST_CHECK(Missing(setAfterA, setAfterB).empty() && Missing(setAfterB, setAfterA).empty());
+        BOOST_CHECK_EQUAL(setAfterA.size(), (size_t)nShared + vDiff[d][0] + vDiff[d][1]);
+        if (vDiff[d][0] + vDiff[d][1] <= 40)
+            BOOST_CHECK(nRecon * 10 < nShow);
+
+        if (BenchEnabled())
+            printf("bench smsg sync %d shared, %d only on B, %d only on A: show %" PRIszu " bytes, recon %" PRIszu " bytes\n",
+                   nShared, vDiff[d][0], vDiff[d][1], nShow, nRecon);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,103 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+#include "smsgstore.h"
+#include "util.h"
+
+using namespace std;
+
+// A header and payload, as SecureMsgStore gets them, with payload bytes from n
+static vector<unsigned char> MakeMessage(int64_t timestamp, uint32_t nPayload, unsigned char n)
+{
+    vector<unsigned char> vch(SMSG_HDR_LEN + nPayload, 0);
+    SecureMessage *psmsg = (SecureMessage*)&vch[0];
+    psmsg->timestamp = timestamp;
+    psmsg->nPayload = nPayload;
+    for (uint32_t i = 0; i < nPayload; i++)
+        vch[SMSG_HDR_LEN + i] = n + i;
+    return vch;
+}
+
+BOOST_AUTO_TEST_SUITE(smsgstore_tests)
+
+BOOST_AUTO_TEST_CASE(smsgstore_segments)
+{
+    const int64_t bucket = 1500000000 - (1500000000 % SMSG_BUCKET_LEN);
+    boost::filesystem::create_directory(GetDataDir() / "smsgStore");
+    SecureMsgSegmentRemove(bucket);
+
+    vector<vector<unsigned char> > vMessages;
+    vector<SecMsgToken> vTokens;
+    for (int i = 0; i < 5; i++)
+    {
+        vMessages.push_back(MakeMessage(bucket + i, 100 + i * 10, i * 16));
+        vector<unsigned char>& vch = vMessages.back();
+        int64_t nOffset;
+        BOOST_REQUIRE(SecureMsgSegmentAppend(bucket, &vch[0], &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, nOffset) == 0);
+        vTokens.push_back(SecMsgToken(bucket + i, &vch[SMSG_HDR_LEN], vch.size() - SMSG_HDR_LEN, nOffset));
+    }
+
+    // Loaded from the index, the same tokens the appends gave
+    set<SecMsgToken> setTokens;
+    bool fRebuilt;
+    BOOST_CHECK(SecureMsgSegmentLoad(bucket, setTokens, fRebuilt) == 0);
+    BOOST_CHECK(!fRebuilt);
+    BOOST_CHECK_EQUAL(setTokens.size(), vTokens.size());
+    BOOST_FOREACH(const SecMsgToken& token, vTokens)
+    {
+        set<SecMsgToken>::iterator it = setTokens.find(token);
+        BOOST_REQUIRE(it != setTokens.end());
+        BOOST_CHECK_EQUAL(it->offset, token.offset);
+    }
+
+    // One batch returns the messages in the order asked for, up to the limits
+    vector<SecMsgToken> vWanted;
+    vWanted.push_back(vTokens[3]);
+    vWanted.push_back(vTokens[1]);
+    vector<unsigned char> vchBunch;
+    BOOST_CHECK_EQUAL(SecureMsgRetrieveBatch(bucket, vWanted, vchBunch, 500, 96000), 2U);
+    vector<unsigned char> vchExpected(vMessages[3]);
+    vchExpected.insert(vchExpected.end(), vMessages[1].begin(), vMessages[1].end());
+    BOOST_CHECK(vchBunch == vchExpected);
+
+    vchBunch.clear();
+    BOOST_CHECK_EQUAL(SecureMsgRetrieveBatch(bucket, vWanted, vchBunch, 1, 96000), 1U);
+    BOOST_CHECK(vchBunch == vMessages[3]);
+
+    // A token that doesn't match what is at its offset is skipped
+    vWanted.clear();
+    vWanted.push_back(vTokens[2]);
+    vWanted[0].offset = vTokens[1].offset;
+    vchBunch.clear();
+    BOOST_CHECK_EQUAL(SecureMsgRetrieveBatch(bucket, vWanted, vchBunch, 500, 96000), 0U);
+
+    // Without the index the data file is read through and the index written again
+    boost::filesystem::remove(SecureMsgSegmentPath(bucket, true));
+    setTokens.clear();
+    BOOST_CHECK(SecureMsgSegmentLoad(bucket, setTokens, fRebuilt) == 0);
+    BOOST_CHECK(fRebuilt);
+    BOOST_CHECK_EQUAL(setTokens.size(), vTokens.size());
+    setTokens.clear();
+    BOOST_CHECK(SecureMsgSegmentLoad(bucket, setTokens, fRebuilt) == 0);
+    BOOST_CHECK(!fRebuilt);
+
+    // A message cut short is dropped and the next one lands where it should
+    boost::filesystem::path pathData = SecureMsgSegmentPath(bucket, false);
+    uint64_t nSize = boost::filesystem::file_size(pathData);
+    FILE *fp = fopen(pathData.string().c_str(), "ab");
+    BOOST_REQUIRE(fp);
+    fwrite(&vMessages[0][0], 1, SMSG_HDR_LEN + 10, fp);
+    fclose(fp);
+    setTokens.clear();
+    BOOST_CHECK(SecureMsgSegmentLoad(bucket, setTokens, fRebuilt) == 0);
+    BOOST_CHECK(fRebuilt);
+    BOOST_CHECK_EQUAL(setTokens.size(), vTokens.size());
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathData), nSize);
+
+    SecureMsgSegmentRemove(bucket);
+    BOOST_CHECK(!boost::filesystem::exists(pathData));
+    BOOST_CHECK(!boost::filesystem::exists(SecureMsgSegmentPath(bucket, true)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "workqueue.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(workqueue_tests)
+
+BOOST_AUTO_TEST_CASE(workqueue_fifo_and_limit)
+{
+    CWorkQueue<int> queue(3);
+    BOOST_CHECK(queue.Push(1));
+    BOOST_CHECK(queue.Push(2));
+    BOOST_CHECK(queue.Push(3));
+    BOOST_CHECK(!queue.Push(4));
+    BOOST_CHECK_EQUAL(queue.size(), 3U);
+    BOOST_CHECK_EQUAL(queue.GetPeakDepth(), 3U);
+    BOOST_CHECK_EQUAL(queue.GetRejected(), 1U);
+
+    int n = 0;
+    for (int i = 1; i <= 3; i++)
+    {
+        BOOST_CHECK(queue.Pop(n, 0));
+        BOOST_CHECK_EQUAL(n, i);
+    }
+    BOOST_CHECK_EQUAL(queue.size(), 0U);
+    BOOST_CHECK_EQUAL(queue.GetPeakDepth(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(workqueue_timeout_and_interrupt)
+{
+    CWorkQueue<int> queue;
+    int n = 0;
+    int64_t nStart = GetTimeMillis();
+    BOOST_CHECK(!queue.Pop(n, 50));
+    BOOST_CHECK(GetTimeMillis() - nStart >= 40);
+
+    queue.Push(1);
+    queue.Interrupt();
+    BOOST_CHECK(!queue.Pop(n, 1000));
+}
+
+static void Consume(CWorkQueue<int>* pqueue, int64_t* pnSum)
+{
+    int n;
+    while (pqueue->Pop(n, 1000))
+    {
+        if (n < 0)
+            return;
+        *pnSum += n;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(workqueue_threads)
+{
+    CWorkQueue<int> queue;
+    const int nThreads = 4;
+    int64_t vnSum[nThreads] = { 0 };
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&Consume, &queue, &vnSum[i]));
+
+    int64_t nExpected = 0;
+    for (int i = 1; i <= 100000; i++)
+    {
+        queue.Push(i);
+        nExpected += i;
+    }
+    for (int i = 0; i < nThreads; i++)
+        queue.Push(-1);
+    threads.join_all();
+
+    int64_t nSum = 0;
+    for (int i = 0; i < nThreads; i++)
+        nSum += vnSum[i];
+    BOOST_CHECK_EQUAL(nSum, nExpected);
+    BOOST_CHECK_EQUAL(queue.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
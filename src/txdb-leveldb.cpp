@@ -274,14 +274,19 @@ bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
     return Write(string("hashBestChain"), hashBestChain);
 }
 
-bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
+bool CTxDB::ReadBestInvalidTrust(arith_uint256& bnBestInvalidTrust)
 {
-    return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    // stored in CBigNum's serialization format for compatibility
+    CBigNum bn;
+    if (!Read(string("bnBestInvalidTrust"), bn))
+        return false;
+    bnBestInvalidTrust = UintToArith256(bn.getuint256());
+    return true;
 }
 
-bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
+bool CTxDB::WriteBestInvalidTrust(const arith_uint256& bnBestInvalidTrust)
 {
-    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    return Write(string("bnBestInvalidTrust"), CBigNum(ArithToUint256(bnBestInvalidTrust)));
 }
 
 bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
@@ -304,6 +309,131 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
+bool CTxDB::ReadAddrIndexHeight(int& nHeight)
+{
+    return Read(string("addrindexheight"), nHeight);
+}
+
+bool CTxDB::WriteAddrIndexHeight(int nHeight)
+{
+    return Write(string("addrindexheight"), nHeight);
+}
+
+bool CTxDB::WriteAddrIndex(const CAddrIndexKey& key, int64_t nValue)
+{
+    return Write(make_pair(string("addrtx"), key), nValue);
+}
+
+bool CTxDB::EraseAddrIndex(const CAddrIndexKey& key)
+{
+    return Erase(make_pair(string("addrtx"), key));
+}
+
+bool CTxDB::WriteAddrUnspent(const CAddrUnspentKey& key, const CAddrUnspentValue& value)
+{
+    return Write(make_pair(string("addrutxo"), key), value);
+}
+
+bool CTxDB::EraseAddrUnspent(const CAddrUnspentKey& key)
+{
+    return Erase(make_pair(string("addrutxo"), key));
+}
+
+bool CTxDB::ScanAddrIndex(unsigned char nAddrType, const uint160& hash, int nStartHeight,
+                          const boost::function<bool (const CAddrIndexKey&, int64_t)>& fn)
+{
+    // All rows of the address share this prefix
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("addrtx") << nAddrType << hash;
+    string strPrefix = ssPrefix.str();
+
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("addrtx"), CAddrIndexKey(nAddrType, hash, max(nStartHeight, 0), 0, 0, false));
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        leveldb::Slice slKey = iterator->key();
+        if (!slKey.starts_with(strPrefix))
+            break;
+        leveldb::Slice slValue = iterator->value();
+        string strType;
+        CAddrIndexKey key;
+        int64_t nValue;
+        try {
+            CSpanStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            CSpanStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> strType >> key;
+            ssValue >> nValue;
+        }
+        catch (std::exception &e) {
+            delete iterator;
+            return error("ScanAddrIndex() : deserialize error");
+        }
+        if (!fn(key, nValue))
+            break;
+    }
+    delete iterator;
+    return true;
+}
+
+bool CTxDB::ReadAddrUnspent(unsigned char nAddrType, const uint160& hash,
+                            vector<pair<CAddrUnspentKey, CAddrUnspentValue> >& vRet)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("addrutxo") << nAddrType << hash;
+    string strPrefix = ssPrefix.str();
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(strPrefix); iterator->Valid(); iterator->Next())
+    {
+        leveldb::Slice slKey = iterator->key();
+        if (!slKey.starts_with(strPrefix))
+            break;
+        leveldb::Slice slValue = iterator->value();
+        string strType;
+        pair<CAddrUnspentKey, CAddrUnspentValue> item;
+        try {
+            CSpanStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            CSpanStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> strType >> item.first;
+            ssValue >> item.second;
+        }
+        catch (std::exception &e) {
+            delete iterator;
+            return error("ReadAddrUnspent() : deserialize error");
+        }
+        vRet.push_back(item);
+    }
+    delete iterator;
+    return true;
+}
+
+bool CTxDB::ReadSpentIndexHeight(int& nHeight)
+{
+    return Read(string("spentindexheight"), nHeight);
+}
+
+bool CTxDB::WriteSpentIndexHeight(int nHeight)
+{
+    return Write(string("spentindexheight"), nHeight);
+}
+
+bool CTxDB::ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value)
+{
+    return Read(make_pair(string("spent"), outpoint), value);
+}
+
+bool CTxDB::WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value)
+{
+    return Write(make_pair(string("spent"), outpoint), value);
+}
+
+bool CTxDB::EraseSpentIndex(const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("spent"), outpoint));
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -343,10 +473,10 @@ bool CTxDB::LoadBlockIndex()
     while (iterator->Valid())
     {
         // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
+        leveldb::Slice slKey = iterator->key();
+        leveldb::Slice slValue = iterator->value();
+        CSpanStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        CSpanStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
         string strType;
         ssKey >> strType;
         // Did we reach the end of the data to read?
@@ -409,7 +539,7 @@ bool CTxDB::LoadBlockIndex()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainTrust = (pindex->pprev ? pindex->pprev->bnChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->bnChainTrust = (pindex->pprev ? pindex->pprev->bnChainTrust : arith_uint256(0)) + pindex->GetBlockTrust();
         // NovaCoin: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
@@ -430,7 +560,7 @@ bool CTxDB::LoadBlockIndex()
     bnBestChainTrust = pindexBest->bnChainTrust;
 
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToDecimalString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
     // NovaCoin: load hashSyncCheckpoint
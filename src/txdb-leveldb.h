@@ -7,6 +7,7 @@
 #define BITCOIN_LEVELDB_H
 
 #include "main.h"
+#include "addrindex.h"
 
 #include <map>
 #include <string>
@@ -15,6 +16,8 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <boost/function.hpp>
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -87,8 +90,7 @@ protected:
         }
         // Unserialize value
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
-                                SER_DISK, CLIENT_VERSION);
+            CSpanStream ssValue(strValue, SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         }
         catch (std::exception &e) {
@@ -195,13 +197,33 @@ public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
-    bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
-    bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
+    bool ReadBestInvalidTrust(arith_uint256& bnBestInvalidTrust);
+    bool WriteBestInvalidTrust(const arith_uint256& bnBestInvalidTrust);
     bool ReadSyncCheckpoint(uint256& hashCheckpoint);
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+
+    // Address index, see addrindex.h
+    bool ReadAddrIndexHeight(int& nHeight);
+    bool WriteAddrIndexHeight(int nHeight);
+    bool WriteAddrIndex(const CAddrIndexKey& key, int64_t nValue);
+    bool EraseAddrIndex(const CAddrIndexKey& key);
+    bool WriteAddrUnspent(const CAddrUnspentKey& key, const CAddrUnspentValue& value);
+    bool EraseAddrUnspent(const CAddrUnspentKey& key);
+    // Visit the history of an address from nStartHeight on in height order, until fn returns false
+    bool ScanAddrIndex(unsigned char nAddrType, const uint160& hash, int nStartHeight,
+                       const boost::function<bool (const CAddrIndexKey&, int64_t)>& fn);
+    bool ReadAddrUnspent(unsigned char nAddrType, const uint160& hash,
+                         std::vector<std::pair<CAddrUnspentKey, CAddrUnspentValue> >& vRet);
+
+    // Spent index, see addrindex.h
+    bool ReadSpentIndexHeight(int& nHeight);
+    bool WriteSpentIndexHeight(int nHeight);
+    bool ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value);
+    bool WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value);
+    bool EraseSpentIndex(const COutPoint& outpoint);
 private:
     bool LoadBlockIndexGuts();
 };
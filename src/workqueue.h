@@ -0,0 +1,109 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <deque>
+#include <stdint.h>
+
+/** FIFO of work items shared between producer threads and a pool of workers.
+  *
+  * Producers Push() items, workers block in Pop() until an item arrives, the
+  * timeout expires or the queue is interrupted.  A queue created with
+  * nMaxDepthIn > 0 refuses items once that many are waiting.  The current
+  * and the highest depth seen are kept for monitoring.
+  */
+template<typename T> class CWorkQueue {
+private:
+    // Mutex to protect the inner state
+    boost::mutex mutex;
+
+    // Workers block on this when the queue is empty
+    boost::condition_variable condWorker;
+
+    std::deque<T> queue;
+
+    // Maximum number of waiting items, 0 for no limit
+    unsigned int nMaxDepth;
+
+    // Highest number of waiting items seen
+    unsigned int nPeakDepth;
+
+    // Number of items that were refused because the queue was full
+    uint64_t nRejected;
+
+    // Whether waiting workers should give up
+    bool fInterrupted;
+
+public:
+    CWorkQueue(unsigned int nMaxDepthIn = 0) :
+        nMaxDepth(nMaxDepthIn), nPeakDepth(0), nRejected(0), fInterrupted(false) {}
+
+    // Add an item, returns false if the queue is full
+    bool Push(const T &item) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nMaxDepth > 0 && queue.size() >= nMaxDepth) {
+                nRejected++;
+                return false;
+            }
+            queue.push_back(item);
+            if (queue.size() > nPeakDepth)
+                nPeakDepth = queue.size();
+        }
+        condWorker.notify_one();
+        return true;
+    }
+
+    // Take the oldest item, waiting up to nTimeoutMillis for one to arrive.
+    // Returns false on timeout or when the queue was interrupted.
+    bool Pop(T &item, int nTimeoutMillis) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nTimeoutMillis);
+        while (queue.empty() && !fInterrupted) {
+            if (!condWorker.timed_wait(lock, timeout))
+                break;
+        }
+        if (queue.empty() || fInterrupted)
+            return false;
+        item = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    // Wake up all waiting workers, Pop() fails from now on
+    void Interrupt() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fInterrupted = true;
+        }
+        condWorker.notify_all();
+    }
+
+    unsigned int size() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    unsigned int GetPeakDepth() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nPeakDepth;
+    }
+
+    uint64_t GetRejected() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nRejected;
+    }
+
+    unsigned int GetMaxDepth() const {
+        return nMaxDepth;
+    }
+};
+
+#endif